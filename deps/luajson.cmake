@@ -7,11 +7,13 @@ set(LUAJSONDIR ${CMAKE_CURRENT_LIST_DIR}/luajson)
 
 include_directories(
   ${LUAJSONDIR}
+  ${CMAKE_CURRENT_LIST_DIR}/luautils  # buffer.h, for cjson.encode_into()
 )
 
 set(SOURCES
   ${LUAJSONDIR}/lua_cjson.c
   ${LUAJSONDIR}/fpconv.c
+  ${LUAJSONDIR}/grisu2.c
   ${LUAJSONDIR}/strbuf.c
 )
 
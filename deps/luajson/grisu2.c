@@ -0,0 +1,371 @@
+/* grisu2 - Shortest double to string conversion
+ *
+ * Copyright (c) 2014 Milo Yip
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* C port of the Grisu2 implementation of Milo Yip's dtoa-benchmark,
+ * based on "Printing Floating-Point Numbers Quickly and Accurately with
+ * Integers" by Florian Loitsch.
+ *
+ * The digits always convert back to the same double, and are the
+ * shortest such digits in all but a very few cases. The output is
+ * formatted the same way as Number.prototype.toString() of JavaScript.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "grisu2.h"
+
+#define DIY_SIGNIFICAND_SIZE    64
+#define DP_SIGNIFICAND_SIZE     52
+#define DP_EXPONENT_BIAS        (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_MIN_EXPONENT         (-DP_EXPONENT_BIAS)
+#define DP_EXPONENT_MASK        UINT64_C(0x7FF0000000000000)
+#define DP_SIGNIFICAND_MASK     UINT64_C(0x000FFFFFFFFFFFFF)
+#define DP_HIDDEN_BIT           UINT64_C(0x0010000000000000)
+
+typedef struct {
+    uint64_t f;
+    int e;
+} diy_fp_t;
+
+/* 10^k normalized, for k = -348, -340, ..., 340 */
+static const uint64_t cached_powers_f[] = {
+    UINT64_C(0xfa8fd5a0081c0288), UINT64_C(0xbaaee17fa23ebf76), UINT64_C(0x8b16fb203055ac76),
+    UINT64_C(0xcf42894a5dce35ea), UINT64_C(0x9a6bb0aa55653b2d), UINT64_C(0xe61acf033d1a45df),
+    UINT64_C(0xab70fe17c79ac6ca), UINT64_C(0xff77b1fcbebcdc4f), UINT64_C(0xbe5691ef416bd60c),
+    UINT64_C(0x8dd01fad907ffc3c), UINT64_C(0xd3515c2831559a83), UINT64_C(0x9d71ac8fada6c9b5),
+    UINT64_C(0xea9c227723ee8bcb), UINT64_C(0xaecc49914078536d), UINT64_C(0x823c12795db6ce57),
+    UINT64_C(0xc21094364dfb5637), UINT64_C(0x9096ea6f3848984f), UINT64_C(0xd77485cb25823ac7),
+    UINT64_C(0xa086cfcd97bf97f4), UINT64_C(0xef340a98172aace5), UINT64_C(0xb23867fb2a35b28e),
+    UINT64_C(0x84c8d4dfd2c63f3b), UINT64_C(0xc5dd44271ad3cdba), UINT64_C(0x936b9fcebb25c996),
+    UINT64_C(0xdbac6c247d62a584), UINT64_C(0xa3ab66580d5fdaf6), UINT64_C(0xf3e2f893dec3f126),
+    UINT64_C(0xb5b5ada8aaff80b8), UINT64_C(0x87625f056c7c4a8b), UINT64_C(0xc9bcff6034c13053),
+    UINT64_C(0x964e858c91ba2655), UINT64_C(0xdff9772470297ebd), UINT64_C(0xa6dfbd9fb8e5b88f),
+    UINT64_C(0xf8a95fcf88747d94), UINT64_C(0xb94470938fa89bcf), UINT64_C(0x8a08f0f8bf0f156b),
+    UINT64_C(0xcdb02555653131b6), UINT64_C(0x993fe2c6d07b7fac), UINT64_C(0xe45c10c42a2b3b06),
+    UINT64_C(0xaa242499697392d3), UINT64_C(0xfd87b5f28300ca0e), UINT64_C(0xbce5086492111aeb),
+    UINT64_C(0x8cbccc096f5088cc), UINT64_C(0xd1b71758e219652c), UINT64_C(0x9c40000000000000),
+    UINT64_C(0xe8d4a51000000000), UINT64_C(0xad78ebc5ac620000), UINT64_C(0x813f3978f8940984),
+    UINT64_C(0xc097ce7bc90715b3), UINT64_C(0x8f7e32ce7bea5c70), UINT64_C(0xd5d238a4abe98068),
+    UINT64_C(0x9f4f2726179a2245), UINT64_C(0xed63a231d4c4fb27), UINT64_C(0xb0de65388cc8ada8),
+    UINT64_C(0x83c7088e1aab65db), UINT64_C(0xc45d1df942711d9a), UINT64_C(0x924d692ca61be758),
+    UINT64_C(0xda01ee641a708dea), UINT64_C(0xa26da3999aef774a), UINT64_C(0xf209787bb47d6b85),
+    UINT64_C(0xb454e4a179dd1877), UINT64_C(0x865b86925b9bc5c2), UINT64_C(0xc83553c5c8965d3d),
+    UINT64_C(0x952ab45cfa97a0b3), UINT64_C(0xde469fbd99a05fe3), UINT64_C(0xa59bc234db398c25),
+    UINT64_C(0xf6c69a72a3989f5c), UINT64_C(0xb7dcbf5354e9bece), UINT64_C(0x88fcf317f22241e2),
+    UINT64_C(0xcc20ce9bd35c78a5), UINT64_C(0x98165af37b2153df), UINT64_C(0xe2a0b5dc971f303a),
+    UINT64_C(0xa8d9d1535ce3b396), UINT64_C(0xfb9b7cd9a4a7443c), UINT64_C(0xbb764c4ca7a44410),
+    UINT64_C(0x8bab8eefb6409c1a), UINT64_C(0xd01fef10a657842c), UINT64_C(0x9b10a4e5e9913129),
+    UINT64_C(0xe7109bfba19c0c9d), UINT64_C(0xac2820d9623bf429), UINT64_C(0x80444b5e7aa7cf85),
+    UINT64_C(0xbf21e44003acdd2d), UINT64_C(0x8e679c2f5e44ff8f), UINT64_C(0xd433179d9c8cb841),
+    UINT64_C(0x9e19db92b4e31ba9), UINT64_C(0xeb96bf6ebadf77d9), UINT64_C(0xaf87023b9bf0ee6b)
+};
+
+static const int16_t cached_powers_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const uint64_t pow10[] = {
+    UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000), UINT64_C(10000),
+    UINT64_C(100000), UINT64_C(1000000), UINT64_C(10000000), UINT64_C(100000000),
+    UINT64_C(1000000000), UINT64_C(10000000000), UINT64_C(100000000000),
+    UINT64_C(1000000000000), UINT64_C(10000000000000), UINT64_C(100000000000000),
+    UINT64_C(1000000000000000), UINT64_C(10000000000000000),
+    UINT64_C(100000000000000000), UINT64_C(1000000000000000000),
+    UINT64_C(10000000000000000000)
+};
+
+static diy_fp_t diy_fp_from_double(double d)
+{
+    diy_fp_t fp;
+    uint64_t u;
+    int biased_e;
+
+    memcpy(&u, &d, sizeof(u));
+    biased_e = (int)((u & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE);
+    fp.f = u & DP_SIGNIFICAND_MASK;
+    if (biased_e != 0) {
+        fp.f += DP_HIDDEN_BIT;
+        fp.e = biased_e - DP_EXPONENT_BIAS;
+    } else {
+        fp.e = DP_MIN_EXPONENT + 1;
+    }
+
+    return fp;
+}
+
+static diy_fp_t diy_fp_normalize(diy_fp_t fp)
+{
+    while (!(fp.f & (UINT64_C(1) << 63))) {
+        fp.f <<= 1;
+        fp.e--;
+    }
+
+    return fp;
+}
+
+/* Rounded upper 64 bits of the 128 bits product */
+static diy_fp_t diy_fp_multiply(diy_fp_t x, diy_fp_t y)
+{
+    const uint64_t m32 = 0xFFFFFFFF;
+    uint64_t a = x.f >> 32, b = x.f & m32;
+    uint64_t c = y.f >> 32, d = y.f & m32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+    diy_fp_t r;
+
+    tmp += 1U << 31;
+    r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+static void diy_fp_normalized_boundaries(diy_fp_t v, diy_fp_t *minus, diy_fp_t *plus)
+{
+    diy_fp_t pl, mi;
+
+    pl.f = (v.f << 1) + 1;
+    pl.e = v.e - 1;
+    pl = diy_fp_normalize(pl);
+
+    if (v.f == DP_HIDDEN_BIT) {
+        mi.f = (v.f << 2) - 1;
+        mi.e = v.e - 2;
+    } else {
+        mi.f = (v.f << 1) - 1;
+        mi.e = v.e - 1;
+    }
+
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+    *plus = pl;
+    *minus = mi;
+}
+
+static diy_fp_t get_cached_power(int e, int *k)
+{
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = (int)dk;
+    unsigned index;
+    diy_fp_t fp;
+
+    if (dk - ik > 0.0)
+        ik++;
+
+    index = (unsigned)((ik >> 3) + 1);
+    *k = -(-348 + (int)(index << 3));
+
+    fp.f = cached_powers_f[index];
+    fp.e = cached_powers_e[index];
+    return fp;
+}
+
+static void grisu_round(char *buffer, int len, uint64_t delta, uint64_t rest,
+                        uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buffer[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static int count_decimal_digit32(uint32_t n)
+{
+    int count = 1;
+
+    while (n >= 10) {
+        n /= 10;
+        count++;
+    }
+
+    return count;
+}
+
+static void digit_gen(diy_fp_t w, diy_fp_t mp, uint64_t delta,
+                      char *buffer, int *len, int *k)
+{
+    const int shift = -mp.e;
+    const uint64_t one = UINT64_C(1) << shift;
+    const uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = (uint32_t)(mp.f >> shift);
+    uint64_t p2 = mp.f & (one - 1);
+    int kappa = count_decimal_digit32(p1);
+
+    *len = 0;
+
+    while (kappa > 0) {
+        uint32_t div = (uint32_t)pow10[kappa - 1];
+        uint32_t d = p1 / div;
+        uint64_t tmp;
+
+        p1 %= div;
+        if (d || *len)
+            buffer[(*len)++] = (char)('0' + d);
+
+        kappa--;
+        tmp = ((uint64_t)p1 << shift) + p2;
+        if (tmp <= delta) {
+            *k += kappa;
+            grisu_round(buffer, *len, delta, tmp, pow10[kappa] << shift, wp_w);
+            return;
+        }
+    }
+
+    for (;;) {
+        char d;
+
+        p2 *= 10;
+        delta *= 10;
+        d = (char)(p2 >> shift);
+        if (d || *len)
+            buffer[(*len)++] = (char)('0' + d);
+
+        p2 &= one - 1;
+        kappa--;
+        if (p2 < delta) {
+            *k += kappa;
+            grisu_round(buffer, *len, delta, p2, one,
+                        -kappa < 20 ? wp_w * pow10[-kappa] : 0);
+            return;
+        }
+    }
+}
+
+/* Digits of the positive, finite and non zero `value`,
+ * value = digits * 10^k */
+static int grisu2(double value, char *buffer, int *k)
+{
+    diy_fp_t v = diy_fp_from_double(value);
+    diy_fp_t w_m, w_p, c_mk, w, wp, wm;
+    int len;
+
+    diy_fp_normalized_boundaries(v, &w_m, &w_p);
+
+    c_mk = get_cached_power(w_p.e, k);
+    w = diy_fp_multiply(diy_fp_normalize(v), c_mk);
+    wp = diy_fp_multiply(w_p, c_mk);
+    wm = diy_fp_multiply(w_m, c_mk);
+    wm.f++;
+    wp.f--;
+
+    digit_gen(w, wp, wp.f - wm.f, buffer, &len, k);
+    return len;
+}
+
+static char *write_exponent(char *p, int e)
+{
+    *p++ = 'e';
+    if (e < 0) {
+        *p++ = '-';
+        e = -e;
+    } else {
+        *p++ = '+';
+    }
+
+    if (e >= 100) {
+        *p++ = (char)('0' + e / 100);
+        e %= 100;
+        *p++ = (char)('0' + e / 10);
+    } else if (e >= 10) {
+        *p++ = (char)('0' + e / 10);
+    }
+
+    *p++ = (char)('0' + e % 10);
+    return p;
+}
+
+int grisu2_dtoa(double value, char *buffer)
+{
+    char digits[20];
+    char *p = buffer;
+    int len, k, kk, i;
+
+    if (value == 0) {
+        if (signbit(value))
+            *p++ = '-';
+        *p++ = '0';
+        return (int)(p - buffer);
+    }
+
+    if (value < 0) {
+        *p++ = '-';
+        value = -value;
+    }
+
+    len = grisu2(value, digits, &k);
+    kk = len + k;   /* 10^(kk - 1) <= value < 10^kk */
+
+    /* Integral values above 2^53 take the exponent form: their shortest
+     * digits are not the exact value, and a decoder with 64-bit integers
+     * would read the bare digits as a different integer */
+    if (len <= kk && kk <= 21 && value <= 9007199254740992.0) {
+        /* 1234e7 -> 12340000000 */
+        memcpy(p, digits, len);
+        p += len;
+        for (i = len; i < kk; i++)
+            *p++ = '0';
+
+    } else if (0 < kk && kk < len) {
+        /* 1234e-2 -> 12.34 */
+        memcpy(p, digits, kk);
+        p += kk;
+        *p++ = '.';
+        memcpy(p, digits + kk, len - kk);
+        p += len - kk;
+
+    } else if (-6 < kk && kk <= 0) {
+        /* 1234e-6 -> 0.001234 */
+        *p++ = '0';
+        *p++ = '.';
+        for (i = kk; i < 0; i++)
+            *p++ = '0';
+        memcpy(p, digits, len);
+        p += len;
+
+    } else {
+        /* 1234e30 -> 1.234e+33 */
+        *p++ = digits[0];
+        if (len > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, len - 1);
+            p += len - 1;
+        }
+        p = write_exponent(p, kk - 1);
+    }
+
+    return (int)(p - buffer);
+}
+
+/* vi:ai et sw=4 ts=4:
+ */
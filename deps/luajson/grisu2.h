@@ -0,0 +1,12 @@
+/* Shortest double to string conversion, see grisu2.c */
+
+/* Buffer required by grisu2_dtoa(): -1.7976931348623157e+308 */
+#define GRISU2_BUFSIZE  32
+
+/* Writes the shortest string which converts back to the finite `value`,
+ * formatted like JavaScript does. Returns the length, the string is not
+ * terminated. */
+extern int grisu2_dtoa(double value, char *buffer);
+
+/* vi:ai et sw=4 ts=4:
+ */
@@ -45,6 +45,28 @@
 
 #include "strbuf.h"
 #include "fpconv.h"
+#include "grisu2.h"
+#include "buffer.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CJSON_USE_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CJSON_USE_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(CJSON_USE_SSE2) && defined(_MSC_VER)
+#include <intrin.h>
+static inline int json_ctz(unsigned int x)
+{
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return (int)index;
+}
+#elif defined(CJSON_USE_SSE2)
+#define json_ctz(x) __builtin_ctz(x)
+#endif
 
 #ifndef CJSON_MODNAME
 #define CJSON_MODNAME   "cjson"
@@ -78,7 +100,12 @@ int strncasecmp(const char *s1, const char *s2, register int n);
 #define DEFAULT_ENCODE_INVALID_NUMBERS 0
 #define DEFAULT_DECODE_INVALID_NUMBERS 1
 #define DEFAULT_ENCODE_KEEP_BUFFER 1
-#define DEFAULT_ENCODE_NUMBER_PRECISION 14
+#define DEFAULT_ENCODE_NUMBER_PRECISION 0  /* Shortest round trip */
+
+/* Lua 5.3 integers are encoded and decoded without a double conversion */
+#if LUA_VERSION_NUM >= 503
+#define JSON_USE_INTEGERS
+#endif
 
 #ifdef DISABLE_INVALID_NUMBERS
 #undef DEFAULT_DECODE_INVALID_NUMBERS
@@ -120,6 +147,12 @@ static const char *json_token_type_name[] = {
     NULL
 };
 
+typedef struct {
+    int index;          /* Stack index of the writer function */
+    int chunk_size;
+    lua_Integer total;  /* Bytes passed to the writer */
+} json_writer_t;
+
 typedef struct {
     json_token_type_t ch2token[256];
     char escape2char[256];  /* Decoding */
@@ -138,11 +171,15 @@ typedef struct {
 
     int decode_invalid_numbers;
     int decode_max_depth;
+
+    /* Only set in the private copy used by json_encode_to_stream() */
+    json_writer_t *encode_writer;
 } json_config_t;
 
 typedef struct {
     const char *data;
     const char *ptr;
+    const char *end;
     strbuf_t *tmp;    /* Temporary storage for strings */
     json_config_t *cfg;
     int current_depth;
@@ -155,8 +192,12 @@ typedef struct {
         const char *string;
         double number;
         int boolean;
+#ifdef JSON_USE_INTEGERS
+        lua_Integer integer;
+#endif
     } value;
     int string_len;
+    int is_integer;     /* T_NUMBER: value.integer is set */
 } json_token_t;
 
 static const char *char2escape[256] = {
@@ -303,12 +344,13 @@ static int json_cfg_decode_max_depth(lua_State *l)
     return json_integer_option(l, 1, &cfg->decode_max_depth, 1, INT_MAX);
 }
 
-/* Configures number precision when converting doubles to text */
+/* Configures number precision when converting doubles to text,
+ * 0 selects the shortest text which converts back to the same double */
 static int json_cfg_encode_number_precision(lua_State *l)
 {
     json_config_t *cfg = json_arg_init(l, 1);
 
-    return json_integer_option(l, 1, &cfg->encode_number_precision, 1, 14);
+    return json_integer_option(l, 1, &cfg->encode_number_precision, 0, 14);
 }
 
 /* Configures JSON encoding buffer persistence */
@@ -401,6 +443,7 @@ static void json_create_config(lua_State *l)
     cfg->decode_invalid_numbers = DEFAULT_DECODE_INVALID_NUMBERS;
     cfg->encode_keep_buffer = DEFAULT_ENCODE_KEEP_BUFFER;
     cfg->encode_number_precision = DEFAULT_ENCODE_NUMBER_PRECISION;
+    cfg->encode_writer = NULL;
 
 #if DEFAULT_ENCODE_KEEP_BUFFER > 0
     strbuf_init(&cfg->encode_buf, 0);
@@ -452,6 +495,93 @@ static void json_create_config(lua_State *l)
     cfg->escape2char['u'] = 'u';          /* Unicode parsing required */
 }
 
+/* ===== STRING SCANNING ===== */
+
+/* Most strings are long runs of characters which need no escaping. These
+ * return the first character at or after `p` which needs attention, or
+ * `end`, 16 bytes at a time with SSE2 or NEON. */
+
+/* Decoding: '"', '\\' and the terminating '\0' */
+static const char *json_scan_string(const char *p, const char *end)
+{
+#if defined(CJSON_USE_SSE2)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        __m128i found = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                                  _mm_cmpeq_epi8(chunk, backslash)),
+                                     _mm_cmpeq_epi8(chunk, zero));
+        int mask = _mm_movemask_epi8(found);
+        if (mask)
+            return p + json_ctz(mask);
+    }
+#elif defined(CJSON_USE_NEON)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t *)p);
+        uint8x16_t found = vorrq_u8(vorrq_u8(vceqq_u8(chunk, quote),
+                                             vceqq_u8(chunk, backslash)),
+                                    vceqq_u8(chunk, vdupq_n_u8(0)));
+        uint64x2_t lanes = vreinterpretq_u64_u8(found);
+        if (vgetq_lane_u64(lanes, 0) | vgetq_lane_u64(lanes, 1))
+            break;
+    }
+#endif
+
+    while (p < end && *p != '"' && *p != '\\' && *p)
+        p++;
+
+    return p;
+}
+
+/* Encoding: characters with an entry in char2escape, that is control
+ * characters, '"', '/', '\\' and DEL */
+static const char *json_scan_escape(const char *p, const char *end)
+{
+#if defined(CJSON_USE_SSE2)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i control = _mm_set1_epi8(0x1f);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        /* chunk <= 0x1f as unsigned bytes */
+        __m128i found = _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk);
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, quote));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, slash));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, backslash));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, del));
+        int mask = _mm_movemask_epi8(found);
+        if (mask)
+            return p + json_ctz(mask);
+    }
+#elif defined(CJSON_USE_NEON)
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t *)p);
+        uint8x16_t found = vcleq_u8(chunk, vdupq_n_u8(0x1f));
+        found = vorrq_u8(found, vceqq_u8(chunk, vdupq_n_u8('"')));
+        found = vorrq_u8(found, vceqq_u8(chunk, vdupq_n_u8('/')));
+        found = vorrq_u8(found, vceqq_u8(chunk, vdupq_n_u8('\\')));
+        found = vorrq_u8(found, vceqq_u8(chunk, vdupq_n_u8(0x7f)));
+        uint64x2_t lanes = vreinterpretq_u64_u8(found);
+        if (vgetq_lane_u64(lanes, 0) | vgetq_lane_u64(lanes, 1))
+            break;
+    }
+#endif
+
+    while (p < end && !char2escape[(unsigned char)*p])
+        p++;
+
+    return p;
+}
+
 /* ===== ENCODING ===== */
 
 static void json_encode_exception(lua_State *l, json_config_t *cfg, strbuf_t *json, int lindex,
@@ -486,11 +616,17 @@ static void json_append_string(lua_State *l, strbuf_t *json, int lindex)
 
     strbuf_append_char_unsafe(json, '\"');
     for (i = 0; i < len; i++) {
+        /* Copy the run of characters which need no escaping at once */
+        const char *run = json_scan_escape(str + i, str + len);
+        if (run > str + i) {
+            strbuf_append_mem_unsafe(json, str + i, run - (str + i));
+            i = run - str;
+            if (i == len)
+                break;
+        }
+
         escstr = char2escape[(unsigned char)str[i]];
-        if (escstr)
-            strbuf_append_string(json, escstr);
-        else
-            strbuf_append_char_unsafe(json, str[i]);
+        strbuf_append_string(json, escstr);
     }
     strbuf_append_char_unsafe(json, '\"');
 }
@@ -568,6 +704,34 @@ static void json_check_encode_depth(lua_State *l, json_config_t *cfg,
 static void json_append_data(lua_State *l, json_config_t *cfg,
                              int current_depth, strbuf_t *json);
 
+/* Passes the encoded text to the writer of json_encode_to_stream() in
+ * pieces of chunk_size bytes. The rest is kept for later unless `all`. */
+static void json_encode_flush(lua_State *l, json_config_t *cfg,
+                              strbuf_t *json, int all)
+{
+    json_writer_t *writer = cfg->encode_writer;
+    int len = strbuf_length(json);
+    int offset = 0;
+
+    while (len - offset >= writer->chunk_size || (all && offset < len)) {
+        int size = len - offset;
+        if (size > writer->chunk_size)
+            size = writer->chunk_size;
+
+        lua_pushvalue(l, writer->index);
+        lua_pushlstring(l, json->buf + offset, size);
+        lua_call(l, 1, 0);
+
+        offset += size;
+        writer->total += size;
+    }
+
+    if (offset > 0) {
+        memmove(json->buf, json->buf + offset, len - offset);
+        json->length = len - offset;
+    }
+}
+
 /* json_append_array args:
  * - lua_State
  * - JSON strbuf
@@ -589,17 +753,66 @@ static void json_append_array(lua_State *l, json_config_t *cfg, int current_dept
         lua_rawgeti(l, -1, i);
         json_append_data(l, cfg, current_depth, json);
         lua_pop(l, 1);
+
+        if (cfg->encode_writer &&
+            strbuf_length(json) >= cfg->encode_writer->chunk_size)
+            json_encode_flush(l, cfg, json, 0);
     }
 
     strbuf_append_char(json, ']');
 }
 
+#ifdef JSON_USE_INTEGERS
+static const char json_digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static void json_append_integer(strbuf_t *json, lua_Integer value)
+{
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    lua_Unsigned u = (lua_Unsigned)value;
+
+    /* Negate as unsigned, LUA_MININTEGER has no positive counterpart */
+    if (value < 0)
+        u = 0u - u;
+
+    while (u >= 100) {
+        const char *pair = json_digit_pairs + (u % 100) * 2;
+        u /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (u >= 10) {
+        const char *pair = json_digit_pairs + u * 2;
+        *--p = pair[1];
+        *--p = pair[0];
+    } else {
+        *--p = (char)('0' + u);
+    }
+    if (value < 0)
+        *--p = '-';
+
+    strbuf_append_mem(json, p, buf + sizeof(buf) - p);
+}
+#endif
+
 static void json_append_number(lua_State *l, json_config_t *cfg,
                                strbuf_t *json, int lindex)
 {
-    double num = lua_tonumber(l, lindex);
+    double num;
     int len;
 
+#ifdef JSON_USE_INTEGERS
+    if (lua_isinteger(l, lindex)) {
+        json_append_integer(json, lua_tointeger(l, lindex));
+        return;
+    }
+#endif
+
+    num = lua_tonumber(l, lindex);
+
     if (cfg->encode_invalid_numbers == 0) {
         /* Prevent encoding invalid numbers */
         if (isinf(num) || isnan(num))
@@ -627,8 +840,13 @@ static void json_append_number(lua_State *l, json_config_t *cfg,
         }
     }
 
-    strbuf_ensure_empty_length(json, FPCONV_G_FMT_BUFSIZE);
-    len = fpconv_g_fmt(strbuf_empty_ptr(json), num, cfg->encode_number_precision);
+    if (cfg->encode_number_precision == 0) {
+        strbuf_ensure_empty_length(json, GRISU2_BUFSIZE);
+        len = grisu2_dtoa(num, strbuf_empty_ptr(json));
+    } else {
+        strbuf_ensure_empty_length(json, FPCONV_G_FMT_BUFSIZE);
+        len = fpconv_g_fmt(strbuf_empty_ptr(json), num, cfg->encode_number_precision);
+    }
     strbuf_extend_length(json, len);
 }
 
@@ -668,6 +886,10 @@ static void json_append_object(lua_State *l, json_config_t *cfg,
         json_append_data(l, cfg, current_depth, json);
         lua_pop(l, 1);
         /* table, key */
+
+        if (cfg->encode_writer &&
+            strbuf_length(json) >= cfg->encode_writer->chunk_size)
+            json_encode_flush(l, cfg, json, 0);
     }
 
     strbuf_append_char(json, '}');
@@ -748,6 +970,181 @@ static int json_encode(lua_State *l)
     return 1;
 }
 
+/* ===== ENCODING INTO BUFFERS ===== */
+
+/* Encodes the value at index 2 into the strbuf at index 1 (a light
+ * userdata) with the config at upvalue 1, the writer is at index 3.
+ * When upvalue 2 is true the value is an array of records which are
+ * encoded one per line (NDJSON).
+ * Called with lua_pcall() so the caller can release or hand back the
+ * strbuf when an error is thrown. */
+static int json_encode_protected(lua_State *l)
+{
+    json_config_t *cfg = lua_touserdata(l, lua_upvalueindex(1));
+    strbuf_t *json = lua_touserdata(l, 1);
+
+    lua_settop(l, 3);
+    if (lua_toboolean(l, lua_upvalueindex(2))) {
+        lua_Integer i, n = luaL_len(l, 2);
+
+        for (i = 1; i <= n; i++) {
+            lua_geti(l, 2, i);
+            json_append_data(l, cfg, 0, json);
+            strbuf_append_char(json, '\n');
+            lua_pop(l, 1);
+
+            if (cfg->encode_writer &&
+                strbuf_length(json) >= cfg->encode_writer->chunk_size)
+                json_encode_flush(l, cfg, json, 0);
+        }
+    } else {
+        lua_pushvalue(l, 2);
+        json_append_data(l, cfg, 0, json);
+        lua_pop(l, 1);
+    }
+
+    if (cfg->encode_writer)
+        json_encode_flush(l, cfg, json, 1);
+
+    return 0;
+}
+
+/* Runs json_encode_protected() with a private copy of the config which
+ * never frees `json` itself. Returns the lua_pcall() status, the error
+ * message is left on the stack. */
+static int json_encode_pcall(lua_State *l, json_config_t *cfg, strbuf_t *json,
+                             int lindex, json_writer_t *writer, int lines)
+{
+    json_config_t local_cfg = *cfg;
+
+    lindex = lua_absindex(l, lindex);
+    local_cfg.encode_keep_buffer = 1;
+    local_cfg.encode_writer = writer;
+
+    lua_pushlightuserdata(l, &local_cfg);
+    lua_pushboolean(l, lines);
+    lua_pushcclosure(l, json_encode_protected, 2);
+    lua_pushlightuserdata(l, json);
+    lua_pushvalue(l, lindex);
+    if (writer) {
+        lua_pushvalue(l, writer->index);
+        writer->index = 3;
+    } else {
+        lua_pushnil(l);
+    }
+    return lua_pcall(l, 3, 0, 0);
+}
+
+/* The luv_buffer_t of a `lutils.new_buffer()` or a `Buffer` object */
+static luv_buffer_t *json_check_buffer(lua_State *l, int lindex)
+{
+    luv_buffer_t *buffer;
+
+    if (lua_istable(l, lindex)) {
+        lua_getfield(l, lindex, "buffer");
+        buffer = luaL_testudata(l, -1, LUV_BUFFER);
+        lua_pop(l, 1);
+    } else {
+        buffer = luaL_testudata(l, lindex, LUV_BUFFER);
+    }
+
+    if (buffer == NULL)
+        luaL_argerror(l, lindex, "expected a buffer");
+
+    return buffer;
+}
+
+/* Appends the text of the value at `lindex` at the limit of the buffer at
+ * index `bindex`, see json_encode_into(). Returns the number of bytes. */
+static int json_encode_buffer(lua_State *l, json_config_t *cfg, int bindex,
+                              int lindex, int lines)
+{
+    luv_buffer_t *buffer = json_check_buffer(l, bindex);
+    strbuf_t json;
+    int start, status;
+
+    if (buffer->data == NULL) {
+        buffer->length = 0;
+        buffer->position = 1;
+        buffer->limit = 1;
+    }
+    luaL_argcheck(l, buffer->limit >= 1 && buffer->limit <= buffer->length + 1,
+                  bindex, "invalid buffer limit");
+    luaL_argcheck(l, buffer->writes == 0, bindex, "buffer is being written");
+
+    /* Borrow the memory of the buffer, it was allocated with malloc()
+     * and has 2 bytes of padding */
+    memset(&json, 0, sizeof(json));
+    json.increment = STRBUF_DEFAULT_INCREMENT;
+    json.buf = buffer->data;
+    json.size = buffer->data ? buffer->length + 2 : 1;
+    json.length = start = buffer->limit - 1;
+
+    status = json_encode_pcall(l, cfg, &json, lindex, NULL, lines);
+    if (status == 0 && json.size < json.length + 2)
+        strbuf_resize(&json, json.length + 1);
+
+    /* Hand back the memory, it may have been moved or grown */
+    buffer->data = json.buf;
+    if (json.buf && json.size - 2 > buffer->length)
+        buffer->length = json.size - 2;
+
+    if (status != 0)
+        lua_error(l);
+
+    buffer->limit = json.length + 1;
+    return json.length - start;
+}
+
+/* cjson.encode_into(buffer, value)
+ *
+ * Appends the JSON text of `value` at the limit of `buffer` and moves the
+ * limit after it, so [position, limit) can be passed to `uv.write()`.
+ * The text is encoded in place: the buffer grows as required and no Lua
+ * string is created. Returns the number of bytes written.
+ *
+ * Raises an error while a `uv.write()` of the buffer is pending, as the
+ * data may be moved. */
+static int json_encode_into(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+    lua_pushinteger(l, json_encode_buffer(l, cfg, 1, 2, 0));
+    return 1;
+}
+
+/* cjson.encode_to_stream(writer, value[, chunk_size])
+ *
+ * Encodes `value` and calls `writer(chunk)` as soon as `chunk_size` bytes
+ * (default 64KB) are ready, and once more with the rest. Only one chunk of
+ * the text is held in memory. `value` must not be modified by the writer.
+ * Returns the total number of bytes. */
+static int json_encode_to_stream(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_writer_t writer;
+    strbuf_t json;
+    int status;
+
+    luaL_checktype(l, 1, LUA_TFUNCTION);
+    luaL_checkany(l, 2);
+    writer.index = 1;
+    writer.chunk_size = (int)luaL_optinteger(l, 3, 64 * 1024);
+    writer.total = 0;
+    luaL_argcheck(l, writer.chunk_size > 0, 3, "expected a positive chunk size");
+
+    strbuf_init(&json, writer.chunk_size + 1024);
+    status = json_encode_pcall(l, cfg, &json, 2, &writer, 0);
+    strbuf_free(&json);
+
+    if (status != 0)
+        return lua_error(l);
+
+    lua_pushinteger(l, writer.total);
+    return 1;
+}
+
 /* ===== DECODING ===== */
 
 static void json_process_value(lua_State *l, json_parse_t *json,
@@ -917,6 +1314,14 @@ static void json_next_string_token(json_parse_t *json, json_token_t *token)
     strbuf_reset(json->tmp);
 
     while ((ch = *json->ptr) != '"') {
+        /* Copy the run of plain characters at once */
+        const char *run = json_scan_string(json->ptr, json->end);
+        if (run > json->ptr) {
+            strbuf_append_mem_unsafe(json->tmp, json->ptr, run - json->ptr);
+            json->ptr = run;
+            continue;
+        }
+
         if (!ch) {
             /* Premature end of the string */
             json_set_token_error(token, json, "unexpected end of string");
@@ -1010,11 +1415,69 @@ static int json_is_invalid_number(json_parse_t *json)
     return 0;
 }
 
+#ifdef JSON_USE_INTEGERS
+/* Parses a plain JSON integer which fits a lua_Integer.
+ * Returns the number of characters used, or 0 when the number has a
+ * fraction or exponent, is out of range, or is not valid JSON (leading
+ * zeros, hexadecimal, ...) and must go through strtod() instead.
+ * "-0" is left to strtod() as well to keep the sign. */
+static int json_parse_integer(const char *p, lua_Integer *value)
+{
+    const char *start = p;
+    lua_Unsigned limit = (lua_Unsigned)LUA_MAXINTEGER;
+    lua_Unsigned u = 0;
+    int negative = 0;
+    int ch;
+
+    if (*p == '-') {
+        negative = 1;
+        limit++;
+        p++;
+    }
+
+    if (*p < '0' || *p > '9')
+        return 0;
+
+    if (*p == '0') {
+        if (negative)
+            return 0;
+        p++;
+    } else {
+        do {
+            unsigned d = *p - '0';
+            if (u > (limit - d) / 10)
+                return 0;   /* Overflow */
+            u = u * 10 + d;
+            p++;
+        } while ('0' <= *p && *p <= '9');
+    }
+
+    ch = *p;
+    if (('0' <= ch && ch <= '9') || ch == '.' ||
+        (ch | 0x20) == 'e' || (ch | 0x20) == 'x')
+        return 0;
+
+    *value = negative ? (lua_Integer)(0u - u) : (lua_Integer)u;
+    return (int)(p - start);
+}
+#endif
+
 static void json_next_number_token(json_parse_t *json, json_token_t *token)
 {
     char *endptr;
 
     token->type = T_NUMBER;
+#ifdef JSON_USE_INTEGERS
+    {
+        int len = json_parse_integer(json->ptr, &token->value.integer);
+        if (len > 0) {
+            token->is_integer = 1;
+            json->ptr += len;
+            return;
+        }
+    }
+#endif
+    token->is_integer = 0;
     token->value.number = fpconv_strtod(json->ptr, &endptr);
     if (json->ptr == endptr)
         json_set_token_error(token, json, "invalid number");
@@ -1246,6 +1709,12 @@ static void json_process_value(lua_State *l, json_parse_t *json,
         lua_pushlstring(l, token->value.string, token->string_len);
         break;;
     case T_NUMBER:
+#ifdef JSON_USE_INTEGERS
+        if (token->is_integer) {
+            lua_pushinteger(l, token->value.integer);
+            break;
+        }
+#endif
         lua_pushnumber(l, token->value.number);
         break;;
     case T_BOOLEAN:
@@ -1279,6 +1748,7 @@ static int json_decode(lua_State *l)
     json.data = luaL_checklstring(l, 1, &json_len);
     json.current_depth = 0;
     json.ptr = json.data;
+    json.end = json.data + json_len;
 
     /* Detect Unicode other than UTF-8 (see RFC 4627, Sec 3)
      *
@@ -1307,6 +1777,1514 @@ static int json_decode(lua_State *l)
     return 1;
 }
 
+/* ===== STREAMING DECODING ===== */
+
+/* Resumable decoder for JSON text which arrives in chunks, e.g. from a
+ * socket:
+ *
+ *   local decoder = cjson.decoder(callback [, options])
+ *   decoder:write(chunk)   -- as many times as needed
+ *   decoder:finish()
+ *
+ * options.mode:
+ * - "values" (default): only the values nested options.depth (default 1)
+ *   containers deep are built as Lua tables, and callback(value, key) is
+ *   called as each one completes. The containers above them are never
+ *   built, so the elements of a big top-level array are decoded one at a
+ *   time. With depth 0 each whole document is passed to the callback.
+ * - "events": no tables are built, callback(event, value) is called with
+ *   "start_object", "end_object", "start_array", "end_array", "key" and
+ *   "value".
+ *
+ * Several documents may follow each other, separated by whitespace.
+ * The memory used depends on the nesting depth and on the largest string
+ * or element, not on the size of the whole document.
+ *
+ * write() and finish() return true, or nil and an error message. After
+ * an error, or an error raised by the callback, the decoder can not be
+ * used anymore. */
+
+#define JSON_DECODER_NAME   "cjson.decoder"
+
+/* Slots of the uservalue table of the decoder */
+#define JSON_DECODER_CALLBACK   1
+#define JSON_DECODER_CONFIG     2
+#define JSON_DECODER_TABLE(i)   (1 + 2 * (i))   /* table of frame i */
+#define JSON_DECODER_KEY(i)     (2 + 2 * (i))   /* pending key of frame i */
+
+typedef enum {
+    JS_VALUE,           /* a value */
+    JS_ARRAY_FIRST,     /* after '[': a value or ']' */
+    JS_OBJECT_FIRST,    /* after '{': a key or '}' */
+    JS_KEY,             /* after ',' in an object */
+    JS_COLON,
+    JS_NEXT             /* ',' or the end of the container */
+} json_stream_expect_t;
+
+typedef enum {
+    JL_NONE,
+    JL_STRING,
+    JL_ESCAPE,
+    JL_UNICODE,         /* the 4 hex digits of \uXXXX */
+    JL_SURROGATE,       /* '\' of the low surrogate */
+    JL_SURROGATE_U,     /* 'u' of the low surrogate */
+    JL_NUMBER,
+    JL_LITERAL
+} json_stream_lex_t;
+
+typedef struct {
+    char type;          /* '{' or '[' */
+    int index;          /* completed array elements */
+} json_stream_frame_t;
+
+typedef struct {
+    json_config_t *cfg;
+    int events;
+    int depth;
+    int failed;
+    char error[128];
+
+    json_stream_expect_t expect;
+    json_stream_lex_t lex;
+    int is_key;         /* the current string is an object key */
+
+    json_stream_frame_t *frames;
+    int nframes;
+    int frames_size;
+
+    strbuf_t tok;
+    int unicode;
+    int unicode_len;
+    int surrogate;
+
+    size_t offset;      /* position of the current chunk in the stream */
+    int uv;             /* stack index of the uservalue table */
+} json_stream_t;
+
+static int json_stream_fail(json_stream_t *js, const char *exp,
+                            const char *found, size_t index)
+{
+    js->failed = 1;
+    snprintf(js->error, sizeof(js->error),
+             "Expected %s but found %s at character %lu",
+             exp, found, (unsigned long)index + 1);
+    return -1;
+}
+
+/* callback(a, b), the values are on the top of the stack */
+static void json_stream_call(lua_State *l, json_stream_t *js)
+{
+    lua_rawgeti(l, js->uv, JSON_DECODER_CALLBACK);
+    lua_insert(l, -3);
+
+    /* Stays set if the callback raises an error */
+    js->failed = 1;
+    snprintf(js->error, sizeof(js->error), "decoder stopped by a callback error");
+    lua_call(l, 2, 0);
+    js->failed = 0;
+    js->error[0] = '\0';
+}
+
+static void json_stream_event(lua_State *l, json_stream_t *js,
+                              const char *event)
+{
+    lua_pushstring(l, event);
+    lua_pushnil(l);
+    json_stream_call(l, js);
+}
+
+/* A value completed at the current level, it is on the top of the stack */
+static void json_stream_complete(lua_State *l, json_stream_t *js)
+{
+    int n = js->nframes;
+    json_stream_frame_t *frame = n > 0 ? &js->frames[n - 1] : NULL;
+
+    if (frame && frame->type == '[')
+        frame->index++;
+
+    js->expect = n > 0 ? JS_NEXT : JS_VALUE;
+
+    if (js->events) {
+        lua_pushstring(l, "value");
+        lua_insert(l, -2);
+        json_stream_call(l, js);
+
+    } else if (n > js->depth) {
+        /* Add to the table being built */
+        lua_rawgeti(l, js->uv, JSON_DECODER_TABLE(n));
+        lua_insert(l, -2);
+        if (frame->type == '[') {
+            lua_rawseti(l, -2, frame->index);
+        } else {
+            lua_rawgeti(l, js->uv, JSON_DECODER_KEY(n));
+            lua_insert(l, -2);
+            lua_rawset(l, -3);
+        }
+        lua_pop(l, 1);
+
+    } else if (n == js->depth) {
+        if (!frame)
+            lua_pushnil(l);
+        else if (frame->type == '[')
+            lua_pushinteger(l, frame->index);
+        else
+            lua_rawgeti(l, js->uv, JSON_DECODER_KEY(n));
+        json_stream_call(l, js);
+
+    } else {
+        lua_pop(l, 1);
+    }
+}
+
+/* Values of scalars are only needed when they are kept */
+static int json_stream_wants_value(json_stream_t *js)
+{
+    return js->events || js->nframes >= js->depth;
+}
+
+static int json_stream_open(lua_State *l, json_stream_t *js, char type,
+                            size_t index)
+{
+    if (js->nframes >= js->cfg->decode_max_depth) {
+        js->failed = 1;
+        snprintf(js->error, sizeof(js->error),
+                 "Found too many nested data structures (%d) at character %lu",
+                 js->nframes + 1, (unsigned long)index + 1);
+        return -1;
+    }
+
+    if (js->nframes >= js->frames_size) {
+        int size = js->frames_size ? js->frames_size * 2 : 16;
+        json_stream_frame_t *frames = realloc(js->frames, size * sizeof(*frames));
+        if (!frames) {
+            js->failed = 1;
+            snprintf(js->error, sizeof(js->error), "out of memory");
+            return -1;
+        }
+        js->frames = frames;
+        js->frames_size = size;
+    }
+
+    js->frames[js->nframes].type = type;
+    js->frames[js->nframes].index = 0;
+    js->nframes++;
+    js->expect = type == '[' ? JS_ARRAY_FIRST : JS_OBJECT_FIRST;
+
+    if (js->events) {
+        json_stream_event(l, js, type == '[' ? "start_array" : "start_object");
+    } else if (js->nframes > js->depth) {
+        lua_newtable(l);
+        lua_rawseti(l, js->uv, JSON_DECODER_TABLE(js->nframes));
+    }
+
+    return 0;
+}
+
+static void json_stream_close(lua_State *l, json_stream_t *js)
+{
+    int n = js->nframes;
+    char type = js->frames[n - 1].type;
+
+    js->nframes--;
+
+    if (js->events) {
+        json_stream_event(l, js, type == '[' ? "end_array" : "end_object");
+        js->expect = js->nframes > 0 ? JS_NEXT : JS_VALUE;
+        return;
+    }
+
+    /* Release the table and the key before they are passed on */
+    lua_pushnil(l);
+    lua_rawseti(l, js->uv, JSON_DECODER_KEY(n));
+
+    if (n > js->depth) {
+        lua_rawgeti(l, js->uv, JSON_DECODER_TABLE(n));
+        lua_pushnil(l);
+        lua_rawseti(l, js->uv, JSON_DECODER_TABLE(n));
+        json_stream_complete(l, js);
+    } else {
+        js->expect = js->nframes > 0 ? JS_NEXT : JS_VALUE;
+    }
+}
+
+/* The string in `tok` is complete */
+static void json_stream_string(lua_State *l, json_stream_t *js)
+{
+    int len;
+    const char *str = strbuf_string(&js->tok, &len);
+
+    if (js->is_key) {
+        js->expect = JS_COLON;
+        if (js->events) {
+            lua_pushstring(l, "key");
+            lua_pushlstring(l, str, len);
+            json_stream_call(l, js);
+        } else if (js->nframes >= js->depth) {
+            lua_pushlstring(l, str, len);
+            lua_rawseti(l, js->uv, JSON_DECODER_KEY(js->nframes));
+        }
+        return;
+    }
+
+    if (json_stream_wants_value(js))
+        lua_pushlstring(l, str, len);
+    else
+        lua_pushnil(l);
+    json_stream_complete(l, js);
+}
+
+/* The number or literal in `tok` is complete */
+static int json_stream_scalar(lua_State *l, json_stream_t *js, size_t index)
+{
+    int len;
+    char *str;
+
+    strbuf_ensure_null(&js->tok);
+    str = strbuf_string(&js->tok, &len);
+
+    if (js->lex == JL_NUMBER) {
+        json_parse_t json;
+        char *endptr;
+        double number;
+#ifdef JSON_USE_INTEGERS
+        lua_Integer integer;
+#endif
+
+        json.ptr = str;
+        if (!js->cfg->decode_invalid_numbers && json_is_invalid_number(&json))
+            return json_stream_fail(js, "value", "invalid number", index - len);
+
+#ifdef JSON_USE_INTEGERS
+        if (json_parse_integer(str, &integer) == len) {
+            lua_pushinteger(l, integer);
+        } else
+#endif
+        {
+            number = fpconv_strtod(str, &endptr);
+            if (endptr != str + len)
+                return json_stream_fail(js, "value", "invalid number", index - len);
+
+            lua_pushnumber(l, number);
+        }
+
+    } else if (!strcmp(str, "true")) {
+        lua_pushboolean(l, 1);
+    } else if (!strcmp(str, "false")) {
+        lua_pushboolean(l, 0);
+    } else if (!strcmp(str, "null")) {
+        lua_pushlightuserdata(l, NULL);
+    } else if (js->cfg->decode_invalid_numbers &&
+               (!strcasecmp(str, "inf") || !strcasecmp(str, "infinity") ||
+                !strcasecmp(str, "nan"))) {
+        char *endptr;
+        lua_pushnumber(l, fpconv_strtod(str, &endptr));
+    } else {
+        return json_stream_fail(js, "value", "invalid token", index - len);
+    }
+
+    js->lex = JL_NONE;
+    json_stream_complete(l, js);
+    return 0;
+}
+
+static int json_stream_unicode(json_stream_t *js, size_t index)
+{
+    char utf8[4];
+    int codepoint = js->unicode;
+    int len;
+
+    if ((codepoint & 0xFC00) == 0xD800) {
+        /* High surrogate, a low surrogate must follow */
+        js->surrogate = codepoint;
+        js->lex = JL_SURROGATE;
+        return 0;
+    }
+
+    if (js->surrogate) {
+        if ((codepoint & 0xFC00) != 0xDC00)
+            return json_stream_fail(js, "string", "invalid unicode escape code", index);
+        codepoint = (((js->surrogate & 0x3FF) << 10) | (codepoint & 0x3FF)) + 0x10000;
+        js->surrogate = 0;
+    } else if ((codepoint & 0xFC00) == 0xDC00) {
+        return json_stream_fail(js, "string", "invalid unicode escape code", index);
+    }
+
+    len = codepoint_to_utf8(utf8, codepoint);
+    if (!len)
+        return json_stream_fail(js, "string", "invalid unicode escape code", index);
+
+    strbuf_append_mem(&js->tok, utf8, len);
+    js->lex = JL_STRING;
+    return 0;
+}
+
+static int json_stream_hex(int ch)
+{
+    if ('0' <= ch && ch <= '9')
+        return ch - '0';
+    ch |= 0x20;
+    if ('a' <= ch && ch <= 'f')
+        return ch - 'a' + 10;
+    return -1;
+}
+
+#define json_stream_is_number_char(ch) \
+    (('0' <= (ch) && (ch) <= '9') || (ch) == '-' || (ch) == '+' || \
+     (ch) == '.' || (ch) == 'e' || (ch) == 'E')
+
+/* Feed `len` bytes to the decoder */
+static int json_stream_feed(lua_State *l, json_stream_t *js,
+                            const char *data, size_t len)
+{
+    const json_token_type_t *ch2token = js->cfg->ch2token;
+    const char *escape2char = js->cfg->escape2char;
+    const char *p = data;
+    const char *end = data + len;
+
+    while (p < end) {
+        int ch = (unsigned char)*p;
+        size_t index = js->offset + (p - data);
+
+        switch (js->lex) {
+        case JL_STRING: {
+            /* Copy the run of plain characters at once */
+            const char *run = p;
+            while ((p = json_scan_string(p, end)) < end && !*p)
+                p++;    /* '\0' is a plain character here */
+            if (p > run)
+                strbuf_append_mem(&js->tok, run, p - run);
+            if (p == end)
+                return 0;
+
+            if (*p++ == '\\') {
+                js->lex = JL_ESCAPE;
+                continue;
+            }
+
+            js->lex = JL_NONE;
+            json_stream_string(l, js);
+            continue;
+        }
+
+        case JL_ESCAPE:
+            p++;
+            ch = escape2char[ch];
+            if (ch == 'u') {
+                js->lex = JL_UNICODE;
+                js->unicode = 0;
+                js->unicode_len = 0;
+            } else if (ch) {
+                strbuf_append_char(&js->tok, ch);
+                js->lex = JL_STRING;
+            } else {
+                return json_stream_fail(js, "string", "invalid escape code", index);
+            }
+            continue;
+
+        case JL_UNICODE: {
+            int digit = json_stream_hex(ch);
+            if (digit < 0)
+                return json_stream_fail(js, "string", "invalid unicode escape code", index);
+            p++;
+            js->unicode = (js->unicode << 4) | digit;
+            if (++js->unicode_len == 4 && json_stream_unicode(js, index) < 0)
+                return -1;
+            continue;
+        }
+
+        case JL_SURROGATE:
+        case JL_SURROGATE_U:
+            if (ch != (js->lex == JL_SURROGATE ? '\\' : 'u'))
+                return json_stream_fail(js, "string", "invalid unicode escape code", index);
+            p++;
+            if (js->lex == JL_SURROGATE) {
+                js->lex = JL_SURROGATE_U;
+            } else {
+                js->lex = JL_UNICODE;
+                js->unicode = 0;
+                js->unicode_len = 0;
+            }
+            continue;
+
+        case JL_NUMBER:
+        case JL_LITERAL:
+            if (js->lex == JL_NUMBER ? json_stream_is_number_char(ch)
+                                     : ('a' <= (ch | 0x20) && (ch | 0x20) <= 'z')) {
+                strbuf_append_char(&js->tok, ch);
+                p++;
+                continue;
+            }
+            if (json_stream_scalar(l, js, index) < 0)
+                return -1;
+            continue;
+
+        case JL_NONE:
+            break;
+        }
+
+        /* Between tokens */
+        switch (ch2token[ch]) {
+        case T_WHITESPACE:
+            p++;
+            continue;
+
+        case T_OBJ_BEGIN:
+        case T_ARR_BEGIN:
+            if (js->expect != JS_VALUE && js->expect != JS_ARRAY_FIRST)
+                break;
+            p++;
+            if (json_stream_open(l, js, (char)ch, index) < 0)
+                return -1;
+            continue;
+
+        case T_OBJ_END:
+        case T_ARR_END:
+            if (js->nframes == 0 || js->frames[js->nframes - 1].type != (ch == '}' ? '{' : '['))
+                break;
+            if (js->expect != JS_NEXT &&
+                js->expect != (ch == '}' ? JS_OBJECT_FIRST : JS_ARRAY_FIRST))
+                break;
+            p++;
+            json_stream_close(l, js);
+            continue;
+
+        case T_COMMA:
+            if (js->expect != JS_NEXT)
+                break;
+            p++;
+            js->expect = js->frames[js->nframes - 1].type == '[' ? JS_VALUE : JS_KEY;
+            continue;
+
+        case T_COLON:
+            if (js->expect != JS_COLON)
+                break;
+            p++;
+            js->expect = JS_VALUE;
+            continue;
+
+        default:
+            if (ch == '"') {
+                if (js->expect == JS_OBJECT_FIRST || js->expect == JS_KEY)
+                    js->is_key = 1;
+                else if (js->expect == JS_VALUE || js->expect == JS_ARRAY_FIRST)
+                    js->is_key = 0;
+                else
+                    break;
+                p++;
+                strbuf_reset(&js->tok);
+                js->lex = JL_STRING;
+                continue;
+            }
+
+            if (js->expect != JS_VALUE && js->expect != JS_ARRAY_FIRST)
+                break;
+
+            if (ch == '-' || ch == '+' || ('0' <= ch && ch <= '9')) {
+                js->lex = JL_NUMBER;
+            } else if ('a' <= (ch | 0x20) && (ch | 0x20) <= 'z') {
+                js->lex = JL_LITERAL;
+            } else {
+                return json_stream_fail(js, "value", "invalid token", index);
+            }
+
+            strbuf_reset(&js->tok);
+            strbuf_append_char(&js->tok, ch);
+            p++;
+            continue;
+        }
+
+        /* An unexpected token */
+        {
+            static const char *expected[] = {
+                "value", "value or array end", "object key string or object end",
+                "object key string", "colon", "comma or object end"
+            };
+            const char *exp = expected[js->expect];
+            json_token_type_t type = ch2token[ch];
+
+            if (js->expect == JS_NEXT && js->frames[js->nframes - 1].type == '[')
+                exp = "comma or array end";
+
+            if (type == T_UNKNOWN) {
+                if (ch == '"')
+                    type = T_STRING;
+                else if (ch == '-' || ch == '+' || ('0' <= ch && ch <= '9'))
+                    type = T_NUMBER;
+                else if (ch == 't' || ch == 'f')
+                    type = T_BOOLEAN;
+                else if (ch == 'n')
+                    type = T_NULL;
+            }
+
+            return json_stream_fail(js, exp, type == T_ERROR || type == T_UNKNOWN
+                                    ? "invalid token" : json_token_type_name[type], index);
+        }
+    }
+
+    return 0;
+}
+
+static json_stream_t *json_check_decoder(lua_State *l)
+{
+    json_stream_t *js = luaL_checkudata(l, 1, JSON_DECODER_NAME);
+
+    lua_settop(l, 2);
+    lua_getuservalue(l, 1);
+    js->uv = lua_gettop(l);
+    return js;
+}
+
+static int json_stream_result(lua_State *l, json_stream_t *js, int ret)
+{
+    if (ret < 0 || js->failed) {
+        lua_pushnil(l);
+        lua_pushstring(l, js->error);
+        return 2;
+    }
+
+    lua_pushboolean(l, 1);
+    return 1;
+}
+
+/* decoder:write(chunk) */
+static int json_decoder_write(lua_State *l)
+{
+    json_stream_t *js = json_check_decoder(l);
+    size_t len;
+    const char *data = luaL_checklstring(l, 2, &len);
+    int ret;
+
+    if (js->failed)
+        return json_stream_result(l, js, -1);
+
+    ret = json_stream_feed(l, js, data, len);
+    js->offset += len;
+
+    return json_stream_result(l, js, ret);
+}
+
+/* decoder:finish(), the decoder can be used again afterwards */
+static int json_decoder_finish(lua_State *l)
+{
+    json_stream_t *js = json_check_decoder(l);
+    int ret = 0;
+
+    if (js->failed)
+        return json_stream_result(l, js, -1);
+
+    if (js->lex == JL_NUMBER || js->lex == JL_LITERAL)
+        ret = json_stream_scalar(l, js, js->offset);
+
+    if (ret == 0 && (js->lex != JL_NONE || js->nframes > 0))
+        ret = json_stream_fail(js, js->lex != JL_NONE ? "string end" : "container end",
+                               "T_END", js->offset);
+
+    if (ret == 0) {
+        js->expect = JS_VALUE;
+        js->offset = 0;
+    }
+
+    return json_stream_result(l, js, ret);
+}
+
+static int json_decoder_gc(lua_State *l)
+{
+    json_stream_t *js = luaL_checkudata(l, 1, JSON_DECODER_NAME);
+
+    strbuf_free(&js->tok);
+    free(js->frames);
+    js->frames = NULL;
+    js->frames_size = js->nframes = 0;
+
+    return 0;
+}
+
+/* cjson.decoder(callback [, options]) */
+static int json_decoder_new(lua_State *l)
+{
+    static const char *modes[] = { "values", "events", NULL };
+    luaL_Reg methods[] = {
+        { "finish", json_decoder_finish },
+        { "write", json_decoder_write },
+        { NULL, NULL }
+    };
+    json_config_t *cfg = json_fetch_config(l);
+    json_stream_t *js;
+    int events = 0;
+    int depth = 1;
+
+    luaL_checktype(l, 1, LUA_TFUNCTION);
+    if (!lua_isnoneornil(l, 2)) {
+        luaL_checktype(l, 2, LUA_TTABLE);
+
+        lua_getfield(l, 2, "mode");
+        events = luaL_checkoption(l, -1, "values", modes);
+        lua_getfield(l, 2, "depth");
+        depth = luaL_optinteger(l, -1, 1);
+        luaL_argcheck(l, depth >= 0, 2, "depth must not be negative");
+        lua_pop(l, 2);
+    }
+
+    js = lua_newuserdata(l, sizeof(*js));
+    memset(js, 0, sizeof(*js));
+    js->cfg = cfg;
+    js->events = events;
+    js->depth = depth;
+    js->expect = JS_VALUE;
+    js->lex = JL_NONE;
+    strbuf_init(&js->tok, 0);
+
+    if (luaL_newmetatable(l, JSON_DECODER_NAME)) {
+        lua_newtable(l);
+        luaL_setfuncs(l, methods, 0);
+        lua_setfield(l, -2, "__index");
+        lua_pushcfunction(l, json_decoder_gc);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_setmetatable(l, -2);
+
+    /* The callback, and the config which must live as long as the decoder */
+    lua_createtable(l, 8, 0);
+    lua_pushvalue(l, 1);
+    lua_rawseti(l, -2, JSON_DECODER_CALLBACK);
+    lua_pushvalue(l, lua_upvalueindex(1));
+    lua_rawseti(l, -2, JSON_DECODER_CONFIG);
+    lua_setuservalue(l, -2);
+
+    return 1;
+}
+
+/* ===== LAZY DECODING ===== */
+
+/* Documents which are decoded on demand, for code which reads a few fields
+ * of a large JSON text:
+ *
+ *   local doc = cjson.lazy(text)
+ *   print(doc.method, doc.params[1], #doc.params)
+ *   for key, value in pairs(doc) do ... end
+ *   local params = cjson.materialize(doc.params)  -- plain Lua tables
+ *
+ * cjson.lazy() validates the text like cjson.decode() and indexes it into a
+ * "tape" with one node per value, without creating any Lua value. The
+ * children of a container follow it on the tape: an array is followed by
+ * its elements, an object by its keys each followed by its value, and the
+ * `next` node of a container is the one after all of its children.
+ *
+ * Objects and arrays are returned as views (userdata) which decode their
+ * members when they are accessed. Strings and numbers are decoded on each
+ * access, the views are cached by the document.
+ *
+ * Looking up a key scans the members of the object, the last duplicate key
+ * wins as with cjson.decode(). Array elements are found from the last
+ * accessed element, so ipairs() and numeric loops are linear.
+ */
+
+#define JSON_LAZY_NAME          "cjson.lazy"
+#define JSON_LAZY_DOC_NAME      "cjson.lazy_document"
+#define JSON_LAZY_NONE          UINT_MAX
+
+typedef struct {
+    unsigned int offset;    /* First character of the value */
+    unsigned int length;    /* Characters of the value, with its quotes or brackets */
+    unsigned int next;      /* Node after the value and its children */
+    unsigned int count;     /* Elements of an array, members of an object */
+    unsigned char type;     /* T_OBJ_BEGIN, T_ARR_BEGIN, T_STRING, ... */
+    unsigned char escaped;  /* T_STRING: has escape sequences */
+} json_lazy_node_t;
+
+/* The text and the config are kept alive by the uservalue of the document */
+typedef struct {
+    const char *text;
+    json_config_t *cfg;
+    json_lazy_node_t *nodes;
+    unsigned int count;
+    unsigned int size;
+} json_lazy_doc_t;
+
+typedef struct {
+    json_lazy_doc_t *doc;
+    unsigned int node;
+    unsigned int cursor;        /* Index of the last accessed element */
+    unsigned int cursor_node;   /* and its node */
+} json_lazy_t;
+
+static unsigned int json_lazy_add(lua_State *l, json_lazy_doc_t *doc,
+                                  json_parse_t *json, json_token_t *token,
+                                  int escaped)
+{
+    json_lazy_node_t *node;
+
+    if (doc->count == doc->size) {
+        unsigned int size = doc->size ? doc->size * 2 : 64;
+        json_lazy_node_t *nodes = NULL;
+
+        if (size > doc->size)
+            nodes = realloc(doc->nodes, size * sizeof(*nodes));
+        if (!nodes) {
+            strbuf_free(json->tmp);
+            luaL_error(l, "not enough memory");
+        }
+
+        doc->nodes = nodes;
+        doc->size = size;
+    }
+
+    node = &doc->nodes[doc->count];
+    node->offset = token->index;
+    node->length = (json->ptr - json->data) - token->index;
+    node->next = doc->count + 1;
+    node->count = 0;
+    node->type = token->type;
+    node->escaped = escaped;
+
+    return doc->count++;
+}
+
+/* json_next_token(), but strings without escapes are only skipped */
+static void json_lazy_next_token(json_parse_t *json, json_token_t *token,
+                                 int *escaped)
+{
+    const char *p = json->ptr;
+
+    while (json->cfg->ch2token[(unsigned char)*p] == T_WHITESPACE)
+        p++;
+    json->ptr = p;
+
+    *escaped = 0;
+    if (*p == '"') {
+        const char *end = json_scan_string(p + 1, json->end);
+        if (end < json->end && *end == '"') {
+            token->type = T_STRING;
+            token->index = p - json->data;
+            json->ptr = end + 1;
+            return;
+        }
+        *escaped = 1;
+    }
+
+    json_next_token(json, token);
+}
+
+/* Adds the key in `token` and reads the token of its value */
+static void json_lazy_key(lua_State *l, json_lazy_doc_t *doc,
+                          json_parse_t *json, json_token_t *token, int escaped)
+{
+    if (token->type != T_STRING)
+        json_throw_parse_error(l, json, "object key string", token);
+    json_lazy_add(l, doc, json, token, escaped);
+
+    json_lazy_next_token(json, token, &escaped);
+    if (token->type != T_COLON)
+        json_throw_parse_error(l, json, "colon", token);
+
+    json_lazy_next_token(json, token, &escaped);
+}
+
+static void json_lazy_build(lua_State *l, json_lazy_doc_t *doc, json_parse_t *json)
+{
+    json_token_t token;
+    unsigned int open = JSON_LAZY_NONE;     /* Innermost open container */
+    unsigned int n;
+    int escaped;
+
+    json_lazy_next_token(json, &token, &escaped);
+
+    for (;;) {
+        /* `token` starts a value */
+        if (token.type == T_OBJ_BEGIN || token.type == T_ARR_BEGIN) {
+            int is_object = token.type == T_OBJ_BEGIN;
+
+            json_decode_descend(l, json, 1);
+            n = json_lazy_add(l, doc, json, &token, 0);
+            doc->nodes[n].next = open;  /* The parent, until it is closed */
+            open = n;
+
+            json_lazy_next_token(json, &token, &escaped);
+            if (token.type != (is_object ? T_OBJ_END : T_ARR_END)) {
+                if (is_object)
+                    json_lazy_key(l, doc, json, &token, escaped);
+                continue;
+            }
+        } else if (token.type == T_STRING || token.type == T_NUMBER ||
+                   token.type == T_BOOLEAN || token.type == T_NULL) {
+            json_lazy_add(l, doc, json, &token, escaped);
+            if (open == JSON_LAZY_NONE)
+                break;
+
+            doc->nodes[open].count++;
+            json_lazy_next_token(json, &token, &escaped);
+        } else {
+            json_throw_parse_error(l, json, "value", &token);
+        }
+
+        /* `token` follows a value or ends an empty container */
+        for (;;) {
+            int is_object = doc->nodes[open].type == T_OBJ_BEGIN;
+
+            if (token.type == (is_object ? T_OBJ_END : T_ARR_END)) {
+                n = open;
+                open = doc->nodes[n].next;
+                doc->nodes[n].next = doc->count;
+                doc->nodes[n].length = (json->ptr - json->data) - doc->nodes[n].offset;
+                json_decode_ascend(json);
+
+                if (open == JSON_LAZY_NONE)
+                    break;
+
+                doc->nodes[open].count++;
+                json_lazy_next_token(json, &token, &escaped);
+                continue;
+            }
+
+            if (token.type != T_COMMA)
+                json_throw_parse_error(l, json, is_object ? "comma or object end"
+                                       : "comma or array end", &token);
+
+            json_lazy_next_token(json, &token, &escaped);
+            if (is_object)
+                json_lazy_key(l, doc, json, &token, escaped);
+            break;
+        }
+
+        if (open == JSON_LAZY_NONE)
+            break;
+    }
+
+    /* Ensure there is no more input left */
+    json_lazy_next_token(json, &token, &escaped);
+    if (token.type != T_END)
+        json_throw_parse_error(l, json, "the end", &token);
+}
+
+/* Pushes the string, number, boolean or null of a node */
+static void json_lazy_push_scalar(lua_State *l, json_lazy_doc_t *doc,
+                                  json_lazy_node_t *node)
+{
+    json_parse_t json;
+    json_token_t token;
+
+    if (node->type == T_STRING && !node->escaped) {
+        lua_pushlstring(l, doc->text + node->offset + 1, node->length - 2);
+        return;
+    }
+
+    json.cfg = doc->cfg;
+    json.data = doc->text;
+    json.ptr = doc->text + node->offset;
+    json.end = json.ptr + node->length;
+    json.current_depth = 0;
+    json.tmp = strbuf_new(node->length);
+
+    json_next_token(&json, &token);
+    json_process_value(l, &json, &token);
+
+    strbuf_free(json.tmp);
+}
+
+/* Pushes the value of node `n`, the document is at `doc_index` */
+static void json_lazy_push(lua_State *l, int doc_index, json_lazy_doc_t *doc,
+                           unsigned int n)
+{
+    json_lazy_node_t *node = &doc->nodes[n];
+    json_lazy_t *view;
+
+    if (node->type != T_OBJ_BEGIN && node->type != T_ARR_BEGIN) {
+        json_lazy_push_scalar(l, doc, node);
+        return;
+    }
+
+    /* The views are cached in the uservalue of the document */
+    lua_getuservalue(l, doc_index);
+    if (lua_rawgeti(l, -1, (lua_Integer)n + 1) != LUA_TNIL) {
+        lua_remove(l, -2);
+        return;
+    }
+    lua_pop(l, 1);
+
+    view = lua_newuserdata(l, sizeof(*view));
+    view->doc = doc;
+    view->node = n;
+    view->cursor = 0;
+    view->cursor_node = n + 1;
+    luaL_setmetatable(l, JSON_LAZY_NAME);
+
+    lua_pushvalue(l, doc_index);
+    lua_setuservalue(l, -2);
+
+    lua_pushvalue(l, -1);
+    lua_rawseti(l, -3, (lua_Integer)n + 1);
+    lua_remove(l, -2);
+}
+
+/* Node of the element `i` (0 based) of an array view */
+static unsigned int json_lazy_element(json_lazy_t *view, unsigned int i)
+{
+    json_lazy_node_t *nodes = view->doc->nodes;
+    unsigned int k = view->cursor;
+    unsigned int n = view->cursor_node;
+
+    if (i < k) {
+        k = 0;
+        n = view->node + 1;
+    }
+
+    for (; k < i; k++)
+        n = nodes[n].next;
+
+    view->cursor = k;
+    view->cursor_node = n;
+    return n;
+}
+
+/* Node of the value of `key` in an object, or JSON_LAZY_NONE */
+static unsigned int json_lazy_member(lua_State *l, json_lazy_doc_t *doc,
+                                     unsigned int object, const char *key,
+                                     size_t len)
+{
+    json_lazy_node_t *nodes = doc->nodes;
+    unsigned int found = JSON_LAZY_NONE;
+    unsigned int n = object + 1;
+    unsigned int i;
+
+    for (i = 0; i < nodes[object].count; i++) {
+        json_lazy_node_t *name = &nodes[n];
+
+        if (!name->escaped) {
+            if (name->length - 2 == len &&
+                !memcmp(doc->text + name->offset + 1, key, len))
+                found = n + 1;
+        } else {
+            size_t name_len;
+            const char *str;
+
+            json_lazy_push_scalar(l, doc, name);
+            str = lua_tolstring(l, -1, &name_len);
+            if (name_len == len && !memcmp(str, key, len))
+                found = n + 1;
+            lua_pop(l, 1);
+        }
+
+        n = nodes[n + 1].next;
+    }
+
+    return found;
+}
+
+/* Checks the view at index 1 and pushes its document */
+static json_lazy_t *json_lazy_check(lua_State *l)
+{
+    json_lazy_t *view = luaL_checkudata(l, 1, JSON_LAZY_NAME);
+
+    lua_getuservalue(l, 1);
+    return view;
+}
+
+static int json_lazy_index(lua_State *l)
+{
+    json_lazy_t *view;
+    json_lazy_node_t *node;
+    unsigned int n = JSON_LAZY_NONE;
+
+    lua_settop(l, 2);
+    view = json_lazy_check(l);
+    node = &view->doc->nodes[view->node];
+
+    if (node->type == T_ARR_BEGIN) {
+        int isnum;
+        lua_Integer i = lua_tointegerx(l, 2, &isnum);
+
+        if (isnum && i >= 1 && i <= node->count)
+            n = json_lazy_element(view, (unsigned int)i - 1);
+    } else if (lua_type(l, 2) == LUA_TSTRING) {
+        size_t len;
+        const char *key = lua_tolstring(l, 2, &len);
+
+        n = json_lazy_member(l, view->doc, view->node, key, len);
+    }
+
+    if (n == JSON_LAZY_NONE)
+        lua_pushnil(l);
+    else
+        json_lazy_push(l, 3, view->doc, n);
+
+    return 1;
+}
+
+static int json_lazy_len(lua_State *l)
+{
+    json_lazy_t *view = luaL_checkudata(l, 1, JSON_LAZY_NAME);
+    json_lazy_node_t *node = &view->doc->nodes[view->node];
+
+    lua_pushinteger(l, node->type == T_ARR_BEGIN ? node->count : 0);
+    return 1;
+}
+
+/* Iterator of pairs(view), upvalues: the next node and its index */
+static int json_lazy_next(lua_State *l)
+{
+    json_lazy_t *view;
+    json_lazy_node_t *nodes;
+    unsigned int n = (unsigned int)lua_tointeger(l, lua_upvalueindex(1));
+    unsigned int i = (unsigned int)lua_tointeger(l, lua_upvalueindex(2));
+
+    lua_settop(l, 1);
+    view = json_lazy_check(l);
+    nodes = view->doc->nodes;
+
+    if (i >= nodes[view->node].count)
+        return 0;
+
+    if (nodes[view->node].type == T_ARR_BEGIN) {
+        lua_pushinteger(l, (lua_Integer)i + 1);
+        json_lazy_push(l, 2, view->doc, n);
+        n = nodes[n].next;
+    } else {
+        json_lazy_push_scalar(l, view->doc, &nodes[n]);
+        json_lazy_push(l, 2, view->doc, n + 1);
+        n = nodes[n + 1].next;
+    }
+
+    lua_pushinteger(l, n);
+    lua_replace(l, lua_upvalueindex(1));
+    lua_pushinteger(l, (lua_Integer)i + 1);
+    lua_replace(l, lua_upvalueindex(2));
+
+    return 2;
+}
+
+static int json_lazy_pairs(lua_State *l)
+{
+    json_lazy_t *view = luaL_checkudata(l, 1, JSON_LAZY_NAME);
+
+    lua_pushinteger(l, (lua_Integer)view->node + 1);
+    lua_pushinteger(l, 0);
+    lua_pushcclosure(l, json_lazy_next, 2);
+    lua_pushvalue(l, 1);
+    lua_pushnil(l);
+
+    return 3;
+}
+
+static int json_lazy_tostring(lua_State *l)
+{
+    json_lazy_t *view = luaL_checkudata(l, 1, JSON_LAZY_NAME);
+    json_lazy_node_t *node = &view->doc->nodes[view->node];
+
+    lua_pushfstring(l, "%s: %p", node->type == T_ARR_BEGIN ? "json array"
+                    : "json object", view);
+    return 1;
+}
+
+static int json_lazy_doc_gc(lua_State *l)
+{
+    json_lazy_doc_t *doc = luaL_checkudata(l, 1, JSON_LAZY_DOC_NAME);
+
+    free(doc->nodes);
+    doc->nodes = NULL;
+    doc->count = doc->size = 0;
+
+    return 0;
+}
+
+/* cjson.lazy(text): a view of the object or array, or the scalar value */
+static int json_lazy_new(lua_State *l)
+{
+    luaL_Reg methods[] = {
+        { "__index", json_lazy_index },
+        { "__len", json_lazy_len },
+        { "__pairs", json_lazy_pairs },
+        { "__tostring", json_lazy_tostring },
+        { NULL, NULL }
+    };
+    json_lazy_doc_t *doc;
+    json_parse_t json;
+    size_t json_len;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    json.cfg = json_fetch_config(l);
+    json.data = luaL_checklstring(l, 1, &json_len);
+    json.current_depth = 0;
+    json.ptr = json.data;
+    json.end = json.data + json_len;
+
+    luaL_argcheck(l, json_len < JSON_LAZY_NONE, 1, "JSON text too large");
+    if (json_len >= 2 && (!json.data[0] || !json.data[1]))
+        luaL_error(l, "JSON parser does not support UTF-16 or UTF-32");
+
+    if (luaL_newmetatable(l, JSON_LAZY_NAME))
+        luaL_setfuncs(l, methods, 0);
+    if (luaL_newmetatable(l, JSON_LAZY_DOC_NAME)) {
+        lua_pushcfunction(l, json_lazy_doc_gc);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_pop(l, 2);
+
+    doc = lua_newuserdata(l, sizeof(*doc));
+    memset(doc, 0, sizeof(*doc));
+    doc->text = json.data;
+    doc->cfg = json.cfg;
+    luaL_setmetatable(l, JSON_LAZY_DOC_NAME);
+
+    lua_createtable(l, 0, 2);
+    lua_pushvalue(l, 1);
+    lua_setfield(l, -2, "text");
+    lua_pushvalue(l, lua_upvalueindex(1));
+    lua_setfield(l, -2, "config");
+    lua_setuservalue(l, 2);
+
+    json.tmp = strbuf_new(json_len);
+    json_lazy_build(l, doc, &json);
+    strbuf_free(json.tmp);
+
+    /* Release the unused part of the tape */
+    if (doc->count < doc->size) {
+        json_lazy_node_t *nodes = realloc(doc->nodes, doc->count * sizeof(*nodes));
+        if (nodes) {
+            doc->nodes = nodes;
+            doc->size = doc->count;
+        }
+    }
+
+    json_lazy_push(l, 2, doc, 0);
+    return 1;
+}
+
+/* cjson.materialize(value): Lua tables of a view, other values unchanged */
+static int json_lazy_materialize(lua_State *l)
+{
+    json_lazy_t *view = luaL_testudata(l, 1, JSON_LAZY_NAME);
+    json_lazy_node_t *node;
+    json_parse_t json;
+    json_token_t token;
+
+    luaL_checkany(l, 1);
+    lua_settop(l, 1);
+    if (!view)
+        return 1;
+
+    node = &view->doc->nodes[view->node];
+    json.cfg = view->doc->cfg;
+    json.data = view->doc->text;
+    json.ptr = json.data + node->offset;
+    json.end = json.ptr + node->length;
+    json.current_depth = 0;
+    json.tmp = strbuf_new(node->length);
+
+    json_next_token(&json, &token);
+    json_process_value(l, &json, &token);
+
+    strbuf_free(json.tmp);
+    return 1;
+}
+
+/* ===== NDJSON ===== */
+
+/* Newline delimited JSON (JSON Lines): one JSON text per line.
+ *
+ *   local decoder = cjson.ndjson_decoder([options])
+ *   local records = decoder:write(chunk)  -- as many times as needed
+ *   records = decoder:finish()            -- a last line without '\n'
+ *
+ * write() returns the array of the records completed by the chunk, a
+ * record may be split across any number of chunks. Blank lines are
+ * ignored. All the records of a chunk are decoded with a single C call.
+ *
+ * options.skip_invalid: drop the lines which are not valid JSON, write()
+ * and finish() then also return the number of lines dropped. Otherwise
+ * an invalid line stops the decoder, which returns nil and the error.
+ * options.max_line: the longest line accepted in bytes, 0 (default) for
+ * no limit.
+ *
+ *   local text = cjson.ndjson_encode(records [, buffer])
+ *
+ * Encodes an array of records, each followed by '\n', into one string or
+ * at the limit of a buffer (see cjson.encode_into).
+ */
+
+#define JSON_NDJSON_NAME    "cjson.ndjson_decoder"
+
+typedef struct {
+    json_config_t *cfg;
+    strbuf_t line;          /* The current line, NUL terminated to decode */
+    strbuf_t tmp;           /* json_parse_t.tmp, released by parse errors */
+    lua_Integer lineno;     /* Lines completed so far */
+    int skip_invalid;
+    int max_line;
+    int discard;            /* Drop the rest of a line over max_line */
+    int failed;
+} json_ndjson_t;
+
+/* Progress of a call to json_ndjson_protected() */
+typedef struct {
+    json_ndjson_t *nd;
+    const char *ptr;
+    const char *end;
+    int finish;             /* Decode the rest as a last line */
+    lua_Integer count;      /* Records in the result array */
+} json_ndjson_ctx_t;
+
+/* Decodes the line in nd->line and appends it to the array at the top */
+static void json_ndjson_decode_line(lua_State *l, json_ndjson_ctx_t *ctx)
+{
+    json_ndjson_t *nd = ctx->nd;
+    json_parse_t json;
+    json_token_t token;
+    int len;
+
+    strbuf_ensure_null(&nd->line);
+    json.data = strbuf_string(&nd->line, &len);
+
+    /* Blank lines */
+    json.ptr = json.data;
+    while (nd->cfg->ch2token[(unsigned char)*json.ptr] == T_WHITESPACE)
+        json.ptr++;
+    if (json.ptr == json.data + len)
+        return;
+
+    if (!nd->tmp.buf)
+        strbuf_init(&nd->tmp, len);
+    else if (nd->tmp.size <= len)
+        strbuf_resize(&nd->tmp, len);
+    strbuf_reset(&nd->tmp);
+
+    json.cfg = nd->cfg;
+    json.end = json.data + len;
+    json.current_depth = 0;
+    json.tmp = &nd->tmp;
+
+    json_next_token(&json, &token);
+    json_process_value(l, &json, &token);
+
+    json_next_token(&json, &token);
+    if (token.type != T_END)
+        json_throw_parse_error(l, &json, "the end", &token);
+
+    lua_rawseti(l, -2, ++ctx->count);
+}
+
+/* Splits [ptr, end) of the context at index 1 into lines, the records are
+ * appended to the array at index 2. The context keeps the position of the
+ * next line when a line throws an error. */
+static int json_ndjson_protected(lua_State *l)
+{
+    json_ndjson_ctx_t *ctx = lua_touserdata(l, 1);
+    json_ndjson_t *nd = ctx->nd;
+
+    lua_settop(l, 2);
+
+    while (ctx->ptr < ctx->end) {
+        const char *newline = memchr(ctx->ptr, '\n', ctx->end - ctx->ptr);
+        const char *stop = newline ? newline : ctx->end;
+
+        if (nd->discard) {
+            ctx->ptr = newline ? newline + 1 : ctx->end;
+            if (newline) {
+                nd->lineno++;
+                nd->discard = 0;
+            }
+            continue;
+        }
+
+        if (nd->max_line > 0 &&
+            strbuf_length(&nd->line) + (stop - ctx->ptr) > nd->max_line) {
+            strbuf_reset(&nd->line);
+            nd->discard = 1;
+            luaL_error(l, "line %d: longer than %d bytes",
+                       (int)nd->lineno + 1, nd->max_line);
+        }
+
+        strbuf_append_mem(&nd->line, ctx->ptr, stop - ctx->ptr);
+        if (!newline) {
+            ctx->ptr = ctx->end;
+            break;
+        }
+
+        ctx->ptr = newline + 1;
+        nd->lineno++;
+        json_ndjson_decode_line(l, ctx);
+        strbuf_reset(&nd->line);
+    }
+
+    if (ctx->finish && strbuf_length(&nd->line) > 0) {
+        nd->lineno++;
+        json_ndjson_decode_line(l, ctx);
+        strbuf_reset(&nd->line);
+    }
+
+    return 0;
+}
+
+/* Decodes [data, data + len), returns the values of write() and finish() */
+static int json_ndjson_run(lua_State *l, json_ndjson_t *nd, const char *data,
+                           size_t len, int finish)
+{
+    json_ndjson_ctx_t ctx;
+    lua_Integer skipped = 0;
+    int records;
+
+    if (nd->failed) {
+        lua_pushnil(l);
+        lua_pushliteral(l, "decoder stopped by an invalid line");
+        return 2;
+    }
+
+    ctx.nd = nd;
+    ctx.ptr = data;
+    ctx.end = data + len;
+    ctx.finish = finish;
+    ctx.count = 0;
+
+    lua_newtable(l);
+    records = lua_gettop(l);
+
+    for (;;) {
+        lua_pushcfunction(l, json_ndjson_protected);
+        lua_pushlightuserdata(l, &ctx);
+        lua_pushvalue(l, records);
+        if (lua_pcall(l, 2, 0, 0) == 0)
+            break;
+
+        strbuf_reset(&nd->line);
+        if (!nd->skip_invalid) {
+            const char *msg = lua_tostring(l, -1);
+
+            nd->failed = 1;
+            lua_pushnil(l);
+            if (msg && !strncmp(msg, "line ", 5))
+                lua_pushstring(l, msg);
+            else
+                lua_pushfstring(l, "line %d: %s", (int)nd->lineno, msg ? msg : "error");
+            return 2;
+        }
+
+        lua_pop(l, 1);
+        skipped++;
+    }
+
+    if (nd->skip_invalid) {
+        lua_pushinteger(l, skipped);
+        return 2;
+    }
+
+    return 1;
+}
+
+static json_ndjson_t *json_check_ndjson(lua_State *l)
+{
+    return luaL_checkudata(l, 1, JSON_NDJSON_NAME);
+}
+
+/* decoder:write(chunk) */
+static int json_ndjson_write(lua_State *l)
+{
+    json_ndjson_t *nd = json_check_ndjson(l);
+    size_t len;
+    const char *data = luaL_checklstring(l, 2, &len);
+
+    return json_ndjson_run(l, nd, data, len, 0);
+}
+
+/* decoder:finish(), the decoder can be used again afterwards */
+static int json_ndjson_finish(lua_State *l)
+{
+    json_ndjson_t *nd = json_check_ndjson(l);
+    int ret = json_ndjson_run(l, nd, "", 0, 1);
+
+    strbuf_reset(&nd->line);
+    nd->lineno = 0;
+    nd->discard = 0;
+    nd->failed = 0;
+
+    return ret;
+}
+
+static int json_ndjson_gc(lua_State *l)
+{
+    json_ndjson_t *nd = json_check_ndjson(l);
+
+    strbuf_free(&nd->line);
+    if (nd->tmp.buf)
+        strbuf_free(&nd->tmp);
+
+    return 0;
+}
+
+/* cjson.ndjson_decoder([options]) */
+static int json_ndjson_decoder_new(lua_State *l)
+{
+    luaL_Reg methods[] = {
+        { "finish", json_ndjson_finish },
+        { "write", json_ndjson_write },
+        { NULL, NULL }
+    };
+    json_config_t *cfg = json_fetch_config(l);
+    json_ndjson_t *nd;
+    int skip_invalid = 0;
+    int max_line = 0;
+
+    if (!lua_isnoneornil(l, 1)) {
+        luaL_checktype(l, 1, LUA_TTABLE);
+
+        lua_getfield(l, 1, "skip_invalid");
+        skip_invalid = lua_toboolean(l, -1);
+        lua_getfield(l, 1, "max_line");
+        max_line = (int)luaL_optinteger(l, -1, 0);
+        luaL_argcheck(l, max_line >= 0, 1, "max_line must not be negative");
+        lua_pop(l, 2);
+    }
+
+    nd = lua_newuserdata(l, sizeof(*nd));
+    memset(nd, 0, sizeof(*nd));
+    nd->cfg = cfg;
+    nd->skip_invalid = skip_invalid;
+    nd->max_line = max_line;
+    strbuf_init(&nd->line, 0);
+
+    if (luaL_newmetatable(l, JSON_NDJSON_NAME)) {
+        lua_newtable(l);
+        luaL_setfuncs(l, methods, 0);
+        lua_setfield(l, -2, "__index");
+        lua_pushcfunction(l, json_ndjson_gc);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_setmetatable(l, -2);
+
+    /* The config must live as long as the decoder */
+    lua_pushvalue(l, lua_upvalueindex(1));
+    lua_setuservalue(l, -2);
+
+    return 1;
+}
+
+/* cjson.ndjson_encode(records [, buffer]) */
+static int json_ndjson_encode(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    strbuf_t json;
+    int len;
+    char *str;
+
+    luaL_checktype(l, 1, LUA_TTABLE);
+
+    if (!lua_isnoneornil(l, 2)) {
+        lua_pushinteger(l, json_encode_buffer(l, cfg, 2, 1, 1));
+        return 1;
+    }
+
+    strbuf_init(&json, 0);
+    if (json_encode_pcall(l, cfg, &json, 1, NULL, 1) != 0) {
+        strbuf_free(&json);
+        return lua_error(l);
+    }
+
+    str = strbuf_string(&json, &len);
+    lua_pushlstring(l, str, len);
+    strbuf_free(&json);
+
+    return 1;
+}
+
 /* ===== INITIALISATION ===== */
 
 #if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
@@ -1364,12 +3342,19 @@ static int lua_cjson_new(lua_State *l)
         { "decode", json_decode },
         { "decode_invalid_numbers", json_cfg_decode_invalid_numbers },
         { "decode_max_depth", json_cfg_decode_max_depth },
+        { "decoder", json_decoder_new },
         { "encode", json_encode },
+        { "encode_into", json_encode_into },
         { "encode_invalid_numbers", json_cfg_encode_invalid_numbers },
         { "encode_keep_buffer", json_cfg_encode_keep_buffer },
         { "encode_max_depth", json_cfg_encode_max_depth },
         { "encode_number_precision", json_cfg_encode_number_precision },
         { "encode_sparse_array", json_cfg_encode_sparse_array },
+        { "encode_to_stream", json_encode_to_stream },
+        { "lazy", json_lazy_new },
+        { "materialize", json_lazy_materialize },
+        { "ndjson_decoder", json_ndjson_decoder_new },
+        { "ndjson_encode", json_ndjson_encode },
         { "new", lua_cjson_new },
         { NULL, NULL }
     };
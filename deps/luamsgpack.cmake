@@ -0,0 +1,18 @@
+cmake_minimum_required(VERSION 2.8)
+
+# MessagePack codec, built like luajson and sharing its strbuf
+
+set(LUAMSGPACKDIR ${CMAKE_CURRENT_LIST_DIR}/luamsgpack)
+
+include_directories(
+  ${LUAMSGPACKDIR}
+  ${CMAKE_CURRENT_LIST_DIR}/luajson   # strbuf.h
+  ${CMAKE_CURRENT_LIST_DIR}/luautils  # buffer.h
+)
+
+set(SOURCES
+  ${LUAMSGPACKDIR}/lua_msgpack.c
+)
+
+add_library(luamsgpack STATIC ${SOURCES})
+target_link_libraries(luamsgpack luajson)
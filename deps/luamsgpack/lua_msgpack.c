@@ -0,0 +1,1255 @@
+/**
+ *  Copyright 2016 The Node.lua Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/* Lua MessagePack - MessagePack (https://msgpack.org) support for Lua,
+ * built like lua-cjson:
+ *
+ *   msgpack.encode(value)                   -- a string
+ *   msgpack.encode_into(buffer, value)      -- appended to a luv_buffer_t
+ *   msgpack.decode(data)                    -- exactly one message
+ *   msgpack.decode_next(data [, position])  -- value, next position
+ *   msgpack.decoder(callback [, options])   -- messages arriving in chunks
+ *
+ * `data` is a string or a luv_buffer_t ([position, limit) is read).
+ *
+ * Type mapping:
+ * - nil and msgpack.null (the same light userdata as cjson.null) encode
+ *   as nil. nil decodes as msgpack.null, so arrays keep their length.
+ * - Lua integers use the smallest integer format. Floats are always
+ *   float64 so the number subtype survives a round trip. uint64 values
+ *   above math.maxinteger decode as floats.
+ * - Lua strings encode as str and luv_buffer_t as bin. Both decode as
+ *   Lua strings.
+ * - Tables are arrays or maps with the same rules as cjson, see
+ *   encode_sparse_array. Empty tables are maps.
+ * - Extension types are not supported.
+ */
+
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "strbuf.h"
+#include "buffer.h"
+
+#if LUA_VERSION_NUM < 503
+#error "msgpack requires Lua 5.3 integers"
+#endif
+
+#ifndef MSGPACK_MODNAME
+#define MSGPACK_MODNAME     "msgpack"
+#endif
+
+#ifndef MSGPACK_VERSION
+#define MSGPACK_VERSION     "1.0.0"
+#endif
+
+#ifdef _MSC_VER
+#define MSGPACK_EXPORT      __declspec(dllexport)
+#else
+#define MSGPACK_EXPORT      extern
+#endif
+
+#define DEFAULT_SPARSE_CONVERT 0
+#define DEFAULT_SPARSE_RATIO 2
+#define DEFAULT_SPARSE_SAFE 10
+#define DEFAULT_ENCODE_MAX_DEPTH 1000
+#define DEFAULT_DECODE_MAX_DEPTH 1000
+#define DEFAULT_DECODER_MAX_SIZE (64 * 1024 * 1024)
+
+typedef struct {
+    strbuf_t encode_buf;
+
+    int encode_sparse_convert;
+    int encode_sparse_ratio;
+    int encode_sparse_safe;
+    int encode_max_depth;
+    int decode_max_depth;
+} mp_config_t;
+
+typedef struct {
+    const unsigned char *start;
+    const unsigned char *ptr;
+    const unsigned char *end;
+    mp_config_t *cfg;
+    int current_depth;
+} mp_parse_t;
+
+/* ===== CONFIGURATION ===== */
+
+static mp_config_t *mp_fetch_config(lua_State *l)
+{
+    mp_config_t *cfg;
+
+    cfg = (mp_config_t *)lua_touserdata(l, lua_upvalueindex(1));
+    if (!cfg)
+        luaL_error(l, "BUG: Unable to fetch msgpack configuration");
+
+    return cfg;
+}
+
+/* Pad the arguments with nil, see json_arg_init() of lua_cjson.c */
+static mp_config_t *mp_arg_init(lua_State *l, int args)
+{
+    luaL_argcheck(l, lua_gettop(l) <= args, args + 1,
+                  "found too many arguments");
+
+    while (lua_gettop(l) < args)
+        lua_pushnil(l);
+
+    return mp_fetch_config(l);
+}
+
+static int mp_integer_option(lua_State *l, int optindex, int *setting,
+                             int min, int max)
+{
+    char errmsg[64];
+    int value;
+
+    if (!lua_isnil(l, optindex)) {
+        value = luaL_checkinteger(l, optindex);
+        snprintf(errmsg, sizeof(errmsg), "expected integer between %d and %d", min, max);
+        luaL_argcheck(l, min <= value && value <= max, 1, errmsg);
+        *setting = value;
+    }
+
+    lua_pushinteger(l, *setting);
+
+    return 1;
+}
+
+static int mp_boolean_option(lua_State *l, int optindex, int *setting)
+{
+    static const char *options[] = { "off", "on", NULL };
+
+    if (!lua_isnil(l, optindex)) {
+        if (lua_isboolean(l, optindex))
+            *setting = lua_toboolean(l, optindex);
+        else
+            *setting = luaL_checkoption(l, optindex, NULL, options);
+    }
+
+    lua_pushboolean(l, *setting);
+
+    return 1;
+}
+
+/* Configures handling of extremely sparse arrays, as cjson:
+ * convert: Convert extremely sparse arrays into maps? Otherwise error.
+ * ratio: 0: always allow sparse; 1: never allow sparse; >1: use ratio
+ * safe: Always use an array when the max index <= safe */
+static int mp_cfg_encode_sparse_array(lua_State *l)
+{
+    mp_config_t *cfg = mp_arg_init(l, 3);
+
+    mp_boolean_option(l, 1, &cfg->encode_sparse_convert);
+    mp_integer_option(l, 2, &cfg->encode_sparse_ratio, 0, INT_MAX);
+    mp_integer_option(l, 3, &cfg->encode_sparse_safe, 0, INT_MAX);
+
+    return 3;
+}
+
+/* Configures the maximum number of nested arrays/maps allowed when
+ * encoding */
+static int mp_cfg_encode_max_depth(lua_State *l)
+{
+    mp_config_t *cfg = mp_arg_init(l, 1);
+
+    return mp_integer_option(l, 1, &cfg->encode_max_depth, 1, INT_MAX);
+}
+
+/* Configures the maximum number of nested arrays/maps allowed when
+ * decoding */
+static int mp_cfg_decode_max_depth(lua_State *l)
+{
+    mp_config_t *cfg = mp_arg_init(l, 1);
+
+    return mp_integer_option(l, 1, &cfg->decode_max_depth, 1, INT_MAX);
+}
+
+static int mp_destroy_config(lua_State *l)
+{
+    mp_config_t *cfg;
+
+    cfg = (mp_config_t *)lua_touserdata(l, 1);
+    if (cfg)
+        strbuf_free(&cfg->encode_buf);
+
+    return 0;
+}
+
+static void mp_create_config(lua_State *l)
+{
+    mp_config_t *cfg;
+
+    cfg = (mp_config_t *)lua_newuserdata(l, sizeof(*cfg));
+
+    /* Create GC method to clean up strbuf */
+    lua_newtable(l);
+    lua_pushcfunction(l, mp_destroy_config);
+    lua_setfield(l, -2, "__gc");
+    lua_setmetatable(l, -2);
+
+    cfg->encode_sparse_convert = DEFAULT_SPARSE_CONVERT;
+    cfg->encode_sparse_ratio = DEFAULT_SPARSE_RATIO;
+    cfg->encode_sparse_safe = DEFAULT_SPARSE_SAFE;
+    cfg->encode_max_depth = DEFAULT_ENCODE_MAX_DEPTH;
+    cfg->decode_max_depth = DEFAULT_DECODE_MAX_DEPTH;
+
+    strbuf_init(&cfg->encode_buf, 0);
+}
+
+/* The luv_buffer_t of a `lutils.new_buffer()` or a `Buffer` object */
+static luv_buffer_t *mp_check_buffer(lua_State *l, int lindex)
+{
+    luv_buffer_t *buffer;
+
+    if (lua_istable(l, lindex)) {
+        lua_getfield(l, lindex, "buffer");
+        buffer = luaL_testudata(l, -1, LUV_BUFFER);
+        lua_pop(l, 1);
+    } else {
+        buffer = luaL_testudata(l, lindex, LUV_BUFFER);
+    }
+
+    if (buffer == NULL)
+        luaL_argerror(l, lindex, "expected a buffer");
+
+    return buffer;
+}
+
+/* The readable bytes [position, limit) of a buffer, or NULL */
+static const char *mp_buffer_data(luv_buffer_t *buffer, size_t *len)
+{
+    if (buffer->data == NULL || buffer->position < 1 ||
+        buffer->limit < buffer->position || buffer->limit > buffer->length + 1) {
+        *len = 0;
+        return NULL;
+    }
+
+    *len = buffer->limit - buffer->position;
+    return buffer->data + buffer->position - 1;
+}
+
+/* The data of a string or buffer argument. `base` is set to the
+ * position of the first byte, 1 for strings */
+static const char *mp_check_data(lua_State *l, int lindex, size_t *len,
+                                 int *base)
+{
+    luv_buffer_t *buffer;
+    const char *data;
+
+    *base = 1;
+    if (lua_type(l, lindex) == LUA_TSTRING)
+        return lua_tolstring(l, lindex, len);
+
+    buffer = mp_check_buffer(l, lindex);
+    data = mp_buffer_data(buffer, len);
+    if (data == NULL)
+        return "";
+
+    *base = buffer->position;
+    return data;
+}
+
+/* ===== ENCODING ===== */
+
+static void mp_encode_exception(lua_State *l, int lindex, const char *reason)
+{
+    luaL_error(l, "Cannot serialise %s: %s",
+                  lua_typename(l, lua_type(l, lindex)), reason);
+}
+
+static inline void mp_append_u8(strbuf_t *s, unsigned char type,
+                                unsigned char value)
+{
+    char *p;
+
+    strbuf_ensure_empty_length(s, 2);
+    p = strbuf_empty_ptr(s);
+    p[0] = type;
+    p[1] = value;
+    strbuf_extend_length(s, 2);
+}
+
+static inline void mp_append_u16(strbuf_t *s, unsigned char type,
+                                 uint16_t value)
+{
+    char *p;
+
+    strbuf_ensure_empty_length(s, 3);
+    p = strbuf_empty_ptr(s);
+    p[0] = type;
+    p[1] = value >> 8;
+    p[2] = value;
+    strbuf_extend_length(s, 3);
+}
+
+static inline void mp_append_u32(strbuf_t *s, unsigned char type,
+                                 uint32_t value)
+{
+    char *p;
+
+    strbuf_ensure_empty_length(s, 5);
+    p = strbuf_empty_ptr(s);
+    p[0] = type;
+    p[1] = value >> 24;
+    p[2] = value >> 16;
+    p[3] = value >> 8;
+    p[4] = value;
+    strbuf_extend_length(s, 5);
+}
+
+static inline void mp_append_u64(strbuf_t *s, unsigned char type,
+                                 uint64_t value)
+{
+    char *p;
+    int i;
+
+    strbuf_ensure_empty_length(s, 9);
+    p = strbuf_empty_ptr(s);
+    p[0] = type;
+    for (i = 8; i > 0; i--) {
+        p[i] = (char)value;
+        value >>= 8;
+    }
+    strbuf_extend_length(s, 9);
+}
+
+static void mp_append_integer(strbuf_t *s, lua_Integer value)
+{
+    if (value >= 0) {
+        if (value < 128)
+            strbuf_append_char(s, (char)value);
+        else if (value <= UINT8_MAX)
+            mp_append_u8(s, 0xcc, (unsigned char)value);
+        else if (value <= UINT16_MAX)
+            mp_append_u16(s, 0xcd, (uint16_t)value);
+        else if (value <= UINT32_MAX)
+            mp_append_u32(s, 0xce, (uint32_t)value);
+        else
+            mp_append_u64(s, 0xcf, (uint64_t)value);
+    } else {
+        if (value >= -32)
+            strbuf_append_char(s, (char)value);
+        else if (value >= INT8_MIN)
+            mp_append_u8(s, 0xd0, (unsigned char)value);
+        else if (value >= INT16_MIN)
+            mp_append_u16(s, 0xd1, (uint16_t)value);
+        else if (value >= INT32_MIN)
+            mp_append_u32(s, 0xd2, (uint32_t)value);
+        else
+            mp_append_u64(s, 0xd3, (uint64_t)value);
+    }
+}
+
+static void mp_append_double(strbuf_t *s, double value)
+{
+    union { double d; uint64_t u; } bits;
+
+    bits.d = value;
+    mp_append_u64(s, 0xcb, bits.u);
+}
+
+/* Header of a str (type 0xd9) or bin (type 0xc4) of `len` bytes */
+static void mp_append_length(lua_State *l, strbuf_t *s, int bin, size_t len)
+{
+    if (!bin && len < 32)
+        strbuf_append_char(s, (char)(0xa0 | len));
+    else if (len <= UINT8_MAX)
+        mp_append_u8(s, bin ? 0xc4 : 0xd9, (unsigned char)len);
+    else if (len <= UINT16_MAX)
+        mp_append_u16(s, bin ? 0xc5 : 0xda, (uint16_t)len);
+    else if (len <= UINT32_MAX && len < INT_MAX / 2)
+        mp_append_u32(s, bin ? 0xc6 : 0xdb, (uint32_t)len);
+    else
+        luaL_error(l, "Cannot serialise %s: too long", bin ? "buffer" : "string");
+}
+
+/* Header of an array (fix type 0x90, type 0xdc) or map (0x80, 0xde) */
+static void mp_append_container(strbuf_t *s, int map, uint32_t count)
+{
+    if (count < 16)
+        strbuf_append_char(s, (char)((map ? 0x80 : 0x90) | count));
+    else if (count <= UINT16_MAX)
+        mp_append_u16(s, map ? 0xde : 0xdc, (uint16_t)count);
+    else
+        mp_append_u32(s, map ? 0xdf : 0xdd, count);
+}
+
+/* Find the size of the array on the top of the Lua stack, see
+ * lua_array_length() of lua_cjson.c
+ * -1   map (not a pure array, or empty)
+ * >0   elements in array */
+static int mp_array_length(lua_State *l, mp_config_t *cfg)
+{
+    lua_Integer k, max = 0;
+    int items = 0;
+
+    lua_pushnil(l);
+    /* table, startkey */
+    while (lua_next(l, -2) != 0) {
+        /* table, key, value */
+        if (lua_isinteger(l, -2)) {
+            k = lua_tointeger(l, -2);
+        } else if (lua_type(l, -2) == LUA_TNUMBER) {
+            lua_Number n = lua_tonumber(l, -2);
+            k = (floor(n) == n && n >= 1 && n <= INT_MAX) ? (lua_Integer)n : 0;
+        } else {
+            k = 0;
+        }
+
+        /* Must not be an array (non integer key) */
+        if (k < 1 || k > INT_MAX) {
+            lua_pop(l, 2);
+            return -1;
+        }
+
+        if (k > max)
+            max = k;
+        items++;
+        lua_pop(l, 1);
+    }
+
+    if (max == 0)
+        return -1;
+
+    /* Encode excessively sparse arrays as maps (if enabled) */
+    if (cfg->encode_sparse_ratio > 0 &&
+        max > items * cfg->encode_sparse_ratio &&
+        max > cfg->encode_sparse_safe) {
+        if (!cfg->encode_sparse_convert)
+            mp_encode_exception(l, -1, "excessively sparse array");
+
+        return -1;
+    }
+
+    return (int)max;
+}
+
+static void mp_append_data(lua_State *l, mp_config_t *cfg,
+                           int current_depth, strbuf_t *s);
+
+static void mp_append_table(lua_State *l, mp_config_t *cfg,
+                            int current_depth, strbuf_t *s)
+{
+    int i, len, header, count = 0;
+
+    /* The key, the value and an error message */
+    if (current_depth > cfg->encode_max_depth || !lua_checkstack(l, 3))
+        luaL_error(l, "Cannot serialise, excessive nesting (%d)", current_depth);
+
+    len = mp_array_length(l, cfg);
+    if (len > 0) {
+        mp_append_container(s, 0, (uint32_t)len);
+        for (i = 1; i <= len; i++) {
+            lua_rawgeti(l, -1, i);
+            mp_append_data(l, cfg, current_depth, s);
+            lua_pop(l, 1);
+        }
+        return;
+    }
+
+    /* The pairs are counted while they are written, most maps have less
+     * than 16 pairs so 1 byte is kept for a fixmap header */
+    header = strbuf_length(s);
+    strbuf_append_char(s, (char)0x80);
+
+    lua_pushnil(l);
+    /* table, startkey */
+    while (lua_next(l, -2) != 0) {
+        /* table, key, value */
+        lua_pushvalue(l, -2);
+        mp_append_data(l, cfg, current_depth, s);
+        lua_pop(l, 1);
+        mp_append_data(l, cfg, current_depth, s);
+        lua_pop(l, 1);
+        count++;
+    }
+
+    if (count < 16) {
+        s->buf[header] = (char)(0x80 | count);
+        return;
+    }
+
+    /* Make room for a map 16 or map 32 header */
+    len = count <= UINT16_MAX ? 3 : 5;
+    strbuf_ensure_empty_length(s, len - 1);
+    memmove(s->buf + header + len, s->buf + header + 1,
+            strbuf_length(s) - header - 1);
+    strbuf_extend_length(s, len - 1);
+
+    if (len == 3) {
+        s->buf[header] = (char)0xde;
+    } else {
+        s->buf[header] = (char)0xdf;
+        s->buf[header + 1] = (char)(count >> 24);
+        s->buf[header + 2] = (char)(count >> 16);
+    }
+    s->buf[header + len - 2] = (char)(count >> 8);
+    s->buf[header + len - 1] = (char)count;
+}
+
+/* Serialise the Lua value on the top of the stack */
+static void mp_append_data(lua_State *l, mp_config_t *cfg,
+                           int current_depth, strbuf_t *s)
+{
+    const char *str;
+    size_t len;
+
+    switch (lua_type(l, -1)) {
+    case LUA_TSTRING:
+        str = lua_tolstring(l, -1, &len);
+        mp_append_length(l, s, 0, len);
+        strbuf_append_mem(s, str, (int)len);
+        break;
+    case LUA_TNUMBER:
+        if (lua_isinteger(l, -1))
+            mp_append_integer(s, lua_tointeger(l, -1));
+        else
+            mp_append_double(s, lua_tonumber(l, -1));
+        break;
+    case LUA_TBOOLEAN:
+        strbuf_append_char(s, lua_toboolean(l, -1) ? (char)0xc3 : (char)0xc2);
+        break;
+    case LUA_TTABLE:
+        mp_append_table(l, cfg, current_depth + 1, s);
+        break;
+    case LUA_TNIL:
+        strbuf_append_char(s, (char)0xc0);
+        break;
+    case LUA_TLIGHTUSERDATA:
+        if (lua_touserdata(l, -1) == NULL) {
+            strbuf_append_char(s, (char)0xc0);
+            break;
+        }
+        mp_encode_exception(l, -1, "type not supported");
+        break;
+    case LUA_TUSERDATA: {
+        luv_buffer_t *buffer = luaL_testudata(l, -1, LUV_BUFFER);
+        if (buffer) {
+            str = mp_buffer_data(buffer, &len);
+            mp_append_length(l, s, 1, len);
+            if (len > 0)
+                strbuf_append_mem(s, str, (int)len);
+            break;
+        }
+        mp_encode_exception(l, -1, "type not supported");
+        break;
+    }
+    default:
+        /* Remaining types (LUA_TFUNCTION, LUA_TTHREAD) cannot be
+         * serialised */
+        mp_encode_exception(l, -1, "type not supported");
+        /* never returns */
+    }
+}
+
+/* msgpack.encode(value) */
+static int mp_encode(lua_State *l)
+{
+    mp_config_t *cfg = mp_fetch_config(l);
+    strbuf_t *s = &cfg->encode_buf;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    /* The buffer is kept by the config, an error leaves nothing to free */
+    strbuf_reset(s);
+    mp_append_data(l, cfg, 0, s);
+    lua_pushlstring(l, s->buf, strbuf_length(s));
+
+    return 1;
+}
+
+/* Encodes the value at index 2 into the strbuf at index 1 (a light
+ * userdata) with the config at upvalue 1. Called with lua_pcall() so the
+ * borrowed memory can be handed back when an error is thrown. */
+static int mp_encode_protected(lua_State *l)
+{
+    mp_config_t *cfg = lua_touserdata(l, lua_upvalueindex(1));
+    strbuf_t *s = lua_touserdata(l, 1);
+
+    lua_settop(l, 2);
+    mp_append_data(l, cfg, 0, s);
+
+    return 0;
+}
+
+/* msgpack.encode_into(buffer, value)
+ *
+ * Appends the message of `value` at the limit of `buffer` and moves the
+ * limit after it, as cjson.encode_into(). Returns the number of bytes.
+ *
+ * Raises an error while a `uv.write()` of the buffer is pending. */
+static int mp_encode_into(lua_State *l)
+{
+    luv_buffer_t *buffer;
+    strbuf_t s;
+    int start, status;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+    buffer = mp_check_buffer(l, 1);
+
+    if (buffer->data == NULL) {
+        buffer->length = 0;
+        buffer->position = 1;
+        buffer->limit = 1;
+    }
+    luaL_argcheck(l, buffer->limit >= 1 && buffer->limit <= buffer->length + 1,
+                  1, "invalid buffer limit");
+    luaL_argcheck(l, buffer->writes == 0, 1, "buffer is being written");
+
+    /* Borrow the memory of the buffer, it was allocated with malloc()
+     * and has 2 bytes of padding */
+    memset(&s, 0, sizeof(s));
+    s.increment = STRBUF_DEFAULT_INCREMENT;
+    s.buf = buffer->data;
+    s.size = buffer->data ? buffer->length + 2 : 1;
+    s.length = start = buffer->limit - 1;
+
+    lua_pushvalue(l, lua_upvalueindex(1));
+    lua_pushcclosure(l, mp_encode_protected, 1);
+    lua_pushlightuserdata(l, &s);
+    lua_pushvalue(l, 2);
+    status = lua_pcall(l, 2, 0, 0);
+    if (status == 0 && s.size < s.length + 2)
+        strbuf_resize(&s, s.length + 1);
+
+    /* Hand back the memory, it may have been moved or grown */
+    buffer->data = s.buf;
+    if (s.buf && s.size - 2 > buffer->length)
+        buffer->length = s.size - 2;
+
+    if (status != 0)
+        return lua_error(l);
+
+    buffer->limit = s.length + 1;
+    lua_pushinteger(l, s.length - start);
+    return 1;
+}
+
+/* ===== DECODING ===== */
+
+static void mp_decode_value(lua_State *l, mp_parse_t *mp);
+
+static void mp_throw_error(lua_State *l, mp_parse_t *mp, const char *reason)
+{
+    luaL_error(l, "Invalid message: %s at byte %d", reason,
+               (int)(mp->ptr - mp->start) + 1);
+}
+
+/* Ensure `n` more bytes are available */
+static inline void mp_need(lua_State *l, mp_parse_t *mp, size_t n)
+{
+    if ((size_t)(mp->end - mp->ptr) < n)
+        mp_throw_error(l, mp, "incomplete data");
+}
+
+static inline uint16_t mp_read_u16(const unsigned char *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t mp_read_u32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint64_t mp_read_u64(const unsigned char *p)
+{
+    return ((uint64_t)mp_read_u32(p) << 32) | mp_read_u32(p + 4);
+}
+
+/* Reads the big endian unsigned integer of `size` bytes after the type */
+static uint64_t mp_read_size(lua_State *l, mp_parse_t *mp, int size)
+{
+    const unsigned char *p = mp->ptr;
+
+    mp_need(l, mp, size);
+    mp->ptr += size;
+
+    switch (size) {
+    case 1: return p[0];
+    case 2: return mp_read_u16(p);
+    case 4: return mp_read_u32(p);
+    default: return mp_read_u64(p);
+    }
+}
+
+static void mp_push_string(lua_State *l, mp_parse_t *mp, uint64_t len)
+{
+    mp_need(l, mp, len);
+    lua_pushlstring(l, (const char *)mp->ptr, (size_t)len);
+    mp->ptr += len;
+}
+
+static void mp_decode_descend(lua_State *l, mp_parse_t *mp, int slots)
+{
+    mp->current_depth++;
+
+    if (mp->current_depth <= mp->cfg->decode_max_depth &&
+        lua_checkstack(l, slots)) {
+        return;
+    }
+
+    luaL_error(l, "Found too many nested data structures (%d) at byte %d",
+               mp->current_depth, (int)(mp->ptr - mp->start));
+}
+
+static void mp_decode_array(lua_State *l, mp_parse_t *mp, uint64_t count)
+{
+    uint64_t i;
+
+    /* Each element takes a byte at least, don't trust the count for the
+     * size of the table */
+    mp_need(l, mp, count);
+    mp_decode_descend(l, mp, 2);
+
+    lua_createtable(l, (int)count, 0);
+    for (i = 1; i <= count; i++) {
+        mp_decode_value(l, mp);
+        lua_rawseti(l, -2, (lua_Integer)i);
+    }
+
+    mp->current_depth--;
+}
+
+static void mp_decode_map(lua_State *l, mp_parse_t *mp, uint64_t count)
+{
+    uint64_t i;
+
+    mp_need(l, mp, count * 2);
+    mp_decode_descend(l, mp, 3);
+
+    lua_createtable(l, 0, (int)count);
+    for (i = 0; i < count; i++) {
+        mp_decode_value(l, mp);
+        mp_decode_value(l, mp);
+        lua_rawset(l, -3);
+    }
+
+    mp->current_depth--;
+}
+
+/* Push the next value of the message */
+static void mp_decode_value(lua_State *l, mp_parse_t *mp)
+{
+    union { float f; uint32_t u; } f32;
+    union { double d; uint64_t u; } f64;
+    unsigned int type;
+    uint64_t u;
+
+    mp_need(l, mp, 1);
+    type = *mp->ptr++;
+
+    if (type <= 0x7f) {
+        lua_pushinteger(l, type);
+        return;
+    } else if (type >= 0xe0) {
+        lua_pushinteger(l, (int)type - 0x100);
+        return;
+    } else if (type <= 0x8f) {
+        mp_decode_map(l, mp, type & 0x0f);
+        return;
+    } else if (type <= 0x9f) {
+        mp_decode_array(l, mp, type & 0x0f);
+        return;
+    } else if (type <= 0xbf) {
+        mp_push_string(l, mp, type & 0x1f);
+        return;
+    }
+
+    switch (type) {
+    case 0xc0:
+        lua_pushlightuserdata(l, NULL);
+        break;
+    case 0xc2:
+    case 0xc3:
+        lua_pushboolean(l, type == 0xc3);
+        break;
+    case 0xc4:  /* bin 8, 16, 32 */
+    case 0xc5:
+    case 0xc6:
+        u = mp_read_size(l, mp, 1 << (type - 0xc4));
+        mp_push_string(l, mp, u);
+        break;
+    case 0xca:
+        f32.u = (uint32_t)mp_read_size(l, mp, 4);
+        lua_pushnumber(l, f32.f);
+        break;
+    case 0xcb:
+        f64.u = mp_read_size(l, mp, 8);
+        lua_pushnumber(l, f64.d);
+        break;
+    case 0xcc:  /* uint 8, 16, 32, 64 */
+    case 0xcd:
+    case 0xce:
+    case 0xcf:
+        u = mp_read_size(l, mp, 1 << (type - 0xcc));
+        if (u > (uint64_t)LUA_MAXINTEGER)
+            lua_pushnumber(l, (lua_Number)u);
+        else
+            lua_pushinteger(l, (lua_Integer)u);
+        break;
+    case 0xd0:
+        lua_pushinteger(l, (int8_t)mp_read_size(l, mp, 1));
+        break;
+    case 0xd1:
+        lua_pushinteger(l, (int16_t)mp_read_size(l, mp, 2));
+        break;
+    case 0xd2:
+        lua_pushinteger(l, (int32_t)mp_read_size(l, mp, 4));
+        break;
+    case 0xd3:
+        lua_pushinteger(l, (lua_Integer)(int64_t)mp_read_size(l, mp, 8));
+        break;
+    case 0xd9:  /* str 8, 16, 32 */
+    case 0xda:
+    case 0xdb:
+        u = mp_read_size(l, mp, 1 << (type - 0xd9));
+        mp_push_string(l, mp, u);
+        break;
+    case 0xdc:
+    case 0xdd:
+        mp_decode_array(l, mp, mp_read_size(l, mp, type == 0xdc ? 2 : 4));
+        break;
+    case 0xde:
+    case 0xdf:
+        mp_decode_map(l, mp, mp_read_size(l, mp, type == 0xde ? 2 : 4));
+        break;
+    default:
+        mp->ptr--;
+        if (type == 0xc1)
+            mp_throw_error(l, mp, "type 0xc1");
+        else
+            mp_throw_error(l, mp, "unsupported extension type");
+    }
+}
+
+static void mp_parse_init(mp_parse_t *mp, mp_config_t *cfg,
+                          const char *data, size_t len)
+{
+    mp->start = mp->ptr = (const unsigned char *)data;
+    mp->end = mp->start + len;
+    mp->cfg = cfg;
+    mp->current_depth = 0;
+}
+
+/* msgpack.decode(data), `data` must hold exactly one message */
+static int mp_decode(lua_State *l)
+{
+    mp_parse_t mp;
+    size_t len;
+    int base;
+    const char *data;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    data = mp_check_data(l, 1, &len, &base);
+
+    mp_parse_init(&mp, mp_fetch_config(l), data, len);
+    mp_decode_value(l, &mp);
+
+    if (mp.ptr != mp.end)
+        mp_throw_error(l, &mp, "trailing data");
+
+    return 1;
+}
+
+/* msgpack.decode_next(data [, position])
+ *
+ * Decodes the message at `position` (default: the first byte of `data`)
+ * and returns it with the position after it, to walk through
+ * concatenated messages. Returns nothing at the end of `data`. */
+static int mp_decode_next(lua_State *l)
+{
+    mp_parse_t mp;
+    size_t len;
+    int base;
+    lua_Integer position;
+    const char *data = mp_check_data(l, 1, &len, &base);
+
+    position = luaL_optinteger(l, 2, base);
+    luaL_argcheck(l, position >= base && position <= base + (lua_Integer)len,
+                  2, "position out of range");
+
+    if (position == base + (lua_Integer)len)
+        return 0;
+
+    mp_parse_init(&mp, mp_fetch_config(l), data, len);
+    mp.ptr += position - base;
+    mp_decode_value(l, &mp);
+
+    lua_pushinteger(l, base + (mp.ptr - mp.start));
+    return 2;
+}
+
+/* ===== STREAMING DECODING ===== */
+
+/* Decoder for concatenated messages which arrive in chunks, e.g. from a
+ * socket:
+ *
+ *   local decoder = msgpack.decoder(callback [, options])
+ *   decoder:write(chunk)   -- a string or buffer, as many times as needed
+ *   decoder:finish()
+ *
+ * callback(value) is called for each complete message. The bytes of an
+ * incomplete message are kept until the rest arrives, a message larger
+ * than options.max_size (default 64MB) is an error.
+ *
+ * write() and finish() return true, or nil and an error message. After
+ * an error, or an error raised by the callback, the decoder can not be
+ * used anymore. */
+
+#define MP_DECODER_NAME     "msgpack.decoder"
+
+/* Slots of the uservalue table of the decoder */
+#define MP_DECODER_CALLBACK 1
+#define MP_DECODER_CONFIG   2
+
+typedef struct {
+    mp_config_t *cfg;
+    strbuf_t pending;       /* start of the next message */
+    size_t scan_offset;     /* pending bytes already scanned */
+    uint64_t scan_count;    /* values still missing */
+    size_t max_size;
+    int failed;
+    char error[128];
+} mp_decoder_t;
+
+/* Finds the end of the message at the start of `data` without decoding
+ * it. Scanning continues from (*offset, *count), which are updated so a
+ * message can be scanned as it arrives. Returns 1 when the message is
+ * complete (it ends at *offset), 0 when more data is needed, -1 when the
+ * data is invalid. *needed is set to the size the message has at least. */
+static int mp_scan(const unsigned char *data, size_t len, size_t *offset,
+                   uint64_t *count, uint64_t *needed)
+{
+    size_t pos = *offset;
+    uint64_t pending = *count;
+
+    while (pending > 0) {
+        const unsigned char *p = data + pos;
+        size_t avail = len - pos;
+        uint64_t header, size = 0, items = 0;
+        unsigned int type;
+
+        if (avail < 1)
+            break;
+
+        type = p[0];
+        header = 1;
+        if (type <= 0x7f || type >= 0xe0 || (type >= 0xc0 && type <= 0xc3)) {
+            if (type == 0xc1)
+                return -1;
+        } else if (type <= 0x8f) {
+            items = (type & 0x0f) * 2;
+        } else if (type <= 0x9f) {
+            items = type & 0x0f;
+        } else if (type <= 0xbf) {
+            size = type & 0x1f;
+        } else if (type >= 0xca && type <= 0xd3) {
+            /* float 32, 64, uint 8 .. 64, int 8 .. 64 */
+            static const unsigned char sizes[] = { 4, 8, 1, 2, 4, 8, 1, 2, 4, 8 };
+            size = sizes[type - 0xca];
+        } else {
+            int width;
+            if (type >= 0xc4 && type <= 0xc6)
+                width = 1 << (type - 0xc4);
+            else if (type >= 0xd9 && type <= 0xdb)
+                width = 1 << (type - 0xd9);
+            else if (type == 0xdc || type == 0xde)
+                width = 2;
+            else if (type == 0xdd || type == 0xdf)
+                width = 4;
+            else
+                return -1;      /* extension types */
+
+            if (avail < 1 + (size_t)width)
+                break;
+
+            header += width;
+            size = width == 1 ? p[1] : width == 2 ? mp_read_u16(p + 1)
+                                                  : mp_read_u32(p + 1);
+            if (type >= 0xdc) {
+                items = type >= 0xde ? size * 2 : size;
+                size = 0;
+            }
+        }
+
+        if (avail < header || avail - header < size) {
+            *needed = pos + header + size;
+            break;
+        }
+
+        pos += header + size;
+        pending += items - 1;
+    }
+
+    *offset = pos;
+    *count = pending;
+    if (*needed < pos)
+        *needed = pos;
+    return pending == 0;
+}
+
+static mp_decoder_t *mp_check_decoder(lua_State *l)
+{
+    return luaL_checkudata(l, 1, MP_DECODER_NAME);
+}
+
+static int mp_decoder_fail(mp_decoder_t *dec, const char *msg)
+{
+    dec->failed = 1;
+    snprintf(dec->error, sizeof(dec->error), "%s", msg);
+    return -1;
+}
+
+/* lua_pcall()ed by mp_decoder_run(): decodes the message in the
+ * mp_parse_t at index 1 */
+static int mp_decode_protected(lua_State *l)
+{
+    mp_parse_t *mp = lua_touserdata(l, 1);
+
+    mp_decode_value(l, mp);
+    return 1;
+}
+
+/* Decodes the complete messages at the start of `data` and sets *used
+ * to their size. Returns 0, or -1 on error */
+static int mp_decoder_run(lua_State *l, mp_decoder_t *dec, int uv,
+                          const char *data, size_t len, size_t *used)
+{
+    size_t start = 0;
+
+    *used = 0;
+    for (;;) {
+        size_t offset = dec->scan_offset;
+        uint64_t count = dec->scan_count;
+        uint64_t needed = 0;
+        int ret = mp_scan((const unsigned char *)data + start, len - start,
+                          &offset, &count, &needed);
+        mp_parse_t mp;
+
+        if (ret < 0)
+            return mp_decoder_fail(dec, "invalid message");
+
+        if (needed > dec->max_size) {
+            snprintf(dec->error, sizeof(dec->error),
+                     "message larger than %d bytes", (int)dec->max_size);
+            dec->failed = 1;
+            return -1;
+        }
+
+        if (ret == 0) {
+            dec->scan_offset = offset;
+            dec->scan_count = count;
+            return 0;
+        }
+
+        mp_parse_init(&mp, dec->cfg, data + start, offset);
+        lua_pushcfunction(l, mp_decode_protected);
+        lua_pushlightuserdata(l, &mp);
+        if (lua_pcall(l, 1, 1, 0) != 0) {
+            mp_decoder_fail(dec, lua_tostring(l, -1));
+            lua_pop(l, 1);
+            return -1;
+        }
+
+        start += offset;
+        *used = start;
+        dec->scan_offset = 0;
+        dec->scan_count = 1;
+
+        /* An error of the callback leaves the decoder failed */
+        dec->failed = 1;
+        snprintf(dec->error, sizeof(dec->error), "callback error");
+        lua_rawgeti(l, uv, MP_DECODER_CALLBACK);
+        lua_insert(l, -2);
+        lua_call(l, 1, 0);
+        dec->failed = 0;
+    }
+}
+
+static int mp_decoder_result(lua_State *l, mp_decoder_t *dec)
+{
+    if (dec->failed) {
+        lua_pushnil(l);
+        lua_pushstring(l, dec->error);
+        return 2;
+    }
+
+    lua_pushboolean(l, 1);
+    return 1;
+}
+
+/* decoder:write(chunk) */
+static int mp_decoder_write(lua_State *l)
+{
+    mp_decoder_t *dec = mp_check_decoder(l);
+    strbuf_t *pending = &dec->pending;
+    size_t len, used;
+    int base;
+    const char *data = mp_check_data(l, 2, &len, &base);
+
+    if (dec->failed)
+        return mp_decoder_result(l, dec);
+
+    lua_settop(l, 2);
+    lua_getuservalue(l, 1);
+
+    if (strbuf_length(pending) == 0) {
+        /* Decode from the chunk, keep only the incomplete message */
+        if (mp_decoder_run(l, dec, 3, data, len, &used) == 0 && used < len)
+            strbuf_append_mem(pending, data + used, (int)(len - used));
+
+    } else {
+        strbuf_append_mem(pending, data, (int)len);
+        if (mp_decoder_run(l, dec, 3, pending->buf, strbuf_length(pending),
+                           &used) == 0 && used > 0) {
+            memmove(pending->buf, pending->buf + used,
+                    strbuf_length(pending) - used);
+            pending->length -= (int)used;
+        }
+    }
+
+    return mp_decoder_result(l, dec);
+}
+
+/* decoder:finish(), the decoder can be used again afterwards */
+static int mp_decoder_finish(lua_State *l)
+{
+    mp_decoder_t *dec = mp_check_decoder(l);
+
+    if (!dec->failed && strbuf_length(&dec->pending) > 0) {
+        snprintf(dec->error, sizeof(dec->error),
+                 "incomplete message (%d bytes)", strbuf_length(&dec->pending));
+        dec->failed = 1;
+    }
+
+    if (!dec->failed) {
+        dec->scan_offset = 0;
+        dec->scan_count = 1;
+    }
+
+    return mp_decoder_result(l, dec);
+}
+
+static int mp_decoder_gc(lua_State *l)
+{
+    mp_decoder_t *dec = mp_check_decoder(l);
+
+    strbuf_free(&dec->pending);
+
+    return 0;
+}
+
+/* msgpack.decoder(callback [, options]) */
+static int mp_decoder_new(lua_State *l)
+{
+    luaL_Reg methods[] = {
+        { "finish", mp_decoder_finish },
+        { "write", mp_decoder_write },
+        { NULL, NULL }
+    };
+    mp_config_t *cfg = mp_fetch_config(l);
+    mp_decoder_t *dec;
+    lua_Integer max_size = DEFAULT_DECODER_MAX_SIZE;
+
+    luaL_checktype(l, 1, LUA_TFUNCTION);
+    if (!lua_isnoneornil(l, 2)) {
+        luaL_checktype(l, 2, LUA_TTABLE);
+
+        lua_getfield(l, 2, "max_size");
+        max_size = luaL_optinteger(l, -1, max_size);
+        luaL_argcheck(l, max_size > 0 && max_size < INT_MAX / 2, 2,
+                      "max_size out of range");
+        lua_pop(l, 1);
+    }
+
+    dec = lua_newuserdata(l, sizeof(*dec));
+    memset(dec, 0, sizeof(*dec));
+    dec->cfg = cfg;
+    dec->max_size = (size_t)max_size;
+    dec->scan_count = 1;
+    strbuf_init(&dec->pending, 0);
+
+    if (luaL_newmetatable(l, MP_DECODER_NAME)) {
+        lua_newtable(l);
+        luaL_setfuncs(l, methods, 0);
+        lua_setfield(l, -2, "__index");
+        lua_pushcfunction(l, mp_decoder_gc);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_setmetatable(l, -2);
+
+    /* The callback, and the config which must live as long as the decoder */
+    lua_createtable(l, 2, 0);
+    lua_pushvalue(l, 1);
+    lua_rawseti(l, -2, MP_DECODER_CALLBACK);
+    lua_pushvalue(l, lua_upvalueindex(1));
+    lua_rawseti(l, -2, MP_DECODER_CONFIG);
+    lua_setuservalue(l, -2);
+
+    return 1;
+}
+
+/* ===== INITIALISATION ===== */
+
+/* Return msgpack module table */
+static int lua_msgpack_new(lua_State *l)
+{
+    luaL_Reg reg[] = {
+        { "decode", mp_decode },
+        { "decode_max_depth", mp_cfg_decode_max_depth },
+        { "decode_next", mp_decode_next },
+        { "decoder", mp_decoder_new },
+        { "encode", mp_encode },
+        { "encode_into", mp_encode_into },
+        { "encode_max_depth", mp_cfg_encode_max_depth },
+        { "encode_sparse_array", mp_cfg_encode_sparse_array },
+        { "new", lua_msgpack_new },
+        { NULL, NULL }
+    };
+
+    /* msgpack module table */
+    lua_newtable(l);
+
+    /* Register functions with config data as upvalue */
+    mp_create_config(l);
+    luaL_setfuncs(l, reg, 1);
+
+    /* Set msgpack.null, the same value as cjson.null */
+    lua_pushlightuserdata(l, NULL);
+    lua_setfield(l, -2, "null");
+
+    /* Set module name / version fields */
+    lua_pushliteral(l, MSGPACK_MODNAME);
+    lua_setfield(l, -2, "NAME");
+    lua_pushliteral(l, MSGPACK_VERSION);
+    lua_setfield(l, -2, "VERSION");
+
+    return 1;
+}
+
+MSGPACK_EXPORT int luaopen_msgpack(lua_State *l)
+{
+    return lua_msgpack_new(l);
+}
@@ -15,8 +15,10 @@ set(SOURCES
   ${LUAUTILSDIR}/http_parser_lua.c
   ${LUAUTILSDIR}/lenv.c
   ${LUAUTILSDIR}/md5.c
+  ${LUAUTILSDIR}/sha1.c
   ${LUAUTILSDIR}/lutils.c
   ${LUAUTILSDIR}/message_lua.c
+  ${LUAUTILSDIR}/websocket_lua.c
 
 )
 
@@ -33,6 +33,7 @@ static int buffer_init(luv_buffer_t* buffer, int length)
 	buffer->time_useconds 	= 0;
 	buffer->type 	 		= LUV_BUFFER_FLAG;
 	buffer->lock 			= NULL;
+	buffer->writes 			= 0;
 
 	if (length > 0) {
 		buffer->data = malloc(length + 2);
@@ -17,6 +17,7 @@ typedef struct luv_buffer_s {
 	int   time_seconds;
 	int   time_useconds;
 	uv_mutex_t* lock;		/* lock */
+	int   writes;			/* pending uv writes of the data */
 
 } luv_buffer_t;
 
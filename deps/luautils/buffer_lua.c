@@ -23,8 +23,8 @@ static luv_buffer_t* luv_buffer_check(lua_State* L, int index)
 static int luv_buffer_close(lua_State* L)
 {
 	luv_buffer_t* buffer = luv_buffer_check(L, 1);
-	lua_Integer ret = buffer_close(buffer);
-	lua_pushinteger(L, ret);
+	luaL_argcheck(L, buffer->writes == 0, 1, "buffer is being written");
+	lua_pushinteger(L, buffer_close(buffer));
 	return 1;
 }
 
@@ -23,6 +23,10 @@
 
 #include "http_parser.h"
 
+#ifdef _WIN32
+#define strncasecmp _strnicmp
+#endif
+
 static const char* method_to_str(unsigned short m) {
   switch (m) {
     case HTTP_DELETE:     return "DELETE";
@@ -54,8 +58,86 @@ static const char* method_to_str(unsigned short m) {
 
 /*****************************************************************************/
 
+#define LHTTP_PARSER          "lhttp_parser"
+
+#define LHTTP_HEADER_NONE     0
+#define LHTTP_HEADER_FIELD    1
+#define LHTTP_HEADER_VALUE    2
+
+/** A header field/value pair, as offsets into `lhttp_parser_t.data`. */
+typedef struct lhttp_header_s {
+  size_t field;
+  size_t field_len;
+  size_t value;
+  size_t value_len;
+} lhttp_header_t;
+
+typedef struct lhttp_parser_s {
+  http_parser parser;
+
+  int batch_headers;        /* Collect url/headers in C, deliver on headers_complete */
+  int body_offsets;         /* Deliver body as (offset, length) into the chunk */
+  const char* chunk;        /* The chunk passed to the current execute() call */
+
+  char*  data;              /* url and header bytes of the current message */
+  size_t length;
+  size_t capacity;
+  size_t url_len;           /* The url is always stored at the start of data */
+
+  lhttp_header_t* headers;
+  int header_count;
+  int header_capacity;
+  int header_state;         /* LHTTP_HEADER_*: last kind of header data seen */
+} lhttp_parser_t;
+
 static struct http_parser_settings lhttp_parser_settings;
 
+static void lhttp_parser_clear(lhttp_parser_t* lparser) {
+  lparser->length       = 0;
+  lparser->url_len      = 0;
+  lparser->header_count = 0;
+  lparser->header_state = LHTTP_HEADER_NONE;
+}
+
+static int lhttp_parser_append(lhttp_parser_t* lparser, const char *at, size_t length) {
+  if (lparser->length + length > lparser->capacity) {
+    size_t capacity = lparser->capacity ? lparser->capacity : 1024;
+    while (capacity < lparser->length + length) {
+      capacity *= 2;
+    }
+
+    char* data = realloc(lparser->data, capacity);
+    if (data == NULL) {
+      return -1;
+    }
+
+    lparser->data     = data;
+    lparser->capacity = capacity;
+  }
+
+  memcpy(lparser->data + lparser->length, at, length);
+  lparser->length += length;
+  return 0;
+}
+
+static lhttp_header_t* lhttp_parser_add_header(lhttp_parser_t* lparser) {
+  if (lparser->header_count >= lparser->header_capacity) {
+    int capacity = lparser->header_capacity ? lparser->header_capacity * 2 : 32;
+    lhttp_header_t* headers = realloc(lparser->headers, capacity * sizeof(*headers));
+    if (headers == NULL) {
+      return NULL;
+    }
+
+    lparser->headers         = headers;
+    lparser->header_capacity = capacity;
+  }
+
+  lhttp_header_t* header = &lparser->headers[lparser->header_count++];
+  memset(header, 0, sizeof(*header));
+  header->field = lparser->length;
+  return header;
+}
+
 static int lhttp_parser_event(http_parser *p, const char* event, const char *at, size_t length) {
   lua_State *L = p->data;
 
@@ -85,6 +167,7 @@ static int lhttp_parser_event(http_parser *p, const char* event, const char *at,
 }
 
 static int lhttp_parser_on_message_begin(http_parser *p) {
+  lhttp_parser_clear((lhttp_parser_t*)p);
   return lhttp_parser_event(p, "message_begin", NULL, 0);
 }
 
@@ -93,22 +176,93 @@ static int lhttp_parser_on_message_complete(http_parser *p) {
 }
 
 static int lhttp_parser_on_url(http_parser *p, const char *at, size_t length) {
-  return lhttp_parser_event(p, "url", at, length);
+  lhttp_parser_t* lparser = (lhttp_parser_t*)p;
+  if (!lparser->batch_headers) {
+    return lhttp_parser_event(p, "url", at, length);
+  }
+
+  /* The url may be split across chunks */
+  if (lhttp_parser_append(lparser, at, length)) {
+    return -1;
+  }
+
+  lparser->url_len += length;
+  return 0;
 }
 
 static int lhttp_parser_on_header_field(http_parser *p, const char *at, size_t length) {
-  return lhttp_parser_event(p, "header_field", at, length);
+  lhttp_parser_t* lparser = (lhttp_parser_t*)p;
+  if (!lparser->batch_headers) {
+    return lhttp_parser_event(p, "header_field", at, length);
+  }
+
+  /* A field after a value (or the first field) starts a new header */
+  lhttp_header_t* header = NULL;
+  if (lparser->header_state != LHTTP_HEADER_FIELD) {
+    header = lhttp_parser_add_header(lparser);
+
+  } else {
+    header = &lparser->headers[lparser->header_count - 1];
+  }
+
+  if (header == NULL || lhttp_parser_append(lparser, at, length)) {
+    return -1;
+  }
+
+  header->field_len += length;
+  lparser->header_state = LHTTP_HEADER_FIELD;
+  return 0;
 }
 
 static int lhttp_parser_on_header_value(http_parser *p, const char *at, size_t length) {
-  return lhttp_parser_event(p, "header_value", at, length); 
+  lhttp_parser_t* lparser = (lhttp_parser_t*)p;
+  if (!lparser->batch_headers) {
+    return lhttp_parser_event(p, "header_value", at, length);
+  }
+
+  if (lparser->header_count <= 0) {
+    return -1;
+  }
+
+  lhttp_header_t* header = &lparser->headers[lparser->header_count - 1];
+  if (lparser->header_state != LHTTP_HEADER_VALUE) {
+    header->value = lparser->length;
+  }
+
+  if (lhttp_parser_append(lparser, at, length)) {
+    return -1;
+  }
+
+  header->value_len += length;
+  lparser->header_state = LHTTP_HEADER_VALUE;
+  return 0;
 }
 
 static int lhttp_parser_on_body(http_parser *p, const char *at, size_t length) {
-  return lhttp_parser_event(p, "body", at, length); 
+  lhttp_parser_t* lparser = (lhttp_parser_t*)p;
+  if (!lparser->body_offsets || lparser->chunk == NULL) {
+    return lhttp_parser_event(p, "body", at, length);
+  }
+
+  lua_State *L = p->data;
+  lua_getuservalue(L, 1);
+  lua_getfield(L, -1, "body");
+  if (lua_isfunction (L, -1) == 0) {
+    lua_pop(L, 2);
+    return 0;
+  };
+
+  /* body(offset, length), offset is 0-based like execute() */
+  lua_pushinteger(L, at - lparser->chunk);
+  lua_pushinteger(L, length);
+  lua_call(L, 2, 1);
+
+  lua_pop(L, 2); /* pop returned value and the userdata env */
+  return 0;
 }
 
 static int lhttp_parser_on_headers_complete(http_parser *p) {
+  lhttp_parser_t* lparser = (lhttp_parser_t*)p;
   lua_State *L = p->data;
 
   /* Put the environment of the userdata on the top of the stack */
@@ -125,7 +279,7 @@ static int lhttp_parser_on_headers_complete(http_parser *p) {
   };
 
   /* Push a new table as the argument */
-  lua_newtable (L);
+  lua_createtable(L, lparser->header_count, 8);
 
   /* METHOD */
   if (p->type == HTTP_REQUEST || p->type == HTTP_BOTH) {
@@ -152,17 +306,64 @@ static int lhttp_parser_on_headers_complete(http_parser *p) {
   lua_pushboolean(L, p->upgrade);
   lua_setfield(L, -2, "upgrade");
 
+  /* URL & HEADERS: { url = "...", { field, value }, ... } */
+  if (lparser->batch_headers) {
+    if (lparser->url_len > 0) {
+      lua_pushlstring(L, lparser->data, lparser->url_len);
+      lua_setfield(L, -2, "url");
+    }
+
+    int i;
+    for (i = 0; i < lparser->header_count; i++) {
+      lhttp_header_t* header = &lparser->headers[i];
+
+      lua_createtable(L, 2, 0);
+      lua_pushlstring(L, lparser->data + header->field, header->field_len);
+      lua_rawseti(L, -2, 1);
+      lua_pushlstring(L, lparser->data + header->value, header->value_len);
+      lua_rawseti(L, -2, 2);
+      lua_rawseti(L, -2, i + 1);
+    }
+
+    lhttp_parser_clear(lparser);
+  }
+
   lua_call(L, 1, 1);
 
+  /* Returning true pauses the parser, execute() returns after the head. It
+     stops before the last LF of the head, which the next execute() parses */
+  if (lua_toboolean(L, -1)) {
+    http_parser_pause(p, 1);
+  }
+
   lua_pop(L, 2); /* pop returned value and the userdata env */
   return 0;
 }
 
 /******************************************************************************/
 
+static int lhttp_parser_opt_boolean(lua_State *L, int index, const char* name) {
+  if (lua_type(L, index) != LUA_TTABLE) {
+    return 0;
+  }
+
+  lua_getfield(L, index, name);
+  int value = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return value;
+}
+
 /* 
-  Takes as arguments a string for type and a table for event callbacks 
-  new(type, callbacks)
+  Takes as arguments a string for type, a table for event callbacks and an
+  optional table of options
+  new(type, callbacks, options)
+
+  options:
+  - batch_headers: collect the url and all headers in C and pass them to
+    `headers_complete` as `meta.url` and `meta[i] = { field, value }`
+    instead of calling `url`, `header_field` and `header_value`
+  - body_offsets: call `body(offset, length)` with the 0-based offset of the
+    body bytes in the string passed to `execute` instead of a substring
  */
 static int lhttp_parser_new (lua_State *L) {
 
@@ -170,7 +371,12 @@ static int lhttp_parser_new (lua_State *L) {
   http_parser* parser;
   luaL_checktype(L, 2, LUA_TTABLE);
 
-  parser = (http_parser*)lua_newuserdata(L, sizeof(http_parser));
+  lhttp_parser_t* lparser = (lhttp_parser_t*)lua_newuserdata(L, sizeof(lhttp_parser_t));
+  memset(lparser, 0, sizeof(*lparser));
+  lparser->batch_headers = lhttp_parser_opt_boolean(L, 3, "batch_headers");
+  lparser->body_offsets  = lhttp_parser_opt_boolean(L, 3, "body_offsets");
+
+  parser = &lparser->parser;
 
   if (0 == strcmp(type, "request")) {
     http_parser_init(parser, HTTP_REQUEST);
@@ -193,7 +399,7 @@ static int lhttp_parser_new (lua_State *L) {
   lua_setuservalue(L, -2);
 
   /* Set the type of the userdata as an lhttp_parser instance */
-  luaL_getmetatable(L, "lhttp_parser");
+  luaL_getmetatable(L, LHTTP_PARSER);
   lua_setmetatable(L, -2);
 
   /* return the userdata */
@@ -201,10 +407,16 @@ static int lhttp_parser_new (lua_State *L) {
 }
 
 static http_parser* lhttp_parser_check(lua_State *L, int index) {
-  return (http_parser *)luaL_checkudata(L, 1, "lhttp_parser");
+  http_parser* parser = (http_parser *)luaL_checkudata(L, 1, LHTTP_PARSER);
+
+  /* Callbacks must run on the calling thread (coroutine) */
+  parser->data = L;
+  return parser;
 }
 
-/* execute(parser, buffer, offset, length) */
+/* execute(parser, buffer, offset, length)
+  Returns the number of parsed bytes, and the description of the error if the
+  data is not valid HTTP. A paused parser is resumed. */
 static int lhttp_parser_execute(lua_State *L) {
   http_parser* parser = lhttp_parser_check(L, 1);
   size_t chunk_len = 0;
@@ -218,9 +430,23 @@ static int lhttp_parser_execute(lua_State *L) {
   luaL_argcheck(L, offset < chunk_len, 3, "Offset is out of bounds");
   luaL_argcheck(L, offset + length <= chunk_len, 4,  "Length extends beyond end of chunk");
 
+  if (HTTP_PARSER_ERRNO(parser) == HPE_PAUSED) {
+    http_parser_pause(parser, 0);
+  }
+
+  lhttp_parser_t* lparser = (lhttp_parser_t*)parser;
+  lparser->chunk = chunk;
   size_t nparsed = http_parser_execute(parser, &lhttp_parser_settings, chunk + offset, length);
+  lparser->chunk = NULL;
+
+  lua_pushinteger(L, nparsed);
+
+  enum http_errno error = HTTP_PARSER_ERRNO(parser);
+  if (error != HPE_OK && error != HPE_PAUSED) {
+    lua_pushstring(L, http_errno_description(error));
+    return 2;
+  }
 
-  lua_pushnumber(L, nparsed);
   return 1;
 }
 
@@ -241,6 +467,7 @@ static int lhttp_parser_reset(lua_State *L) {
   http_parser* parser = lhttp_parser_check(L, 1);
 
   const char *type = luaL_checkstring(L, 2);
+  lhttp_parser_clear((lhttp_parser_t*)parser);
 
   if (0 == strcmp(type, "request")) {
     http_parser_init(parser, HTTP_REQUEST);
@@ -258,6 +485,22 @@ static int lhttp_parser_reset(lua_State *L) {
   return 0;
 }
 
+/** Free the header buffers of the parser */
+static int lhttp_parser_gc(lua_State *L) {
+  lhttp_parser_t* lparser = (lhttp_parser_t*)luaL_checkudata(L, 1, LHTTP_PARSER);
+
+  free(lparser->data);
+  lparser->data     = NULL;
+  lparser->capacity = 0;
+
+  free(lparser->headers);
+  lparser->headers         = NULL;
+  lparser->header_capacity = 0;
+
+  lhttp_parser_clear(lparser);
+  return 0;
+}
+
 /** parse_url(buffer, is_connect) */
 static int lhttp_parser_parse_url (lua_State *L) {
   size_t len;
@@ -305,15 +548,183 @@ static int lhttp_parser_parse_url (lua_State *L) {
 
 /******************************************************************************/
 
+typedef struct lhttp_head_buffer_s {
+  char*  data;
+  size_t length;
+  size_t capacity;
+} lhttp_head_buffer_t;
+
+static int lhttp_head_append(lhttp_head_buffer_t* buffer, const char* data, size_t length) {
+  if (buffer->length + length > buffer->capacity) {
+    size_t capacity = buffer->capacity * 2;
+    while (capacity < buffer->length + length) {
+      capacity *= 2;
+    }
+
+    char* newData = realloc(buffer->data, capacity);
+    if (newData == NULL) {
+      return -1;
+    }
+
+    buffer->data     = newData;
+    buffer->capacity = capacity;
+  }
+
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+  return 0;
+}
+
+/* Append a header value, each run of CR/LF characters becomes a space */
+static int lhttp_head_append_value(lhttp_head_buffer_t* buffer, const char* value, size_t length) {
+  const char* end = value + length;
+  while (value < end) {
+    const char* p = value;
+    while (p < end && *p != '\r' && *p != '\n') {
+      p++;
+    }
+
+    if (lhttp_head_append(buffer, value, p - value)) {
+      return -1;
+    }
+
+    if (p == end) {
+      break;
+    }
+
+    while (p < end && (*p == '\r' || *p == '\n')) {
+      p++;
+    }
+
+    if (lhttp_head_append(buffer, " ", 1)) {
+      return -1;
+    }
+
+    value = p;
+  }
+
+  return 0;
+}
+
+static int lhttp_head_append_field(lua_State *L, lhttp_head_buffer_t* buffer, int index, const char* name, const char* def) {
+  size_t length = 0;
+  const char* value = NULL;
+
+  lua_getfield(L, index, name);
+  if (lua_isnil(L, -1)) {
+    value  = def;
+    length = def ? strlen(def) : 0;
+
+  } else {
+    value = luaL_tolstring(L, -1, &length);
+    lua_remove(L, -2);
+  }
+
+  int ret = value ? lhttp_head_append(buffer, value, length) : 0;
+  lua_pop(L, 1);
+  return ret;
+}
+
+/* 
+  Serializes the start line and headers of a HTTP message in one pass.
+  encode_head(head, reason) -> string, chunked
+
+  `head` is `{ method = 'GET', path = '/' }` for a request or 
+  `{ code = 200, reason = 'OK' }` for a response, `head.version` defaults to 
+  1.1, `reason` is used if `head.reason` is nil. The header pairs are 
+  `head[i] = { name, value }`. `chunked` is true if the message has a 
+  `Transfer-Encoding: chunked` header.
+ */
+static int lhttp_parser_encode_head(lua_State *L) {
+  int chunked = 0;
+  int ret = 0;
+  int i, count;
+  luaL_checktype(L, 1, LUA_TTABLE);
+
+  lhttp_head_buffer_t buffer;
+  buffer.length   = 0;
+  buffer.capacity = 512;
+  buffer.data     = malloc(buffer.capacity);
+  if (buffer.data == NULL) {
+    return luaL_error(L, "out of memory");
+  }
+
+  /* Start line */
+  lua_getfield(L, 1, "method");
+  int isRequest = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+
+  if (isRequest) {
+    ret |= lhttp_head_append_field(L, &buffer, 1, "method", NULL);
+    ret |= lhttp_head_append(&buffer, " ", 1);
+    ret |= lhttp_head_append_field(L, &buffer, 1, "path", "/");
+    ret |= lhttp_head_append(&buffer, " HTTP/", 6);
+    ret |= lhttp_head_append_field(L, &buffer, 1, "version", "1.1");
+
+  } else {
+    ret |= lhttp_head_append(&buffer, "HTTP/", 5);
+    ret |= lhttp_head_append_field(L, &buffer, 1, "version", "1.1");
+    ret |= lhttp_head_append(&buffer, " ", 1);
+    ret |= lhttp_head_append_field(L, &buffer, 1, "code", "200");
+    ret |= lhttp_head_append(&buffer, " ", 1);
+    ret |= lhttp_head_append_field(L, &buffer, 1, "reason", luaL_optstring(L, 2, ""));
+  }
+
+  ret |= lhttp_head_append(&buffer, "\r\n", 2);
+
+  /* Headers */
+  count = (int)lua_rawlen(L, 1);
+  for (i = 1; i <= count && ret == 0; i++) {
+    size_t keyLength = 0, valueLength = 0;
+
+    lua_rawgeti(L, 1, i);
+    if (!lua_istable(L, -1)) {
+      lua_pop(L, 1);
+      continue;
+    }
+
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    const char* key   = luaL_tolstring(L, -2, &keyLength);
+    const char* value = luaL_tolstring(L, -2, &valueLength);
+
+    if (keyLength == 17 && strncasecmp(key, "transfer-encoding", 17) == 0) {
+      chunked = (valueLength == 7 && strncasecmp(value, "chunked", 7) == 0);
+    }
+
+    ret |= lhttp_head_append(&buffer, key, keyLength);
+    ret |= lhttp_head_append(&buffer, ": ", 2);
+    ret |= lhttp_head_append_value(&buffer, value, valueLength);
+    ret |= lhttp_head_append(&buffer, "\r\n", 2);
+
+    lua_pop(L, 5); /* item, key, value and their tolstring copies */
+  }
+
+  ret |= lhttp_head_append(&buffer, "\r\n", 2);
+  if (ret != 0) {
+    free(buffer.data);
+    return luaL_error(L, "out of memory");
+  }
+
+  lua_pushlstring(L, buffer.data, buffer.length);
+  lua_pushboolean(L, chunked);
+  free(buffer.data);
+  return 2;
+}
+
+/******************************************************************************/
+
 static const luaL_Reg lhttp_parser_m[] = {
   {"execute",       lhttp_parser_execute},
   {"finish",        lhttp_parser_finish},
   {"reset",         lhttp_parser_reset},
+  {"__gc",          lhttp_parser_gc},
   {NULL,            NULL}
 };
 
 static const luaL_Reg lhttp_parser_f[] = {
   {"new",           lhttp_parser_new},
+  {"encode_head",   lhttp_parser_encode_head},
   {"parse_url",     lhttp_parser_parse_url},
   {NULL,            NULL}
 };
@@ -330,7 +741,7 @@ LUALIB_API int luaopen_lhttp_parser(lua_State *L) {
   lhttp_parser_settings.on_message_complete = lhttp_parser_on_message_complete;
 
   /* Create a metatable for the lhttp_parser userdata type */
-  luaL_newmetatable(L, "lhttp_parser");
+  luaL_newmetatable(L, LHTTP_PARSER);
   lua_pushvalue(L, -1);
   lua_setfield(L, -2, "__index");
   luaL_setfuncs(L, lhttp_parser_m, 0);
@@ -18,6 +18,7 @@
  
 #include "buffer_lua.c"
 #include "md5.h"
+#include "sha1.h"
 #include "os.c"
 
 //#include "message.c"
@@ -38,6 +39,20 @@ static int luv_md5(lua_State *L) {
   return 1;
 }
 
+/**
+ *  SHA-1 hash function.
+ *  @param message: arbitrary binary string.
+ *  @return  A 160-bit hash string.
+ */
+static int luv_sha1(lua_State *L) {
+  unsigned char buff[SHA1_HASHSIZE];
+  size_t l;
+  const char *message = luaL_checklstring(L, 1, &l);
+  sha1(message, l, buff);
+  lua_pushlstring(L, (const char*)buff, SHA1_HASHSIZE);
+  return 1;
+}
+
 static int luv_base64_encode(lua_State *L) {
   uint8_t* buffer = NULL;
   int bufferSize = 0;
@@ -175,6 +190,7 @@ static const luaL_Reg lutils_functions[] = {
 
   // misc
   { "md5",              luv_md5 },
+  { "sha1",             luv_sha1 },
   { "base64_encode",    luv_base64_encode },
   { "base64_decode",    luv_base64_decode },
   { "hex_encode",       luv_hex_encode },
@@ -0,0 +1,105 @@
+/*
+ *  Copyright 2016 The Lnode Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include <string.h>
+#include <stdint.h>
+
+#include "sha1.h"
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(uint32_t state[5], const unsigned char block[64])
+{
+  uint32_t w[80];
+  uint32_t a, b, c, d, e, f, k, t;
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16)
+         | ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+  }
+
+  for (i = 16; i < 80; i++) {
+    w[i] = ROL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+
+  a = state[0]; b = state[1]; c = state[2]; d = state[3]; e = state[4];
+
+  for (i = 0; i < 80; i++) {
+    if (i < 20) {
+      f = (b & c) | ((~b) & d);
+      k = 0x5A827999;
+
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+
+    t = ROL32(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = ROL32(b, 30);
+    b = a;
+    a = t;
+  }
+
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+}
+
+void sha1 (const void *message, size_t len, unsigned char *output)
+{
+  uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+  const unsigned char *data = (const unsigned char *)message;
+  unsigned char block[64];
+  uint64_t bits = (uint64_t)len * 8;
+  size_t left = len;
+  int i;
+
+  while (left >= 64) {
+    sha1_block(state, data);
+    data += 64;
+    left -= 64;
+  }
+
+  /* padding: 0x80, zeros and the message length in bits (big-endian) */
+  memset(block, 0, sizeof(block));
+  memcpy(block, data, left);
+  block[left] = 0x80;
+  if (left >= 56) {
+    sha1_block(state, block);
+    memset(block, 0, sizeof(block));
+  }
+
+  for (i = 0; i < 8; i++) {
+    block[63 - i] = (unsigned char)(bits >> (i * 8));
+  }
+  sha1_block(state, block);
+
+  for (i = 0; i < 5; i++) {
+    output[i * 4]     = (unsigned char)(state[i] >> 24);
+    output[i * 4 + 1] = (unsigned char)(state[i] >> 16);
+    output[i * 4 + 2] = (unsigned char)(state[i] >> 8);
+    output[i * 4 + 3] = (unsigned char)(state[i]);
+  }
+}
@@ -0,0 +1,32 @@
+/*
+ *  Copyright 2016 The Lnode Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#ifndef sha1_h
+#define sha1_h
+
+#include <stddef.h>
+
+#define SHA1_HASHSIZE  20
+
+/**
+ *  SHA-1 hash function (FIPS 180-1).
+ *  @param message: arbitrary binary data.
+ *  @param len: message length.
+ *  @param output: buffer to receive the hash value, at least SHA1_HASHSIZE.
+ */
+void sha1 (const void *message, size_t len, unsigned char *output);
+
+#endif
@@ -0,0 +1,672 @@
+/*
+ *  Copyright 2016 The Lnode Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define SystemFunction036 NTAPI SystemFunction036
+#include <ntsecapi.h>
+#undef SystemFunction036
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LWS_USE_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define LWS_USE_NEON 1
+#endif
+
+/*
+ * WebSocket (RFC 6455) frame codec.
+ *
+ * The decoder buffers partial frames across `execute()` calls, unmasks the
+ * payloads, reassembles fragmented messages and validates the framing, the
+ * Lua side only sees complete messages and control frames.
+ */
+
+#define LWS_DECODER           "lwebsocket_decoder"
+
+#define LWS_OP_CONTINUATION   0x0
+#define LWS_OP_TEXT           0x1
+#define LWS_OP_BINARY         0x2
+#define LWS_OP_CLOSE          0x8
+#define LWS_OP_PING           0x9
+#define LWS_OP_PONG           0xA
+
+#define LWS_CLOSE_PROTOCOL_ERROR  1002
+#define LWS_CLOSE_INVALID_DATA    1007
+#define LWS_CLOSE_TOO_BIG         1009
+
+#define LWS_DEFAULT_MAX_PAYLOAD   (64 * 1024 * 1024)
+
+typedef struct lws_decoder_s {
+  uint8_t* buffer;          /* Bytes of a partial frame */
+  size_t length;
+  size_t capacity;
+
+  uint8_t* message;         /* Payload of a fragmented message */
+  size_t message_length;
+  size_t message_capacity;
+  int message_opcode;       /* 0 when no fragmented message is in progress */
+  int message_compressed;
+
+  size_t max_payload;
+  int expect_mask;          /* 1: frames must be masked, 0: must not, -1: any */
+  int allow_rsv1;           /* permessage-deflate was negotiated */
+} lws_decoder_t;
+
+/*****************************************************************************/
+/* masking */
+
+/**
+ * XOR `len` bytes of `src` with the 4-byte `key` into `dst` (may be equal to
+ * `src`). 16 bytes per step with SSE2/NEON, 8 bytes with plain 64-bit words,
+ * then the tail byte by byte.
+ */
+static void lws_mask(uint8_t* dst, const uint8_t* src, size_t len, const uint8_t* key)
+{
+  size_t i = 0;
+  uint8_t k[16];
+  uint64_t k64;
+
+  for (i = 0; i < 16; i++) {
+    k[i] = key[i & 3];
+  }
+
+  i = 0;
+
+#if defined(LWS_USE_SSE2)
+  {
+    __m128i mask = _mm_loadu_si128((const __m128i*)k);
+    for (; i + 16 <= len; i += 16) {
+      __m128i data = _mm_loadu_si128((const __m128i*)(src + i));
+      _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(data, mask));
+    }
+  }
+
+#elif defined(LWS_USE_NEON)
+  {
+    uint8x16_t mask = vld1q_u8(k);
+    for (; i + 16 <= len; i += 16) {
+      vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), mask));
+    }
+  }
+#endif
+
+  /* The key repeats every 4 bytes, so a 16-byte step keeps it aligned */
+  memcpy(&k64, k, sizeof(k64));
+  for (; i + 8 <= len; i += 8) {
+    uint64_t data;
+    memcpy(&data, src + i, sizeof(data));
+    data ^= k64;
+    memcpy(dst + i, &data, sizeof(data));
+  }
+
+  for (; i < len; i++) {
+    dst[i] = src[i] ^ key[i & 3];
+  }
+}
+
+/*
+ * Random masking keys for client frames. RFC 6455 10.3 requires keys that
+ * can not be predicted, so they are taken from the system CSPRNG.
+ * Returns 0 on success.
+ */
+static int lws_random(uint8_t* buf, size_t len)
+{
+#ifdef _WIN32
+  return RtlGenRandom(buf, (ULONG)len) ? 0 : -1;
+
+#else
+  static int urandom_fd = -1;
+  int fd = urandom_fd;
+  if (fd < 0) {
+    fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return -1;
+    }
+    urandom_fd = fd;
+  }
+
+  while (len > 0) {
+    ssize_t n = read(fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+
+    } else if (n <= 0) {
+      return -1;
+    }
+
+    buf += n;
+    len -= (size_t)n;
+  }
+
+  return 0;
+#endif
+}
+
+/* Returns 1 if the `len` bytes at `s` are valid UTF-8 */
+static int lws_is_utf8(const uint8_t* s, size_t len)
+{
+  size_t i = 0;
+  while (i < len) {
+    /* Skip ASCII runs 8 bytes at a time */
+    while (i + 8 <= len) {
+      uint64_t word;
+      memcpy(&word, s + i, sizeof(word));
+      if (word & 0x8080808080808080ULL) {
+        break;
+      }
+      i += 8;
+    }
+
+    if (i >= len) {
+      break;
+    }
+
+    uint8_t c = s[i];
+    if (c < 0x80) {
+      i++;
+
+    } else if ((c & 0xE0) == 0xC0) {
+      if (c < 0xC2 || i + 1 >= len || (s[i + 1] & 0xC0) != 0x80) {
+        return 0;
+      }
+      i += 2;
+
+    } else if ((c & 0xF0) == 0xE0) {
+      if (i + 2 >= len || (s[i + 1] & 0xC0) != 0x80 || (s[i + 2] & 0xC0) != 0x80) {
+        return 0;
+      }
+      if ((c == 0xE0 && s[i + 1] < 0xA0) || (c == 0xED && s[i + 1] > 0x9F)) {
+        return 0; /* overlong or surrogate */
+      }
+      i += 3;
+
+    } else if ((c & 0xF8) == 0xF0) {
+      if (c > 0xF4 || i + 3 >= len || (s[i + 1] & 0xC0) != 0x80
+          || (s[i + 2] & 0xC0) != 0x80 || (s[i + 3] & 0xC0) != 0x80) {
+        return 0;
+      }
+      if ((c == 0xF0 && s[i + 1] < 0x90) || (c == 0xF4 && s[i + 1] > 0x8F)) {
+        return 0; /* overlong or > U+10FFFF */
+      }
+      i += 4;
+
+    } else {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*****************************************************************************/
+/* encoder */
+
+/**
+ * encode(opcode, payload [, fin [, mask [, rsv1]]]) -> frame
+ * `mask` may be a 4-byte key string, or true to use a random key.
+ */
+static int lws_encode(lua_State *L) {
+  int opcode = (int)luaL_checkinteger(L, 1);
+  size_t len = 0;
+  const uint8_t* payload = (const uint8_t*)luaL_optlstring(L, 2, "", &len);
+  int fin  = lua_isnoneornil(L, 3) ? 1 : lua_toboolean(L, 3);
+  int rsv1 = lua_toboolean(L, 5);
+  uint8_t key[4];
+  int masked = 0;
+
+  if (lua_type(L, 4) == LUA_TSTRING) {
+    size_t key_len = 0;
+    const char* k = lua_tolstring(L, 4, &key_len);
+    luaL_argcheck(L, key_len == 4, 4, "mask key must be 4 bytes");
+    memcpy(key, k, 4);
+    masked = 1;
+
+  } else if (lua_toboolean(L, 4)) {
+    if (lws_random(key, sizeof(key)) != 0) {
+      return luaL_error(L, "unable to get a random mask key");
+    }
+    masked = 1;
+  }
+
+  luaL_argcheck(L, opcode >= 0 && opcode <= 0xF, 1, "invalid opcode");
+  if (opcode & 0x8) {
+    luaL_argcheck(L, len <= 125, 2, "control frame payload too big");
+  }
+
+  uint8_t head[14];
+  size_t head_len = 2;
+  head[0] = (uint8_t)((fin ? 0x80 : 0) | (rsv1 ? 0x40 : 0) | opcode);
+
+  if (len < 126) {
+    head[1] = (uint8_t)len;
+
+  } else if (len <= 0xFFFF) {
+    head[1] = 126;
+    head[2] = (uint8_t)(len >> 8);
+    head[3] = (uint8_t)(len);
+    head_len = 4;
+
+  } else {
+    int i;
+    head[1] = 127;
+    for (i = 0; i < 8; i++) {
+      head[2 + i] = (uint8_t)((uint64_t)len >> (56 - i * 8));
+    }
+    head_len = 10;
+  }
+
+  if (masked) {
+    head[1] |= 0x80;
+    memcpy(head + head_len, key, 4);
+    head_len += 4;
+  }
+
+  luaL_Buffer b;
+  uint8_t* out = (uint8_t*)luaL_buffinitsize(L, &b, head_len + len);
+  memcpy(out, head, head_len);
+  if (masked) {
+    lws_mask(out + head_len, payload, len, key);
+
+  } else if (len > 0) {
+    memcpy(out + head_len, payload, len);
+  }
+
+  luaL_pushresultsize(&b, head_len + len);
+  return 1;
+}
+
+/** mask(data, key) -> string, XOR data with a 4-byte key */
+static int lws_mask_string(lua_State *L) {
+  size_t len = 0, key_len = 0;
+  const uint8_t* data = (const uint8_t*)luaL_checklstring(L, 1, &len);
+  const char* key = luaL_checklstring(L, 2, &key_len);
+  luaL_argcheck(L, key_len == 4, 2, "mask key must be 4 bytes");
+
+  luaL_Buffer b;
+  uint8_t* out = (uint8_t*)luaL_buffinitsize(L, &b, len);
+  lws_mask(out, data, len, (const uint8_t*)key);
+  luaL_pushresultsize(&b, len);
+  return 1;
+}
+
+/** is_utf8(data) -> boolean */
+static int lws_is_utf8_string(lua_State *L) {
+  size_t len = 0;
+  const uint8_t* data = (const uint8_t*)luaL_checklstring(L, 1, &len);
+  lua_pushboolean(L, lws_is_utf8(data, len));
+  return 1;
+}
+
+/*****************************************************************************/
+/* decoder */
+
+static int lws_reserve(uint8_t** data, size_t* capacity, size_t size)
+{
+  if (size <= *capacity) {
+    return 0;
+  }
+
+  size_t new_capacity = *capacity ? *capacity : 1024;
+  while (new_capacity < size) {
+    new_capacity *= 2;
+  }
+
+  uint8_t* new_data = realloc(*data, new_capacity);
+  if (new_data == NULL) {
+    return -1;
+  }
+
+  *data = new_data;
+  *capacity = new_capacity;
+  return 0;
+}
+
+/**
+ * new_decoder([options]) -> decoder
+ * options:
+ * - maxPayload {Number} max size of a message, default 64MB
+ * - masked {Boolean} true if incoming frames must be masked (server side),
+ *   false if they must not be (client side), nil to accept both
+ * - compressed {Boolean} accept RSV1 (permessage-deflate) on data messages
+ */
+static int lws_decoder_new(lua_State *L) {
+  lws_decoder_t* decoder = lua_newuserdata(L, sizeof(*decoder));
+  memset(decoder, 0, sizeof(*decoder));
+  decoder->max_payload = LWS_DEFAULT_MAX_PAYLOAD;
+  decoder->expect_mask = -1;
+
+  luaL_getmetatable(L, LWS_DECODER);
+  lua_setmetatable(L, -2);
+
+  if (lua_istable(L, 1)) {
+    lua_getfield(L, 1, "maxPayload");
+    if (lua_isinteger(L, -1)) {
+      decoder->max_payload = (size_t)lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "masked");
+    if (!lua_isnil(L, -1)) {
+      decoder->expect_mask = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "compressed");
+    decoder->allow_rsv1 = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+
+  return 1;
+}
+
+static lws_decoder_t* lws_decoder_check(lua_State *L, int index) {
+  return (lws_decoder_t*)luaL_checkudata(L, index, LWS_DECODER);
+}
+
+static int lws_decoder_gc(lua_State *L) {
+  lws_decoder_t* decoder = lws_decoder_check(L, 1);
+  free(decoder->buffer);
+  free(decoder->message);
+  decoder->buffer  = NULL;
+  decoder->message = NULL;
+  decoder->length = decoder->capacity = 0;
+  decoder->message_length = decoder->message_capacity = 0;
+  return 0;
+}
+
+/* Push {opcode=, payload=, compressed=} at events[*count + 1] */
+static void lws_push_event(lua_State *L, int events, int* count,
+                           int opcode, int compressed,
+                           const uint8_t* payload, size_t len, const uint8_t* key)
+{
+  lua_createtable(L, 0, 3);
+  lua_pushinteger(L, opcode);
+  lua_setfield(L, -2, "opcode");
+
+  if (key) {
+    luaL_Buffer b;
+    uint8_t* out = (uint8_t*)luaL_buffinitsize(L, &b, len);
+    lws_mask(out, payload, len, key);
+    luaL_pushresultsize(&b, len);
+
+  } else {
+    lua_pushlstring(L, (const char*)payload, len);
+  }
+  lua_setfield(L, -2, "payload");
+
+  if (compressed) {
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, "compressed");
+  }
+
+  lua_rawseti(L, events, ++(*count));
+}
+
+#define LWS_FAIL(code, message) do { \
+  error_code = (code); error_message = (message); goto failed; \
+} while (0)
+
+/**
+ * decoder:execute(data) -> events
+ * Returns an array of complete messages and control frames, each one a
+ * table {opcode, payload, compressed}, or nil, error, closeCode when the
+ * peer violated the protocol.
+ */
+static int lws_decoder_execute(lua_State *L) {
+  lws_decoder_t* decoder = lws_decoder_check(L, 1);
+  size_t data_len = 0;
+  const uint8_t* data = (const uint8_t*)luaL_checklstring(L, 2, &data_len);
+  const char* error_message = NULL;
+  int error_code = 0;
+
+  /* Parse straight from the input unless a partial frame is pending */
+  const uint8_t* p = data;
+  size_t left = data_len;
+  if (decoder->length > 0) {
+    if (lws_reserve(&decoder->buffer, &decoder->capacity, decoder->length + data_len)) {
+      return luaL_error(L, "out of memory");
+    }
+
+    memcpy(decoder->buffer + decoder->length, data, data_len);
+    decoder->length += data_len;
+    p = decoder->buffer;
+    left = decoder->length;
+  }
+
+  lua_newtable(L);
+  int events = lua_gettop(L);
+  int count = 0;
+
+  while (left >= 2) {
+    int fin    = (p[0] & 0x80) != 0;
+    int rsv1   = (p[0] & 0x40) != 0;
+    int rsv23  = (p[0] & 0x30);
+    int opcode = (p[0] & 0x0F);
+    int masked = (p[1] & 0x80) != 0;
+    uint64_t len = (p[1] & 0x7F);
+    size_t head_len = 2;
+
+    if (len == 126) {
+      if (left < 4) break;
+      len = ((uint64_t)p[2] << 8) | p[3];
+      head_len = 4;
+
+    } else if (len == 127) {
+      int i;
+      if (left < 10) break;
+      len = 0;
+      for (i = 0; i < 8; i++) {
+        len = (len << 8) | p[2 + i];
+      }
+      head_len = 10;
+    }
+
+    if (rsv23 || (rsv1 && !decoder->allow_rsv1)) {
+      LWS_FAIL(LWS_CLOSE_PROTOCOL_ERROR, "reserved bits must be 0");
+    }
+
+    if (decoder->expect_mask >= 0 && masked != decoder->expect_mask) {
+      LWS_FAIL(LWS_CLOSE_PROTOCOL_ERROR, masked ? "unexpected masked frame" : "frame must be masked");
+    }
+
+    if (opcode & 0x8) {
+      if (opcode > LWS_OP_PONG) {
+        LWS_FAIL(LWS_CLOSE_PROTOCOL_ERROR, "invalid opcode");
+      }
+      if (!fin || len > 125 || rsv1) {
+        LWS_FAIL(LWS_CLOSE_PROTOCOL_ERROR, "invalid control frame");
+      }
+
+    } else if (opcode > LWS_OP_BINARY) {
+      LWS_FAIL(LWS_CLOSE_PROTOCOL_ERROR, "invalid opcode");
+
+    } else if (opcode == LWS_OP_CONTINUATION) {
+      if (decoder->message_opcode == 0) {
+        LWS_FAIL(LWS_CLOSE_PROTOCOL_ERROR, "unexpected continuation frame");
+      }
+      if (rsv1) {
+        LWS_FAIL(LWS_CLOSE_PROTOCOL_ERROR, "RSV1 set on a continuation frame");
+      }
+
+    } else if (decoder->message_opcode != 0) {
+      LWS_FAIL(LWS_CLOSE_PROTOCOL_ERROR, "expected a continuation frame");
+    }
+
+    if (len > decoder->max_payload
+        || (opcode == LWS_OP_CONTINUATION && decoder->message_length + len > decoder->max_payload)) {
+      LWS_FAIL(LWS_CLOSE_TOO_BIG, "message too big");
+    }
+
+    const uint8_t* key = NULL;
+    if (masked) {
+      if (left < head_len + 4) break;
+      key = p + head_len;
+      head_len += 4;
+    }
+
+    if (left - head_len < len) {
+      break; /* wait for the rest of the payload */
+    }
+
+    const uint8_t* payload = p + head_len;
+    size_t payload_len = (size_t)len;
+
+    if (opcode & 0x8) {
+      lws_push_event(L, events, &count, opcode, 0, payload, payload_len, key);
+
+    } else if (fin && opcode != LWS_OP_CONTINUATION) {
+      /* Unfragmented message, unmask directly into the Lua string */
+      lws_push_event(L, events, &count, opcode, rsv1, payload, payload_len, key);
+
+      if (opcode == LWS_OP_TEXT && !rsv1) {
+        size_t text_len = 0;
+        lua_rawgeti(L, events, count);
+        lua_getfield(L, -1, "payload");
+        const uint8_t* text = (const uint8_t*)lua_tolstring(L, -1, &text_len);
+        int valid = lws_is_utf8(text, text_len);
+        lua_pop(L, 2);
+
+        if (!valid) {
+          LWS_FAIL(LWS_CLOSE_INVALID_DATA, "invalid UTF-8 in text message");
+        }
+      }
+
+    } else {
+      /* Fragment: append to the message buffer */
+      if (opcode != LWS_OP_CONTINUATION) {
+        decoder->message_opcode = opcode;
+        decoder->message_compressed = rsv1;
+        decoder->message_length = 0;
+      }
+
+      if (lws_reserve(&decoder->message, &decoder->message_capacity,
+                      decoder->message_length + payload_len)) {
+        return luaL_error(L, "out of memory");
+      }
+
+      uint8_t* dst = decoder->message + decoder->message_length;
+      if (key) {
+        lws_mask(dst, payload, payload_len, key);
+
+      } else if (payload_len > 0) {
+        memcpy(dst, payload, payload_len);
+      }
+      decoder->message_length += payload_len;
+
+      if (fin) {
+        int message_opcode = decoder->message_opcode;
+        int compressed = decoder->message_compressed;
+        decoder->message_opcode = 0;
+
+        if (message_opcode == LWS_OP_TEXT && !compressed
+            && !lws_is_utf8(decoder->message, decoder->message_length)) {
+          LWS_FAIL(LWS_CLOSE_INVALID_DATA, "invalid UTF-8 in text message");
+        }
+
+        lws_push_event(L, events, &count, message_opcode, compressed,
+                       decoder->message, decoder->message_length, NULL);
+        decoder->message_length = 0;
+      }
+    }
+
+    p += head_len + payload_len;
+    left -= head_len + payload_len;
+  }
+
+  /* Keep the partial frame for the next call */
+  if (left > 0) {
+    if (p != decoder->buffer) {
+      if (lws_reserve(&decoder->buffer, &decoder->capacity, left)) {
+        return luaL_error(L, "out of memory");
+      }
+      memmove(decoder->buffer, p, left);
+    }
+  }
+  decoder->length = left;
+
+  return 1;
+
+failed:
+  decoder->length = 0;
+  decoder->message_opcode = 0;
+  decoder->message_length = 0;
+
+  lua_pushnil(L);
+  lua_pushstring(L, error_message);
+  lua_pushinteger(L, error_code);
+  return 3;
+}
+
+/** decoder:reset() discards buffered data */
+static int lws_decoder_reset(lua_State *L) {
+  lws_decoder_t* decoder = lws_decoder_check(L, 1);
+  decoder->length = 0;
+  decoder->message_opcode = 0;
+  decoder->message_length = 0;
+  return 0;
+}
+
+static const luaL_Reg lws_decoder_m[] = {
+  { "execute", lws_decoder_execute },
+  { "reset",   lws_decoder_reset },
+  { "__gc",    lws_decoder_gc },
+  { NULL, NULL }
+};
+
+static const luaL_Reg lws_functions[] = {
+  { "encode",      lws_encode },
+  { "is_utf8",     lws_is_utf8_string },
+  { "mask",        lws_mask_string },
+  { "new_decoder", lws_decoder_new },
+  { NULL, NULL }
+};
+
+LUALIB_API int luaopen_lwebsocket(lua_State *L) {
+  luaL_newmetatable(L, LWS_DECODER);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, lws_decoder_m, 0);
+  lua_pop(L, 1);
+
+  luaL_newlib(L, lws_functions);
+
+  lua_pushinteger(L, LWS_OP_CONTINUATION); lua_setfield(L, -2, "CONTINUATION");
+  lua_pushinteger(L, LWS_OP_TEXT);         lua_setfield(L, -2, "TEXT");
+  lua_pushinteger(L, LWS_OP_BINARY);       lua_setfield(L, -2, "BINARY");
+  lua_pushinteger(L, LWS_OP_CLOSE);        lua_setfield(L, -2, "CLOSE");
+  lua_pushinteger(L, LWS_OP_PING);         lua_setfield(L, -2, "PING");
+  lua_pushinteger(L, LWS_OP_PONG);         lua_setfield(L, -2, "PONG");
+
+  return 1;
+}
@@ -76,6 +76,10 @@ static void luv_walk_cb(uv_handle_t* handle, void* arg) {
   lua_State* L = (lua_State*)arg;
   luv_handle_t* data = (luv_handle_t*)handle->data;
 
+  // Skip the handles which are not created by luv, like the uv_async_t of
+  // the asynchronous sqlite3 connections
+  if (!data) return;
+
   // Sanity check
   // Most invalid values are large and refs are small, 0x1000000 is arbitrary.
   assert(data && data->ref < 0x1000000);
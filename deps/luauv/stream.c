@@ -15,9 +15,23 @@
  *
  */
 #include "luv.h"
+#include "buffer.h"
 
+// A string, or the readable bytes [position, limit) of a luv_buffer_t. The
+// buffer is written in place, see luv_ref_write_data().
 static void luv_check_buf(lua_State *L, int idx, uv_buf_t *pbuf) {
     size_t len;
+    luv_buffer_t* buffer = (luv_buffer_t*)luaL_testudata(L, idx, LUV_BUFFER);
+    if (buffer) {
+      int start = buffer->position - 1;
+      int length = buffer->limit - buffer->position;
+      if (buffer->data == NULL || start < 0 || length < 0 || start + length > buffer->length) {
+        length = 0;
+      }
+      pbuf->base = length > 0 ? buffer->data + start : "";
+      pbuf->len = length;
+      return;
+    }
     pbuf->base = (char*)luaL_checklstring(L, idx, &len);
     pbuf->len = len;
 }
@@ -137,8 +151,53 @@ static int luv_read_stop(lua_State* L) {
   return 1;
 }
 
+static void luv_mark_buffer(lua_State* L, int index, int delta) {
+  luv_buffer_t* buffer = (luv_buffer_t*)luaL_testudata(L, index, LUV_BUFFER);
+  if (buffer) {
+    buffer->writes += delta;
+  }
+}
+
+// Returns a ref keeping the data of a write alive until it completes. The
+// buffers are marked as written, so close() and encode_into() do not free or
+// move their memory in the meantime. A table is copied, so removing items
+// from the caller's table does not release them.
+static int luv_ref_write_data(lua_State* L, int index) {
+  if (lua_istable(L, index)) {
+    size_t i, count = lua_rawlen(L, index);
+    lua_createtable(L, (int)count, 0);
+    for (i = 1; i <= count; ++i) {
+      lua_rawgeti(L, index, i);
+      luv_mark_buffer(L, -1, 1);
+      lua_rawseti(L, -2, i);
+    }
+  }
+  else {
+    luv_mark_buffer(L, index, 1);
+    lua_pushvalue(L, index);
+  }
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static void luv_release_write_data(lua_State* L, int ref) {
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  if (lua_istable(L, -1)) {
+    size_t i, count = lua_rawlen(L, -1);
+    for (i = 1; i <= count; ++i) {
+      lua_rawgeti(L, -1, i);
+      luv_mark_buffer(L, -1, -1);
+      lua_pop(L, 1);
+    }
+  }
+  else {
+    luv_mark_buffer(L, -1, -1);
+  }
+  lua_pop(L, 1);
+}
+
 static void luv_write_cb(uv_write_t* req, int status) {
   lua_State* L = luv_state(req->handle->loop);
+  luv_release_write_data(L, ((luv_req_t*)req->data)->data_ref);
   luv_status(L, status);
   luv_fulfill_req(L, (luv_req_t*)req->data, 1);
   luv_cleanup_req(L, (luv_req_t*)req->data);
@@ -171,21 +230,20 @@ static int luv_write(lua_State* L) {
     ret = uv_write(req, handle, bufs, count, luv_write_cb);
     free(bufs);
   }
-  else if (lua_isstring(L, 2)) {
+  else if (lua_isstring(L, 2) || luaL_testudata(L, 2, LUV_BUFFER)) {
     uv_buf_t buf;
     luv_check_buf(L, 2, &buf);
     ret = uv_write(req, handle, &buf, 1, luv_write_cb);
   }
   else {
-    return luaL_argerror(L, 2, "data must be string or table of strings");
+    return luaL_argerror(L, 2, "data must be string, buffer or table of strings");
   }
   if (ret < 0) {
     luv_cleanup_req(L, (luv_req_t*)req->data);
     lua_pop(L, 1);
     return luv_error(L, ret);
   }
-  lua_pushvalue(L, 2);
-  ((luv_req_t*)req->data)->data_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  ((luv_req_t*)req->data)->data_ref = luv_ref_write_data(L, 2);
   return 1;
 }
 
@@ -204,21 +262,20 @@ static int luv_write2(lua_State* L) {
     ret = uv_write2(req, handle, bufs, count, send_handle, luv_write_cb);
     free(bufs);
   }
-  else if (lua_isstring(L, 2)) {
+  else if (lua_isstring(L, 2) || luaL_testudata(L, 2, LUV_BUFFER)) {
     uv_buf_t buf;
     luv_check_buf(L, 2, &buf);
     ret = uv_write2(req, handle, &buf, 1, send_handle, luv_write_cb);
   }
   else {
-    return luaL_argerror(L, 2, "data must be string or table of strings");
+    return luaL_argerror(L, 2, "data must be string, buffer or table of strings");
   }
   if (ret < 0) {
     luv_cleanup_req(L, (luv_req_t*)req->data);
     lua_pop(L, 1);
     return luv_error(L, ret);
   }
-  lua_pushvalue(L, 2);
-  ((luv_req_t*)req->data)->data_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  ((luv_req_t*)req->data)->data_ref = luv_ref_write_data(L, 2);
   return 1;
 }
 
@@ -231,13 +288,13 @@ static int luv_try_write(lua_State* L) {
     ret = uv_try_write(handle, bufs, count);
     free(bufs);
   }
-  else if (lua_isstring(L, 2)) {
+  else if (lua_isstring(L, 2) || luaL_testudata(L, 2, LUV_BUFFER)) {
     uv_buf_t buf;
     luv_check_buf(L, 2, &buf);
     ret = uv_try_write(handle, &buf, 1);
   }
   else {
-    return luaL_argerror(L, 2, "data must be string or table of strings");
+    return luaL_argerror(L, 2, "data must be string, buffer or table of strings");
   }
   if (ret < 0) return luv_error(L, ret);
   lua_pushinteger(L, ret);
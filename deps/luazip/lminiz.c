@@ -17,6 +17,13 @@
 
 #include "luv.h"
 #include "miniz.c"
+#include "buffer.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // miniz
@@ -26,20 +33,55 @@ typedef struct {
 	uv_loop_t *loop;
 	uv_fs_t req;
 	uv_file fd;
+	int pending;			// async extractions in progress
+	int closed;
 } lmz_file_t;
 
 #define MZ_READER_NAME "miniz_reader"
 #define MZ_WRITER_NAME "miniz_writer"
+#define MZ_DEFLATOR_NAME "miniz_deflator"
+#define MZ_INFLATOR_NAME "miniz_inflator"
+#define MZ_BUNDLE_NAME "miniz_bundle"
+
+#define MZ_STREAM_CHUNK_SIZE (16 * 1024)
+
+// window_bits of a gzip stream (same convention as zlib: 16 + 15)
+#define MZ_GZIP_WINDOW_BITS (16 + MZ_DEFAULT_WINDOW_BITS)
+
+#define MZ_GZIP_HEADER      0
+#define MZ_GZIP_BODY        1
+#define MZ_GZIP_TRAILER     2
+#define MZ_GZIP_DONE        3
+
+typedef struct {
+	mz_stream stream;
+	int window_bits;
+	int closed;
+
+	// gzip wrapper, miniz itself only knows zlib and raw deflate streams
+	int gzip;
+	int gzip_state;
+	mz_ulong crc;
+	mz_uint32 size;				// uncompressed size modulo 2^32
+	unsigned char* pending;		// partial gzip header of the inflator
+	size_t pending_len;
+	size_t pending_cap;
+	unsigned char trailer[8];
+	size_t trailer_len;
+} lmz_stream_t;
 
 ///////////////////////////////////////////////////////////////////////////////
 // reader
 
+// Called from the worker threads too, so it must not share a request
 static size_t lmz_file_read(void *pOpaque, mz_uint64 file_offset, void *pBuf, size_t n) {
 	lmz_file_t* zip = pOpaque;
+	uv_fs_t req;
 
 	const uv_buf_t buf = uv_buf_init(pBuf, n);
-	uv_fs_read(zip->loop, &(zip->req), zip->fd, &buf, 1, file_offset, NULL);
-	return zip->req.result;
+	int ret = uv_fs_read(NULL, &req, zip->fd, &buf, 1, file_offset, NULL);
+	uv_fs_req_cleanup(&req);
+	return ret < 0 ? 0 : (size_t)ret;
 }
 
 static int lmz_reader_init(lua_State* L) {
@@ -55,6 +97,8 @@ static int lmz_reader_init(lua_State* L) {
 	memset(archive, 0, sizeof(*archive));
 
 	// open & stat file
+	zip->pending = 0;
+	zip->closed = 0;
 	zip->loop = uv_default_loop();
 	zip->fd = uv_fs_open(zip->loop, &(zip->req), path, O_RDONLY, 0644, NULL);
 	uv_fs_fstat(zip->loop, &(zip->req), zip->fd, NULL);
@@ -74,7 +118,16 @@ static int lmz_reader_init(lua_State* L) {
 
 static int lmz_reader_close(lua_State *L) {
 	lmz_file_t* zip = luaL_checkudata(L, 1, MZ_READER_NAME);
+	if (zip->pending > 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, "zip reader is busy");
+		return 2;
+
+	} else if (zip->closed) {
+		return 0;
+	}
 
+	zip->closed = 1;
 	uv_fs_close(zip->loop, &(zip->req), zip->fd, NULL);
 	uv_fs_req_cleanup(&(zip->req));
 
@@ -84,7 +137,11 @@ static int lmz_reader_close(lua_State *L) {
 
 static int lmz_reader_gc(lua_State *L) {
 	lmz_file_t* zip = luaL_checkudata(L, 1, MZ_READER_NAME);
+	if (zip->closed) {
+		return 0;
+	}
 
+	zip->closed = 1;
 	uv_fs_close(zip->loop, &(zip->req), zip->fd, NULL);
 	uv_fs_req_cleanup(&(zip->req));
 
@@ -274,6 +331,359 @@ static int lmz_writer_gc(lua_State *L) {
 	return 0;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// bundle
+
+// A read-only zip file mapped into memory with a hash index of the entry
+// names. Used by the module searcher: stored entries are passed to
+// `luaL_loadbuffer` straight from the mapping, without a copy.
+
+typedef struct {
+	const char* name;			// points into the central directory
+	mz_uint32 name_len;
+	mz_uint32 hash;
+	mz_uint file_index;
+} lmz_bundle_entry_t;
+
+typedef struct {
+	mz_zip_archive archive;
+	const mz_uint8* data;		// the mapped file
+	size_t size;
+	lmz_bundle_entry_t* entries;
+	mz_uint32 mask;				// number of slots - 1, a power of two
+	int closed;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+} lmz_bundle_t;
+
+static mz_uint32 lmz_bundle_hash(const char* name, size_t len) {
+	mz_uint32 hash = 2166136261u;	// FNV-1a
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ (mz_uint8)name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static const mz_uint8* lmz_bundle_central_dir(lmz_bundle_t* bundle, mz_uint file_index) {
+	mz_zip_internal_state* state = bundle->archive.m_pState;
+	return &MZ_ZIP_ARRAY_ELEMENT(&state->m_central_dir, mz_uint8,
+		MZ_ZIP_ARRAY_ELEMENT(&state->m_central_dir_offsets, mz_uint32, file_index));
+}
+
+static int lmz_bundle_map(lmz_bundle_t* bundle, const char* filename) {
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return -1;
+	}
+
+	bundle->mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (bundle->mapping == NULL) {
+		return -1;
+	}
+
+	bundle->data = MapViewOfFile(bundle->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (bundle->data == NULL) {
+		CloseHandle(bundle->mapping);
+		bundle->mapping = NULL;
+		return -1;
+	}
+
+	bundle->size = (size_t)size.QuadPart;
+	return 0;
+
+#else
+	uv_fs_t req;
+	int fd = uv_fs_open(NULL, &req, filename, O_RDONLY, 0, NULL);
+	uv_fs_req_cleanup(&req);
+	if (fd < 0) {
+		return fd;
+	}
+
+	int ret = uv_fs_fstat(NULL, &req, fd, NULL);
+	size_t size = (size_t)req.statbuf.st_size;
+	uv_fs_req_cleanup(&req);
+	if (ret < 0 || size == 0) {
+		uv_fs_close(NULL, &req, fd, NULL);
+		uv_fs_req_cleanup(&req);
+		return -1;
+	}
+
+	void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	uv_fs_close(NULL, &req, fd, NULL);
+	uv_fs_req_cleanup(&req);
+	if (data == MAP_FAILED) {
+		return -1;
+	}
+
+	bundle->data = data;
+	bundle->size = size;
+	return 0;
+#endif
+}
+
+static void lmz_bundle_unmap(lmz_bundle_t* bundle) {
+	if (bundle->data == NULL) {
+		return;
+	}
+
+#ifdef _WIN32
+	UnmapViewOfFile(bundle->data);
+	CloseHandle(bundle->mapping);
+	bundle->mapping = NULL;
+#else
+	munmap((void*)bundle->data, bundle->size);
+#endif
+	bundle->data = NULL;
+}
+
+static int lmz_bundle_build_index(lmz_bundle_t* bundle) {
+	mz_uint count = mz_zip_reader_get_num_files(&bundle->archive);
+	mz_uint32 slots = 16;
+	while (slots < count * 2) {
+		slots <<= 1;
+	}
+
+	bundle->entries = calloc(slots, sizeof(lmz_bundle_entry_t));
+	if (bundle->entries == NULL) {
+		return -1;
+	}
+
+	bundle->mask = slots - 1;
+	for (mz_uint i = 0; i < count; i++) {
+		const mz_uint8* p = lmz_bundle_central_dir(bundle, i);
+		const char* name = (const char*)p + MZ_ZIP_CENTRAL_DIR_HEADER_SIZE;
+		mz_uint32 name_len = MZ_READ_LE16(p + MZ_ZIP_CDH_FILENAME_LEN_OFS);
+		mz_uint32 hash = lmz_bundle_hash(name, name_len);
+
+		// Linear probing, the first entry with a given name wins like in
+		// mz_zip_reader_locate_file
+		mz_uint32 slot = hash & bundle->mask;
+		while (bundle->entries[slot].name) {
+			lmz_bundle_entry_t* entry = &bundle->entries[slot];
+			if (entry->hash == hash && entry->name_len == name_len
+				&& memcmp(entry->name, name, name_len) == 0) {
+				break;
+			}
+			slot = (slot + 1) & bundle->mask;
+		}
+
+		if (bundle->entries[slot].name == NULL) {
+			bundle->entries[slot].name = name;
+			bundle->entries[slot].name_len = name_len;
+			bundle->entries[slot].hash = hash;
+			bundle->entries[slot].file_index = i;
+		}
+	}
+
+	return 0;
+}
+
+// Returns the index of the entry with the given name, -1 if not found
+static int lmz_bundle_find(lmz_bundle_t* bundle, const char* name, size_t name_len) {
+	mz_uint32 hash = lmz_bundle_hash(name, name_len);
+	mz_uint32 slot = hash & bundle->mask;
+	while (bundle->entries[slot].name) {
+		lmz_bundle_entry_t* entry = &bundle->entries[slot];
+		if (entry->hash == hash && entry->name_len == name_len
+			&& memcmp(entry->name, name, name_len) == 0) {
+			return (int)entry->file_index;
+		}
+		slot = (slot + 1) & bundle->mask;
+	}
+
+	return -1;
+}
+
+static lmz_bundle_t* lmz_check_bundle(lua_State* L, int index) {
+	lmz_bundle_t* bundle = luaL_checkudata(L, index, MZ_BUNDLE_NAME);
+	if (bundle->closed) {
+		luaL_error(L, "attempt to use a closed bundle");
+	}
+	return bundle;
+}
+
+// The data of a stored entry inside the mapping, NULL if the entry is
+// compressed, encrypted or damaged
+static const mz_uint8* lmz_bundle_stored_data(lmz_bundle_t* bundle, mz_uint file_index, size_t* size) {
+	const mz_uint8* p = lmz_bundle_central_dir(bundle, file_index);
+	if (MZ_READ_LE16(p + MZ_ZIP_CDH_METHOD_OFS) != 0
+		|| (MZ_READ_LE16(p + MZ_ZIP_CDH_BIT_FLAG_OFS) & 1)) {
+		return NULL;
+	}
+
+	mz_uint64 length = MZ_READ_LE32(p + MZ_ZIP_CDH_COMPRESSED_SIZE_OFS);
+	mz_uint64 offset = MZ_READ_LE32(p + MZ_ZIP_CDH_LOCAL_HEADER_OFS);
+	if (offset + MZ_ZIP_LOCAL_DIR_HEADER_SIZE > bundle->size) {
+		return NULL;
+	}
+
+	const mz_uint8* local = bundle->data + offset;
+	if (MZ_READ_LE32(local) != MZ_ZIP_LOCAL_DIR_HEADER_SIG) {
+		return NULL;
+	}
+
+	offset += MZ_ZIP_LOCAL_DIR_HEADER_SIZE + MZ_READ_LE16(local + MZ_ZIP_LDH_FILENAME_LEN_OFS)
+		+ MZ_READ_LE16(local + MZ_ZIP_LDH_EXTRA_LEN_OFS);
+	if (offset + length > bundle->size) {
+		return NULL;
+	}
+
+	*size = (size_t)length;
+	return bundle->data + offset;
+}
+
+/**
+ * open_bundle(filename) -> bundle
+ * Map a zip file into memory and index its entries.
+ */
+static int lmz_bundle_open(lua_State* L) {
+	const char* filename = luaL_checkstring(L, 1);
+
+	lmz_bundle_t* bundle = lua_newuserdata(L, sizeof(*bundle));
+	memset(bundle, 0, sizeof(*bundle));
+	bundle->closed = 1;
+	luaL_getmetatable(L, MZ_BUNDLE_NAME);
+	lua_setmetatable(L, -2);
+
+	if (lmz_bundle_map(bundle, filename) < 0) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: open failed", filename);
+		return 2;
+	}
+
+	if (!mz_zip_reader_init_mem(&bundle->archive, bundle->data, bundle->size, 0)) {
+		lmz_bundle_unmap(bundle);
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s does not appear to be a zip file", filename);
+		return 2;
+	}
+
+	bundle->closed = 0;
+	if (lmz_bundle_build_index(bundle) < 0) {
+		return luaL_error(L, "out of memory");
+	}
+
+	return 1;
+}
+
+static int lmz_bundle_close(lua_State* L) {
+	lmz_bundle_t* bundle = luaL_checkudata(L, 1, MZ_BUNDLE_NAME);
+	if (bundle->closed) {
+		return 0;
+	}
+
+	bundle->closed = 1;
+	mz_zip_reader_end(&bundle->archive);
+	free(bundle->entries);
+	bundle->entries = NULL;
+	lmz_bundle_unmap(bundle);
+	return 0;
+}
+
+/** bundle:locate(name) -> index (1-based) or nil */
+static int lmz_bundle_locate(lua_State* L) {
+	lmz_bundle_t* bundle = lmz_check_bundle(L, 1);
+	size_t name_len;
+	const char* name = luaL_checklstring(L, 2, &name_len);
+
+	int index = lmz_bundle_find(bundle, name, name_len);
+	if (index < 0) {
+		return 0;
+	}
+
+	lua_pushinteger(L, index + 1);
+	return 1;
+}
+
+/** bundle:read(name) -> data or nil */
+static int lmz_bundle_read(lua_State* L) {
+	lmz_bundle_t* bundle = lmz_check_bundle(L, 1);
+	size_t name_len, size = 0;
+	const char* name = luaL_checklstring(L, 2, &name_len);
+
+	int index = lmz_bundle_find(bundle, name, name_len);
+	if (index < 0) {
+		return 0;
+	}
+
+	const mz_uint8* data = lmz_bundle_stored_data(bundle, index, &size);
+	if (data) {
+		lua_pushlstring(L, (const char*)data, size);
+		return 1;
+	}
+
+	void* output = mz_zip_reader_extract_to_heap(&bundle->archive, index, &size, 0);
+	if (output == NULL) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: extract failed", name);
+		return 2;
+	}
+
+	lua_pushlstring(L, output, size);
+	free(output);
+	return 1;
+}
+
+/**
+ * bundle:load(name [, chunkname [, mode]]) -> function
+ * Load the Lua chunk (source or bytecode) of the entry `name`. Returns nil
+ * if there is no such file, nil and an error message if it can not be
+ * loaded.
+ */
+static int lmz_bundle_load(lua_State* L) {
+	lmz_bundle_t* bundle = lmz_check_bundle(L, 1);
+	size_t name_len, size = 0;
+	const char* name = luaL_checklstring(L, 2, &name_len);
+	const char* chunkname = luaL_optstring(L, 3, name);
+	const char* mode = luaL_optstring(L, 4, NULL);
+
+	int index = lmz_bundle_find(bundle, name, name_len);
+	if (index < 0 || mz_zip_reader_is_file_a_directory(&bundle->archive, index)) {
+		return 0;
+	}
+
+	int ret;
+	const mz_uint8* data = lmz_bundle_stored_data(bundle, index, &size);
+	if (data) {
+		ret = luaL_loadbufferx(L, (const char*)data, size, chunkname, mode);
+
+	} else {
+		void* output = mz_zip_reader_extract_to_heap(&bundle->archive, index, &size, 0);
+		if (output == NULL) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "%s: extract failed", name);
+			return 2;
+		}
+
+		ret = luaL_loadbufferx(L, output, size, chunkname, mode);
+		free(output);
+	}
+
+	if (ret != LUA_OK) {
+		lua_pushnil(L);
+		lua_insert(L, -2);
+		return 2;
+	}
+
+	return 1;
+}
+
+static int lmz_bundle_get_num_files(lua_State* L) {
+	lmz_bundle_t* bundle = lmz_check_bundle(L, 1);
+	lua_pushinteger(L, mz_zip_reader_get_num_files(&bundle->archive));
+	return 1;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // methods
 
@@ -301,12 +711,1410 @@ static int lmz_deflate(lua_State* L) {
 	return 1;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// stream
+
+static int lmz_check_flush(lua_State* L, int index) {
+	static const char* const names[] = { "none", "sync", "full", "finish", NULL };
+	static const int values[] = { MZ_NO_FLUSH, MZ_SYNC_FLUSH, MZ_FULL_FLUSH, MZ_FINISH };
+	return values[luaL_checkoption(L, index, "none", names)];
+}
+
+static lmz_stream_t* lmz_check_stream(lua_State* L, int index, const char* name) {
+	lmz_stream_t* stream = luaL_checkudata(L, index, name);
+	if (stream->closed) {
+		luaL_error(L, "attempt to use a closed %s", name);
+	}
+	return stream;
+}
+
+static void lmz_stream_reset_gzip(lmz_stream_t* stream) {
+	stream->gzip_state  = MZ_GZIP_HEADER;
+	stream->crc         = MZ_CRC32_INIT;
+	stream->size        = 0;
+	stream->pending_len = 0;
+	stream->trailer_len = 0;
+}
+
+static void lmz_put_le32(unsigned char* p, mz_uint32 value) {
+	p[0] = (unsigned char)(value);
+	p[1] = (unsigned char)(value >> 8);
+	p[2] = (unsigned char)(value >> 16);
+	p[3] = (unsigned char)(value >> 24);
+}
+
+static mz_uint32 lmz_get_le32(const unsigned char* p) {
+	return (mz_uint32)p[0] | ((mz_uint32)p[1] << 8) | ((mz_uint32)p[2] << 16) | ((mz_uint32)p[3] << 24);
+}
+
+/**
+ * Returns the length of the gzip header (RFC 1952) at `p`, 0 if more data is
+ * needed, or -1 if it is not a valid header.
+ */
+static int lmz_gzip_header_length(const unsigned char* p, size_t n) {
+	if (n < 10) {
+		return (n > 0 && p[0] != 0x1f) || (n > 1 && p[1] != 0x8b) ? -1 : 0;
+	}
+
+	if (p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || (p[3] & 0xE0)) {
+		return -1;
+	}
+
+	int flags = p[3];
+	size_t pos = 10;
+	if (flags & 0x04) {  // FEXTRA
+		if (n < pos + 2) return 0;
+		pos += 2 + (p[pos] | (p[pos + 1] << 8));
+		if (n < pos) return 0;
+	}
+
+	if (flags & 0x08) {  // FNAME
+		while (pos < n && p[pos]) pos++;
+		if (pos >= n) return 0;
+		pos++;
+	}
+
+	if (flags & 0x10) {  // FCOMMENT
+		while (pos < n && p[pos]) pos++;
+		if (pos >= n) return 0;
+		pos++;
+	}
+
+	if (flags & 0x02) {  // FHCRC
+		pos += 2;
+		if (n < pos) return 0;
+	}
+
+	return (int)pos;
+}
+
+/**
+ * Create a streaming compressor.
+ * @param level compression level 0 ~ 10, default 6
+ * @param window_bits 15 for a zlib stream, -15 for raw deflate data and 31
+ *  for a gzip stream
+ */
+static int lmz_deflator_init(lua_State* L) {
+	int level = luaL_optinteger(L, 1, MZ_DEFAULT_LEVEL);
+	int window_bits = luaL_optinteger(L, 2, MZ_DEFAULT_WINDOW_BITS);
+	int gzip = (window_bits == MZ_GZIP_WINDOW_BITS);
+
+	lmz_stream_t* stream = lua_newuserdata(L, sizeof(*stream));
+	memset(stream, 0, sizeof(*stream));
+	stream->closed = 1;
+	luaL_getmetatable(L, MZ_DEFLATOR_NAME);
+	lua_setmetatable(L, -2);
+
+	int ret = mz_deflateInit2(&stream->stream, level, MZ_DEFLATED,
+		gzip ? -MZ_DEFAULT_WINDOW_BITS : window_bits, 9, MZ_DEFAULT_STRATEGY);
+	if (ret != MZ_OK) {
+		lua_pushnil(L);
+		lua_pushstring(L, mz_error(ret));
+		return 2;
+	}
+
+	stream->window_bits = window_bits;
+	stream->gzip = gzip;
+	stream->closed = 0;
+	lmz_stream_reset_gzip(stream);
+	return 1;
+}
+
+/**
+ * Compress `data`, returns the compressed output produced so far.
+ * @param data string
+ * @param flush 'none', 'sync', 'full' or 'finish'
+ */
+static int lmz_deflator_deflate(lua_State* L) {
+	lmz_stream_t* stream = lmz_check_stream(L, 1, MZ_DEFLATOR_NAME);
+	size_t in_len = 0;
+	const char* in_buf = luaL_optlstring(L, 2, "", &in_len);
+	int flush = lmz_check_flush(L, 3);
+
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+
+	if (stream->gzip) {
+		if (stream->gzip_state == MZ_GZIP_DONE) {
+			luaL_pushresult(&b);
+			return 1;
+
+		} else if (stream->gzip_state == MZ_GZIP_HEADER) {
+			// magic, CM = deflate, no flags, no mtime, XFL, OS = unknown
+			static const char header[10] = { 0x1f, (char)0x8b, 8, 0, 0, 0, 0, 0, 0, (char)0xff };
+			luaL_addlstring(&b, header, sizeof(header));
+			stream->gzip_state = MZ_GZIP_BODY;
+		}
+
+		stream->crc  = mz_crc32(stream->crc, (const unsigned char*)in_buf, in_len);
+		stream->size += (mz_uint32)in_len;
+	}
+
+	mz_streamp s = &stream->stream;
+	s->next_in  = (const unsigned char*)in_buf;
+	s->avail_in = (unsigned int)in_len;
+
+	for (;;) {
+		unsigned char* out = (unsigned char*)luaL_prepbuffsize(&b, MZ_STREAM_CHUNK_SIZE);
+		s->next_out  = out;
+		s->avail_out = MZ_STREAM_CHUNK_SIZE;
+
+		int ret = mz_deflate(s, flush);
+		luaL_addsize(&b, MZ_STREAM_CHUNK_SIZE - s->avail_out);
+
+		if (ret == MZ_STREAM_END) {
+			if (stream->gzip) {
+				unsigned char trailer[8];
+				lmz_put_le32(trailer, (mz_uint32)stream->crc);
+				lmz_put_le32(trailer + 4, stream->size);
+				luaL_addlstring(&b, (const char*)trailer, sizeof(trailer));
+				stream->gzip_state = MZ_GZIP_DONE;
+			}
+			break;
+
+		} else if (ret == MZ_BUF_ERROR) {
+			// No progress possible: all input consumed and nothing to flush
+			break;
+
+		} else if (ret != MZ_OK) {
+			lua_pushnil(L);
+			lua_pushstring(L, mz_error(ret));
+			return 2;
+		}
+
+		if (s->avail_in == 0 && s->avail_out > 0) {
+			break;
+		}
+	}
+
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/**
+ * Create a streaming decompressor.
+ * @param window_bits 15 for a zlib stream, -15 for raw deflate data and 31
+ *  for a gzip stream
+ */
+static int lmz_inflator_init(lua_State* L) {
+	int window_bits = luaL_optinteger(L, 1, MZ_DEFAULT_WINDOW_BITS);
+	int gzip = (window_bits == MZ_GZIP_WINDOW_BITS);
+
+	lmz_stream_t* stream = lua_newuserdata(L, sizeof(*stream));
+	memset(stream, 0, sizeof(*stream));
+	stream->closed = 1;
+	luaL_getmetatable(L, MZ_INFLATOR_NAME);
+	lua_setmetatable(L, -2);
+
+	int ret = mz_inflateInit2(&stream->stream, gzip ? -MZ_DEFAULT_WINDOW_BITS : window_bits);
+	if (ret != MZ_OK) {
+		lua_pushnil(L);
+		lua_pushstring(L, mz_error(ret));
+		return 2;
+	}
+
+	stream->window_bits = window_bits;
+	stream->gzip = gzip;
+	stream->closed = 0;
+	lmz_stream_reset_gzip(stream);
+	return 1;
+}
+
+/**
+ * Decompress `data`, returns the output produced so far, a boolean which
+ * is true when the end of the compressed stream has been reached and the
+ * number of unused input bytes after the end of the stream.
+ * If `max_size` is given, decompression stops as soon as more than
+ * `max_size` bytes have been produced, the caller can tell from the length
+ * of the output and must not use the stream afterwards.
+ */
+static int lmz_inflator_inflate(lua_State* L) {
+	lmz_stream_t* stream = lmz_check_stream(L, 1, MZ_INFLATOR_NAME);
+	size_t in_len = 0;
+	const char* in_buf = luaL_optlstring(L, 2, "", &in_len);
+	lua_Integer max_size = luaL_optinteger(L, 3, -1);
+	size_t total = 0;
+	int done = 0;
+
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+
+	if (stream->gzip && stream->gzip_state == MZ_GZIP_HEADER) {
+		// Parse from the input, or from the pending bytes if the header
+		// was split across calls
+		const unsigned char* p = (const unsigned char*)in_buf;
+		size_t n = in_len;
+		if (stream->pending_len > 0) {
+			size_t size = stream->pending_len + in_len;
+			if (size > stream->pending_cap) {
+				unsigned char* pending = realloc(stream->pending, size);
+				if (pending == NULL) {
+					return luaL_error(L, "out of memory");
+				}
+				stream->pending = pending;
+				stream->pending_cap = size;
+			}
+			memcpy(stream->pending + stream->pending_len, in_buf, in_len);
+			stream->pending_len = size;
+			p = stream->pending;
+			n = size;
+		}
+
+		int header_len = lmz_gzip_header_length(p, n);
+		if (header_len < 0) {
+			lua_pushnil(L);
+			lua_pushstring(L, "incorrect gzip header");
+			return 2;
+
+		} else if (header_len == 0) {
+			if (stream->pending_len == 0 && in_len > 0) {
+				stream->pending = realloc(stream->pending, in_len);
+				if (stream->pending == NULL) {
+					stream->pending_cap = 0;
+					return luaL_error(L, "out of memory");
+				}
+				memcpy(stream->pending, in_buf, in_len);
+				stream->pending_len = stream->pending_cap = in_len;
+			}
+
+			luaL_pushresult(&b);
+			lua_pushboolean(L, 0);
+			lua_pushinteger(L, 0);
+			return 3;
+		}
+
+		// The pending buffer is not touched again until the next member
+		in_buf = (const char*)p + header_len;
+		in_len = n - header_len;
+		stream->pending_len = 0;
+		stream->gzip_state = MZ_GZIP_BODY;
+	}
+
+	mz_streamp s = &stream->stream;
+	s->next_in  = (const unsigned char*)in_buf;
+	s->avail_in = (unsigned int)in_len;
+
+	if (stream->gzip && stream->gzip_state != MZ_GZIP_BODY) {
+		goto trailer;
+	}
+
+	for (;;) {
+		unsigned char* out = (unsigned char*)luaL_prepbuffsize(&b, MZ_STREAM_CHUNK_SIZE);
+		s->next_out  = out;
+		s->avail_out = MZ_STREAM_CHUNK_SIZE;
+
+		// MZ_FINISH would require the whole output to fit in one buffer
+		int ret = mz_inflate(s, MZ_SYNC_FLUSH);
+		size_t produced = MZ_STREAM_CHUNK_SIZE - s->avail_out;
+		if (stream->gzip) {
+			stream->crc  = mz_crc32(stream->crc, out, produced);
+			stream->size += (mz_uint32)produced;
+		}
+		luaL_addsize(&b, produced);
+		total += produced;
+
+		if (ret == MZ_STREAM_END) {
+			done = 1;
+			break;
+
+		} else if (ret == MZ_BUF_ERROR) {
+			// All input consumed and no pending output left
+			break;
+
+		} else if (ret != MZ_OK) {
+			lua_pushnil(L);
+			lua_pushstring(L, mz_error(ret));
+			return 2;
+
+		} else if (max_size >= 0 && total > (size_t)max_size) {
+			break;
+		}
+
+		// tinfl may still hold output even when all input has been consumed,
+		// so keep going until it reports that no progress is possible
+	}
+
+	if (stream->gzip && done) {
+		stream->gzip_state = MZ_GZIP_TRAILER;
+		done = 0;
+	}
+
+trailer:
+	if (stream->gzip && stream->gzip_state == MZ_GZIP_TRAILER) {
+		// CRC32 and ISIZE, possibly split across calls
+		size_t count = sizeof(stream->trailer) - stream->trailer_len;
+		if (count > s->avail_in) {
+			count = s->avail_in;
+		}
+
+		memcpy(stream->trailer + stream->trailer_len, s->next_in, count);
+		stream->trailer_len += count;
+		s->next_in  += count;
+		s->avail_in -= (unsigned int)count;
+
+		if (stream->trailer_len == sizeof(stream->trailer)) {
+			if (lmz_get_le32(stream->trailer) != (mz_uint32)stream->crc) {
+				lua_pushnil(L);
+				lua_pushstring(L, "incorrect data check");
+				return 2;
+
+			} else if (lmz_get_le32(stream->trailer + 4) != stream->size) {
+				lua_pushnil(L);
+				lua_pushstring(L, "incorrect length check");
+				return 2;
+			}
+
+			stream->gzip_state = MZ_GZIP_DONE;
+		}
+	}
+
+	if (stream->gzip && stream->gzip_state == MZ_GZIP_DONE) {
+		done = 1;
+	}
+
+	luaL_pushresult(&b);
+	lua_pushboolean(L, done);
+	lua_pushinteger(L, done ? s->avail_in : 0);
+	return 3;
+}
+
+static int lmz_deflator_reset(lua_State* L) {
+	lmz_stream_t* stream = lmz_check_stream(L, 1, MZ_DEFLATOR_NAME);
+	lmz_stream_reset_gzip(stream);
+	lua_pushboolean(L, mz_deflateReset(&stream->stream) == MZ_OK);
+	return 1;
+}
+
+static int lmz_inflator_reset(lua_State* L) {
+	lmz_stream_t* stream = lmz_check_stream(L, 1, MZ_INFLATOR_NAME);
+	lmz_stream_reset_gzip(stream);
+	mz_inflateEnd(&stream->stream);
+	lua_pushboolean(L, mz_inflateInit2(&stream->stream,
+		stream->gzip ? -MZ_DEFAULT_WINDOW_BITS : stream->window_bits) == MZ_OK);
+	return 1;
+}
+
+static int lmz_deflator_close(lua_State* L) {
+	lmz_stream_t* stream = luaL_checkudata(L, 1, MZ_DEFLATOR_NAME);
+	if (!stream->closed) {
+		stream->closed = 1;
+		mz_deflateEnd(&stream->stream);
+	}
+	return 0;
+}
+
+static int lmz_inflator_close(lua_State* L) {
+	lmz_stream_t* stream = luaL_checkudata(L, 1, MZ_INFLATOR_NAME);
+	if (!stream->closed) {
+		stream->closed = 1;
+		mz_inflateEnd(&stream->stream);
+	}
+
+	free(stream->pending);
+	stream->pending = NULL;
+	stream->pending_len = stream->pending_cap = 0;
+	return 0;
+}
+
+/** crc32(data [, crc]) -> crc */
+static int lmz_crc32(lua_State* L) {
+	size_t len = 0;
+	const char* data = luaL_checklstring(L, 1, &len);
+	mz_ulong crc = (mz_ulong)luaL_optinteger(L, 2, MZ_CRC32_INIT);
+	lua_pushinteger(L, (lua_Integer)mz_crc32(crc, (const unsigned char*)data, len));
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// async
+
+// Work run on the libuv threadpool, the result is passed to the callback
+// on the loop thread as `callback(err, data)`.
+
+#define LMZ_WORK_DEFLATE			1
+#define LMZ_WORK_INFLATE			2
+#define LMZ_WORK_EXTRACT			3
+#define LMZ_WORK_EXTRACT_TO_FILE	4
+
+typedef struct {
+	uv_work_t req;
+	int type;
+	int callback_ref;
+	int data_ref;				// keeps the input string or the reader alive
+
+	const char* in_buf;
+	size_t in_len;
+	char* in_copy;				// copy of a luv_buffer_t input
+	int flags;
+	int gzip;					// wrap the deflate data in a gzip file
+
+	lmz_file_t* zip;
+	mz_uint file_index;
+	char* filename;
+
+	void* out_buf;
+	size_t out_len;
+	const char* error;
+} lmz_work_t;
+
+// Add the gzip header and trailer around the raw deflate data
+static void lmz_work_gzip(lmz_work_t* work) {
+	static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff };
+	unsigned char* output = malloc(sizeof(header) + work->out_len + 8);
+	if (output == NULL) {
+		work->error = "out of memory";
+		return;
+	}
+
+	memcpy(output, header, sizeof(header));
+	if (work->out_len > 0) {
+		memcpy(output + sizeof(header), work->out_buf, work->out_len);
+	}
+
+	unsigned char* trailer = output + sizeof(header) + work->out_len;
+	mz_ulong crc = mz_crc32(MZ_CRC32_INIT, (const unsigned char*)work->in_buf, work->in_len);
+	mz_uint32 size = (mz_uint32)work->in_len;
+	for (int i = 0; i < 4; i++) {
+		trailer[i] = (unsigned char)(crc >> (i * 8));
+		trailer[i + 4] = (unsigned char)(size >> (i * 8));
+	}
+
+	free(work->out_buf);
+	work->out_buf = output;
+	work->out_len += sizeof(header) + 8;
+}
+
+static void lmz_work_cb(uv_work_t* req) {
+	lmz_work_t* work = req->data;
+
+	switch (work->type) {
+	case LMZ_WORK_DEFLATE:
+		work->out_buf = tdefl_compress_mem_to_heap(work->in_buf, work->in_len, &work->out_len, work->flags);
+		if (work->out_buf == NULL && work->in_len > 0) {
+			work->error = "deflate failed";
+
+		} else if (work->gzip) {
+			lmz_work_gzip(work);
+		}
+		break;
+
+	case LMZ_WORK_INFLATE:
+		work->out_buf = tinfl_decompress_mem_to_heap(work->in_buf, work->in_len, &work->out_len, work->flags);
+		if (work->out_buf == NULL && work->in_len > 0) {
+			work->error = "inflate failed";
+		}
+		break;
+
+	case LMZ_WORK_EXTRACT:
+		work->out_buf = mz_zip_reader_extract_to_heap(&work->zip->archive, work->file_index, &work->out_len, work->flags);
+		if (work->out_buf == NULL) {
+			work->error = "extract failed";
+		}
+		break;
+
+	case LMZ_WORK_EXTRACT_TO_FILE:
+		if (!mz_zip_reader_extract_to_file(&work->zip->archive, work->file_index, work->filename, work->flags)) {
+			work->error = "extract failed";
+		}
+		break;
+	}
+}
+
+static void lmz_after_work_cb(uv_work_t* req, int status) {
+	lmz_work_t* work = req->data;
+	lua_State* L = luv_state(req->loop);
+
+	if (work->zip) {
+		work->zip->pending--;
+	}
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, work->callback_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, work->callback_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, work->data_ref);
+
+	int nargs = 1;
+	if (status == UV_ECANCELED) {
+		lua_pushstring(L, "canceled");
+
+	} else if (work->error) {
+		lua_pushstring(L, work->error);
+
+	} else {
+		lua_pushnil(L);
+		if (work->type == LMZ_WORK_EXTRACT_TO_FILE) {
+			lua_pushboolean(L, 1);
+		} else {
+			lua_pushlstring(L, work->out_buf ? work->out_buf : "", work->out_len);
+		}
+		nargs = 2;
+	}
+
+	free(work->out_buf);
+	free(work->in_copy);
+	free(work->filename);
+	free(work);
+
+	lua_call(L, nargs, 0);
+}
+
+// Input of the async functions: a string, or the readable bytes
+// [position, limit) of a luv_buffer_t. Checked before the work is allocated,
+// so a bad argument leaks nothing.
+static void lmz_check_input(lua_State* L, int index) {
+	if (luaL_testudata(L, index, LUV_BUFFER) == NULL) {
+		luaL_checkstring(L, index);
+	}
+}
+
+static void lmz_work_set_input(lua_State* L, int index, lmz_work_t* work) {
+	luv_buffer_t* buffer = luaL_testudata(L, index, LUV_BUFFER);
+	if (buffer) {
+		int start = buffer->position - 1;
+		int length = buffer->limit - buffer->position;
+		if (buffer->data == NULL || start < 0 || length < 0 || start + length > buffer->length) {
+			length = 0;
+		}
+
+		// The buffer is mutable, the worker gets its own copy
+		work->in_copy = malloc(length > 0 ? length : 1);
+		if (length > 0) {
+			memcpy(work->in_copy, buffer->data + start, length);
+		}
+
+		work->in_buf = work->in_copy;
+		work->in_len = length;
+		return;
+	}
+
+	// Lua strings are immutable, keep a reference instead of copying
+	work->in_buf = lua_tolstring(L, index, &work->in_len);
+	lua_pushvalue(L, index);
+	work->data_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static lmz_work_t* lmz_work_new(lua_State* L, int type, int callback_index) {
+	luaL_checktype(L, callback_index, LUA_TFUNCTION);
+
+	lmz_work_t* work = calloc(1, sizeof(*work));
+	if (work == NULL) {
+		luaL_error(L, "out of memory");
+		return NULL;
+	}
+
+	work->type = type;
+	work->req.data = work;
+	work->data_ref = LUA_NOREF;
+	lua_pushvalue(L, callback_index);
+	work->callback_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return work;
+}
+
+static int lmz_work_queue(lua_State* L, lmz_work_t* work) {
+	int ret = uv_queue_work(luv_loop(L), &work->req, lmz_work_cb, lmz_after_work_cb);
+	if (ret < 0) {
+		if (work->zip) {
+			work->zip->pending--;
+		}
+
+		luaL_unref(L, LUA_REGISTRYINDEX, work->callback_ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, work->data_ref);
+		free(work->in_copy);
+		free(work->filename);
+		free(work);
+
+		lua_pushnil(L);
+		lua_pushstring(L, uv_strerror(ret));
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/**
+ * deflate_async(data, [level, [window_bits,]] callback)
+ * `level` is 0 ~ 10, default 6. `window_bits` is -15 for raw deflate data
+ * (default, same output as `deflate(data, flags)`), 15 for a zlib stream
+ * and 31 for a gzip file.
+ */
+static int lmz_deflate_async(lua_State* L) {
+	int callback_index = 2;
+	while (callback_index < 4 && !lua_isfunction(L, callback_index)) {
+		callback_index++;
+	}
+
+	int level = (callback_index > 2) ? luaL_optinteger(L, 2, MZ_DEFAULT_LEVEL) : MZ_DEFAULT_LEVEL;
+	int window_bits = (callback_index > 3) ? luaL_optinteger(L, 3, -MZ_DEFAULT_WINDOW_BITS) : -MZ_DEFAULT_WINDOW_BITS;
+	if (window_bits != MZ_DEFAULT_WINDOW_BITS && window_bits != -MZ_DEFAULT_WINDOW_BITS
+		&& window_bits != MZ_GZIP_WINDOW_BITS) {
+		return luaL_argerror(L, 3, "window bits must be 15, -15 or 31");
+	}
+
+	lmz_check_input(L, 1);
+	lmz_work_t* work = lmz_work_new(L, LMZ_WORK_DEFLATE, callback_index);
+	lmz_work_set_input(L, 1, work);
+	work->gzip = (window_bits == MZ_GZIP_WINDOW_BITS);
+	work->flags = tdefl_create_comp_flags_from_zip_params(level,
+		work->gzip ? -MZ_DEFAULT_WINDOW_BITS : window_bits, MZ_DEFAULT_STRATEGY);
+	return lmz_work_queue(L, work);
+}
+
+/**
+ * inflate_async(data, [flags,] callback)
+ * Same as `inflate(data, flags)`.
+ */
+static int lmz_inflate_async(lua_State* L) {
+	int callback_index = lua_isfunction(L, 2) ? 2 : 3;
+	int flags = (callback_index == 3) ? luaL_optinteger(L, 2, 0) : 0;
+
+	lmz_check_input(L, 1);
+	lmz_work_t* work = lmz_work_new(L, LMZ_WORK_INFLATE, callback_index);
+	lmz_work_set_input(L, 1, work);
+	work->flags = flags;
+	return lmz_work_queue(L, work);
+}
+
+static lmz_work_t* lmz_reader_work_new(lua_State* L, int type, int callback_index) {
+	lmz_file_t* zip = luaL_checkudata(L, 1, MZ_READER_NAME);
+	if (zip->closed) {
+		luaL_error(L, "attempt to use a closed zip reader");
+	}
+
+	lmz_work_t* work = lmz_work_new(L, type, callback_index);
+	work->zip = zip;
+	zip->pending++;
+
+	lua_pushvalue(L, 1);
+	work->data_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return work;
+}
+
+/**
+ * reader:extract_async(index, [flags,] callback)
+ * Extract the file at `index` on the threadpool, `callback(err, data)`.
+ */
+static int lmz_reader_extract_async(lua_State *L) {
+	mz_uint file_index = luaL_checkinteger(L, 2) - 1;
+	int callback_index = lua_isfunction(L, 3) ? 3 : 4;
+	int flags = (callback_index == 4) ? luaL_optinteger(L, 3, 0) : 0;
+
+	lmz_work_t* work = lmz_reader_work_new(L, LMZ_WORK_EXTRACT, callback_index);
+	work->file_index = file_index;
+	work->flags = flags;
+	return lmz_work_queue(L, work);
+}
+
+/**
+ * reader:extract_to_file_async(index, filename, callback)
+ * Extract the file at `index` to `filename` on the threadpool.
+ */
+static int lmz_reader_extract_to_file_async(lua_State *L) {
+	mz_uint file_index = luaL_checkinteger(L, 2) - 1;
+	const char* filename = luaL_checkstring(L, 3);
+
+	lmz_work_t* work = lmz_reader_work_new(L, LMZ_WORK_EXTRACT_TO_FILE, 4);
+	work->file_index = file_index;
+	work->filename = strdup(filename);
+	return lmz_work_queue(L, work);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// parallel writer
+
+// Writes a zip file while its entries are compressed on the threadpool.
+// Up to `jobs` entries are compressed at the same time, and the compressed
+// entries are appended to the file one by one in the order they were added,
+// so the archive is the same whichever worker finishes first.
+//
+// Files are read and deflated in chunks, and compressed data beyond
+// MZ_PARALLEL_SPILL_SIZE goes to a temporary file, so the memory used does
+// not depend on the size of the files.
+
+#define MZ_PARALLEL_WRITER_NAME "miniz_parallel_writer"
+#define MZ_PARALLEL_READ_SIZE	(64 * 1024)
+#define MZ_PARALLEL_SPILL_SIZE	(1024 * 1024)
+
+// Same as the default size of the libuv threadpool
+#define MZ_PARALLEL_JOBS		4
+
+#define LMZ_ENTRY_WAITING		0
+#define LMZ_ENTRY_WORKING		1
+#define LMZ_ENTRY_READY			2
+
+typedef struct lmz_entry_s lmz_entry_t;
+typedef struct lmz_pwriter_s lmz_pwriter_t;
+
+struct lmz_entry_s {
+	uv_work_t req;
+	lmz_pwriter_t* writer;
+	lmz_entry_t* next;
+	int state;
+
+	char* name;
+	char* filename;				// source file, NULL for `in_buf`
+	const char* in_buf;
+	size_t in_len;
+	int data_ref;
+	int level;
+
+	mz_uint16 dos_time;
+	mz_uint16 dos_date;
+	mz_uint16 method;
+	mz_uint32 crc;
+	mz_uint64 uncomp_size;
+	mz_uint64 comp_size;
+
+	// compressed data, the first MZ_PARALLEL_SPILL_SIZE bytes are kept in
+	// memory and the rest in a temporary file
+	unsigned char* out_buf;
+	size_t out_len;
+	size_t out_cap;
+	FILE* spill;
+
+	char error[256];
+};
+
+struct lmz_pwriter_s {
+	mz_zip_archive archive;
+	uv_loop_t* loop;
+	char* filename;
+
+	lmz_entry_t* head;			// entries not appended yet, in order
+	lmz_entry_t* tail;
+	lmz_entry_t* next;			// next entry to compress
+	int jobs;					// max. entries compressed or waiting to be appended
+	int active;
+
+	uv_work_t append_req;
+	lmz_entry_t* append_entry;	// NULL: writing the central directory
+	int appending;
+	char append_error[256];		// set by the append job, merged on the loop thread
+
+	int self_ref;				// keeps the writer alive while busy
+	int finish_ref;
+	int finishing;
+	int finished;
+	int closed;
+
+	char error[256];
+};
+
+// Thread-safe version of `mz_zip_time_to_dos_time`
+static void lmz_dos_time(time_t time, mz_uint16* dos_time, mz_uint16* dos_date) {
+	struct tm tm;
+#ifdef _WIN32
+	if (localtime_s(&tm, &time)) {
+#else
+	if (localtime_r(&time, &tm) == NULL) {
+#endif
+		*dos_time = *dos_date = 0;
+		return;
+	}
+
+	*dos_time = (mz_uint16)((tm.tm_hour << 11) + (tm.tm_min << 5) + (tm.tm_sec >> 1));
+	*dos_date = (mz_uint16)(((tm.tm_year + 1900 - 1980) << 9) + ((tm.tm_mon + 1) << 5) + tm.tm_mday);
+}
+
+static mz_bool lmz_entry_put_buf(const void* data, int len, void* user) {
+	lmz_entry_t* entry = user;
+	const unsigned char* p = data;
+	size_t n = (size_t)len;
+
+	entry->comp_size += n;
+	if (entry->out_len < MZ_PARALLEL_SPILL_SIZE) {
+		size_t count = MZ_MIN(n, MZ_PARALLEL_SPILL_SIZE - entry->out_len);
+		if (entry->out_len + count > entry->out_cap) {
+			size_t cap = MZ_MAX(entry->out_cap * 2, 64 * 1024);
+			cap = MZ_MIN(MZ_MAX(cap, entry->out_len + count), MZ_PARALLEL_SPILL_SIZE);
+			unsigned char* out_buf = realloc(entry->out_buf, cap);
+			if (out_buf == NULL) {
+				return MZ_FALSE;
+			}
+
+			entry->out_buf = out_buf;
+			entry->out_cap = cap;
+		}
+
+		memcpy(entry->out_buf + entry->out_len, p, count);
+		entry->out_len += count;
+		p += count;
+		n -= count;
+	}
+
+	if (n == 0) {
+		return MZ_TRUE;
+	}
+
+	if (entry->spill == NULL && (entry->spill = tmpfile()) == NULL) {
+		return MZ_FALSE;
+	}
+
+	return fwrite(p, 1, n, entry->spill) == n;
+}
+
+// Reads and compresses the entry, on a worker thread
+static void lmz_entry_compress_cb(uv_work_t* req) {
+	lmz_entry_t* entry = req->data;
+	tdefl_compressor* comp = NULL;
+	unsigned char* chunk = NULL;
+	FILE* file = NULL;
+	mz_ulong crc = MZ_CRC32_INIT;
+
+	const unsigned char* in_buf = (const unsigned char*)entry->in_buf;
+	size_t remaining = entry->in_len;
+
+	if (entry->filename) {
+		struct MZ_FILE_STAT_STRUCT file_stat;
+		file = MZ_FOPEN(entry->filename, "rb");
+		chunk = malloc(MZ_PARALLEL_READ_SIZE);
+		if (file == NULL || chunk == NULL) {
+			snprintf(entry->error, sizeof(entry->error), "%s: can not open", entry->filename);
+			goto done;
+		}
+
+		if (MZ_FILE_STAT(entry->filename, &file_stat) == 0) {
+			lmz_dos_time(file_stat.st_mtime, &entry->dos_time, &entry->dos_date);
+		}
+	}
+
+	if (entry->level > 0) {
+		comp = malloc(sizeof(tdefl_compressor));
+		int flags = tdefl_create_comp_flags_from_zip_params(entry->level, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+		if (comp == NULL || tdefl_init(comp, lmz_entry_put_buf, entry, flags) != TDEFL_STATUS_OKAY) {
+			snprintf(entry->error, sizeof(entry->error), "%s: out of memory", entry->name);
+			goto done;
+		}
+
+		entry->method = MZ_DEFLATED;
+	}
+
+	for (;;) {
+		const unsigned char* data;
+		size_t len;
+		int last;
+
+		if (file) {
+			len = fread(chunk, 1, MZ_PARALLEL_READ_SIZE, file);
+			if (ferror(file)) {
+				snprintf(entry->error, sizeof(entry->error), "%s: read failed", entry->filename);
+				break;
+			}
+
+			data = chunk;
+			last = (len < MZ_PARALLEL_READ_SIZE);
+
+		} else {
+			len = MZ_MIN(remaining, MZ_PARALLEL_READ_SIZE);
+			data = in_buf;
+			in_buf += len;
+			remaining -= len;
+			last = (remaining == 0);
+		}
+
+		crc = mz_crc32(crc, data, len);
+		entry->uncomp_size += len;
+		if (entry->uncomp_size > 0xFFFFFFFF) {
+			snprintf(entry->error, sizeof(entry->error), "%s: file too large", entry->name);
+			break;
+		}
+
+		int ok;
+		if (comp) {
+			tdefl_status status = tdefl_compress_buffer(comp, data, len, last ? TDEFL_FINISH : TDEFL_NO_FLUSH);
+			ok = (status == (last ? TDEFL_STATUS_DONE : TDEFL_STATUS_OKAY));
+
+		} else {
+			ok = (len == 0) || lmz_entry_put_buf(data, (int)len, entry);
+		}
+
+		if (!ok) {
+			snprintf(entry->error, sizeof(entry->error), "%s: deflate failed", entry->name);
+			break;
+		}
+
+		if (last) {
+			break;
+		}
+	}
+
+	entry->crc = (mz_uint32)crc;
+	if (entry->uncomp_size == 0) {
+		// Empty files and directories are stored without data
+		entry->method = 0;
+		entry->comp_size = 0;
+		entry->out_len = 0;
+	}
+
+done:
+	if (file) {
+		fclose(file);
+	}
+
+	free(chunk);
+	free(comp);
+}
+
+static int lmz_pwriter_write(mz_zip_archive* archive, mz_uint64* offset, const void* data, size_t len) {
+	if (len == 0) {
+		return 1;
+
+	} else if (archive->m_pWrite(archive->m_pIO_opaque, *offset, data, len) != len) {
+		return 0;
+	}
+
+	*offset += len;
+	return 1;
+}
+
+// Appends `append_entry` or writes the central directory, on a worker thread.
+// Only one of these runs at a time, they are the only users of `archive`.
+// Errors go to `append_error`, the loop thread owns `error`.
+static void lmz_pwriter_append_cb(uv_work_t* req) {
+	lmz_pwriter_t* writer = req->data;
+	lmz_entry_t* entry = writer->append_entry;
+	mz_zip_archive* archive = &writer->archive;
+
+	if (entry == NULL) {
+		if (!mz_zip_writer_finalize_archive(archive)) {
+			snprintf(writer->append_error, sizeof(writer->append_error), "%s: write failed", writer->filename);
+		}
+		return;
+	}
+
+	mz_uint8 header[MZ_ZIP_LOCAL_DIR_HEADER_SIZE];
+	mz_uint16 name_size = (mz_uint16)strlen(entry->name);
+	mz_uint32 ext_attributes = (name_size && entry->name[name_size - 1] == '/') ? 0x10 : 0;
+	mz_uint64 header_ofs = archive->m_archive_size;
+	mz_uint64 offset = header_ofs;
+
+	// no zip64 support
+	if (header_ofs + sizeof(header) + name_size + entry->comp_size > 0xFFFFFFFF) {
+		snprintf(writer->append_error, sizeof(writer->append_error), "%s: archive too large", writer->filename);
+		return;
+	}
+
+	mz_zip_writer_create_local_dir_header(archive, header, name_size, 0, entry->uncomp_size,
+		entry->comp_size, entry->crc, entry->method, 0, entry->dos_time, entry->dos_date);
+
+	int ok = lmz_pwriter_write(archive, &offset, header, sizeof(header))
+		&& lmz_pwriter_write(archive, &offset, entry->name, name_size)
+		&& lmz_pwriter_write(archive, &offset, entry->out_buf, entry->out_len);
+
+	if (ok && entry->spill && entry->uncomp_size > 0) {
+		unsigned char* chunk = malloc(MZ_PARALLEL_READ_SIZE);
+		ok = (chunk != NULL) && (fseek(entry->spill, 0, SEEK_SET) == 0);
+		while (ok) {
+			size_t len = fread(chunk, 1, MZ_PARALLEL_READ_SIZE, entry->spill);
+			if (len == 0) {
+				ok = !ferror(entry->spill);
+				break;
+			}
+
+			ok = lmz_pwriter_write(archive, &offset, chunk, len);
+		}
+		free(chunk);
+	}
+
+	if (ok) {
+		ok = mz_zip_writer_add_to_central_dir(archive, entry->name, name_size, NULL, 0, NULL, 0,
+			entry->uncomp_size, entry->comp_size, entry->crc, entry->method, 0,
+			entry->dos_time, entry->dos_date, header_ofs, ext_attributes);
+	}
+
+	if (!ok) {
+		snprintf(writer->append_error, sizeof(writer->append_error), "%s: write failed", writer->filename);
+		return;
+	}
+
+	archive->m_total_files++;
+	archive->m_archive_size = offset;
+}
+
+static void lmz_entry_free(lua_State* L, lmz_entry_t* entry) {
+	luaL_unref(L, LUA_REGISTRYINDEX, entry->data_ref);
+	if (entry->spill) {
+		fclose(entry->spill);
+	}
+
+	free(entry->out_buf);
+	free(entry->filename);
+	free(entry->name);
+	free(entry);
+}
+
+static void lmz_pwriter_set_error(lmz_pwriter_t* writer, const char* error) {
+	if (writer->error[0] == '\0') {
+		snprintf(writer->error, sizeof(writer->error), "%s", error);
+	}
+}
+
+static void lmz_pwriter_end(lua_State* L, lmz_pwriter_t* writer) {
+	if (writer->closed) {
+		return;
+	}
+
+	writer->closed = 1;
+	mz_zip_writer_end(&writer->archive);
+	if (!writer->finished && writer->filename) {
+		// Don't leave an incomplete archive behind
+		remove(writer->filename);
+	}
+
+	while (writer->head) {
+		lmz_entry_t* entry = writer->head;
+		writer->head = entry->next;
+		lmz_entry_free(L, entry);
+	}
+
+	writer->tail = writer->next = NULL;
+	free(writer->filename);
+	writer->filename = NULL;
+}
+
+static void lmz_pwriter_after_compress_cb(uv_work_t* req, int status);
+static void lmz_pwriter_after_append_cb(uv_work_t* req, int status);
+
+// Starts the next jobs, called on the loop thread when something changed
+static void lmz_pwriter_pump(lmz_pwriter_t* writer) {
+	lua_State* L = luv_state(writer->loop);
+
+	while (!writer->error[0] && writer->next && writer->active < writer->jobs) {
+		lmz_entry_t* entry = writer->next;
+		writer->next = entry->next;
+		writer->active++;
+
+		entry->state = LMZ_ENTRY_WORKING;
+		int ret = uv_queue_work(writer->loop, &entry->req, lmz_entry_compress_cb, lmz_pwriter_after_compress_cb);
+		if (ret < 0) {
+			entry->state = LMZ_ENTRY_READY;
+			lmz_pwriter_set_error(writer, uv_strerror(ret));
+		}
+	}
+
+	if (writer->appending) {
+		return;
+	}
+
+	if (writer->error[0]) {
+		// Drop the entries which are not being compressed
+		lmz_entry_t** link = &writer->head;
+		writer->tail = NULL;
+		while (*link) {
+			lmz_entry_t* entry = *link;
+			if (entry->state == LMZ_ENTRY_WORKING) {
+				writer->tail = entry;
+				link = &entry->next;
+				continue;
+			}
+
+			if (entry->state == LMZ_ENTRY_READY) {
+				writer->active--;
+			}
+
+			*link = entry->next;
+			lmz_entry_free(L, entry);
+		}
+		writer->next = NULL;
+
+	} else if (writer->head && writer->head->state == LMZ_ENTRY_READY) {
+		writer->append_entry = writer->head;
+
+	} else if (!writer->head && writer->finishing && !writer->finished) {
+		writer->append_entry = NULL;
+
+	} else {
+		goto check;
+	}
+
+	if (!writer->error[0]) {
+		writer->append_req.data = writer;
+		int ret = uv_queue_work(writer->loop, &writer->append_req, lmz_pwriter_append_cb, lmz_pwriter_after_append_cb);
+		if (ret >= 0) {
+			writer->appending = 1;
+			return;
+		}
+
+		lmz_pwriter_set_error(writer, uv_strerror(ret));
+		lmz_pwriter_pump(writer);
+		return;
+	}
+
+check:
+	if (writer->head) {
+		return;
+	}
+
+	if (writer->finishing && writer->finish_ref != LUA_NOREF && (writer->finished || writer->error[0])) {
+		int finish_ref = writer->finish_ref;
+		writer->finish_ref = LUA_NOREF;
+		lmz_pwriter_end(L, writer);
+
+		lua_rawgeti(L, LUA_REGISTRYINDEX, finish_ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, finish_ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, writer->self_ref);
+		writer->self_ref = LUA_NOREF;
+
+		int nargs = 1;
+		if (writer->finished) {
+			lua_pushnil(L);
+			lua_pushboolean(L, 1);
+			nargs = 2;
+
+		} else {
+			lua_pushstring(L, writer->error);
+		}
+
+		lua_call(L, nargs, 0);
+		return;
+	}
+
+	if (!writer->finishing) {
+		luaL_unref(L, LUA_REGISTRYINDEX, writer->self_ref);
+		writer->self_ref = LUA_NOREF;
+	}
+}
+
+static void lmz_pwriter_after_compress_cb(uv_work_t* req, int status) {
+	lmz_entry_t* entry = req->data;
+	lmz_pwriter_t* writer = entry->writer;
+	lua_State* L = luv_state(req->loop);
+
+	entry->state = LMZ_ENTRY_READY;
+	if (status == UV_ECANCELED) {
+		lmz_pwriter_set_error(writer, "canceled");
+
+	} else if (entry->error[0]) {
+		lmz_pwriter_set_error(writer, entry->error);
+	}
+
+	// The input string is not needed anymore
+	luaL_unref(L, LUA_REGISTRYINDEX, entry->data_ref);
+	entry->data_ref = LUA_NOREF;
+
+	lmz_pwriter_pump(writer);
+}
+
+static void lmz_pwriter_after_append_cb(uv_work_t* req, int status) {
+	lmz_pwriter_t* writer = req->data;
+	lmz_entry_t* entry = writer->append_entry;
+	lua_State* L = luv_state(req->loop);
+
+	writer->appending = 0;
+	writer->append_entry = NULL;
+	if (status == UV_ECANCELED) {
+		lmz_pwriter_set_error(writer, "canceled");
+
+	} else if (writer->append_error[0]) {
+		lmz_pwriter_set_error(writer, writer->append_error);
+		writer->append_error[0] = '\0';
+	}
+
+	if (entry) {
+		writer->head = entry->next;
+		if (writer->head == NULL) {
+			writer->tail = NULL;
+		}
+
+		writer->active--;
+		lmz_entry_free(L, entry);
+
+	} else if (!writer->error[0]) {
+		writer->finished = 1;
+	}
+
+	lmz_pwriter_pump(writer);
+}
+
+static lmz_pwriter_t* lmz_check_pwriter(lua_State* L, int index) {
+	lmz_pwriter_t* writer = luaL_checkudata(L, index, MZ_PARALLEL_WRITER_NAME);
+	if (writer->closed || writer->finishing) {
+		luaL_error(L, "attempt to use a finished zip writer");
+	}
+
+	return writer;
+}
+
+// Keep the writer alive while there is work in progress
+static void lmz_pwriter_ref(lua_State* L, lmz_pwriter_t* writer, int index) {
+	if (writer->self_ref == LUA_NOREF) {
+		lua_pushvalue(L, index);
+		writer->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+}
+
+static lmz_entry_t* lmz_pwriter_new_entry(lua_State* L, lmz_pwriter_t* writer) {
+	const char* name = luaL_checkstring(L, 2);
+	size_t name_size = strlen(name);
+	if (name_size == 0 || name_size > 0xFFFF || !mz_zip_writer_validate_archive_name(name)) {
+		luaL_argerror(L, 2, "invalid entry name");
+	}
+
+	lmz_entry_t* entry = calloc(1, sizeof(*entry));
+	if (entry == NULL || (entry->name = strdup(name)) == NULL) {
+		free(entry);
+		luaL_error(L, "out of memory");
+		return NULL;
+	}
+
+	entry->writer = writer;
+	entry->req.data = entry;
+	entry->data_ref = LUA_NOREF;
+	entry->level = MZ_DEFAULT_LEVEL;
+	entry->state = LMZ_ENTRY_WAITING;
+	return entry;
+}
+
+static int lmz_pwriter_queue(lua_State* L, lmz_pwriter_t* writer, lmz_entry_t* entry) {
+	if (writer->tail) {
+		writer->tail->next = entry;
+	} else {
+		writer->head = entry;
+	}
+
+	writer->tail = entry;
+	if (writer->next == NULL) {
+		writer->next = entry;
+	}
+
+	lmz_pwriter_ref(L, writer, 1);
+	lmz_pwriter_pump(writer);
+	return 0;
+}
+
+/**
+ * new_parallel_writer(filename, [jobs])
+ * Create the zip file `filename`, `jobs` is the max. number of entries
+ * compressed at the same time, default 4.
+ */
+static int lmz_pwriter_init(lua_State* L) {
+	const char* filename = luaL_checkstring(L, 1);
+	int jobs = (int)luaL_optinteger(L, 2, MZ_PARALLEL_JOBS);
+
+	lmz_pwriter_t* writer = lua_newuserdata(L, sizeof(*writer));
+	memset(writer, 0, sizeof(*writer));
+	writer->loop = luv_loop(L);
+	writer->jobs = MZ_MAX(jobs, 1);
+	writer->self_ref = LUA_NOREF;
+	writer->finish_ref = LUA_NOREF;
+	writer->closed = 1;
+	luaL_getmetatable(L, MZ_PARALLEL_WRITER_NAME);
+	lua_setmetatable(L, -2);
+
+	if (!mz_zip_writer_init_file(&writer->archive, filename, 0)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: can not open", filename);
+		return 2;
+	}
+
+	writer->filename = strdup(filename);
+	writer->closed = 0;
+	return 1;
+}
+
+/**
+ * writer:add(name, data, [level])
+ * Add an entry with the content of the string `data`, a directory if `name`
+ * ends with '/'. `level` is 0 ~ 10, default 6.
+ */
+static int lmz_pwriter_add(lua_State* L) {
+	lmz_pwriter_t* writer = lmz_check_pwriter(L, 1);
+	size_t size;
+	const char* data = luaL_checklstring(L, 3, &size);
+	int level = (int)luaL_optinteger(L, 4, MZ_DEFAULT_LEVEL);
+
+	lmz_entry_t* entry = lmz_pwriter_new_entry(L, writer);
+	if (size > 0 && entry->name[strlen(entry->name) - 1] == '/') {
+		lmz_entry_free(L, entry);
+		return luaL_argerror(L, 3, "directories can not contain data");
+	}
+
+	entry->level = level & 0xF;
+	entry->in_buf = data;
+	entry->in_len = size;
+
+	lua_pushvalue(L, 3);
+	entry->data_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	lmz_dos_time(time(NULL), &entry->dos_time, &entry->dos_date);
+	return lmz_pwriter_queue(L, writer, entry);
+}
+
+/**
+ * writer:add_file(name, filename, [level])
+ * Add an entry with the content of the file `filename`, which is read on
+ * the threadpool. Errors are passed to the callback of `finish`.
+ */
+static int lmz_pwriter_add_file(lua_State* L) {
+	lmz_pwriter_t* writer = lmz_check_pwriter(L, 1);
+	const char* filename = luaL_checkstring(L, 3);
+	int level = (int)luaL_optinteger(L, 4, MZ_DEFAULT_LEVEL);
+
+	lmz_entry_t* entry = lmz_pwriter_new_entry(L, writer);
+	entry->level = level & 0xF;
+	entry->filename = strdup(filename);
+	if (entry->filename == NULL) {
+		lmz_entry_free(L, entry);
+		return luaL_error(L, "out of memory");
+	}
+
+	return lmz_pwriter_queue(L, writer, entry);
+}
+
+/**
+ * writer:finish(callback)
+ * Write the central directory once all entries have been added and close
+ * the file, then call `callback(err, true)`.
+ */
+static int lmz_pwriter_finish(lua_State* L) {
+	lmz_pwriter_t* writer = lmz_check_pwriter(L, 1);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+
+	lua_pushvalue(L, 2);
+	writer->finish_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	writer->finishing = 1;
+
+	lmz_pwriter_ref(L, writer, 1);
+	lmz_pwriter_pump(writer);
+	return 0;
+}
+
+/**
+ * writer:close()
+ * Close the writer, the file is removed if it was not finished.
+ */
+static int lmz_pwriter_close(lua_State* L) {
+	lmz_pwriter_t* writer = luaL_checkudata(L, 1, MZ_PARALLEL_WRITER_NAME);
+	if (writer->self_ref != LUA_NOREF) {
+		lua_pushnil(L);
+		lua_pushstring(L, "zip writer is busy");
+		return 2;
+	}
+
+	lmz_pwriter_end(L, writer);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int lmz_pwriter_gc(lua_State* L) {
+	lmz_pwriter_t* writer = luaL_checkudata(L, 1, MZ_PARALLEL_WRITER_NAME);
+
+	// Only when the state is closed with work in progress, which still uses it
+	if (writer->self_ref != LUA_NOREF) {
+		return 0;
+	}
+
+	lmz_pwriter_end(L, writer);
+	return 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // methods
 
 static const luaL_Reg lminiz_read_m[] = {
   {"close",			lmz_reader_close},
   {"extract",		lmz_reader_extract},
+  {"extract_async",	lmz_reader_extract_async},
+  {"extract_to_file_async", lmz_reader_extract_to_file_async},
   {"get_filename",	lmz_reader_get_filename},
   {"get_num_files", lmz_reader_get_num_files},
   {"is_directory",	lmz_reader_is_file_a_directory},
@@ -323,11 +2131,49 @@ static const luaL_Reg lminiz_write_m[] = {
   {NULL, NULL}
 };
 
+static const luaL_Reg lminiz_parallel_write_m[] = {
+  {"add",			lmz_pwriter_add},
+  {"add_file",		lmz_pwriter_add_file},
+  {"close",			lmz_pwriter_close},
+  {"finish",		lmz_pwriter_finish},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lminiz_deflator_m[] = {
+  {"close",			lmz_deflator_close},
+  {"deflate",		lmz_deflator_deflate},
+  {"reset",			lmz_deflator_reset},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lminiz_inflator_m[] = {
+  {"close",			lmz_inflator_close},
+  {"inflate",		lmz_inflator_inflate},
+  {"reset",			lmz_inflator_reset},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lminiz_bundle_m[] = {
+  {"close",			lmz_bundle_close},
+  {"get_num_files", lmz_bundle_get_num_files},
+  {"load",			lmz_bundle_load},
+  {"locate",		lmz_bundle_locate},
+  {"read",			lmz_bundle_read},
+  {NULL, NULL}
+};
+
 static const luaL_Reg lminiz_f[] = {
+  {"crc32",			lmz_crc32},
+  {"new_deflator",	lmz_deflator_init},
+  {"new_inflator",	lmz_inflator_init},
   {"new_reader",	lmz_reader_init},
   {"new_writer",	lmz_writer_init},
+  {"new_parallel_writer", lmz_pwriter_init},
+  {"open_bundle",	lmz_bundle_open},
   {"inflate",		lmz_inflate},
+  {"inflate_async",	lmz_inflate_async},
   {"deflate",		lmz_deflate},
+  {"deflate_async",	lmz_deflate_async},
   {NULL, NULL}
 };
 
@@ -358,6 +2204,42 @@ LUALIB_API int luaopen_miniz(lua_State *L) {
 	lua_setfield(L, -2, "__gc");
 	lua_pop(L, 1);
 
+	// parallel writer
+	luaL_newmetatable(L, MZ_PARALLEL_WRITER_NAME);
+	luaL_newlib(L, lminiz_parallel_write_m);
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, lmz_pwriter_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	// deflator
+	luaL_newmetatable(L, MZ_DEFLATOR_NAME);
+	luaL_newlib(L, lminiz_deflator_m);
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, lmz_deflator_close);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	// inflator
+	luaL_newmetatable(L, MZ_INFLATOR_NAME);
+	luaL_newlib(L, lminiz_inflator_m);
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, lmz_inflator_close);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	// bundle
+	luaL_newmetatable(L, MZ_BUNDLE_NAME);
+	luaL_newlib(L, lminiz_bundle_m);
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, lmz_bundle_close);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
 	// z
 	luaL_newlib(L, lminiz_f);
 
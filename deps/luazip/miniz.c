@@ -1676,6 +1676,17 @@ tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_nex
   TINFL_CR_FINISH
 
 common_exit:
+  // Put back the whole bytes of the bit buffer (backported from miniz 2.x), so data following the deflate
+  // stream (gzip trailer, concatenated streams) is not swallowed by the look-ahead.
+  if ((status != TINFL_STATUS_NEEDS_MORE_INPUT) && (status != TINFL_STATUS_FAILED))
+  {
+    while ((pIn_buf_cur > pIn_buf_next) && (num_bits >= 8))
+    {
+      --pIn_buf_cur;
+      num_bits -= 8;
+    }
+    if (num_bits < 64) bit_buf &= (tinfl_bit_buf_t)((((mz_uint64)1) << num_bits) - (mz_uint64)1);
+  }
   r->m_num_bits = num_bits; r->m_bit_buf = bit_buf; r->m_dist = dist; r->m_counter = counter; r->m_num_extra = num_extra; r->m_dist_from_out_buf_start = dist_from_out_buf_start;
   *pIn_buf_size = pIn_buf_cur - pIn_buf_next; *pOut_buf_size = pOut_buf_cur - pOut_buf_next;
   if ((decomp_flags & (TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32)) && (status >= 0))
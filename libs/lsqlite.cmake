@@ -14,7 +14,7 @@ set(SOURCES
 if (WIN32)
   add_library(lsqlite SHARED ${SOURCES})
   set_target_properties(lsqlite PROPERTIES PREFIX "")
-  target_link_libraries(lsqlite lualib)
+  target_link_libraries(lsqlite lualib luauv uv)
   
 elseif (APPLE)
   add_library(lsqlite STATIC ${SOURCES})
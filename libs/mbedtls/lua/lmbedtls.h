@@ -52,6 +52,7 @@
 #include "mbedtls/sha256.h"
 #include "mbedtls/sha512.h"
 #include "mbedtls/ssl.h"
+#include "mbedtls/ssl_cache.h"
 #include "mbedtls/x509_crl.h"
 #include "mbedtls/x509_csr.h"
 
@@ -100,6 +101,7 @@ static inline void lmbedtls_newmetatable( lua_State *L, const char *tname,
 #define LMBEDTLS_X509_CRL_MT    "mbedtls_x509_crl_t"
 #define LMBEDTLS_X509_CSR_MT    "mbedtls_x509_csr_t"
 #define LMBEDTLS_TLS_MT         "mbedtls_tls_t"
+#define LMBEDTLS_TLS_CONFIG_MT  "mbedtls_tls_config_t"
 
 
 // define data types
@@ -110,12 +112,43 @@ typedef struct {
 } lmbedtls_rng_t;
 
 
+typedef struct lmbedtls_tls_sni_s lmbedtls_tls_sni_t;
+
+// settings shared by the connections of a client or a server
+typedef struct {
+    mbedtls_entropy_context   entropy;
+    mbedtls_ctr_drbg_context  drbg;
+    mbedtls_ssl_config        ssl_conf;
+    mbedtls_x509_crt          cacert;
+    mbedtls_x509_crt          cert;
+    mbedtls_pk_context        key;
+    mbedtls_ssl_cache_context cache;
+    lmbedtls_tls_sni_t       *sni;
+    size_t                    sni_count;
+} lmbedtls_tls_config_t;
+
+
+// the config of a server used for the clients asking for `name`
+struct lmbedtls_tls_sni_s {
+    char                     *name;
+    lmbedtls_tls_config_t    *config;
+};
+
+
+// memory BIO: bytes are read at `start` and appended at `end`
+typedef struct {
+    uint8_t *data;
+    size_t   size;
+    size_t   start;
+    size_t   end;
+} lmbedtls_bio_t;
+
+
 typedef struct {
-    mbedtls_entropy_context  entropy;
-    mbedtls_ctr_drbg_context drbg;
     mbedtls_ssl_context      ssl_context;
-    mbedtls_ssl_config       ssl_conf;
-    mbedtls_x509_crt         cacert;
+    lmbedtls_bio_t           input;
+    lmbedtls_bio_t           output;
+    int                      closed;
 } lmbedtls_tls_t;
 
 
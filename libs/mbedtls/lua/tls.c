@@ -25,139 +25,499 @@
  */
 
 
+#include <ctype.h>
+#include <stdlib.h>
+
 #include "lmbedtls.h"
 
-static void tls_debug( void *ctx, int level, const char *file, int line, const char *str )
+/*
+ * A TLS connection does no socket I/O: the records received from the peer
+ * are written to the input BIO with `input()`, and the records to send are
+ * taken from the output BIO with `output()`, so the connection can run on
+ * top of any stream of the event loop.
+ *
+ *   local config = tls.new_config("client")
+ *   config:ca(pem)
+ *   local conn = tls.new(config, "example.com")
+ *   conn:handshake()              -- false until the handshake is done
+ *   socket:write(conn:output())
+ *   conn:input(received)
+ */
+
+#define LMBEDTLS_BIO_SIZE   (16 * 1024)
+
+
+/* memory BIOs */
+
+static int bio_write( lmbedtls_bio_t *bio, const uint8_t *buf, size_t len )
 {
-    ((void) level);
+    if ( len == 0 ) {
+        return 0;
+
+    } else if ( bio->end + len > bio->size ) {
+        size_t pending = bio->end - bio->start;
+        size_t size = bio->size ? bio->size : LMBEDTLS_BIO_SIZE;
+        uint8_t *data = NULL;
+
+        // reuse the space of the bytes already read before growing
+        if ( bio->start > 0 ) {
+            memmove( bio->data, bio->data + bio->start, pending );
+            bio->start = 0;
+            bio->end   = pending;
+        }
 
-    fprintf( (FILE *) ctx, "%s:%04d: %s", file, line, str );
-    fflush(  (FILE *) ctx  );
+        if ( pending + len > bio->size ) {
+            while ( size < pending + len ) {
+                size *= 2;
+            }
+
+            data = realloc( bio->data, size );
+            if ( !data ) {
+                return -1;
+            }
+
+            bio->data = data;
+            bio->size = size;
+        }
+    }
+
+    memcpy( bio->data + bio->end, buf, len );
+    bio->end += len;
+
+    return 0;
 }
 
+static size_t bio_read( lmbedtls_bio_t *bio, uint8_t *buf, size_t len )
+{
+    size_t pending = bio->end - bio->start;
 
-static int tls_free(lmbedtls_tls_t *tls)
+    if ( len > pending ) {
+        len = pending;
+    }
+
+    memcpy( buf, bio->data + bio->start, len );
+    bio->start += len;
+
+    if ( bio->start == bio->end ) {
+        bio->start = bio->end = 0;
+    }
+
+    return len;
+}
+
+static void bio_free( lmbedtls_bio_t *bio )
 {
-    mbedtls_x509_crt_free( &tls->cacert );
-    mbedtls_ssl_free( &tls->ssl_context );
-    mbedtls_ssl_config_free( &tls->ssl_conf );
-    mbedtls_ctr_drbg_free( &tls->drbg );
-    mbedtls_entropy_free( &tls->entropy );
+    free( bio->data );
+    memset( bio, 0, sizeof( lmbedtls_bio_t ) );
+}
 
-    return 0;
+static int tls_net_send( void *ctx, const unsigned char *buf, size_t len )
+{
+    lmbedtls_tls_t *tls = ctx;
+
+    if ( bio_write( &tls->output, buf, len ) ) {
+        return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+    }
+
+    return (int)len;
 }
 
-int tls_net_send( void *ctx, const unsigned char *buf, size_t len )
+static int tls_net_recv( void *ctx, unsigned char *buf, size_t len )
 {
+    lmbedtls_tls_t *tls = ctx;
 
-    return 0;
+    if ( tls->input.start == tls->input.end ) {
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    }
+
+    return (int)bio_read( &tls->input, buf, len );
 }
 
-int tls_net_recv( void *ctx, unsigned char *buf, size_t len )
+static int tls_push_error( lua_State *L, int rc )
 {
-    return 0;
+    lmbedtls_errbuf_t errstr;
+
+    lmbedtls_strerror( rc, errstr );
+    lua_pushnil( L );
+    lua_pushstring( L, errstr );
+
+    return 2;
 }
 
-static int tls_tostring( lua_State *L )
+
+/* config */
+
+// case-insensitive comparison of the string `a` with the `len` bytes at `b`
+static int tls_sni_equal( const char *a, const unsigned char *b, size_t len )
 {
-    TOSTRING_MT( L, LMBEDTLS_TLS_MT );
+    size_t i = 0;
+
+    for ( i = 0; i < len; i++ ) {
+        if ( !a[i] || tolower( (unsigned char)a[i] ) != tolower( b[i] ) ) {
+            return 0;
+        }
+    }
+
+    return a[len] == '\0';
+}
+
+// "*.example.com" matches the names with one more label than example.com
+static int tls_sni_match( const char *pattern, const unsigned char *name, size_t len )
+{
+    if ( pattern[0] == '*' && pattern[1] == '.' ) {
+        const unsigned char *dot = memchr( name, '.', len );
+        if ( !dot || dot == name ) {
+            return 0;
+        }
+
+        return tls_sni_equal( pattern + 1, dot, len - ( dot - name ) );
+    }
+
+    return tls_sni_equal( pattern, name, len );
+}
+
+/*
+ * Called by a server during the handshake with the name sent by the client.
+ * Clients which send an unknown name get the certificate of the config
+ * itself, an exact match is preferred over a wildcard.
+ */
+static int tls_sni_callback( void *ctx, mbedtls_ssl_context *ssl,
+                             const unsigned char *name, size_t len )
+{
+    lmbedtls_tls_config_t *config = ctx;
+    lmbedtls_tls_config_t *host = NULL;
+    size_t i = 0;
+
+    for ( i = 0; i < config->sni_count; i++ ) {
+        lmbedtls_tls_sni_t *entry = &config->sni[i];
+        if ( !tls_sni_match( entry->name, name, len ) ) {
+            continue;
+        }
+
+        host = entry->config;
+        if ( entry->name[0] != '*' ) {
+            break;
+        }
+    }
+
+    if ( !host ) {
+        return 0;
+    }
+
+    if ( host->cacert.version ) {
+        mbedtls_ssl_set_hs_ca_chain( ssl, &host->cacert, NULL );
+    }
+
+    return mbedtls_ssl_set_hs_own_cert( ssl, &host->cert, &host->key );
+}
+
+static int tls_config_tostring( lua_State *L )
+{
+    TOSTRING_MT( L, LMBEDTLS_TLS_CONFIG_MT );
     return 1;
 }
 
-static int tls_gc( lua_State *L )
+static int tls_config_gc( lua_State *L )
 {
-    lmbedtls_tls_t *tls = lua_touserdata( L, 1 );
+    lmbedtls_tls_config_t *config = lua_touserdata( L, 1 );
+    size_t i = 0;
+
+    for ( i = 0; i < config->sni_count; i++ ) {
+        free( config->sni[i].name );
+    }
+    free( config->sni );
 
-    tls_free(tls);
+    mbedtls_ssl_cache_free( &config->cache );
+    mbedtls_pk_free( &config->key );
+    mbedtls_x509_crt_free( &config->cert );
+    mbedtls_x509_crt_free( &config->cacert );
+    mbedtls_ssl_config_free( &config->ssl_conf );
+    mbedtls_ctr_drbg_free( &config->drbg );
+    mbedtls_entropy_free( &config->entropy );
 
     return 0;
 }
 
-static int tls_init(lmbedtls_tls_t *tls)
+static int tls_config_ca( lua_State *L )
 {
-    const char* seed = "tls";
-    const uint8_t* pers = (const uint8_t*)seed;
-    size_t pers_len = strlen(seed);
+    lmbedtls_tls_config_t *config = lauxh_checkudata( L, 1, LMBEDTLS_TLS_CONFIG_MT );
+    size_t len = 0;
+    const char *pem = lauxh_checklstring( L, 2, &len );
+
+    // the PEM parser expects the terminating NUL in the length
+    int rc = mbedtls_x509_crt_parse( &config->cacert, (const uint8_t *)pem, len + 1 );
+    if ( rc < 0 ) {
+        return tls_push_error( L, rc );
+    }
+
+    mbedtls_ssl_conf_ca_chain( &config->ssl_conf, &config->cacert, NULL );
+
+    // number of certificates which could not be parsed
+    lua_pushboolean( L, 1 );
+    lua_pushinteger( L, rc );
+    return 2;
+}
+
+static int tls_config_ca_file( lua_State *L )
+{
+    lmbedtls_tls_config_t *config = lauxh_checkudata( L, 1, LMBEDTLS_TLS_CONFIG_MT );
+    const char *path = lauxh_checkstring( L, 2 );
+
+    int rc = mbedtls_x509_crt_parse_file( &config->cacert, path );
+    if ( rc < 0 ) {
+        return tls_push_error( L, rc );
+    }
+
+    mbedtls_ssl_conf_ca_chain( &config->ssl_conf, &config->cacert, NULL );
+
+    lua_pushboolean( L, 1 );
+    lua_pushinteger( L, rc );
+    return 2;
+}
+
+static int tls_config_own_cert( lua_State *L )
+{
+    lmbedtls_tls_config_t *config = lauxh_checkudata( L, 1, LMBEDTLS_TLS_CONFIG_MT );
+    size_t cert_len = 0;
+    const char *cert = lauxh_checklstring( L, 2, &cert_len );
+    size_t key_len = 0;
+    const char *key = lauxh_checklstring( L, 3, &key_len );
+    size_t pwd_len = 0;
+    const char *pwd = lauxh_optlstring( L, 4, NULL, &pwd_len );
+
+    int rc = mbedtls_x509_crt_parse( &config->cert, (const uint8_t *)cert, cert_len + 1 );
+    if ( rc == 0 ) {
+        rc = mbedtls_pk_parse_key( &config->key, (const uint8_t *)key, key_len + 1,
+                                   (const uint8_t *)pwd, pwd_len );
+    }
+
+    if ( rc == 0 ) {
+        rc = mbedtls_ssl_conf_own_cert( &config->ssl_conf, &config->cert, &config->key );
+    }
+
+    if ( rc ) {
+        return tls_push_error( L, rc );
+    }
 
-    mbedtls_ssl_init        (&tls->ssl_context);
-    mbedtls_ssl_config_init (&tls->ssl_conf);
-    mbedtls_x509_crt_init   (&tls->cacert);
-    mbedtls_ctr_drbg_init   (&tls->drbg);
-    mbedtls_entropy_init    (&tls->entropy);
+    lua_pushboolean( L, 1 );
+    return 1;
+}
 
-    mbedtls_ctr_drbg_seed(&tls->drbg, mbedtls_entropy_func, &tls->entropy, pers, pers_len);
+static int tls_config_authmode( lua_State *L )
+{
+    static const char *const modes[] = { "none", "optional", "required", NULL };
+    static const int values[] = {
+        MBEDTLS_SSL_VERIFY_NONE,
+        MBEDTLS_SSL_VERIFY_OPTIONAL,
+        MBEDTLS_SSL_VERIFY_REQUIRED
+    };
 
+    lmbedtls_tls_config_t *config = lauxh_checkudata( L, 1, LMBEDTLS_TLS_CONFIG_MT );
+    int mode = luaL_checkoption( L, 2, NULL, modes );
+
+    mbedtls_ssl_conf_authmode( &config->ssl_conf, values[mode] );
     return 0;
 }
 
-static int tls_set_certificates(lua_State *L)
+/*
+ * sni(name, config): the connections of this server use the certificate,
+ * key and CA chain of `config` when the client asks for `name`. `name` may
+ * start with "*." to match any subdomain.
+ */
+static int tls_config_sni( lua_State *L )
 {
-    lmbedtls_tls_t *tls = lauxh_checkudata( L, 1, LMBEDTLS_TLS_MT );
-    const char *cas_pem = lauxh_optstring( L, 2, "");
-    size_t cas_pem_len  = strlen(cas_pem);
+    lmbedtls_tls_config_t *config = lauxh_checkudata( L, 1, LMBEDTLS_TLS_CONFIG_MT );
+    size_t len = 0;
+    const char *name = lauxh_checklstring( L, 2, &len );
+    lmbedtls_tls_config_t *host = lauxh_checkudata( L, 3, LMBEDTLS_TLS_CONFIG_MT );
+    lmbedtls_tls_sni_t *entry = NULL;
+    size_t i = 0;
+
+    luaL_argcheck( L, config->ssl_conf.endpoint == MBEDTLS_SSL_IS_SERVER, 1,
+                   "not a server config" );
+    luaL_argcheck( L, host->cert.version != 0, 3, "config without certificate" );
+
+    for ( i = 0; i < config->sni_count; i++ ) {
+        if ( tls_sni_equal( config->sni[i].name, (const uint8_t *)name, len ) ) {
+            entry = &config->sni[i];
+            break;
+        }
+    }
+
+    if ( !entry ) {
+        lmbedtls_tls_sni_t *sni = realloc( config->sni,
+                ( config->sni_count + 1 ) * sizeof( lmbedtls_tls_sni_t ) );
+        if ( !sni ) {
+            return tls_push_error( L, MBEDTLS_ERR_SSL_ALLOC_FAILED );
+        }
+
+        config->sni = sni;
+        entry = &sni[config->sni_count];
+        entry->name = malloc( len + 1 );
+        if ( !entry->name ) {
+            return tls_push_error( L, MBEDTLS_ERR_SSL_ALLOC_FAILED );
+        }
+
+        memcpy( entry->name, name, len + 1 );
+        config->sni_count++;
+    }
+
+    entry->config = host;
+
+    // handshakes in progress may still use a replaced config, so the
+    // configs are kept alive as long as this one
+    lua_getuservalue( L, 1 );
+    if ( lua_isnil( L, -1 ) ) {
+        lua_pop( L, 1 );
+        lua_newtable( L );
+        lua_pushvalue( L, -1 );
+        lua_setuservalue( L, 1 );
+    }
+
+    lua_pushvalue( L, 3 );
+    lua_rawsetp( L, -2, host );
+
+    mbedtls_ssl_conf_sni( &config->ssl_conf, tls_sni_callback, config );
+
+    lua_pushboolean( L, 1 );
+    return 1;
+}
+
+static int tls_config_new( lua_State *L )
+{
+    static const char *const endpoints[] = { "client", "server", NULL };
+
+    const char *seed = "lnode.tls";
+    int endpoint = luaL_checkoption( L, 1, "client", endpoints );
+    lmbedtls_tls_config_t *config = lua_newuserdata( L, sizeof( lmbedtls_tls_config_t ) );
+    int rc = 0;
+
+    config->sni       = NULL;
+    config->sni_count = 0;
+
+    mbedtls_ssl_config_init ( &config->ssl_conf );
+    mbedtls_x509_crt_init   ( &config->cacert );
+    mbedtls_x509_crt_init   ( &config->cert );
+    mbedtls_pk_init         ( &config->key );
+    mbedtls_ssl_cache_init  ( &config->cache );
+    mbedtls_ctr_drbg_init   ( &config->drbg );
+    mbedtls_entropy_init    ( &config->entropy );
+    lauxh_setmetatable( L, LMBEDTLS_TLS_CONFIG_MT );
+
+    rc = mbedtls_ctr_drbg_seed( &config->drbg, mbedtls_entropy_func, &config->entropy,
+                                (const uint8_t *)seed, strlen( seed ) );
+    if ( rc == 0 ) {
+        rc = mbedtls_ssl_config_defaults( &config->ssl_conf,
+                endpoint ? MBEDTLS_SSL_IS_SERVER : MBEDTLS_SSL_IS_CLIENT,
+                MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT );
+    }
+
+    if ( rc ) {
+        return tls_push_error( L, rc );
+    }
+
+    mbedtls_ssl_conf_rng( &config->ssl_conf, mbedtls_ctr_drbg_random, &config->drbg );
 
-    return mbedtls_x509_crt_parse( &tls->cacert, (const uint8_t *) cas_pem, cas_pem_len );
+    // let clients resume their sessions without a full handshake
+    if ( endpoint ) {
+        mbedtls_ssl_conf_session_cache( &config->ssl_conf, &config->cache,
+                                        mbedtls_ssl_cache_get, mbedtls_ssl_cache_set );
+    }
+
+    return 1;
 }
 
 
-static int tls_config(lua_State *L)
+/* connection */
+
+static int tls_tostring( lua_State *L )
 {
-    lmbedtls_tls_t *tls = lauxh_checkudata( L, 1, LMBEDTLS_TLS_MT );
-    const char* serverName = lauxh_optstring( L, 2, "");
+    TOSTRING_MT( L, LMBEDTLS_TLS_MT );
+    return 1;
+}
 
+static int tls_gc( lua_State *L )
+{
+    lmbedtls_tls_t *tls = lua_touserdata( L, 1 );
 
-    int ret = mbedtls_ssl_config_defaults( &tls->ssl_conf, MBEDTLS_SSL_IS_CLIENT,
-                    MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    mbedtls_ssl_free( &tls->ssl_context );
+    bio_free( &tls->input );
+    bio_free( &tls->output );
 
-    if (ret == 0) {
-        /* OPTIONAL is not optimal for security,
-         * but makes interop easier in this simplified example */
-        mbedtls_ssl_conf_authmode( &tls->ssl_conf, MBEDTLS_SSL_VERIFY_OPTIONAL );
-        mbedtls_ssl_conf_ca_chain( &tls->ssl_conf, &tls->cacert, NULL );
-        mbedtls_ssl_conf_rng( &tls->ssl_conf, mbedtls_ctr_drbg_random, &tls->drbg );
-        mbedtls_ssl_conf_dbg( &tls->ssl_conf, tls_debug, stdout );
+    return 0;
+}
 
-        ret = mbedtls_ssl_setup(&tls->ssl_context, &tls->ssl_conf);
+static int tls_input( lua_State *L )
+{
+    lmbedtls_tls_t *tls = lauxh_checkudata( L, 1, LMBEDTLS_TLS_MT );
+    size_t len = 0;
+    const char *data = lauxh_checklstring( L, 2, &len );
+
+    if ( bio_write( &tls->input, (const uint8_t *)data, len ) ) {
+        return tls_push_error( L, MBEDTLS_ERR_SSL_ALLOC_FAILED );
     }
 
-    if (ret == 0) {
-        ret = mbedtls_ssl_set_hostname(&tls->ssl_context, serverName);
+    lua_pushboolean( L, 1 );
+    return 1;
+}
+
+static int tls_output( lua_State *L )
+{
+    lmbedtls_tls_t *tls = lauxh_checkudata( L, 1, LMBEDTLS_TLS_MT );
+    lmbedtls_bio_t *bio = &tls->output;
+
+    if ( bio->start == bio->end ) {
+        lua_pushnil( L );
+        return 1;
     }
- 
-    mbedtls_ssl_set_bio( &tls->ssl_context, &tls, tls_net_send, tls_net_recv, NULL );
-   
-    lua_pushnumber( L, ret );
+
+    lua_pushlstring( L, (const char *)bio->data + bio->start, bio->end - bio->start );
+    bio->start = bio->end = 0;
+
     return 1;
 }
 
-static int tls_handshake(lua_State *L)
+static int tls_pending( lua_State *L )
 {
     lmbedtls_tls_t *tls = lauxh_checkudata( L, 1, LMBEDTLS_TLS_MT );
 
-    int ret = -1;
-    while ((ret = mbedtls_ssl_handshake(&tls->ssl_context)) != 0) {
-        if (ret != MBEDTLS_ERR_SSL_WANT_READ && 
-            ret != MBEDTLS_ERR_SSL_WANT_WRITE ) {
-            break;
-        }
-    }    
+    lua_pushinteger( L, tls->output.end - tls->output.start );
+    return 1;
+}
+
+static int tls_handshake( lua_State *L )
+{
+    lmbedtls_tls_t *tls = lauxh_checkudata( L, 1, LMBEDTLS_TLS_MT );
+
+    int rc = mbedtls_ssl_handshake( &tls->ssl_context );
+    if ( rc == MBEDTLS_ERR_SSL_WANT_READ || rc == MBEDTLS_ERR_SSL_WANT_WRITE ) {
+        lua_pushboolean( L, 0 );
+        return 1;
 
+    } else if ( rc ) {
+        return tls_push_error( L, rc );
+    }
 
-    lua_pushnumber( L, ret );
+    lua_pushboolean( L, 1 );
     return 1;
 }
 
-static int tls_verify(lua_State *L)
+static int tls_verify( lua_State *L )
 {
     lmbedtls_tls_t *tls = lauxh_checkudata( L, 1, LMBEDTLS_TLS_MT );
 
     int ret = mbedtls_ssl_get_verify_result( &tls->ssl_context );
-    if (ret != 0) {
+    if ( ret != 0 ) {
         char vrfy_buf[512];
-        mbedtls_x509_crt_verify_info(vrfy_buf, sizeof(vrfy_buf), "", ret);
+        int len = mbedtls_x509_crt_verify_info( vrfy_buf, sizeof( vrfy_buf ), "", ret );
+
+        // one line per error
+        while ( len > 0 && vrfy_buf[len - 1] == '\n' ) {
+            len--;
+        }
 
         lua_pushboolean( L, 0 );
-        lua_pushstring( L, vrfy_buf );
+        lua_pushlstring( L, vrfy_buf, len > 0 ? len : 0 );
 
         return 2;
     }
@@ -166,64 +526,207 @@ static int tls_verify(lua_State *L)
     return 1;
 }
 
+static void tls_push_time( lua_State *L, const char *name, const mbedtls_x509_time *time )
+{
+    char buf[32];
+
+    snprintf( buf, sizeof( buf ), "%04d-%02d-%02d %02d:%02d:%02d", time->year,
+              time->mon, time->day, time->hour, time->min, time->sec );
+    lua_pushstring( L, buf );
+    lua_setfield( L, -2, name );
+}
+
+static int tls_peer_certificate( lua_State *L )
+{
+    lmbedtls_tls_t *tls = lauxh_checkudata( L, 1, LMBEDTLS_TLS_MT );
+    const mbedtls_x509_crt *cert = mbedtls_ssl_get_peer_cert( &tls->ssl_context );
+    char buf[512];
+
+    if ( !cert ) {
+        lua_pushnil( L );
+        return 1;
+    }
+
+    lua_createtable( L, 0, 6 );
+    lua_pushinteger( L, cert->version );
+    lua_setfield( L, -2, "version" );
+
+    if ( mbedtls_x509_dn_gets( buf, sizeof( buf ), &cert->subject ) > 0 ) {
+        lua_pushstring( L, buf );
+        lua_setfield( L, -2, "subject" );
+    }
+
+    if ( mbedtls_x509_dn_gets( buf, sizeof( buf ), &cert->issuer ) > 0 ) {
+        lua_pushstring( L, buf );
+        lua_setfield( L, -2, "issuer" );
+    }
+
+    if ( mbedtls_x509_serial_gets( buf, sizeof( buf ), &cert->serial ) > 0 ) {
+        lua_pushstring( L, buf );
+        lua_setfield( L, -2, "serial" );
+    }
+
+    tls_push_time( L, "valid_from", &cert->valid_from );
+    tls_push_time( L, "valid_to", &cert->valid_to );
+
+    lua_pushlstring( L, (const char *)cert->raw.p, cert->raw.len );
+    lua_setfield( L, -2, "raw" );
+
+    return 1;
+}
+
+static int tls_version( lua_State *L )
+{
+    lmbedtls_tls_t *tls = lauxh_checkudata( L, 1, LMBEDTLS_TLS_MT );
+
+    lua_pushstring( L, mbedtls_ssl_get_version( &tls->ssl_context ) );
+    return 1;
+}
+
+static int tls_ciphersuite( lua_State *L )
+{
+    lmbedtls_tls_t *tls = lauxh_checkudata( L, 1, LMBEDTLS_TLS_MT );
+
+    lua_pushstring( L, mbedtls_ssl_get_ciphersuite( &tls->ssl_context ) );
+    return 1;
+}
 
+// Encrypts `data` into the output BIO, returns the number of bytes written
 static int tls_write( lua_State *L )
 {
     lmbedtls_tls_t *tls = lauxh_checkudata( L, 1, LMBEDTLS_TLS_MT );
+    size_t len = 0;
+    const uint8_t *data = (const uint8_t *)lauxh_checklstring( L, 2, &len );
+    size_t written = 0;
+
+    // mbedtls_ssl_write() writes at most one record per call, so loop
+    // until all the data is in the output BIO
+    while ( written < len ) {
+        int rc = mbedtls_ssl_write( &tls->ssl_context, data + written, len - written );
+        if ( rc == MBEDTLS_ERR_SSL_WANT_READ || rc == MBEDTLS_ERR_SSL_WANT_WRITE ) {
+            break;
 
+        } else if ( rc < 0 ) {
+            return tls_push_error( L, rc );
+        }
 
-    return 0;
+        written += rc;
+    }
+
+    lua_pushinteger( L, written );
+    return 1;
 }
 
+/*
+ * Decrypts all the records of the input BIO. Returns the plaintext, false
+ * if more input is needed, or nil once the peer closed the connection.
+ */
 static int tls_read( lua_State *L )
 {
     lmbedtls_tls_t *tls = lauxh_checkudata( L, 1, LMBEDTLS_TLS_MT );
+    luaL_Buffer buffer;
+    int rc = 0;
 
+    if ( tls->closed ) {
+        lua_pushnil( L );
+        return 1;
+    }
 
-    return 0;
+    luaL_buffinit( L, &buffer );
+
+    for (;;) {
+        uint8_t *data = (uint8_t *)luaL_prepbuffsize( &buffer, MBEDTLS_SSL_MAX_CONTENT_LEN );
+
+        rc = mbedtls_ssl_read( &tls->ssl_context, data, MBEDTLS_SSL_MAX_CONTENT_LEN );
+        if ( rc > 0 ) {
+            luaL_addsize( &buffer, rc );
+            continue;
+
+        } else if ( rc == 0 || rc == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY ) {
+            tls->closed = 1;
+
+        } else if ( rc != MBEDTLS_ERR_SSL_WANT_READ && rc != MBEDTLS_ERR_SSL_WANT_WRITE ) {
+            return tls_push_error( L, rc );
+        }
+
+        break;
+    }
+
+    luaL_pushresult( &buffer );
+    if ( lua_rawlen( L, -1 ) > 0 ) {
+        return 1;
+
+    } else if ( tls->closed ) {
+        lua_pushnil( L );
+        return 1;
+    }
+
+    lua_pushboolean( L, 0 );
+    return 1;
 }
 
+// Writes a close_notify alert into the output BIO
 static int tls_close( lua_State *L )
 {
     lmbedtls_tls_t *tls = lauxh_checkudata( L, 1, LMBEDTLS_TLS_MT );
-   
-    mbedtls_ssl_close_notify(&tls->ssl_context);
-    return 0;
-}
 
+    int rc = mbedtls_ssl_close_notify( &tls->ssl_context );
+    if ( rc && rc != MBEDTLS_ERR_SSL_WANT_READ && rc != MBEDTLS_ERR_SSL_WANT_WRITE ) {
+        return tls_push_error( L, rc );
+    }
+
+    lua_pushboolean( L, 1 );
+    return 1;
+}
 
 static int tls_new( lua_State *L )
 {
-    size_t len = 0;
+    lmbedtls_tls_config_t *config = lauxh_checkudata( L, 1, LMBEDTLS_TLS_CONFIG_MT );
+    const char *hostname = lauxh_optstring( L, 2, NULL );
     lmbedtls_tls_t *tls = lua_newuserdata( L, sizeof( lmbedtls_tls_t ) );
     int rc = 0;
-    lmbedtls_errbuf_t errstr;
 
-    if ( !tls ) {
-        lua_pushnil( L );
-        lua_pushstring( L, strerror( errno ) );
-        return 2;
-    }
+    memset( tls, 0, sizeof( lmbedtls_tls_t ) );
+    mbedtls_ssl_init( &tls->ssl_context );
+    lauxh_setmetatable( L, LMBEDTLS_TLS_MT );
 
-    rc = tls_init(tls);
+    // the context points to the config, which must live as long
+    lua_pushvalue( L, 1 );
+    lua_setuservalue( L, -2 );
 
-    if ( rc == 0 ) {
-        lauxh_setmetatable( L, LMBEDTLS_TLS_MT );
-        return 1;
+    rc = mbedtls_ssl_setup( &tls->ssl_context, &config->ssl_conf );
+    if ( rc == 0 && hostname ) {
+        rc = mbedtls_ssl_set_hostname( &tls->ssl_context, hostname );
     }
 
-    // got error
-    tls_free(tls);
+    if ( rc ) {
+        return tls_push_error( L, rc );
+    }
 
-    lmbedtls_strerror( rc, errstr );
-    lua_pushnil( L );
-    lua_pushstring( L, errstr );
+    // userdata does not move, the context can point to it
+    mbedtls_ssl_set_bio( &tls->ssl_context, tls, tls_net_send, tls_net_recv, NULL );
 
-    return 2;
+    return 1;
 }
 
 LUALIB_API int luaopen_lmbedtls_tls( lua_State *L )
 {
+    struct luaL_Reg config_mmethods[] = {
+        { "__gc",       tls_config_gc },
+        { "__tostring", tls_config_tostring },
+        { NULL, NULL }
+    };
+
+    struct luaL_Reg config_methods[] = {
+        { "authmode",           tls_config_authmode },
+        { "ca",                 tls_config_ca },
+        { "ca_file",            tls_config_ca_file },
+        { "own_cert",           tls_config_own_cert },
+        { "sni",                tls_config_sni },
+
+        { NULL, NULL }
+    };
+
     struct luaL_Reg tls_mmethods[] = {
         { "__gc",       tls_gc },
         { "__tostring", tls_tostring },
@@ -231,18 +734,23 @@ LUALIB_API int luaopen_lmbedtls_tls( lua_State *L )
     };
 
     struct luaL_Reg tls_methods[] = {
+        { "ciphersuite",        tls_ciphersuite },
         { "close",              tls_close   },
-        { "config",             tls_config  },
         { "handshake",          tls_handshake   },
+        { "input",              tls_input   },
+        { "output",             tls_output  },
+        { "peer_certificate",   tls_peer_certificate },
+        { "pending",            tls_pending },
         { "read",               tls_read    },
-        { "set_certificates",   tls_set_certificates   },
         { "verify",             tls_verify   },
+        { "version",            tls_version },
         { "write",              tls_write   },
 
         { NULL, NULL }
     };
 
     // register metatable
+    lmbedtls_newmetatable( L, LMBEDTLS_TLS_CONFIG_MT, config_mmethods, config_methods );
     lmbedtls_newmetatable( L, LMBEDTLS_TLS_MT, tls_mmethods, tls_methods );
 
     // create table
@@ -250,7 +758,7 @@ LUALIB_API int luaopen_lmbedtls_tls( lua_State *L )
 
     // add new function
     lauxh_pushfn2tbl( L, "new", tls_new );
+    lauxh_pushfn2tbl( L, "new_config", tls_config_new );
 
     return 1;
 }
-
@@ -29,9 +29,12 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sqlite3.h>
 #include <lua.h>
 #include <lauxlib.h>
+#include "luv.h"
 
 
 /*
@@ -85,6 +88,7 @@ void luaL_register (lua_State *L, const char *libname, const luaL_Reg *l){
 #define KEY_TRACE_DATA(p)	KEY((p), 7)
 #define KEY_BUSY_DATA(p)	KEY((p), 8)
 #define KEY_COMMIT_DATA(p)	KEY((p), 9)
+#define KEY_STMT_CACHE(p)	KEY((p), 10)
 
 #define KEY_XFUNC(p)		KEY((p), 1)
 #define KEY_XSTEP(p)		KEY((p), 2)
@@ -99,19 +103,44 @@ void luaL_register (lua_State *L, const char *libname, const luaL_Reg *l){
 
 
 
+#define DB_META			"lsqlite.db"
+#define STMT_META		"lsqlite.stmt"
+#define STMT_CACHE_SIZE		32	/* Default capacity of the statement cache */
+#define FETCH_MANY_PREALLOC	256	/* Rows preallocated by fetch_many() */
+
+
+typedef struct Stmt Stmt;
+
+typedef struct
+{
+  Stmt *	first;		/* Most recently used */
+  Stmt *	last;		/* Least recently used, the next to be evicted */
+  int		size;
+  int		capacity;
+  lua_Integer	hits;
+  lua_Integer	misses;
+  lua_Integer	evictions;
+  lua_Integer	invalidations;
+} StmtCache;
+
+
 typedef struct
 {
   sqlite3 * 	sqlite3;
   lua_State * 	L;
   int		key2value_pos;	/* Used by callback wrappers to find the key2value array on the lua stack */
+  StmtCache	cache;		/* Statements returned by cached() */
 } DB;
 
 
-typedef struct
+struct Stmt
 {
   DB * db;
   sqlite3_stmt * stmt;
-} Stmt;
+  int cached;			/* Owned by the statement cache of db */
+  Stmt * prev;
+  Stmt * next;
+};
 
 
 typedef struct
@@ -147,6 +176,8 @@ static void push_callback(lua_State * L, DB * db, void * cb_key);
 static int pop_break_condition(lua_State * L);
 static void push_nil_or_string(lua_State * L, const char * str);
 
+static void cache_clear(lua_State * L, DB * db);
+
 
 
 
@@ -332,7 +363,10 @@ static void * checkudata(lua_State * L, int narg)
 
 static sqlite3_stmt * checkstmt_stmt(lua_State * L, int narg)
 {
-  return checkstmt(L, narg)->stmt;
+  sqlite3_stmt * stmt = checkstmt(L, narg)->stmt;
+  if (!stmt)
+    report_error(L, "libluasqlite3: Statement is finalized");
+  return stmt;
 }
 
 static sqlite3 * checkdb_sqlite3(lua_State * L, int narg)
@@ -509,6 +543,8 @@ FUNC( l_sqlite3_close )
   delete_private_value(L, KEY_BUSY_DATA(db));
   delete_private_value(L, KEY_COMMIT_DATA(db));
   
+  cache_clear(L, db);
+  
   lua_pushnumber(L, sqlite3_close(db->sqlite3) );
   return 1;
 }
@@ -736,7 +772,18 @@ FUNC( l_sqlite3_errmsg )
 
 FUNC( l_sqlite3_finalize )
 {
-  lua_pushnumber(L, sqlite3_finalize(checkstmt_stmt(L, 1)) );
+  Stmt * stmt = checkstmt(L, 1);
+  
+  /* Cached statements are only reset, they are finalized by the cache */
+  if (stmt->cached)
+  {
+    sqlite3_reset(stmt->stmt);
+    lua_pushnumber(L, SQLITE_OK);
+    return 1;
+  }
+  
+  lua_pushnumber(L, sqlite3_finalize(stmt->stmt) );
+  stmt->stmt = 0;
   return 1;
 }
 
@@ -765,7 +812,10 @@ FUNC( l_sqlite3_open )
   if (sqlite3)
   {
     DB * db = (DB *) lua_newuserdata(L, sizeof(DB));
+    memset(db, 0, sizeof(DB));
     db->sqlite3 = sqlite3;
+    db->cache.capacity = STMT_CACHE_SIZE;
+    luaL_setmetatable(L, DB_META);
   }
   else
     lua_pushnil(L);
@@ -795,8 +845,10 @@ FUNC( l_sqlite3_prepare )
   lua_pushnumber(L, error);
   
   stmt = lua_newuserdata(L, sizeof(Stmt));
+  memset(stmt, 0, sizeof(Stmt));
   stmt->db = checkdb(L, 1);
   stmt->stmt = sqlite3_stmt;
+  luaL_setmetatable(L, STMT_META);
   
   if (leftover_size > 0)
     lua_pushlstring(L, leftover, leftover_size);
@@ -807,6 +859,512 @@ FUNC( l_sqlite3_prepare )
 }
 
 
+/*
+ * Statement cache
+ *
+ * cached(db, sql) returns a statement from a per-connection LRU cache keyed
+ * by the SQL text, reset and with its bindings cleared, so the same few
+ * statements are not parsed and planned again for every use. The values of
+ * an optional table are bound to it, by position or by name.
+ *
+ * Cached statements are prepared with sqlite3_prepare_v2(), so SQLite
+ * compiles them again after a schema change. A statement is dropped from
+ * the cache if that fails with SQLITE_SCHEMA. finalize() on a cached
+ * statement only resets it. A statement evicted from the cache is
+ * finalized, so keep it only until the next call of cached().
+ */
+
+static void cache_unlink(StmtCache * cache, Stmt * stmt)
+{
+  if (stmt->prev)
+    stmt->prev->next = stmt->next;
+  else
+    cache->first = stmt->next;
+  
+  if (stmt->next)
+    stmt->next->prev = stmt->prev;
+  else
+    cache->last = stmt->prev;
+  
+  stmt->prev = stmt->next = 0;
+}
+
+
+static void cache_push_first(StmtCache * cache, Stmt * stmt)
+{
+  stmt->prev = 0;
+  stmt->next = cache->first;
+  if (cache->first)
+    cache->first->prev = stmt;
+  else
+    cache->last = stmt;
+  cache->first = stmt;
+}
+
+
+/* The cache table maps the SQL text to the statement, and the statement
+   (as light userdata) back to the SQL text */
+static void cache_remove(lua_State * L, Stmt * stmt)
+{
+  DB * db = stmt->db;
+  
+  push_private_table(L, KEY_STMT_CACHE(db));
+  lua_pushlightuserdata(L, stmt);
+  lua_rawget(L, -2);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pushlightuserdata(L, stmt);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  
+  cache_unlink(&db->cache, stmt);
+  db->cache.size--;
+  
+  sqlite3_finalize(stmt->stmt);
+  stmt->stmt	= 0;
+  stmt->cached	= 0;
+}
+
+
+static void cache_invalidate(lua_State * L, Stmt * stmt)
+{
+  stmt->db->cache.invalidations++;
+  cache_remove(L, stmt);
+}
+
+
+static void cache_trim(lua_State * L, DB * db, int capacity)
+{
+  while (db->cache.size > capacity)
+  {
+    db->cache.evictions++;
+    cache_remove(L, db->cache.last);
+  }
+}
+
+
+static void cache_clear(lua_State * L, DB * db)
+{
+  Stmt * stmt;
+  
+  while ((stmt = db->cache.first))
+  {
+    cache_unlink(&db->cache, stmt);
+    sqlite3_finalize(stmt->stmt);
+    stmt->stmt	= 0;
+    stmt->cached	= 0;
+  }
+  
+  db->cache.size = 0;
+  delete_private_value(L, KEY_STMT_CACHE(db));
+}
+
+
+static int bind_value(lua_State * L, sqlite3_stmt * stmt, int index, int narg)
+{
+  switch(lua_type(L, narg))
+  {
+    case LUA_TNUMBER:
+      if (lua_isinteger(L, narg))
+        return sqlite3_bind_int64(stmt, index, lua_tointeger(L, narg));
+      else
+        return sqlite3_bind_double(stmt, index, lua_tonumber(L, narg));
+    
+    case LUA_TBOOLEAN:
+      return sqlite3_bind_int(stmt, index, lua_toboolean(L, narg));
+    
+    case LUA_TSTRING:
+      return sqlite3_bind_text(stmt, index, lua_tostring(L, narg), lua_strlen(L, narg), SQLITE_TRANSIENT);
+    
+    case LUA_TLIGHTUSERDATA:	/* cjson.null */
+      if (lua_touserdata(L, narg) == 0)
+        return sqlite3_bind_null(stmt, index);
+  }
+  
+  return luaL_error(L, "libluasqlite3: Cannot bind a %s value", luaL_typename(L, narg));
+}
+
+
+/*
+ * Binds the values of the table at narg: array items to `?NNN` and fields
+ * to `:name`, `$name` or `@name`. Fields which are not parameters of the
+ * statement are ignored.
+ */
+static int bind_table(lua_State * L, sqlite3_stmt * stmt, int narg)
+{
+  int error = SQLITE_OK;
+  
+  lua_pushnil(L);
+  while (error == SQLITE_OK && lua_next(L, narg))
+  {
+    int index = 0;
+    
+    if (lua_type(L, -2) == LUA_TSTRING)
+    {
+      static const char prefixes[] = ":$@";
+      char name[128];
+      size_t size;
+      const char * key = lua_tolstring(L, -2, &size);
+      int i;
+      
+      if (size < sizeof(name) - 1)
+      {
+        memcpy(name + 1, key, size + 1);
+        for (i = 0; prefixes[i] && !index; i++)
+        {
+          name[0] = prefixes[i];
+          index = sqlite3_bind_parameter_index(stmt, name);
+        }
+      }
+    }
+    else if (lua_isinteger(L, -2))
+      index = (int) lua_tointeger(L, -2);
+    
+    if (index > 0)
+      error = bind_value(L, stmt, index, lua_gettop(L));
+    
+    lua_pop(L, 1);
+  }
+  
+  if (error != SQLITE_OK)
+    lua_pop(L, 1);	/* the key */
+  
+  return error;
+}
+
+
+FUNC( l_sqlite3_cached )
+{
+  DB * db		= checkdb(L, 1);
+  const char * sql	= checkstr(L, 2);
+  Stmt * stmt;
+  int error		= SQLITE_OK;
+  
+  if (!lua_isnoneornil(L, 3))
+    luaL_checktype(L, 3, LUA_TTABLE);
+  
+  init_callback_usage(L, db);
+  lua_settop(L, 3);
+  
+  push_private_table(L, KEY_STMT_CACHE(db));	/* 4 */
+  lua_pushvalue(L, 2);
+  lua_rawget(L, 4);				/* 5 */
+  
+  stmt = lua_touserdata(L, 5);
+  if (stmt)
+  {
+    db->cache.hits++;
+    cache_unlink(&db->cache, stmt);
+    cache_push_first(&db->cache, stmt);
+    
+    sqlite3_reset(stmt->stmt);
+    sqlite3_clear_bindings(stmt->stmt);
+  }
+  else
+  {
+    sqlite3_stmt * sqlite3_stmt = 0;
+    
+    lua_pop(L, 1);
+    db->cache.misses++;
+    
+    error = sqlite3_prepare_v2(db->sqlite3, sql, lua_strlen(L, 2), &sqlite3_stmt, 0);
+    if (error != SQLITE_OK || !sqlite3_stmt)
+    {
+      lua_pushnumber(L, error);
+      lua_pushnil(L);
+      return 2;
+    }
+    
+    stmt = lua_newuserdata(L, sizeof(Stmt));	/* 5 */
+    memset(stmt, 0, sizeof(Stmt));
+    stmt->db	= db;
+    stmt->stmt	= sqlite3_stmt;
+    stmt->cached	= 1;
+    luaL_setmetatable(L, STMT_META);
+    
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 5);
+    lua_rawset(L, 4);
+    lua_pushlightuserdata(L, stmt);
+    lua_pushvalue(L, 2);
+    lua_rawset(L, 4);
+    
+    cache_push_first(&db->cache, stmt);
+    db->cache.size++;
+    cache_trim(L, db, db->cache.capacity);
+  }
+  
+  if (lua_istable(L, 3))
+    error = bind_table(L, stmt->stmt, 3);
+  
+  lua_pushnumber(L, error);
+  lua_pushvalue(L, 5);
+  return 2;	/* error code, statement */
+}
+
+
+FUNC( l_sqlite3_cache_size )
+{
+  DB * db = checkdb(L, 1);
+  
+  if (!lua_isnoneornil(L, 2))
+  {
+    int capacity = checkint(L, 2);
+    /* cached() returns the statement it just added */
+    luaL_argcheck(L, capacity >= 1, 2, "capacity must be at least 1");
+    db->cache.capacity = capacity;
+    cache_trim(L, db, capacity);
+  }
+  
+  lua_pushinteger(L, db->cache.capacity);
+  return 1;
+}
+
+
+FUNC( l_sqlite3_cache_stats )
+{
+  DB * db		= checkdb(L, 1);
+  StmtCache * cache	= &db->cache;
+  lua_Integer lookups	= cache->hits + cache->misses;
+  
+  lua_createtable(L, 0, 7);
+  lua_pushinteger(L, cache->size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, cache->capacity);
+  lua_setfield(L, -2, "capacity");
+  lua_pushinteger(L, cache->hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, cache->misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, cache->evictions);
+  lua_setfield(L, -2, "evictions");
+  lua_pushinteger(L, cache->invalidations);
+  lua_setfield(L, -2, "invalidations");
+  lua_pushnumber(L, lookups ? (lua_Number) cache->hits / lookups : 0);
+  lua_setfield(L, -2, "hit_rate");
+  return 1;
+}
+
+
+FUNC( l_sqlite3_cache_clear )
+{
+  cache_clear(L, checkdb(L, 1));
+  return 0;
+}
+
+
+/*
+ * Bulk insert and fetch
+ *
+ * insert_many(stmt, rows[, options]) binds and steps every row table of the
+ * array in one call, inside a transaction unless `options.transaction` is
+ * false or a transaction is already open. fetch_many(stmt, n) steps up to n
+ * rows into one array. Both save the Lua/C crossings of bind_*, step, reset
+ * and column_* per value.
+ */
+
+static int insert_rows(lua_State * L)
+{
+  Stmt * stmt	= lua_touserdata(L, 1);
+  int * count	= lua_touserdata(L, 3);
+  int num_rows	= (int) lua_rawlen(L, 2);
+  int index, error = SQLITE_OK;
+  
+  for (index = 1; index <= num_rows && error == SQLITE_OK; index++)
+  {
+    if (lua_rawgeti(L, 2, index) != LUA_TTABLE)
+      return luaL_error(L, "libluasqlite3: Row %d is not a table", index);
+    
+    sqlite3_reset(stmt->stmt);
+    sqlite3_clear_bindings(stmt->stmt);
+    error = bind_table(L, stmt->stmt, lua_gettop(L));
+    lua_pop(L, 1);
+    
+    if (error == SQLITE_OK)
+    {
+      error = sqlite3_step(stmt->stmt);
+      if (error == SQLITE_DONE || error == SQLITE_ROW)
+      {
+        error = SQLITE_OK;
+        (*count)++;
+      }
+    }
+  }
+  
+  /* The error code of the legacy interface is only reported by reset */
+  if (error != SQLITE_OK)
+    error = sqlite3_reset(stmt->stmt);
+  else
+    sqlite3_reset(stmt->stmt);
+  
+  lua_pushinteger(L, error);
+  return 1;
+}
+
+
+FUNC( l_sqlite3_insert_many )
+{
+  Stmt * stmt		= checkstmt(L, 1);
+  sqlite3 * db		= stmt->db->sqlite3;
+  int transaction	= 1;
+  int count		= 0;
+  int error;
+  
+  checkstmt_stmt(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (lua_istable(L, 3))
+  {
+    lua_getfield(L, 3, "transaction");
+    transaction = lua_isnil(L, -1) || lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  
+  init_callback_usage(L, stmt->db);
+  
+  /* Nested in the transaction of the caller */
+  if (!sqlite3_get_autocommit(db))
+    transaction = 0;
+  
+  if (transaction)
+  {
+    error = sqlite3_exec(db, "BEGIN", 0, 0, 0);
+    if (error != SQLITE_OK)
+    {
+      lua_pushnumber(L, error);
+      lua_pushinteger(L, 0);
+      return 2;
+    }
+  }
+  
+  lua_pushcfunction(L, insert_rows);
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 2);
+  lua_pushlightuserdata(L, &count);
+  if (lua_pcall(L, 3, 1, 0))
+  {
+    sqlite3_reset(stmt->stmt);
+    if (transaction)
+      sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    return lua_error(L);
+  }
+  
+  error = (int) lua_tointeger(L, -1);
+  if (error == SQLITE_SCHEMA && stmt->cached)
+    cache_invalidate(L, stmt);
+  
+  if (transaction)
+  {
+    if (error == SQLITE_OK)
+      error = sqlite3_exec(db, "COMMIT", 0, 0, 0);
+    if (error != SQLITE_OK && !sqlite3_get_autocommit(db))
+      sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+  }
+  
+  lua_pushnumber(L, error);
+  lua_pushinteger(L, count);
+  return 2;	/* error code, number of rows inserted before an error */
+}
+
+
+/* Like push_column(), but integers keep all 64 bits */
+static void push_column_value(lua_State * L, sqlite3_stmt * stmt, int column)
+{
+  switch(sqlite3_column_type(stmt, column))
+  {
+    case SQLITE_INTEGER:
+      lua_pushinteger(L, sqlite3_column_int64(stmt, column));
+      break;
+    
+    case SQLITE_FLOAT:
+      lua_pushnumber(L, sqlite3_column_double(stmt, column));
+      break;
+    
+    case SQLITE_TEXT:
+      lua_pushlstring(L, (const char*)sqlite3_column_text(stmt, column), sqlite3_column_bytes(stmt, column));
+      break;
+    
+    case SQLITE_BLOB:
+      lua_pushlstring(L, sqlite3_column_blob(stmt, column), sqlite3_column_bytes(stmt, column));
+      break;
+    
+    default:
+      lua_pushnil(L);
+  }
+}
+
+
+/*
+ * fetch_many(stmt, n[, mode]) returns the error code and an array of up to
+ * n rows. The code is ROW if there may be more rows, DONE at the end.
+ * mode: "a" (default) for rows keyed by column name, "i" for arrays.
+ */
+FUNC( l_sqlite3_fetch_many )
+{
+  Stmt * stmt		= checkstmt(L, 1);
+  sqlite3_stmt * s	= checkstmt_stmt(L, 1);
+  int max_rows		= checkint(L, 2);
+  const char * mode	= luaL_optstring(L, 3, "a");
+  int named		= (mode[0] != 'i');
+  int num_columns	= sqlite3_column_count(s);
+  int names		= 0;
+  int num_rows		= 0;
+  int error		= SQLITE_ROW;
+  int column;
+  
+  luaL_argcheck(L, max_rows > 0, 2, "must be a positive number");
+  init_callback_usage(L, stmt->db);
+  
+  /* The names are pushed once and copied for every row */
+  if (named)
+  {
+    luaL_checkstack(L, num_columns + 2, "too many columns");
+    names = lua_gettop(L) + 1;
+    for (column = 0; column < num_columns; column++)
+      lua_pushstring(L, sqlite3_column_name(s, column));
+  }
+  
+  /* n may be far more than the rows there are, grow past the first few */
+  lua_createtable(L, max_rows < FETCH_MANY_PREALLOC ? max_rows : FETCH_MANY_PREALLOC, 0);
+  
+  while (num_rows < max_rows)
+  {
+    error = sqlite3_step(s);
+    if (error != SQLITE_ROW)
+      break;
+    
+    if (named)
+    {
+      lua_createtable(L, 0, num_columns);
+      for (column = 0; column < num_columns; column++)
+      {
+        lua_pushvalue(L, names + column);
+        push_column_value(L, s, column);
+        lua_rawset(L, -3);
+      }
+    }
+    else
+    {
+      lua_createtable(L, num_columns, 0);
+      for (column = 0; column < num_columns; column++)
+      {
+        push_column_value(L, s, column);
+        lua_rawseti(L, -2, column + 1);
+      }
+    }
+    
+    lua_rawseti(L, -2, ++num_rows);
+  }
+  
+  if (error == SQLITE_SCHEMA && stmt->cached)
+    cache_invalidate(L, stmt);
+  
+  lua_pushnumber(L, error);
+  lua_insert(L, -2);
+  return 2;	/* error code, rows */
+}
+
+
 FUNC( l_sqlite3_reset )
 {
   lua_pushnumber(L, sqlite3_reset(checkstmt_stmt(L, 1)) );
@@ -817,8 +1375,16 @@ FUNC( l_sqlite3_reset )
 FUNC( l_sqlite3_step )
 {
   Stmt * stmt = checkstmt(L, 1);
+  int error;
+  
+  checkstmt_stmt(L, 1);
   init_callback_usage(L, stmt->db);
-  lua_pushnumber(L, sqlite3_step(stmt->stmt) );
+  
+  error = sqlite3_step(stmt->stmt);
+  if (error == SQLITE_SCHEMA && stmt->cached)
+    cache_invalidate(L, stmt);
+  
+  lua_pushnumber(L, error);
   return 1;
 }
 
@@ -1458,11 +2024,1408 @@ FUNC( l_sqlite3_set_authorizer )
   return 1;
 }
 
-typedef struct { char * name; int (*func)(lua_State *); } f_entry;
-typedef struct { char * name; int value; } d_entry;
 
-static void f(lua_State * L, f_entry entries[])
-{
+/*
+ * Asynchronous connections
+ *
+ * A connection opened by open_async() is owned by its own thread. The
+ * statements are queued to that thread and the rows come back to the event
+ * loop in batches through an uv_async_t, so a slow commit or a big SELECT
+ * does not block the loop:
+ *
+ *   local db = api.open_async(filename)
+ *   db:exec(sql, function(err) end)
+ *   db:run(sql, params, function(err, changes, last_insert_rowid) end)
+ *   db:query(sql, params, batch, function(err, rows, done) end)
+ *   db:close(function(err) end)
+ *
+ * The callback is always the last argument, so these work with utils.await.
+ * Parameters are an array for `?` or a table of names for `:name`, `$name`
+ * and `@name`. Without `batch` all rows are returned by one call.
+ *
+ * open_pool() opens a database in WAL mode with one writer thread and a
+ * few reader threads, each with its own connection:
+ *
+ *   local pool = api.open_pool(filename, { readers = 2, batch = 256 })
+ *   pool:run(sql, params, callback)		-- queued to the writer
+ *   pool:query(sql, params, batch, callback)	-- run by a free reader
+ *
+ * In WAL mode the readers do not block the writer and see the last commit.
+ * The writer runs the statements queued by run() together in one
+ * transaction, up to `batch` of them, each in its own savepoint, so one
+ * fsync is shared by many writes and a failing statement does not undo the
+ * others. exec() is run on the writer outside of these transactions.
+ */
+
+#define ASYNC_DB_META		"lsqlite.async"
+#define ASYNC_POOL_META		"lsqlite.pool"
+#define ASYNC_MAX_BATCHES	2	/* Batches a thread may be ahead of the loop */
+#define ASYNC_POOL_READERS	2
+#define ASYNC_WRITE_BATCH	256	/* Writes per transaction of a pool */
+#define ASYNC_BUSY_TIMEOUT	5000	/* ms, for checkpoints of a pool */
+
+enum { ASYNC_EXEC, ASYNC_RUN, ASYNC_QUERY, ASYNC_CLOSE };
+
+typedef struct
+{
+  int		type;		/* SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT or SQLITE_NULL */
+  int		size;
+  union { sqlite3_int64 i; double d; char * s; } v;
+} AsyncValue;
+
+typedef struct
+{
+  char *	name;		/* NULL for positional parameters */
+  int		index;
+  AsyncValue	value;
+} AsyncParam;
+
+typedef struct AsyncJob
+{
+  struct AsyncJob * next;
+  int		type;
+  char *	sql;
+  AsyncParam *	params;
+  int		num_params;
+  int		batch_size;
+  int		callback_ref;
+  int		num_columns;	/* Set by the thread before the first result */
+  char **	names;
+  int		batches;	/* Results posted but not handled yet */
+} AsyncJob;
+
+typedef struct AsyncResult
+{
+  struct AsyncResult * next;
+  AsyncJob *	job;
+  int		done;
+  char *	error;
+  int		changes;
+  sqlite3_int64	last_insert_rowid;
+  int		num_rows;
+  int		capacity;
+  AsyncValue *	values;
+} AsyncResult;
+
+typedef struct AsyncDB AsyncDB;
+
+typedef struct
+{
+  AsyncDB *	adb;
+  sqlite3 *	sqlite3;
+  uv_thread_t	thread;
+} AsyncWorker;
+
+typedef struct
+{
+  AsyncDB *	adb;
+} AsyncHandle;
+
+typedef struct
+{
+  AsyncDB *	writer;
+  AsyncDB *	readers;
+  int		closing;
+} AsyncPool;
+
+/* The jobs of one queue, run by one or more threads */
+struct AsyncDB
+{
+  uv_async_t	async;		/* First member, `data` is left to luv */
+  AsyncWorker *	workers;
+  int		num_workers;
+  int		running;	/* Threads which have not closed their connection */
+  int		write_batch;	/* Run up to this many RUN jobs per transaction */
+  uv_mutex_t	mutex;
+  uv_cond_t	cond;
+  AsyncJob *	jobs;
+  AsyncJob *	last_job;
+  AsyncJob *	close_job;
+  char *	close_error;
+  AsyncResult *	results;
+  AsyncResult *	last_result;
+  AsyncDB **	owner;		/* Cleared when closed */
+  int		self_ref;	/* Keeps the handle alive while jobs are pending */
+  int		pending;
+  int		closing;
+  int		shutdown;	/* Closed by __gc, results are discarded */
+  lua_Integer	transactions;
+  lua_Integer	writes;
+};
+
+
+static char * async_strdup(const char * str)
+{
+  size_t size = strlen(str) + 1;
+  char * copy = malloc(size);
+  if (copy)
+    memcpy(copy, str, size);
+  return copy;
+}
+
+static void async_free_values(AsyncValue * values, int count)
+{
+  int index;
+  for (index = 0; index < count; index++)
+    if (values[index].type == SQLITE_TEXT || values[index].type == SQLITE_BLOB)
+      free(values[index].v.s);
+}
+
+static void async_free_job(AsyncJob * job)
+{
+  int index;
+  
+  for (index = 0; index < job->num_params; index++)
+  {
+    free(job->params[index].name);
+    async_free_values(&job->params[index].value, 1);
+  }
+  for (index = 0; job->names && index < job->num_columns; index++)
+    free(job->names[index]);
+  
+  free(job->names);
+  free(job->params);
+  free(job->sql);
+  free(job);
+}
+
+static void async_free_result(AsyncResult * result)
+{
+  if (result->values)
+    async_free_values(result->values, result->num_rows * result->job->num_columns);
+  free(result->values);
+  free(result->error);
+  free(result);
+}
+
+
+/*
+ * The worker thread
+ */
+
+static void async_post(AsyncDB * adb, AsyncResult * result)
+{
+  /* The result may be freed by the loop as soon as it is queued, the
+     job lives until its last result */
+  AsyncJob * job	= result->job;
+  int done		= result->done;
+  
+  uv_mutex_lock(&adb->mutex);
+  if (adb->last_result)
+    adb->last_result->next = result;
+  else
+    adb->results = result;
+  adb->last_result = result;
+  job->batches++;
+  
+  /* Wait until the loop has caught up with the rows of a large query */
+  while (!done && !adb->shutdown && job->batches >= ASYNC_MAX_BATCHES)
+  {
+    uv_async_send(&adb->async);
+    uv_cond_wait(&adb->cond, &adb->mutex);
+  }
+  uv_mutex_unlock(&adb->mutex);
+  
+  uv_async_send(&adb->async);
+}
+
+static AsyncResult * async_new_result(AsyncJob * job)
+{
+  AsyncResult * result = calloc(1, sizeof(AsyncResult));
+  if (result)
+    result->job = job;
+  return result;
+}
+
+static int async_bind(sqlite3_stmt * stmt, AsyncJob * job)
+{
+  int index, error = SQLITE_OK;
+  
+  for (index = 0; index < job->num_params && error == SQLITE_OK; index++)
+  {
+    AsyncParam * param	= &job->params[index];
+    AsyncValue * value	= &param->value;
+    int position	= param->index;
+    
+    if (param->name)
+    {
+      static const char prefixes[] = ":$@";
+      char * name = param->name;
+      int i;
+      
+      /* The name is stored with a leading blank to be replaced by a prefix */
+      for (i = 0, position = 0; prefixes[i] && !position; i++)
+      {
+        name[0] = prefixes[i];
+        position = sqlite3_bind_parameter_index(stmt, name);
+      }
+      
+      /* Fields of a table which are not parameters are ignored */
+      if (!position)
+        continue;
+    }
+    
+    switch (value->type)
+    {
+      case SQLITE_INTEGER:	error = sqlite3_bind_int64(stmt, position, value->v.i); break;
+      case SQLITE_FLOAT:	error = sqlite3_bind_double(stmt, position, value->v.d); break;
+      case SQLITE_TEXT:		error = sqlite3_bind_text(stmt, position, value->v.s, value->size, SQLITE_STATIC); break;
+      default:			error = sqlite3_bind_null(stmt, position); break;
+    }
+  }
+  
+  return error;
+}
+
+static int async_add_row(AsyncResult * result, sqlite3_stmt * stmt, int num_columns)
+{
+  AsyncValue * row;
+  int index;
+  
+  if ((result->num_rows + 1) * num_columns > result->capacity)
+  {
+    int capacity = result->capacity ? result->capacity * 2 : num_columns * 16;
+    AsyncValue * values = realloc(result->values, capacity * sizeof(AsyncValue));
+    if (!values)
+      return SQLITE_NOMEM;
+    result->values	= values;
+    result->capacity	= capacity;
+  }
+  
+  row = result->values + result->num_rows * num_columns;
+  for (index = 0; index < num_columns; index++)
+  {
+    AsyncValue * value = &row[index];
+    value->type = sqlite3_column_type(stmt, index);
+    
+    switch (value->type)
+    {
+      case SQLITE_INTEGER:	value->v.i = sqlite3_column_int64(stmt, index); break;
+      case SQLITE_FLOAT:	value->v.d = sqlite3_column_double(stmt, index); break;
+      case SQLITE_TEXT:
+      case SQLITE_BLOB:
+      {
+        const void * data = (value->type == SQLITE_TEXT)
+          ? (const void *) sqlite3_column_text(stmt, index)
+          : sqlite3_column_blob(stmt, index);
+        value->size	= sqlite3_column_bytes(stmt, index);
+        value->v.s	= malloc(value->size + 1);
+        if (!value->v.s)
+        {
+          value->type = SQLITE_NULL;
+          result->num_rows++;
+          return SQLITE_NOMEM;
+        }
+        if (value->size)
+          memcpy(value->v.s, data, value->size);
+        break;
+      }
+    }
+  }
+  
+  result->num_rows++;
+  return SQLITE_OK;
+}
+
+/* Returns the last result of the job, to be posted by the caller */
+static AsyncResult * async_run_statement(AsyncWorker * worker, AsyncJob * job, AsyncResult * result)
+{
+  AsyncDB * adb		= worker->adb;
+  sqlite3 * db		= worker->sqlite3;
+  sqlite3_stmt * stmt	= 0;
+  int error		= sqlite3_prepare_v2(db, job->sql, -1, &stmt, 0);
+  
+  if (error == SQLITE_OK && stmt)
+    error = async_bind(stmt, job);
+  
+  if (error == SQLITE_OK && stmt && job->type == ASYNC_QUERY)
+  {
+    int index, num_columns = sqlite3_column_count(stmt);
+    
+    job->names = calloc(num_columns ? num_columns : 1, sizeof(char *));
+    if (!job->names)
+      error = SQLITE_NOMEM;
+    for (index = 0; error == SQLITE_OK && index < num_columns; index++)
+    {
+      job->names[index] = async_strdup(sqlite3_column_name(stmt, index));
+      if (!job->names[index])
+        error = SQLITE_NOMEM;
+    }
+    job->num_columns = num_columns;
+  }
+  
+  while (error == SQLITE_OK && stmt)
+  {
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE)
+      break;
+    else if (rc != SQLITE_ROW)
+      error = rc;
+    else if (job->type == ASYNC_QUERY)
+    {
+      error = async_add_row(result, stmt, job->num_columns);
+      
+      if (error == SQLITE_OK && job->batch_size > 0 && result->num_rows >= job->batch_size)
+      {
+        async_post(adb, result);
+        result = async_new_result(job);
+        if (!result)
+        {
+          /* Nothing can be reported without a result, stop here */
+          sqlite3_finalize(stmt);
+          return 0;
+        }
+      }
+    }
+  }
+  
+  if (error != SQLITE_OK)
+    result->error = async_strdup(error == SQLITE_NOMEM ? "out of memory" : sqlite3_errmsg(db));
+  
+  result->changes		= sqlite3_changes(db);
+  result->last_insert_rowid	= sqlite3_last_insert_rowid(db);
+  result->done			= 1;
+  
+  sqlite3_finalize(stmt);
+  return result;
+}
+
+/* Runs the RUN jobs of a list in one transaction, each in a savepoint */
+static void async_run_batch(AsyncWorker * worker, AsyncJob * jobs, int count)
+{
+  AsyncDB * adb		= worker->adb;
+  sqlite3 * db		= worker->sqlite3;
+  AsyncResult * first	= 0;
+  AsyncResult * last	= 0;
+  AsyncResult * result;
+  int savepoints	= (count > 1);
+  int transaction;
+  
+  /* Without a transaction, like after an exec() with BEGIN, every statement
+     is committed by itself */
+  transaction = sqlite3_get_autocommit(db) && sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0) == SQLITE_OK;
+  
+  while (jobs)
+  {
+    AsyncJob * job = jobs;
+    jobs = job->next;
+    
+    result = async_new_result(job);
+    if (!result)
+      continue;	/* The callback of the job is never called */
+    
+    if (transaction && savepoints)
+      sqlite3_exec(db, "SAVEPOINT async_write", 0, 0, 0);
+    
+    result = async_run_statement(worker, job, result);
+    
+    if (transaction && savepoints)
+    {
+      if (!result || result->error)
+        sqlite3_exec(db, "ROLLBACK TO async_write", 0, 0, 0);
+      sqlite3_exec(db, "RELEASE async_write", 0, 0, 0);
+    }
+    
+    if (!result)
+      continue;
+    
+    if (last)
+      last->next = result;
+    else
+      first = result;
+    last = result;
+  }
+  
+  if (transaction && sqlite3_exec(db, "COMMIT", 0, 0, 0) != SQLITE_OK)
+  {
+    const char * message = sqlite3_errmsg(db);
+    
+    for (result = first; result; result = result->next)
+      if (!result->error)
+      {
+        result->error = async_strdup(message);
+        result->changes = 0;
+      }
+    if (!sqlite3_get_autocommit(db))
+      sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+  }
+  
+  uv_mutex_lock(&adb->mutex);
+  adb->transactions += transaction;
+  adb->writes += count;
+  uv_mutex_unlock(&adb->mutex);
+  
+  while ((result = first))
+  {
+    first = result->next;
+    result->next = 0;
+    async_post(adb, result);
+  }
+}
+
+/* Closes the connection of a thread, the last one posts the result of close() */
+static void async_close_worker(AsyncWorker * worker)
+{
+  AsyncDB * adb		= worker->adb;
+  AsyncResult * result	= 0;
+  char * error		= 0;
+  
+  if (sqlite3_close(worker->sqlite3) != SQLITE_OK)
+  {
+    error = async_strdup(sqlite3_errmsg(worker->sqlite3));
+    sqlite3_close_v2(worker->sqlite3);
+  }
+  worker->sqlite3 = 0;
+  
+  uv_mutex_lock(&adb->mutex);
+  if (error && !adb->close_error)
+    adb->close_error = error;
+  else
+    free(error);
+  
+  if (--adb->running == 0 && adb->close_job && !adb->shutdown)
+  {
+    result = async_new_result(adb->close_job);
+    if (result)
+    {
+      result->error	= adb->close_error;
+      result->done	= 1;
+      adb->close_error	= 0;
+    }
+  }
+  uv_mutex_unlock(&adb->mutex);
+  
+  if (result)
+    async_post(adb, result);
+}
+
+static void async_thread(void * arg)
+{
+  AsyncWorker * worker	= arg;
+  AsyncDB * adb		= worker->adb;
+  
+  for (;;)
+  {
+    AsyncJob * job;
+    AsyncResult * result;
+    int count = 1;
+    
+    uv_mutex_lock(&adb->mutex);
+    while (!adb->jobs && !adb->close_job && !adb->shutdown)
+      uv_cond_wait(&adb->cond, &adb->mutex);
+    
+    /* close() is the last job of the queue */
+    if (adb->shutdown || !adb->jobs)
+    {
+      uv_mutex_unlock(&adb->mutex);
+      break;
+    }
+    
+    job = adb->jobs;
+    adb->jobs = job->next;
+    job->next = 0;
+    
+    if (job->type == ASYNC_CLOSE)
+    {
+      adb->close_job = job;
+      uv_cond_broadcast(&adb->cond);
+    }
+    else if (job->type == ASYNC_RUN && adb->write_batch > 0)
+    {
+      /* Take the writes queued after this one into the same transaction */
+      AsyncJob * last = job;
+      while (count < adb->write_batch && adb->jobs && adb->jobs->type == ASYNC_RUN)
+      {
+        last->next = adb->jobs;
+        last = adb->jobs;
+        adb->jobs = last->next;
+        last->next = 0;
+        count++;
+      }
+    }
+    
+    if (!adb->jobs)
+      adb->last_job = 0;
+    uv_mutex_unlock(&adb->mutex);
+    
+    if (job->type == ASYNC_CLOSE)
+      break;
+    
+    if (job->type == ASYNC_RUN && adb->write_batch > 0)
+    {
+      async_run_batch(worker, job, count);
+      continue;
+    }
+    
+    result = async_new_result(job);
+    if (!result)
+      continue;	/* The callback of the job is never called */
+    
+    if (job->type == ASYNC_EXEC)
+    {
+      char * errmsg = 0;
+      if (sqlite3_exec(worker->sqlite3, job->sql, 0, 0, &errmsg) != SQLITE_OK)
+        result->error = async_strdup(errmsg ? errmsg : sqlite3_errmsg(worker->sqlite3));
+      sqlite3_free(errmsg);
+      result->done = 1;
+    }
+    else
+      result = async_run_statement(worker, job, result);
+    
+    if (result)
+      async_post(adb, result);
+  }
+  
+  async_close_worker(worker);
+}
+
+
+/*
+ * The event loop side
+ */
+
+static void async_close_cb(uv_handle_t * handle)
+{
+  AsyncDB * adb = (AsyncDB *) handle;
+  uv_mutex_destroy(&adb->mutex);
+  uv_cond_destroy(&adb->cond);
+  free(adb->close_error);
+  free(adb->workers);
+  free(adb);
+}
+
+static void async_join(AsyncDB * adb)
+{
+  int index;
+  for (index = 0; index < adb->num_workers; index++)
+    uv_thread_join(&adb->workers[index].thread);
+}
+
+static void async_interrupt(AsyncDB * adb)
+{
+  int index;
+  
+  uv_mutex_lock(&adb->mutex);
+  if (!adb->closing)
+    for (index = 0; index < adb->num_workers; index++)
+      sqlite3_interrupt(adb->workers[index].sqlite3);
+  uv_mutex_unlock(&adb->mutex);
+}
+
+static void async_queue(AsyncDB * adb, AsyncJob * job)
+{
+  uv_mutex_lock(&adb->mutex);
+  if (adb->last_job)
+    adb->last_job->next = job;
+  else
+    adb->jobs = job;
+  adb->last_job = job;
+  uv_cond_broadcast(&adb->cond);
+  uv_mutex_unlock(&adb->mutex);
+}
+
+static void async_push_value(lua_State * L, AsyncValue * value)
+{
+  switch (value->type)
+  {
+    case SQLITE_INTEGER:	lua_pushinteger(L, (lua_Integer) value->v.i); break;
+    case SQLITE_FLOAT:		lua_pushnumber(L, value->v.d); break;
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:		lua_pushlstring(L, value->v.s, value->size); break;
+    default:			lua_pushnil(L); break;
+  }
+}
+
+static void async_push_rows(lua_State * L, AsyncResult * result)
+{
+  AsyncJob * job	= result->job;
+  AsyncValue * value	= result->values;
+  int row, column;
+  
+  lua_createtable(L, result->num_rows, 0);
+  for (row = 1; row <= result->num_rows; row++)
+  {
+    lua_createtable(L, 0, job->num_columns);
+    for (column = 0; column < job->num_columns; column++, value++)
+    {
+      if (value->type == SQLITE_NULL)
+        continue;
+      async_push_value(L, value);
+      lua_setfield(L, -2, job->names[column]);
+    }
+    lua_rawseti(L, -2, row);
+  }
+}
+
+static AsyncResult * async_pop_result(AsyncDB * adb)
+{
+  AsyncResult * result;
+  
+  uv_mutex_lock(&adb->mutex);
+  result = adb->results;
+  if (result)
+  {
+    adb->results = result->next;
+    if (!adb->results)
+      adb->last_result = 0;
+    result->job->batches--;
+    uv_cond_broadcast(&adb->cond);
+  }
+  uv_mutex_unlock(&adb->mutex);
+  
+  return result;
+}
+
+static void async_idle(lua_State * L, AsyncDB * adb)
+{
+  if (--adb->pending == 0)
+  {
+    uv_unref((uv_handle_t *) &adb->async);
+    luaL_unref(L, LUA_REGISTRYINDEX, adb->self_ref);
+    adb->self_ref = LUA_NOREF;
+  }
+}
+
+/* Pushes the arguments of the callback of a result, returns their number */
+static int async_push_result(lua_State * L, AsyncResult * result)
+{
+  if (result->error)
+  {
+    lua_pushstring(L, result->error);
+    return 1;
+  }
+  
+  lua_pushnil(L);
+  switch (result->job->type)
+  {
+    case ASYNC_RUN:
+      lua_pushinteger(L, result->changes);
+      lua_pushinteger(L, (lua_Integer) result->last_insert_rowid);
+      return 3;
+      
+    case ASYNC_QUERY:
+      async_push_rows(L, result);
+      lua_pushboolean(L, result->done);
+      return 3;
+  }
+  
+  return 1;
+}
+
+static void async_cb(uv_async_t * handle)
+{
+  AsyncDB * adb		= (AsyncDB *) handle;
+  lua_State * L		= luv_state(handle->loop);
+  AsyncResult * result;
+  
+  while ((result = async_pop_result(adb)))
+  {
+    AsyncJob * job	= result->job;
+    int done		= result->done;
+    int closed		= done && (job->type == ASYNC_CLOSE);
+    int top		= lua_gettop(L);
+    int nargs;
+    
+    lua_rawgeti(L, LUA_REGISTRYINDEX, job->callback_ref);
+    nargs = async_push_result(L, result);
+    async_free_result(result);
+    
+    if (done)
+    {
+      luaL_unref(L, LUA_REGISTRYINDEX, job->callback_ref);
+      async_free_job(job);
+      
+      if (closed)
+      {
+        async_join(adb);
+        *adb->owner = 0;
+        uv_close((uv_handle_t *) handle, async_close_cb);
+      }
+      async_idle(L, adb);
+    }
+    
+    if (!lua_isfunction(L, top + 1))
+      lua_settop(L, top);
+    else if (lua_pcall(L, nargs, 0, 0))
+    {
+      /* Errors reach the caller of the loop like the ones of request
+         callbacks, the remaining results go out on the next iteration */
+      if (!closed)
+        uv_async_send(handle);
+      lua_error(L);
+    }
+    
+    if (closed)
+      break;
+  }
+}
+
+/* Stops the threads of a connection which is not referenced any more. This
+   only happens without pending jobs, or when the Lua state is closed */
+static void async_shutdown(AsyncDB * adb)
+{
+  AsyncJob * job;
+  AsyncResult * result;
+  
+  /* The queued jobs are not run, the running ones are interrupted */
+  async_interrupt(adb);
+  uv_mutex_lock(&adb->mutex);
+  adb->shutdown = 1;
+  uv_cond_broadcast(&adb->cond);
+  uv_mutex_unlock(&adb->mutex);
+  
+  async_join(adb);
+  
+  /* The callbacks are dropped with the Lua state, only the memory is freed */
+  while ((job = adb->jobs))
+  {
+    adb->jobs = job->next;
+    async_free_job(job);
+  }
+  while ((result = adb->results))
+  {
+    adb->results = result->next;
+    job = result->done ? result->job : 0;
+    async_free_result(result);
+    if (job == adb->close_job)
+      adb->close_job = 0;
+    if (job)
+      async_free_job(job);
+  }
+  if (adb->close_job)
+    async_free_job(adb->close_job);
+  
+  if (!uv_is_closing((uv_handle_t *) &adb->async))
+    uv_close((uv_handle_t *) &adb->async, async_close_cb);
+}
+
+static int async_copy_value(lua_State * L, int index, AsyncValue * value)
+{
+  switch (lua_type(L, index))
+  {
+    case LUA_TNUMBER:
+      if (lua_isinteger(L, index))
+      {
+        value->type	= SQLITE_INTEGER;
+        value->v.i	= lua_tointeger(L, index);
+      }
+      else
+      {
+        value->type	= SQLITE_FLOAT;
+        value->v.d	= lua_tonumber(L, index);
+      }
+      return 1;
+      
+    case LUA_TBOOLEAN:
+      value->type	= SQLITE_INTEGER;
+      value->v.i	= lua_toboolean(L, index);
+      return 1;
+      
+    case LUA_TSTRING:
+    {
+      size_t size;
+      const char * str	= lua_tolstring(L, index, &size);
+      value->type	= SQLITE_TEXT;
+      value->size	= (int) size;
+      value->v.s	= malloc(size + 1);
+      if (!value->v.s)
+        return 0;
+      memcpy(value->v.s, str, size + 1);
+      return 1;
+    }
+    
+    case LUA_TLIGHTUSERDATA:	/* cjson.null */
+      if (lua_touserdata(L, index) == NULL)
+      {
+        value->type = SQLITE_NULL;
+        return 1;
+      }
+  }
+  
+  value->type = SQLITE_NULL;
+  return 0;
+}
+
+/* Creates a job for the sql at 2, the parameters at `params` (or 0) and
+   the callback at the top of the stack */
+static AsyncJob * async_new_job(lua_State * L, int type, int params)
+{
+  const char * sql	= luaL_checkstring(L, 2);
+  AsyncJob * job	= calloc(1, sizeof(AsyncJob));
+  
+  if (!job)
+    luaL_error(L, "out of memory");
+  
+  job->type		= type;
+  job->callback_ref	= LUA_NOREF;
+  job->sql		= async_strdup(sql);
+  if (!job->sql)
+    goto out_of_memory;
+  
+  if (params && !lua_isnil(L, params))
+  {
+    int count = 0, capacity = 0;
+    
+    if (!lua_istable(L, params))
+    {
+      async_free_job(job);
+      luaL_typerror(L, params, "table");
+    }
+    
+    lua_pushnil(L);
+    while (lua_next(L, params))
+    {
+      AsyncParam * param;
+      
+      if (count == capacity)
+      {
+        AsyncParam * items;
+        capacity = capacity ? capacity * 2 : 8;
+        items = realloc(job->params, capacity * sizeof(AsyncParam));
+        if (!items)
+        {
+          lua_pop(L, 2);
+          goto out_of_memory;
+        }
+        job->params = items;
+      }
+      
+      param = &job->params[count];
+      memset(param, 0, sizeof(AsyncParam));
+      job->num_params = ++count;
+      
+      if (lua_type(L, -2) == LUA_TSTRING)
+      {
+        /* Room for the prefix which is chosen by async_bind() */
+        size_t size;
+        const char * name = lua_tolstring(L, -2, &size);
+        param->name = malloc(size + 2);
+        if (!param->name)
+        {
+          lua_pop(L, 2);
+          goto out_of_memory;
+        }
+        param->name[0] = ' ';
+        memcpy(param->name + 1, name, size + 1);
+      }
+      else if (lua_isinteger(L, -2))
+        param->index = (int) lua_tointeger(L, -2);
+      else
+      {
+        lua_pop(L, 2);
+        async_free_job(job);
+        luaL_error(L, "invalid parameter key");
+      }
+      
+      if (!async_copy_value(L, -1, &param->value))
+      {
+        const char * name = luaL_typename(L, -1);
+        lua_pop(L, 2);
+        async_free_job(job);
+        luaL_error(L, "cannot bind a %s value", name);
+      }
+      
+      lua_pop(L, 1);
+    }
+  }
+  
+  return job;
+  
+out_of_memory:
+  async_free_job(job);
+  luaL_error(L, "out of memory");
+  return 0;
+}
+
+static int async_submit(lua_State * L, AsyncDB * adb, AsyncJob * job)
+{
+  if (!lua_isfunction(L, -1) && job->type != ASYNC_CLOSE)
+  {
+    async_free_job(job);
+    return luaL_error(L, "callback expected as the last argument");
+  }
+  
+  lua_pushvalue(L, -1);
+  job->callback_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  
+  /* The connection at 1 is not collected while it has pending jobs */
+  if (adb->pending++ == 0)
+  {
+    lua_pushvalue(L, 1);
+    adb->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    uv_ref((uv_handle_t *) &adb->async);
+  }
+  
+  if (job->type == ASYNC_CLOSE)
+    adb->closing = 1;
+  
+  async_queue(adb, job);
+  return 0;
+}
+
+static int async_exec(lua_State * L, AsyncDB * adb)
+{
+  return async_submit(L, adb, async_new_job(L, ASYNC_EXEC, 0));
+}
+
+static int async_run(lua_State * L, AsyncDB * adb)
+{
+  return async_submit(L, adb, async_new_job(L, ASYNC_RUN, lua_gettop(L) > 3 ? 3 : 0));
+}
+
+static int async_query(lua_State * L, AsyncDB * adb)
+{
+  int top		= lua_gettop(L);
+  AsyncJob * job	= async_new_job(L, ASYNC_QUERY, top > 3 ? 3 : 0);
+  
+  if (top > 4 && !lua_isnil(L, 4))
+  {
+    if (!lua_isinteger(L, 4) || lua_tointeger(L, 4) < 1)
+    {
+      async_free_job(job);
+      luaL_argerror(L, 4, "batch size must be a positive integer");
+    }
+    job->batch_size = (int) lua_tointeger(L, 4);
+  }
+  
+  return async_submit(L, adb, job);
+}
+
+/* The jobs queued before are run first, the callback is at the top */
+static int async_close(lua_State * L, AsyncDB * adb)
+{
+  AsyncJob * job = calloc(1, sizeof(AsyncJob));
+  
+  if (!job)
+    return luaL_error(L, "out of memory");
+  
+  job->type = ASYNC_CLOSE;
+  return async_submit(L, adb, job);
+}
+
+static AsyncDB * async_new(uv_loop_t * loop, sqlite3 ** connections, int count, AsyncDB ** owner)
+{
+  AsyncDB * adb = calloc(1, sizeof(AsyncDB));
+  int index, error = 0;
+  
+  if (adb)
+    adb->workers = calloc(count, sizeof(AsyncWorker));
+  if (!adb || !adb->workers)
+  {
+    for (index = 0; index < count; index++)
+      sqlite3_close(connections[index]);
+    free(adb);
+    return 0;
+  }
+  
+  adb->num_workers	= count;
+  adb->owner		= owner;
+  adb->self_ref		= LUA_NOREF;
+  uv_mutex_init(&adb->mutex);
+  uv_cond_init(&adb->cond);
+  uv_async_init(loop, &adb->async, async_cb);
+  adb->async.data = 0;
+  uv_unref((uv_handle_t *) &adb->async);
+  
+  for (index = 0; index < count; index++)
+  {
+    adb->workers[index].adb	= adb;
+    adb->workers[index].sqlite3	= connections[index];
+  }
+  
+  /* A thread closes its connection when it stops */
+  for (index = 0; index < count && !error; index++)
+  {
+    error = uv_thread_create(&adb->workers[index].thread, async_thread, &adb->workers[index]);
+    if (!error)
+      adb->running++;
+  }
+  
+  if (error)
+  {
+    int started = adb->running;
+    
+    adb->shutdown = 1;
+    uv_cond_broadcast(&adb->cond);
+    for (index = 0; index < started; index++)
+      uv_thread_join(&adb->workers[index].thread);
+    for (index = started; index < count; index++)
+      sqlite3_close(connections[index]);
+    
+    uv_close((uv_handle_t *) &adb->async, async_close_cb);
+    return 0;
+  }
+  
+  *owner = adb;
+  return adb;
+}
+
+static uv_loop_t * async_loop(lua_State * L)
+{
+  uv_loop_t * loop = luv_loop(L);
+  
+  if (!sqlite3_threadsafe())
+    luaL_error(L, "sqlite3 is built without thread support");
+  
+  if (!loop)
+  {
+    /* The event loop is created by the `uv` module */
+    lua_getglobal(L, "require");
+    lua_pushstring(L, "uv");
+    lua_call(L, 1, 0);
+    loop = luv_loop(L);
+  }
+  
+  return loop;
+}
+
+/* Each connection is used by one thread at a time, the mutex of sqlite is not needed */
+static int async_open(lua_State * L, const char * filename, int flags, sqlite3 ** db)
+{
+  int error = sqlite3_open_v2(filename, db, flags | SQLITE_OPEN_NOMUTEX, 0);
+  
+  if (error != SQLITE_OK)
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, *db ? sqlite3_errmsg(*db) : "out of memory");
+    sqlite3_close(*db);
+    *db = 0;
+  }
+  return error;
+}
+
+
+/*
+ * Connections
+ */
+
+static AsyncDB * async_check(lua_State * L)
+{
+  AsyncHandle * handle = luaL_checkudata(L, 1, ASYNC_DB_META);
+  if (!handle->adb || handle->adb->closing)
+    luaL_error(L, "database is closed");
+  return handle->adb;
+}
+
+FUNC( l_async_exec )
+{
+  return async_exec(L, async_check(L));
+}
+
+FUNC( l_async_run )
+{
+  return async_run(L, async_check(L));
+}
+
+FUNC( l_async_query )
+{
+  return async_query(L, async_check(L));
+}
+
+FUNC( l_async_interrupt )
+{
+  async_interrupt(async_check(L));
+  return 0;
+}
+
+FUNC( l_async_close )
+{
+  AsyncDB * adb = async_check(L);
+  lua_settop(L, 2);
+  return async_close(L, adb);
+}
+
+FUNC( l_async_gc )
+{
+  AsyncHandle * handle = luaL_checkudata(L, 1, ASYNC_DB_META);
+  
+  if (handle->adb)
+  {
+    async_shutdown(handle->adb);
+    handle->adb = 0;
+  }
+  return 0;
+}
+
+FUNC( l_async_tostring )
+{
+  AsyncHandle * handle = luaL_checkudata(L, 1, ASYNC_DB_META);
+  lua_pushfstring(L, "sqlite3 async connection: %p%s", handle,
+    (handle->adb && !handle->adb->closing) ? "" : " (closed)");
+  return 1;
+}
+
+static const luaL_Reg async_methods[] = {
+  { "exec",		l_async_exec },
+  { "run",		l_async_run },
+  { "query",		l_async_query },
+  { "interrupt",	l_async_interrupt },
+  { "close",		l_async_close },
+  { 0, 0 }
+};
+
+FUNC( l_sqlite3_open_async )
+{
+  const char * filename	= checkstr(L, 1);
+  uv_loop_t * loop	= async_loop(L);
+  sqlite3 * sqlite3	= 0;
+  AsyncHandle * handle;
+  
+  if (async_open(L, filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, &sqlite3) != SQLITE_OK)
+    return 2;
+  
+  handle = lua_newuserdata(L, sizeof(AsyncHandle));
+  handle->adb = 0;
+  if (luaL_newmetatable(L, ASYNC_DB_META))
+  {
+    luaL_newlib(L, async_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_async_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, l_async_tostring);
+    lua_setfield(L, -2, "__tostring");
+  }
+  lua_setmetatable(L, -2);
+  
+  if (!async_new(loop, &sqlite3, 1, &handle->adb))
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, "cannot start the thread of the connection");
+    return 2;
+  }
+  
+  return 1;
+}
+
+
+/*
+ * Connection pools
+ */
+
+static AsyncPool * pool_check(lua_State * L)
+{
+  AsyncPool * pool = luaL_checkudata(L, 1, ASYNC_POOL_META);
+  if (pool->closing || !pool->writer || !pool->readers)
+    luaL_error(L, "database is closed");
+  return pool;
+}
+
+FUNC( l_pool_exec )
+{
+  return async_exec(L, pool_check(L)->writer);
+}
+
+FUNC( l_pool_run )
+{
+  return async_run(L, pool_check(L)->writer);
+}
+
+FUNC( l_pool_query )
+{
+  return async_query(L, pool_check(L)->readers);
+}
+
+FUNC( l_pool_interrupt )
+{
+  AsyncPool * pool = pool_check(L);
+  async_interrupt(pool->readers);
+  async_interrupt(pool->writer);
+  return 0;
+}
+
+FUNC( l_pool_stats )
+{
+  AsyncPool * pool = luaL_checkudata(L, 1, ASYNC_POOL_META);
+  AsyncDB * writer = pool->writer;
+  
+  lua_createtable(L, 0, 3);
+  lua_pushinteger(L, pool->readers ? pool->readers->num_workers : 0);
+  lua_setfield(L, -2, "readers");
+  
+  if (writer)
+  {
+    uv_mutex_lock(&writer->mutex);
+    lua_pushinteger(L, writer->writes);
+    lua_setfield(L, -2, "writes");
+    lua_pushinteger(L, writer->transactions);
+    lua_setfield(L, -2, "transactions");
+    uv_mutex_unlock(&writer->mutex);
+  }
+  return 1;
+}
+
+/* Called when the readers are closed: closes the writer, which checkpoints
+   the WAL file as the last connection */
+static int pool_close_writer(lua_State * L)
+{
+  AsyncPool * pool = lua_touserdata(L, lua_upvalueindex(1));
+  
+  lua_settop(L, 0);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_pushvalue(L, lua_upvalueindex(2));
+  return async_close(L, pool->writer);
+}
+
+FUNC( l_pool_close )
+{
+  AsyncPool * pool = pool_check(L);
+  
+  lua_settop(L, 2);
+  pool->closing = 1;
+  
+  /* The readers are closed first, then the writer with the callback */
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 2);
+  lua_pushcclosure(L, pool_close_writer, 2);
+  return async_close(L, pool->readers);
+}
+
+FUNC( l_pool_gc )
+{
+  AsyncPool * pool = luaL_checkudata(L, 1, ASYNC_POOL_META);
+  
+  if (pool->readers)
+    async_shutdown(pool->readers);
+  if (pool->writer)
+    async_shutdown(pool->writer);
+  pool->readers = pool->writer = 0;
+  return 0;
+}
+
+FUNC( l_pool_tostring )
+{
+  AsyncPool * pool = luaL_checkudata(L, 1, ASYNC_POOL_META);
+  lua_pushfstring(L, "sqlite3 connection pool: %p%s", pool,
+    (pool->writer && !pool->closing) ? "" : " (closed)");
+  return 1;
+}
+
+static const luaL_Reg pool_methods[] = {
+  { "exec",		l_pool_exec },
+  { "run",		l_pool_run },
+  { "query",		l_pool_query },
+  { "interrupt",	l_pool_interrupt },
+  { "stats",		l_pool_stats },
+  { "close",		l_pool_close },
+  { 0, 0 }
+};
+
+static int pool_option(lua_State * L, const char * name, int value)
+{
+  if (lua_istable(L, 2))
+  {
+    lua_getfield(L, 2, name);
+    if (!lua_isnil(L, -1))
+    {
+      if (!lua_isinteger(L, -1) || lua_tointeger(L, -1) < 1)
+        luaL_error(L, "option %s must be a positive integer", name);
+      value = (int) lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+  return value;
+}
+
+/* Enables WAL mode, which works only for files */
+static int pool_init_writer(sqlite3 * db, int busy_timeout)
+{
+  sqlite3_stmt * stmt = 0;
+  int error = sqlite3_prepare_v2(db, "PRAGMA journal_mode=WAL", -1, &stmt, 0);
+  
+  if (error == SQLITE_OK)
+  {
+    error = sqlite3_step(stmt);
+    if (error == SQLITE_ROW)
+      error = sqlite3_stricmp((const char *) sqlite3_column_text(stmt, 0), "wal") ? SQLITE_MISUSE : SQLITE_OK;
+    sqlite3_finalize(stmt);
+  }
+  
+  /* Durable in WAL mode, only a power loss may undo the last commits */
+  if (error == SQLITE_OK)
+    error = sqlite3_exec(db, "PRAGMA synchronous=NORMAL", 0, 0, 0);
+  
+  sqlite3_busy_timeout(db, busy_timeout);
+  return error;
+}
+
+FUNC( l_sqlite3_open_pool )
+{
+  const char * filename	= checkstr(L, 1);
+  uv_loop_t * loop	= async_loop(L);
+  int num_readers	= pool_option(L, "readers", ASYNC_POOL_READERS);
+  int write_batch	= pool_option(L, "batch", ASYNC_WRITE_BATCH);
+  int busy_timeout	= pool_option(L, "busy_timeout", ASYNC_BUSY_TIMEOUT);
+  sqlite3 * writer	= 0;
+  sqlite3 ** readers;
+  AsyncPool * pool;
+  int index, error;
+  
+  luaL_argcheck(L, num_readers <= 64, 2, "too many readers");
+  
+  /* The writer creates the file and the WAL before the readers open it */
+  if (async_open(L, filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, &writer) != SQLITE_OK)
+    return 2;
+  
+  error = pool_init_writer(writer, busy_timeout);
+  if (error != SQLITE_OK)
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, error == SQLITE_MISUSE ? "WAL mode is not supported by this database" : sqlite3_errmsg(writer));
+    sqlite3_close(writer);
+    return 2;
+  }
+  
+  readers = lua_newuserdata(L, num_readers * sizeof(sqlite3 *));
+  for (index = 0; index < num_readers; index++)
+  {
+    if (async_open(L, filename, SQLITE_OPEN_READONLY, &readers[index]) != SQLITE_OK)
+    {
+      while (index-- > 0)
+        sqlite3_close(readers[index]);
+      sqlite3_close(writer);
+      return 2;
+    }
+    sqlite3_busy_timeout(readers[index], busy_timeout);
+  }
+  
+  pool = lua_newuserdata(L, sizeof(AsyncPool));
+  memset(pool, 0, sizeof(AsyncPool));
+  if (luaL_newmetatable(L, ASYNC_POOL_META))
+  {
+    luaL_newlib(L, pool_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_pool_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, l_pool_tostring);
+    lua_setfield(L, -2, "__tostring");
+  }
+  lua_setmetatable(L, -2);
+  
+  if (!async_new(loop, readers, num_readers, &pool->readers))
+  {
+    sqlite3_close(writer);
+    lua_pushnil(L);
+    lua_pushstring(L, "cannot start the threads of the pool");
+    return 2;
+  }
+  
+  if (!async_new(loop, &writer, 1, &pool->writer))
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, "cannot start the threads of the pool");
+    return 2;	/* The readers are stopped by __gc */
+  }
+  pool->writer->write_batch = write_batch;
+  
+  return 1;
+}
+
+
+typedef struct { char * name; int (*func)(lua_State *); } f_entry;
+typedef struct { char * name; int value; } d_entry;
+
+static void f(lua_State * L, f_entry entries[])
+{
   int index;
   lua_newtable(L);
   for( index=0; entries[index].name; index++)
@@ -1498,6 +3461,10 @@ f_entry api_entries[] = {
   { "bind_parameter_count",	l_sqlite3_bind_parameter_count },
   { "busy_timeout",		l_sqlite3_busy_timeout },
   { "changes",			l_sqlite3_changes },
+  { "cache_clear",		l_sqlite3_cache_clear },
+  { "cache_size",		l_sqlite3_cache_size },
+  { "cache_stats",		l_sqlite3_cache_stats },
+  { "cached",			l_sqlite3_cached },
   { "close",			l_sqlite3_close },
   { "column_blob",		l_sqlite3_column_blob },
   { "column_text",		l_sqlite3_column_text },
@@ -1513,10 +3480,14 @@ f_entry api_entries[] = {
   { "data_count",		l_sqlite3_data_count },
   { "errcode",			l_sqlite3_errcode },
   { "errmsg",			l_sqlite3_errmsg },
+  { "fetch_many",		l_sqlite3_fetch_many },
   { "finalize",			l_sqlite3_finalize },
+  { "insert_many",		l_sqlite3_insert_many },
   { "interrupt",		l_sqlite3_interrupt },
   { "last_insert_rowid",	l_sqlite3_last_insert_rowid },
   { "open",			l_sqlite3_open },
+  { "open_async",		l_sqlite3_open_async },
+  { "open_pool",		l_sqlite3_open_pool },
   { "prepare",			l_sqlite3_prepare },
   { "reset",			l_sqlite3_reset },
   { "step",			l_sqlite3_step },
@@ -1628,6 +3599,14 @@ d_entry auth_entries[] = {
   { 0, 0 }
 };
 
+static void set_api_metatable(lua_State * L, const char * name)
+{
+  luaL_newmetatable(L, name);
+  lua_pushvalue(L, -2);		/* the api table */
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+}
+
 #define lauxh_pushstr2tbl(L, k, v) do{ \
     lua_pushstring(L, k); \
     lua_pushstring(L, v); \
@@ -1639,6 +3618,10 @@ LUALIB_API int luaopen_lsqlite(lua_State * L)
   lua_newtable(L);
 
   f(L, api_entries);
+  
+  /* db:prepare(sql), stmt:step() ... call the api functions */
+  set_api_metatable(L, DB_META);
+  set_api_metatable(L, STMT_META);
   lua_setfield(L, -2, "api");
 
   d(L, error_entries);
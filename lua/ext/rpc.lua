@@ -151,7 +151,9 @@ function exports.server(port, handler, callback)
 
 	local handleRpcRequest = function(handler, request, response)
 		local content = request.body
-		local body = json.parse(content)
+		-- Only `id`, `method` and `params` are read, the rest of the body
+		-- is never decoded
+		local body = json.lazy(content)
 
 		-- bad request
 		if (not body) then
@@ -171,7 +173,8 @@ function exports.server(port, handler, callback)
 		end
 
 		utils.async(function()
-			local status, ret = pcall(method, handler, table.unpack(body.params))
+			local params = json.materialize(body.params)
+			local status, ret = pcall(method, handler, table.unpack(params))
 			if (not status) then
 				response:sendJSON({jsonrpc = 2.0, id = id, error = { 
 					code = -32000, message = ret}})
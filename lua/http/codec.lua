@@ -36,6 +36,15 @@ local format = string.format
 local match  = string.match
 local concat = table.concat
 
+-- Native start line and header serializer, see `http_parser_lua.c`
+local encodeHead = nil
+do
+    local ret, lhttp_parser = pcall(require, 'lhttp_parser')
+    if ret and lhttp_parser.encode_head then
+        encodeHead = lhttp_parser.encode_head
+    end
+end
+
 -------------------------------------------------------------------------------
 -- STATUS_CODES
 
@@ -126,6 +135,21 @@ function exports.encoder()
 
         --console.log('item', item)
 
+        if encodeHead then
+            local reason = nil
+            if item.method then
+                assert(item.path and #item.path > 0, "expected non-empty path")
+            else
+                reason = STATUS_CODES[item.code]
+            end
+
+            head, chunkedEncoding = encodeHead(item, reason)
+
+            -- cotent
+            mode = chunkedEncoding and encodeChunkedContent or encodeRawContent
+            return head
+        end
+
         -- start line
         local version = item.version or 1.1
         if item.method then
@@ -401,78 +425,86 @@ function exports.createDecoder(options, callback)
     return decoder
 end
 
--- lhttp_parser
+--[[
+Same as `createDecoder()`, but the messages are parsed by `lhttp_parser` in
+C. The url and the headers of a message arrive in one call, instead of one
+pattern match per header line in Lua. Returns nil if `lhttp_parser` is not
+available.
+
+@param options {Object} - `type`: 'request' (default), 'response' or 'both'
+@param callback {Function} - `callback(event, error)`, the head table, the
+  body chunks and "" at the end of each message, as `createDecoder()`.
+  Returning true after a head stops the decoder, the bytes after the head
+  are left in `decoder.buffer`.
+--]]
 function exports.createDecoder2(options, callback)
-    local lhttp_parser = require('lhttp_parser')
+    local ret, lhttp_parser = pcall(require, 'lhttp_parser')
+    if not ret then
+        return nil
+    end
 
     local decoder = {}
-    local headers = {}
-    local header_name
     decoder.buffer = ""
 
-    local parser = nil
+    local head = nil -- the head of the paused parser
 
-    local options = {
-        message_begin = function(...) 
-            headers = {} 
-        end,
-
-        message_complete = function(...)
-            
-        end,
-
-        url = function(url) 
-            --console.log('url', url)
-            headers.path = url 
-        end,
+    local events = {
+        headers_complete = function(meta)
+            head = {}
+            for i = 1, #meta do
+                head[i] = meta[i]
+            end
 
-        header_field = function(name) 
-            header_name = name 
-        end,
+            head.path      = meta.url
+            head.method    = meta.method
+            head.code      = meta.status_code
+            head.keepAlive = meta.should_keep_alive
+            head.upgrade   = meta.upgrade
+            head.version   = tonumber(meta.version_major .. "." .. meta.version_minor)
 
-        header_value = function(value) 
-            --console.log('header_value', header_name, value)
-            headers[#headers + 1] = {header_name, value}
+            -- Pause, so the head is emitted when the offset of the data
+            -- after it is known
+            return true
         end,
 
-        body = function(body)
-            --console.log('body', body)
-            callback(body)
+        body = function(chunk)
+            callback(chunk)
         end,
 
-        headers_complete = function(meta) 
-            --console.log('headers_complete', meta)
-
-            headers.method    = meta.method
-            headers.code      = meta.status_code
-            headers.reason    = meta.reason
-            headers.keepAlive = meta.should_keep_alive
-            headers.upgrade   = meta.upgrade
-            headers.version   = meta.version_major .. "." .. meta.version_minor
-
-            callback(headers)
+        message_complete = function()
+            callback("")
         end
     }
 
-    --local decode = exports.decoder()
-    --console.log(options, callback, decode)
-    parser = lhttp_parser.new('both', options)
-    --console.log(parser)
+    local parser = lhttp_parser.new((options and options.type) or 'request',
+        events, { batch_headers = true })
 
-    decoder.decode = function(message)
+    decoder.decode = function(chunk)
         local offset = 0
-        local leftover = #message
+        local length = #chunk
+
+        while offset < length do
+            local parsed, err = parser:execute(chunk, offset, length - offset)
+            offset = offset + parsed
 
-        while (leftover > 0) do
-            local ret = parser:execute(message, offset, leftover)
-            --console.log('message', offset, ret)
+            if err then
+                callback(nil, err)
+                break
+            end
 
-            if (ret <= 0) then
+            if not head then
                 break
             end
 
-            leftover = leftover - ret
-            offset   = offset + ret
+            local event = head
+            head = nil
+
+            -- The paused parser stopped before the last LF of the head
+            decoder.buffer = chunk:sub(offset + 2)
+            if callback(event) then
+                break
+            end
+            decoder.buffer = ""
         end
     end
 
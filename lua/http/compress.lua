@@ -0,0 +1,447 @@
+--[[
+
+Copyright 2016 The Node.lua Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+local uv    = require('uv')
+local miniz = require('miniz')
+
+-- Response compression
+-- ======
+--
+-- An opt-in request handler which compresses the response body with gzip or
+-- deflate when the client accepts it. The body goes through a streaming
+-- deflator as it is written and is sent with chunked transfer encoding.
+-- Small bodies, responses which are already encoded and content types which
+-- are already compressed (images, video, archives, ...) are sent unchanged.
+--
+-- The static file handler (`http/static`) uses the cache of this handler to
+-- keep the compressed files in memory, keyed by their ETag.
+--
+
+local meta = { }
+meta.name        = "lnode/http/compress"
+meta.version     = "1.0.0"
+meta.description = "Response compression for the http server."
+meta.tags        = { "lnode", "http", "gzip", "deflate" }
+
+local exports = { meta = meta }
+
+-- window bits of the miniz deflator for each content coding
+local WINDOW_BITS = { gzip = 31, deflate = 15 }
+
+-------------------------------------------------------------------------------
+-- local functions
+
+--[[
+Returns the content coding to use for the given `Accept-Encoding` header:
+'gzip', 'deflate' or nil for identity. gzip is preferred when both have the
+same quality.
+--]]
+local function _negotiate(header)
+    if type(header) ~= 'string' then
+        return nil
+    end
+
+    local qualities = {}
+    for item in header:gmatch("[^,]+") do
+        local name, params = item:match("^%s*([%w%-%*]+)%s*(.*)$")
+        if name then
+            local q = params:match(";%s*[qQ]%s*=%s*([%d%.]+)")
+            qualities[name:lower()] = tonumber(q) or 1
+        end
+    end
+
+    local best, bestQuality = nil, 0
+    for _, name in ipairs({ 'gzip', 'deflate' }) do
+        local q = qualities[name] or qualities['*'] or 0
+        if q > bestQuality then
+            best, bestQuality = name, q
+        end
+    end
+
+    return best
+end
+
+-- Whether a body of the given Content-Type is worth compressing
+local function _isCompressible(contentType)
+    if type(contentType) ~= 'string' then
+        return false
+    end
+
+    contentType = contentType:lower():match("^%s*([^;%s]+)")
+    if not contentType then
+        return false
+
+    elseif contentType:find("^text/") then
+        return true
+
+    elseif contentType:find("^image/svg") then
+        return true
+    end
+
+    -- only the suffixes, `vnd.openxmlformats-*` documents are zip files
+    return (contentType:find("json$") or contentType:find("javascript$")
+        or contentType:find("[/+]xml$")) and true or false
+end
+
+-- Weak ETag of the compressed representation
+local function _weakETag(etag)
+    if type(etag) == 'string' and not etag:find("^W/") then
+        return 'W/' .. etag
+    end
+
+    return etag
+end
+
+local function _addVary(response)
+    local vary = response.headers['Vary']
+    if not vary then
+        response:setHeader('Vary', 'Accept-Encoding')
+
+    elseif (vary ~= '*') and not vary:lower():find('accept%-encoding') then
+        response:setHeader('Vary', vary .. ', Accept-Encoding')
+    end
+end
+
+-------------------------------------------------------------------------------
+-- CompressCache
+
+-- LRU cache of compressed bodies limited by the total size of the cached
+-- data. `get` with a missing key compresses the data once, concurrent
+-- requests for the same key wait for the same result.
+local CompressCache = {}
+CompressCache.__index = CompressCache
+
+function CompressCache.new(maxSize)
+    local self = setmetatable({}, CompressCache)
+    self.entries = {}
+    self.pending = {}
+    self.size    = 0
+    self.maxSize = maxSize or 8 * 1024 * 1024
+    self.tick    = 0
+    return self
+end
+
+function CompressCache:_evict()
+    while self.size > self.maxSize do
+        local oldestKey, oldest = nil, nil
+        for key, entry in pairs(self.entries) do
+            if (not oldest) or (entry.tick < oldest.tick) then
+                oldestKey, oldest = key, entry
+            end
+        end
+
+        if not oldestKey then
+            break
+        end
+
+        self.entries[oldestKey] = nil
+        self.size = self.size - #oldest.data
+    end
+end
+
+function CompressCache:set(key, data)
+    local entry = self.entries[key]
+    if entry then
+        self.size = self.size - #entry.data
+    end
+
+    self.tick = self.tick + 1
+    self.entries[key] = { data = data, tick = self.tick }
+    self.size = self.size + #data
+    self:_evict()
+end
+
+--[[
+Calls `callback(err, data)` with the compressed data cached for `key`.
+On a miss `load(callback)` is called to read the data, which is then
+compressed on the threadpool with `encoding` at `level`.
+--]]
+function CompressCache:get(key, encoding, level, load, callback)
+    local entry = self.entries[key]
+    if entry then
+        self.tick = self.tick + 1
+        entry.tick = self.tick
+        return callback(nil, entry.data)
+    end
+
+    local waiting = self.pending[key]
+    if waiting then
+        waiting[#waiting + 1] = callback
+        return
+    end
+
+    waiting = { callback }
+    self.pending[key] = waiting
+
+    local _done = function(err, data)
+        self.pending[key] = nil
+        if data and #data <= self.maxSize then
+            self:set(key, data)
+        end
+
+        for _, item in ipairs(waiting) do
+            item(err, data)
+        end
+    end
+
+    load(function(err, data)
+        if err then
+            return _done(err)
+        end
+
+        local ret
+        ret, err = miniz.deflate_async(data, level, WINDOW_BITS[encoding], _done)
+        if not ret then
+            _done(err)
+        end
+    end)
+end
+
+function CompressCache:clear()
+    self.entries = {}
+    self.size = 0
+end
+
+-------------------------------------------------------------------------------
+-- response
+
+--[[
+Replace `write`, `finish` and `sendFile` of the response so the body is
+compressed with `encoding` (or sent unchanged if not worth it). The decision
+is made when the first `threshold` bytes have been written or the response
+finishes, whichever comes first.
+--]]
+local function _wrapResponse(request, response, encoding, options)
+    local write, finish, sendFile = response.write, response.finish, response.sendFile
+    local threshold = options.threshold
+
+    local handle = nil      -- the deflator, false: send unchanged
+    local pending = {}      -- body written before the decision
+    local pendingSize = 0
+
+    local _decide = function(self, size)
+        if handle ~= nil then
+            return
+        end
+
+        handle = false
+        if self.headersSent then
+            return
+        end
+
+        local headers = self.headers
+        local statusCode = self.statusCode
+        if (request.method == 'HEAD') or (statusCode < 200)
+            or (statusCode == 204) or (statusCode == 304) then
+            return
+
+        elseif headers['Content-Encoding'] then
+            return
+
+        elseif not options.filter(headers['Content-Type'], request, self) then
+            return
+        end
+
+        local cacheControl = headers['Cache-Control']
+        if cacheControl and cacheControl:lower():find('no%-transform') then
+            return
+        end
+
+        _addVary(self)
+        if not encoding then
+            return
+        end
+
+        local length = tonumber(headers['Content-Length']) or size
+        if length and length < threshold then
+            return
+        end
+
+        handle = miniz.new_deflator(options.level, WINDOW_BITS[encoding])
+        if not handle then
+            handle = false
+            return
+        end
+
+        self:removeHeader('Content-Length')
+        self:setHeader('Content-Encoding', encoding)
+        if headers['ETag'] then
+            self:setHeader('ETag', _weakETag(headers['ETag']))
+        end
+    end
+
+    local _takePending = function()
+        local data = table.concat(pending)
+        pending, pendingSize = {}, 0
+        return data
+    end
+
+    response.compression = { encoding = encoding, options = options }
+
+    function response:write(chunk, callback)
+        if (handle == nil) and (not self.headersSent) then
+            -- Wait for enough data to know if it is worth compressing
+            if chunk and #chunk > 0 then
+                pending[#pending + 1] = chunk
+                pendingSize = pendingSize + #chunk
+            end
+
+            if pendingSize < threshold then
+                if callback then callback() end
+                return true
+            end
+
+            chunk = nil
+        end
+
+        _decide(self)
+        if pendingSize > 0 then
+            chunk = _takePending() .. (chunk or '')
+        end
+
+        if handle and chunk then
+            chunk = handle:deflate(chunk, 'none')
+            if #chunk == 0 then
+                -- Buffered by the deflator
+                if callback then callback() end
+                return true
+            end
+        end
+
+        return write(self, chunk, callback)
+    end
+
+    function response:finish(chunk)
+        if (handle == nil) or (pendingSize > 0) then
+            chunk = _takePending() .. (chunk or '')
+            _decide(self, #chunk)
+        end
+
+        if handle then
+            local output = handle:deflate(chunk or '', 'finish')
+            handle:close()
+            handle = false
+            chunk = output
+        end
+
+        return finish(self, chunk)
+    end
+
+    -- Send everything compressed so far, so the client can decode all data
+    -- written before. Useful for event streams.
+    function response:flush()
+        _decide(self)
+
+        local data = _takePending()
+        if handle then
+            data = handle:deflate(data, 'sync')
+        end
+
+        if #data > 0 then
+            write(self, data)
+        end
+    end
+
+    -- Files are sent unchanged, see `http/static` for compressed files.
+    -- Once part of the body went through the deflator the rest has to as
+    -- well, so the file is read and written in pieces instead of sendfile.
+    function response:sendFile(fd, offset, length, callback)
+        if handle == nil then
+            handle = false
+        end
+
+        if not handle then
+            if pendingSize > 0 then
+                write(self, _takePending())
+            end
+
+            return sendFile(self, fd, offset, length, callback)
+        end
+
+        callback = callback or function() end
+
+        local _next
+        _next = function(position, remaining)
+            if remaining <= 0 then
+                self:finish()
+                return callback()
+            end
+
+            uv.fs_read(fd, math.min(remaining, 64 * 1024), position, function(err, data)
+                if err or (not data) or (#data == 0) then
+                    err = err or 'Unexpected end of file'
+                    self.socket:destroy(err)
+                    return callback(err)
+                end
+
+                self:write(data, function()
+                    _next(position + #data, remaining - #data)
+                end)
+            end)
+        end
+
+        _next(offset, length)
+    end
+end
+
+-------------------------------------------------------------------------------
+-- exports
+
+exports.CompressCache  = CompressCache
+exports.negotiate      = _negotiate
+exports.isCompressible = _isCompressible
+exports.weakETag       = _weakETag
+exports.addVary        = _addVary
+
+--[[
+Create a request handler `function(request, response, next)` which enables
+compression of the response and then calls `next()`.
+
+options:
+- level     {Number} compression level 0 ~ 9, default 6
+- threshold {Number} bodies smaller than this are not compressed, default 1024
+- filter    {Function} `filter(contentType, request, response)` returns true
+  if the body should be compressed, default `isCompressible(contentType)`
+- cacheSize {Number} max size of the compressed static files kept in memory,
+  default 8MB, larger static files are sent uncompressed
+--]]
+function exports.createHandler(options)
+    options = options or {}
+
+    local settings = {
+        level     = options.level or 6,
+        threshold = options.threshold or 1024,
+        filter    = options.filter or _isCompressible
+    }
+
+    settings.cache = CompressCache.new(options.cacheSize)
+
+    local handler = function(request, response, next)
+        if not response.compression then
+            local encoding = _negotiate(request.headers['Accept-Encoding'])
+            _wrapResponse(request, response, encoding, settings)
+        end
+
+        if next then
+            return next()
+        end
+    end
+
+    return handler, settings.cache
+end
+
+return exports
@@ -28,8 +28,11 @@ local exports = { meta = meta }
 local net   = require('net')
 local url   = require('url')
 local utils = require('utils')
+local timer = require('timer')
+local uv    = require('uv')
 local codec = require('http/codec')
 
+local Emitter  = require('core').Emitter
 local Writable = require('stream').Writable
 
 exports.STATUS_CODES = codec.STATUS_CODES
@@ -108,6 +111,28 @@ end
 -------------------------------------------------------------------------------
 -- ServerResponse
 
+-- The `Date` header value, formatted once per second by a timer instead of
+-- for every response
+local dateString = nil
+local dateTimer  = nil
+
+local function _getDateString()
+    if not dateTimer then
+        local _update = function()
+            dateString = os.date("!%a, %d %b %Y %H:%M:%S GMT")
+        end
+
+        _update()
+        dateTimer = uv.new_timer()
+        uv.timer_start(dateTimer, 1000, 1000, _update)
+
+        -- The timer must not keep the event loop alive
+        uv.unref(dateTimer)
+    end
+
+    return dateString
+end
+
 local ServerResponse = Writable:extend()
 exports.ServerResponse = ServerResponse
 
@@ -174,7 +199,7 @@ function ServerResponse:flushHeaders()
     end
 
     if not sent_date and self.sendDate then
-        head[#head + 1] = { "Date", os.date("!%a, %d %b %Y %H:%M:%S GMT") }
+        head[#head + 1] = { "Date", _getDateString() }
     end
 
     if self.hasBody and not sent_transfer_encoding and not sent_content_length then
@@ -193,7 +218,8 @@ function ServerResponse:flushHeaders()
                     head[#head + 1] = { "Connection", "close" }
                 end
 
-            elseif statusCode >= 300 then
+            elseif statusCode >= 300 and statusCode ~= 304 then
+                -- a 304 never has a body, the connection can be reused
                 self.keepAlive = false
                 head[#head + 1] = { "Connection", "close" }
 
@@ -209,7 +235,34 @@ function ServerResponse:flushHeaders()
 
     head.code = statusCode
     local h = self.encode(head)
-    self.socket:write(h)
+    self:_send(h)
+end
+
+-- A pipelined response can not be written until the responses before it on
+-- the same connection have finished, until then its output is kept in the
+-- `_queued` list.
+function ServerResponse:_send(data, callback)
+    local queued = self._queued
+    if queued then
+        queued[#queued + 1] = { data, callback }
+        return true
+    end
+
+    return self.socket:write(data, callback)
+end
+
+-- Write the queued output to the socket, the caller corks the socket so 
+-- this goes out with as few writes as possible
+function ServerResponse:_dequeue()
+    local queued = self._queued
+    if not queued then
+        return
+    end
+
+    self._queued = nil
+    for _, item in ipairs(queued) do
+        self.socket:write(item[1], item[2])
+    end
 end
 
 function ServerResponse:write(chunk, callback)
@@ -218,7 +271,7 @@ function ServerResponse:write(chunk, callback)
     end
 
     self:flushHeaders()
-    return self.socket:write(self.encode(chunk), callback)
+    return self:_send(self.encode(chunk), callback)
 end
 
 function ServerResponse:_end()
@@ -230,6 +283,8 @@ function ServerResponse:finish(chunk)
         self.hasBody = true
     end
 
+    self.finished = true
+
     self:flushHeaders()
     local last = ""
     if chunk then
@@ -244,8 +299,8 @@ function ServerResponse:finish(chunk)
         end
     end
     
-    if #last > 0 then
-        self.socket:write(last, function()
+    if (#last > 0) or self._queued then
+        self:_send(last, function()
             _maybeClose()
         end )
     else
@@ -253,6 +308,102 @@ function ServerResponse:finish(chunk)
     end
 end
 
+-- The file descriptor of a plain TCP or pipe socket, nil if the data has to
+-- go through the socket object (TLS, Windows, ...)
+local function _getSocketFd(socket)
+    if (not socket._handle) or (socket.meta.__index ~= net.Socket) then
+        return nil
+
+    elseif os.platform() == 'win32' then
+        return nil
+    end
+
+    local fd = uv.fileno(socket._handle)
+    return (type(fd) == 'number') and fd or nil
+end
+
+--[[
+Send `length` bytes of the open file `fd` starting at `offset` as the body 
+and finish the response. The data is copied from the file to the socket by
+`uv.fs_sendfile` on the threadpool, so it never passes through the Lua heap.
+If the socket buffer is full a piece of the file is written normally, the 
+sendfile loop continues once that write completed.
+@param callback {Function} - function(err), called after the last byte
+--]]
+function ServerResponse:sendFile(fd, offset, length, callback)
+    callback = callback or function() end
+    local socket = self.socket
+
+    if not self.headersSent and not self.headers['Content-Length'] then
+        self:setHeader('Content-Length', length)
+    end
+
+    self.hasBody = (length > 0)
+    self:flushHeaders()
+
+    local _onDone = function(err)
+        if err then
+            socket:destroy(err)
+            return callback(err)
+        end
+
+        self:finish()
+        callback()
+    end
+
+    -- Read and write the file in pieces
+    local _writeFile
+    _writeFile = function(position, remaining, next)
+        local size = math.min(remaining, 64 * 1024)
+        uv.fs_read(fd, size, position, function(err, data)
+            if err or (not data) or (#data == 0) then
+                return _onDone(err or 'Unexpected end of file')
+            end
+
+            self:_send(data, function(err)
+                if err then return _onDone(err) end
+                next(position + #data, remaining - #data)
+            end)
+        end)
+    end
+
+    local outFd = (not self._queued) and _getSocketFd(socket)
+    if not outFd then
+        local _next
+        _next = function(position, remaining)
+            if remaining <= 0 then return _onDone() end
+            _writeFile(position, remaining, _next)
+        end
+
+        return _next(offset, length)
+    end
+
+    local _sendfile
+    _sendfile = function(position, remaining)
+        if remaining <= 0 then 
+            return _onDone() 
+        end
+
+        uv.fs_sendfile(outFd, fd, position, remaining, function(err, sent)
+            if err and not tostring(err):find('^EAGAIN') then
+                return _onDone(err)
+
+            elseif err or (sent == 0) then
+                -- The socket is not writable right now
+                return _writeFile(position, remaining, _sendfile)
+            end
+
+            _sendfile(position + sent, remaining - sent)
+        end)
+    end
+
+    -- Wait for the head to be written before the socket is used directly
+    socket:write('', function(err)
+        if err then return callback(err) end
+        _sendfile(offset, length)
+    end)
+end
+
 function ServerResponse:writeHead(newStatusCode, newHeaders)
     if (self.headersSent) then
         print('writeHead', "headers already sent")
@@ -277,6 +428,44 @@ function exports.handleConnection(socket, onRequest)
 
     local decoder = nil
     local request, response
+    local responses = {} -- unfinished responses in request order
+
+    -- Once the first response has been written, the output of the following 
+    -- pipelined responses can be sent. The responses which are already 
+    -- finished are written together with one corked write.
+    local _onResponseFinish = function(finished)
+        for i = 1, #responses do
+            if responses[i] == finished then
+                table.remove(responses, i)
+                break
+            end
+        end
+
+        if not finished.keepAlive then
+            -- The socket is closed after this response
+            responses = {}
+            return
+        end
+
+        socket._httpIdle = (#responses == 0)
+        if socket._httpIdle and socket._httpClosing then
+            socket:_end()
+            return
+        end
+
+        socket:cork()
+        for _, item in ipairs(responses) do
+            if not item._queued then
+                break
+            end
+
+            item:_dequeue()
+            if not item.finished then
+                break
+            end
+        end
+        socket:uncork()
+    end
 
     local _onFlush = function ()
         request:push()
@@ -305,7 +494,18 @@ function exports.handleConnection(socket, onRequest)
 
         -- Create a new response object
         response = ServerResponse:new(socket)
-        response.keepAlive = event.keepAlive
+        response.keepAlive = event.keepAlive and not socket._httpClosing
+
+        local current = response
+        if #responses > 0 then
+            current._queued = {}
+        end
+
+        socket._httpIdle = false
+        responses[#responses + 1] = current
+        current:once('finish', function()
+            _onResponseFinish(current)
+        end)
 
         -- If the request upgrades the protocol then detatch the listeners so http codec is no longer used
         if request.headers.upgrade then
@@ -347,7 +547,7 @@ function exports.handleConnection(socket, onRequest)
     end
 
     -- [[
-    decoder = codec.createDecoder({}, function(event, error)
+    local _onEvent = function(event, error)
         --console.log('event', event, error)
 
         if (error) then
@@ -359,13 +559,18 @@ function exports.handleConnection(socket, onRequest)
         elseif request and type(event) == "string" then
             return _onContentData(event)
         end
-    end)
+    end
+
+    -- The requests are parsed in C by lhttp_parser if it is available
+    decoder = codec.createDecoder2({ type = 'request' }, _onEvent)
+        or codec.createDecoder({}, _onEvent)
 
     local _onData = function (chunk)
         decoder.decode(chunk)
     end
     --]]
 
+    socket._httpIdle = true
     socket:once('timeout', _onTimeout)
     
     -- set socket timeout
@@ -376,12 +581,254 @@ function exports.handleConnection(socket, onRequest)
     process:once('exit', _onTimeout)
 end
 
+-- Returns a request handler serving the files under `root`, see `http/static`
+function exports.static(root, options)
+    return require('http/static').createHandler(root, options)
+end
+
+-- Returns a request handler which compresses the responses, see `http/compress`
+function exports.compress(options)
+    return require('http/compress').createHandler(options)
+end
+
 function exports.createServer(onRequest)
-    return net.createServer(function(socket)
+    local connections = {}
+
+    local server = net.createServer(function(socket)
+        connections[socket] = true
+        socket:once('close', function()
+            connections[socket] = nil
+        end)
+
         return exports.handleConnection(socket, onRequest)
     end)
+
+    -- Close idle keep-alive connections together with the server, busy 
+    -- connections are closed after the current response.
+    server:on('close', function()
+        for socket in pairs(connections) do
+            if socket._httpIdle then
+                socket:destroy()
+            else
+                socket._httpClosing = true
+            end
+        end
+    end)
+
+    return server
 end
 
+-------------------------------------------------------------------------------
+-- Agent
+
+-- An Agent keeps the keep-alive sockets of finished requests in per-host
+-- pools and hands them to later requests to the same host, so these skip the
+-- DNS lookup and TCP handshake. Requests beyond `maxSockets` per host wait in
+-- a queue until a socket is released.
+local Agent = Emitter:extend()
+exports.Agent = Agent
+
+local function _listAdd(lists, name, item)
+    local list = lists[name]
+    if not list then
+        list = {}
+        lists[name] = list
+    end
+
+    list[#list + 1] = item
+end
+
+local function _listRemove(lists, name, item)
+    local list = lists[name]
+    if not list then
+        return
+    end
+
+    for i = #list, 1, -1 do
+        if list[i] == item then
+            table.remove(list, i)
+        end
+    end
+
+    if #list == 0 then
+        lists[name] = nil
+    end
+end
+
+--[[
+options:
+- keepAlive      {Boolean} keep sockets around for reuse, default true
+- maxSockets     {Number} max sockets in use per host, default 16
+- maxFreeSockets {Number} max idle sockets kept per host, default 4
+- idleTimeout    {Number} close idle sockets after this many ms, default 5000
+--]]
+function Agent:initialize(options)
+    options = options or {}
+
+    self.keepAlive      = options.keepAlive ~= false
+    self.maxSockets     = options.maxSockets or 16
+    self.maxFreeSockets = options.maxFreeSockets or 4
+    self.idleTimeout    = options.idleTimeout or 5000
+
+    self.sockets        = {} -- name: sockets in use
+    self.freeSockets    = {} -- name: idle sockets
+    self.requests       = {} -- name: requests waiting for a socket
+end
+
+function Agent:getName(options)
+    return tostring(options.host or '') .. ':' .. tostring(options.port or '')
+end
+
+function Agent:addRequest(request)
+    local name = self:getName(request)
+
+    -- Reuse an idle socket, skipping the ones closed by the server which
+    -- have not emitted 'close' yet
+    local free = self.freeSockets[name]
+    while free do
+        local socket = table.remove(free)
+        if #free == 0 then
+            self.freeSockets[name] = nil
+            free = nil
+        end
+
+        if not socket.destroyed then
+            self:_activateSocket(socket, name)
+            request:onSocket(socket, true)
+            return
+        end
+    end
+
+    -- Open a new socket
+    local sockets = self.sockets[name]
+    if (not sockets) or (#sockets < self.maxSockets) then
+        request:onSocket(self:createConnection(request, name), false)
+        return
+    end
+
+    -- Wait for a socket to be released
+    _listAdd(self.requests, name, request)
+end
+
+function Agent:createConnection(options, name)
+    local socket = net.createConnection(options.port, options.host)
+    socket._agentName = name
+    self:_activateSocket(socket, name)
+
+    socket:on('close', function()
+        self:removeSocket(socket)
+    end)
+
+    -- Errors of idle sockets have no request to report to
+    socket:on('error', function()
+        self:removeSocket(socket)
+    end)
+
+    return socket
+end
+
+function Agent:_activateSocket(socket, name)
+    if socket._agentTimer then
+        timer.clearTimeout(socket._agentTimer)
+        socket._agentTimer = nil
+    end
+
+    if socket._agentOnData then
+        socket:removeListener('data', socket._agentOnData)
+        socket._agentOnData = nil
+    end
+
+    if socket._handle then
+        uv.ref(socket._handle)
+    end
+
+    _listAdd(self.sockets, name, socket)
+end
+
+-- Called by a request after its response has been read completely and the
+-- connection can be used again.
+function Agent:releaseSocket(socket)
+    local name = socket._agentName
+    _listRemove(self.sockets, name, socket)
+
+    if socket.destroyed then
+        return self:removeSocket(socket)
+    end
+
+    -- Hand over to the next queued request
+    local queue = self.requests[name]
+    if queue then
+        local request = table.remove(queue, 1)
+        if #queue == 0 then
+            self.requests[name] = nil
+        end
+
+        self:_activateSocket(socket, name)
+        request:onSocket(socket, true)
+        return
+    end
+
+    local free = self.freeSockets[name]
+    if (not self.keepAlive) or (free and #free >= self.maxFreeSockets) then
+        socket:destroy()
+        return
+    end
+
+    _listAdd(self.freeSockets, name, socket)
+
+    -- Idle sockets must not keep the event loop alive
+    uv.unref(socket._handle)
+
+    socket._agentTimer = timer.setTimeout(self.idleTimeout, function()
+        socket._agentTimer = nil
+        socket:destroy()
+    end)
+    uv.unref(socket._agentTimer)
+
+    -- The server is not supposed to send anything on an idle connection
+    socket._agentOnData = function()
+        socket:destroy()
+    end
+    socket:on('data', socket._agentOnData)
+end
+
+function Agent:removeSocket(socket)
+    local name = socket._agentName
+    if socket._agentTimer then
+        timer.clearTimeout(socket._agentTimer)
+        socket._agentTimer = nil
+    end
+
+    _listRemove(self.sockets, name, socket)
+    _listRemove(self.freeSockets, name, socket)
+
+    -- A slot is available for the next queued request
+    local queue = self.requests[name]
+    local sockets = self.sockets[name]
+    if queue and ((not sockets) or (#sockets < self.maxSockets)) then
+        local request = table.remove(queue, 1)
+        if #queue == 0 then
+            self.requests[name] = nil
+        end
+
+        request:onSocket(self:createConnection(request, name), false)
+    end
+end
+
+-- Close all idle sockets
+function Agent:destroy()
+    local freeSockets = self.freeSockets
+    self.freeSockets = {}
+
+    for _, list in pairs(freeSockets) do
+        for _, socket in ipairs(list) do
+            socket:destroy()
+        end
+    end
+end
+
+exports.globalAgent = Agent:new()
+
 -------------------------------------------------------------------------------
 -- ClientRequest
 
@@ -396,6 +843,13 @@ function exports.ClientRequest.getDefaultUserAgent()
     return exports.ClientRequest._defaultUserAgent
 end
 
+--[[
+options:
+- host, port, path, method, headers
+- agent  {Agent|Boolean} the agent used to get a socket, `false` opens a 
+  new connection which is closed after the response, default `globalAgent`
+- socket {Socket} use this socket instead of a new connection
+--]]
 function ClientRequest:initialize(options, callback)
     Writable.initialize(self)
     self:cork()
@@ -448,29 +902,82 @@ function ClientRequest:initialize(options, callback)
     end
 
     self.encode = codec.encoder()
+    self.callback = callback
+
+    -- agent
+    local agent = options.agent
+    if (agent == nil) and (options.socket == nil) then
+        agent = exports.globalAgent
+    end
+    self.agent = agent or nil
+
+    if self.agent then
+        self.agent:addRequest(self)
 
+    else
+        local socket = options.socket or net.createConnection(self.port, self.host)
+        self:onSocket(socket, false, options.connect_emitter)
+    end
+end
+
+-- Attach the request to a socket, `reused` is true if the socket is an 
+-- already connected keep-alive socket of the agent.
+function ClientRequest:onSocket(socket, reused, connect_emitter)
     local decoder = nil
-    local buffer = ''
     local response
+    local _onData, _onEnd
 
     local _onFlush = function ()
         response:push()
         response = nil
     end
 
-    local socket = options.socket or net.createConnection(self.port, self.host)
-    local connect_emitter = options.connect_emitter or 'connect'
+    local _onError = function(...) 
+        self:emit('error', ...) 
+    end
 
     self.socket = socket
-    socket:on('error', function(...) self:emit('error', ...) end)
-    socket:on(connect_emitter, function()
+    self.reusedSocket = reused
+    socket:on('error', _onError)
+
+    local _detach = function()
+        socket:removeListener('data',  _onData)
+        socket:removeListener('end',   _onEnd)
+        socket:removeListener('error', _onError)
+    end
+
+    -- Return the socket to the agent if the connection can be kept alive
+    local _release = function()
+        if (not self.agent) or (not self.keepAlive) or self.upgraded then
+            return false
+        end
+
+        _detach()
+        socket:setTimeout(0)
+        if self._onTimeout then
+            socket:removeListener('timeout', self._onTimeout)
+        end
+
+        self.released = true
+        self.agent:releaseSocket(socket)
+        return true
+    end
+
+    local _onConnect = function()
         self.connected = true
         self:emit('socket', socket)
 
-        local _onEnd = function ()
+        _onEnd = function ()
             -- Just in case the stream ended and we still had an open response,
             -- end it.
-            if response then _onFlush() end
+            if response then
+                _onFlush()
+
+            elseif not self.responded then
+                -- Closed before any response, e.g. a pooled keep-alive
+                -- socket the server had already timed out
+                self:emit('error', 'socket hang up')
+            end
         end
 
         local _onHeadersEnd = function(event) 
@@ -479,10 +986,13 @@ function ClientRequest:initialize(options, callback)
                 if response then _onFlush() end
                 -- Create a new response object
                 response = IncomingMessage:new(event, socket)
+                self.responded = true
+                self.keepAlive = event.keepAlive
                 -- If the request upgrades the protocol then detatch the listeners so http codec is no longer used
                 local is_upgraded
                 if response.headers.upgrade then
                     is_upgraded = true
+                    self.upgraded = true
                     socket:removeListener("data", _onData)
                     socket:removeListener("end",  _onEnd)
                     socket:read(0)
@@ -492,8 +1002,8 @@ function ClientRequest:initialize(options, callback)
                     end
                 end
                 -- Call the user callback to handle the response
-                if callback then
-                    callback(response)
+                if self.callback then
+                    self.callback(response)
                 end
 
                 self:emit('response', response)
@@ -515,7 +1025,10 @@ function ClientRequest:initialize(options, callback)
             if #chunk == 0 then
                 -- Empty string in http-decoder means end of body
                 -- End the response stream and remove the response reference.
+                local released = _release()
                 _onFlush()
+                return released -- break
+
             else
                 -- Forward non-empty body chunks to the response stream.
                 if not response:push(chunk) then
@@ -541,7 +1054,7 @@ function ClientRequest:initialize(options, callback)
             end
         end)
 
-        local _onData = function (chunk)
+        _onData = function (chunk)
             decoder.decode(chunk)
         end
         --]]
@@ -552,8 +1065,24 @@ function ClientRequest:initialize(options, callback)
         if self.ended then
             self:_done(self.ended.data, self.ended.cb)
         end
+    end
 
-    end)
+    if reused then
+        -- Emit 'socket' on the next tick like a fresh connection does, so
+        -- callers can attach their listeners after the request is created
+        process.nextTick(function()
+            if socket.destroyed then
+                -- Closed by the server in the meantime
+                socket:removeListener('error', _onError)
+                self.agent:removeSocket(socket)
+                return self:emit('error', 'socket hang up')
+            end
+
+            _onConnect()
+        end)
+    else
+        socket:once(connect_emitter or 'connect', _onConnect)
+    end
 end
 
 function ClientRequest:flushHeaders()
@@ -593,7 +1122,11 @@ end
 
 function ClientRequest:_setConnection()
     if not self.connection then
-        table.insert(self, { 'connection', 'close' })
+        if self.agent and self.agent.keepAlive then
+            table.insert(self, { 'connection', 'keep-alive' })
+        else
+            table.insert(self, { 'connection', 'close' })
+        end
     end
 end
 
@@ -618,22 +1151,38 @@ function ClientRequest:done(data, callback)
     end
 end
 
+-- The callback listens on the request, the socket only forwards its
+-- 'timeout' event, so the forwarder can be removed when the socket is
+-- returned to the agent without touching other listeners of the socket
 function ClientRequest:setTimeout(msecs, callback)
-    if self.socket then
-        self.socket:setTimeout(msecs, callback)
+    local socket = self.socket
+    if not socket then
+        return
+    end
+
+    if callback then
+        self:once('timeout', callback)
     end
+
+    if not self._onTimeout then
+        self._onTimeout = function()
+            self:emit('timeout')
+        end
+        socket:on('timeout', self._onTimeout)
+    end
+
+    socket:setTimeout(msecs)
 end
 
+-- The socket is not closed if it has been returned to the agent
 function ClientRequest:destroy()
-    if self.socket then
+    if self.socket and not self.released then
         self.socket:destroy()
     end
 end
 
 function ClientRequest:abort()
-    if self.socket then
-        self.socket:destroy()
-    end
+    self:destroy()
 end
 
 -------------------------------------------------------------------------------
@@ -0,0 +1,547 @@
+--[[
+
+Copyright 2016 The Node.lua Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+local uv    = require('uv')
+local path  = require('path')
+
+local compress = require('http/compress')
+
+-- Static file server
+-- ======
+--
+-- Serves the files under a root directory. The file contents are sent with
+-- `ServerResponse:sendFile` (sendfile), stat results and ETags are cached in
+-- memory and dropped when a `fs_event` watcher reports a change. Supports
+-- conditional GET (304) and single byte ranges (206).
+--
+
+local meta = { }
+meta.name        = "lnode/http/static"
+meta.version     = "1.0.0"
+meta.description = "Static file handler for the http server."
+meta.tags        = { "lnode", "http", "static" }
+
+local exports = { meta = meta }
+
+exports.MIME_TYPES = {
+    css  = 'text/css',
+    gif  = 'image/gif',
+    htm  = 'text/html',
+    html = 'text/html',
+    ico  = 'image/x-icon',
+    jpeg = 'image/jpeg',
+    jpg  = 'image/jpeg',
+    js   = 'application/javascript',
+    json = 'application/json',
+    lua  = 'text/plain',
+    m3u8 = 'application/vnd.apple.mpegurl',
+    mp3  = 'audio/mpeg',
+    mp4  = 'video/mp4',
+    pdf  = 'application/pdf',
+    png  = 'image/png',
+    svg  = 'image/svg+xml',
+    ts   = 'video/mp2t',
+    txt  = 'text/plain',
+    wav  = 'audio/wav',
+    webm = 'video/webm',
+    xml  = 'application/xml',
+    zip  = 'application/zip'
+}
+
+local MONTHS = {
+    Jan = 1, Feb = 2, Mar = 3, Apr = 4, May = 5,  Jun = 6,
+    Jul = 7, Aug = 8, Sep = 9, Oct = 10, Nov = 11, Dec = 12
+}
+
+-------------------------------------------------------------------------------
+-- local functions
+
+local function _formatHttpDate(time)
+    return os.date("!%a, %d %b %Y %H:%M:%S GMT", time)
+end
+
+-- Parse a IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT") into seconds since
+-- the epoch, without going through the local time zone
+local function _parseHttpDate(text)
+    if type(text) ~= 'string' then
+        return nil
+    end
+
+    local day, month, year, hour, min, sec =
+        text:match("^%a+, (%d%d) (%a%a%a) (%d%d%d%d) (%d%d):(%d%d):(%d%d) GMT$")
+    month = MONTHS[month]
+    if not month then
+        return nil
+    end
+
+    -- days from civil
+    local y = tonumber(year)
+    local m = month
+    if m <= 2 then y = y - 1 end
+    local era = (y >= 0 and y or y - 399) // 400
+    local yoe = y - era * 400
+    local doy = (153 * (m + (m > 2 and -3 or 9)) + 2) // 5 + tonumber(day) - 1
+    local doe = yoe * 365 + yoe // 4 - yoe // 100 + doy
+    local days = era * 146097 + doe - 719468
+
+    return ((days * 24 + tonumber(hour)) * 60 + tonumber(min)) * 60 + tonumber(sec)
+end
+
+-- Returns start and end (inclusive) of the requested byte range, `false`
+-- if the range can not be satisfied and nil if the whole file should be sent
+local function _parseRange(range, size)
+    if type(range) ~= 'string' then
+        return nil
+    end
+
+    local first, last = range:match("^%s*bytes%s*=%s*(%d*)%s*%-%s*(%d*)%s*$")
+    if (not first) or (first == '' and last == '') then
+        -- Unsupported unit or multiple ranges: send the whole file
+        return nil
+    end
+
+    local startPos, endPos
+    if first == '' then
+        -- suffix range: the last N bytes
+        local suffix = tonumber(last)
+        if suffix == 0 then
+            return false
+        end
+
+        startPos = math.max(size - suffix, 0)
+        endPos   = size - 1
+
+    else
+        startPos = tonumber(first)
+        endPos   = (last == '') and (size - 1) or math.min(tonumber(last), size - 1)
+    end
+
+    if startPos >= size or startPos > endPos then
+        return false
+    end
+
+    return startPos, endPos
+end
+
+local function _etagMatches(header, etag)
+    if header == '*' then
+        return true
+    end
+
+    for item in header:gmatch("[^,]+") do
+        item = item:trim():gsub("^W/", "")
+        if item == etag then
+            return true
+        end
+    end
+
+    return false
+end
+
+-- Read the whole file, used for the files which are sent compressed
+local function _readFile(filename, size, callback)
+    uv.fs_open(filename, 'r', 438, function(err, fd)
+        if err then
+            return callback(err)
+        end
+
+        uv.fs_read(fd, size, 0, function(err, data)
+            uv.fs_close(fd, function() end)
+            if (not err) and (#data ~= size) then
+                err = 'Unexpected end of file'
+            end
+
+            callback(err, data)
+        end)
+    end)
+end
+
+-------------------------------------------------------------------------------
+-- StatCache
+
+-- Cache of stat results and derived headers, each directory containing a
+-- cached file is watched and its entries are removed when it changes.
+local StatCache = {}
+StatCache.__index = StatCache
+
+function StatCache.new(maxEntries)
+    local self = setmetatable({}, StatCache)
+    self.entries    = {}
+    self.count      = 0
+    self.maxEntries = maxEntries or 1000
+    self.watchers   = {}
+    return self
+end
+
+function StatCache:get(filename)
+    return self.entries[filename]
+end
+
+function StatCache:remove(filename)
+    local entry = self.entries[filename]
+    if entry then
+        self.entries[filename] = nil
+        self.count = self.count - 1
+
+        -- An index file is also cached under the name of its directory
+        if entry.directory and (entry.directory ~= filename) then
+            self:remove(entry.directory)
+        end
+    end
+end
+
+function StatCache:clear()
+    self.entries = {}
+    self.count = 0
+end
+
+function StatCache:_watch(dirname)
+    if self.watchers[dirname] ~= nil then
+        return self.watchers[dirname]
+    end
+
+    local _onChange = function(err, name)
+        if err or (not name) then
+            -- Don't know what changed
+            self:clear()
+            return
+        end
+
+        self:remove(path.join(dirname, name))
+    end
+
+    local watcher = uv.new_fs_event()
+    local ok, ret = false, nil
+    if watcher then
+        ok, ret = pcall(uv.fs_event_start, watcher, dirname, {}, _onChange)
+    end
+
+    if (not ok) or (not ret) then
+        -- Without a watcher the entries of this directory are not cached
+        if watcher then uv.close(watcher) end
+        self.watchers[dirname] = false
+        return false
+    end
+
+    -- The watchers must not keep the event loop alive
+    uv.unref(watcher)
+    self.watchers[dirname] = watcher
+    return watcher
+end
+
+function StatCache:set(filename, entry)
+    if not self:_watch(path.dirname(filename)) then
+        return
+    end
+
+    if self.count >= self.maxEntries then
+        self:clear()
+    end
+
+    if not self.entries[filename] then
+        self.count = self.count + 1
+    end
+
+    self.entries[filename] = entry
+end
+
+function StatCache:close()
+    for _, watcher in pairs(self.watchers) do
+        if watcher then
+            uv.close(watcher)
+        end
+    end
+
+    self.watchers = {}
+    self:clear()
+end
+
+-------------------------------------------------------------------------------
+-- exports
+
+exports.parseHttpDate = _parseHttpDate
+exports.parseRange    = _parseRange
+
+--[[
+Create a request handler `function(request, response, next)` which serves
+the files under `root`.
+
+options:
+- index      {String} file served for a directory, default 'index.html'
+- maxAge     {Number} Cache-Control max-age in seconds, default 0
+- maxEntries {Number} max number of cached stat entries, default 1000
+- mimeTypes  {Object} extra extension to Content-Type mappings
+
+If the file does not exist `next()` is called, or a 404 response is sent
+when `next` is nil.
+
+When the response has been prepared by the `http/compress` handler, files
+worth compressing are sent compressed. The compressed data is kept in the
+cache of that handler, keyed by the ETag of the file. Files larger than the
+cacheSize of that handler are sent unchanged with sendfile.
+--]]
+function exports.createHandler(root, options)
+    options = options or {}
+
+    root = path.resolve(root)
+    local index  = options.index or 'index.html'
+    local maxAge = options.maxAge or 0
+    local cache  = StatCache.new(options.maxEntries)
+
+    local mimeTypes = {}
+    for key, value in pairs(exports.MIME_TYPES) do mimeTypes[key] = value end
+    for key, value in pairs(options.mimeTypes or {}) do mimeTypes[key] = value end
+
+    local _sendStatus = function(response, statusCode, headers)
+        response:writeHead(statusCode, headers or {})
+
+        -- the Content-Length of a 304 would describe the file (RFC 7230)
+        if statusCode ~= 304 then
+            response:setHeader('Content-Length', 0)
+        end
+        response:finish()
+    end
+
+    -- stat the file and build its cache entry
+    local _stat
+    _stat = function(filename, callback)
+        local entry = cache:get(filename)
+        if entry then
+            return callback(entry)
+        end
+
+        uv.fs_stat(filename, function(err, stat)
+            if err or (not stat) then
+                return callback(nil)
+
+            elseif stat.type == 'directory' then
+                if filename:sub(-#index) == index then
+                    return callback(nil)
+                end
+
+                local indexname = path.join(filename, index)
+                return _stat(indexname, function(entry)
+                    -- Only while the entry of the index file is cached, so
+                    -- both are removed when the index file changes
+                    if entry and (cache:get(indexname) == entry) then
+                        entry.directory = filename
+                        cache:set(filename, entry)
+                    end
+
+                    callback(entry)
+                end)
+
+            elseif stat.type ~= 'file' then
+                return callback(nil)
+            end
+
+            local mtime = stat.mtime.sec
+            local extname = path.extname(filename):sub(2):lower()
+
+            entry = {
+                filename     = filename,
+                size         = stat.size,
+                mtime        = mtime,
+                etag         = string.format('"%x-%x"', stat.size,
+                                  mtime * 1000 + stat.mtime.nsec // 1000000),
+                lastModified = _formatHttpDate(mtime),
+                contentType  = mimeTypes[extname] or 'application/octet-stream'
+            }
+
+            cache:set(filename, entry)
+            callback(entry)
+        end)
+    end
+
+    local _isNotModified = function(request, entry)
+        local ifNoneMatch = request.headers['If-None-Match']
+        if ifNoneMatch then
+            return _etagMatches(ifNoneMatch, entry.etag)
+        end
+
+        local since = _parseHttpDate(request.headers['If-Modified-Since'])
+        return (since ~= nil) and (entry.mtime <= since)
+    end
+
+    -- The content coding the file is sent with, nil for identity
+    local _getEncoding = function(request, response, entry)
+        local compression = response.compression
+        if not compression then
+            return nil
+        end
+
+        local options = compression.options
+        if not options.filter(entry.contentType, request, response) then
+            return nil
+        end
+
+        compress.addVary(response)
+        if (entry.size < options.threshold) or request.headers['Range'] then
+            return nil
+
+        elseif entry.size > options.cache.maxSize then
+            -- Compressed files are read into memory as a whole
+            return nil
+        end
+
+        return compression.encoding
+    end
+
+    -- The file could not be read after it was stat'ed
+    local _sendError = function(response, next, entry, err)
+        cache:remove(entry.filename)
+        if tostring(err):find('^ENOENT') then
+            if next then return next() end
+            return _sendStatus(response, 404)
+        end
+
+        _sendStatus(response, 500)
+    end
+
+    local _serveCompressed = function(request, response, next, entry, headers, encoding)
+        local compression = response.compression
+        local options = compression.options
+        local key = entry.filename .. '\0' .. entry.etag .. '\0' .. encoding
+
+        local _load = function(callback)
+            _readFile(entry.filename, entry.size, callback)
+        end
+
+        options.cache:get(key, encoding, options.level, _load, function(err, data)
+            if err then
+                return _sendError(response, next, entry, err)
+            end
+
+            headers['Content-Encoding'] = encoding
+            response:writeHead(200, headers)
+            response:setHeader('Content-Length', #data)
+
+            if request.method == 'HEAD' then
+                return response:finish()
+            end
+
+            response:finish(data)
+        end)
+    end
+
+    local _serve = function(request, response, next, entry)
+        local headers = {
+            ['Content-Type']  = entry.contentType,
+            ['ETag']          = entry.etag,
+            ['Last-Modified'] = entry.lastModified,
+            ['Accept-Ranges'] = 'bytes',
+            ['Cache-Control'] = 'public, max-age=' .. maxAge
+        }
+
+        local encoding = _getEncoding(request, response, entry)
+        if encoding then
+            headers['ETag'] = compress.weakETag(entry.etag)
+            headers['Accept-Ranges'] = nil
+        end
+
+        if _isNotModified(request, entry) then
+            headers['Content-Type']  = nil
+            headers['Accept-Ranges'] = nil
+            return _sendStatus(response, 304, headers)
+
+        elseif encoding then
+            return _serveCompressed(request, response, next, entry, headers, encoding)
+        end
+
+        local size = entry.size
+        local startPos, endPos = 0, size - 1
+        local statusCode = 200
+
+        -- If-Range: only use the range if the file has not changed
+        local range = request.headers['Range']
+        local ifRange = request.headers['If-Range']
+        if range and ifRange and (ifRange ~= entry.etag)
+            and (ifRange ~= entry.lastModified) then
+            range = nil
+        end
+
+        if range and (size > 0) then
+            local first, last = _parseRange(range, size)
+            if first == false then
+                headers['Content-Range'] = 'bytes */' .. size
+                return _sendStatus(response, 416, headers)
+
+            elseif first then
+                startPos, endPos = first, last
+                statusCode = 206
+                headers['Content-Range'] = 'bytes ' .. startPos .. '-' .. endPos .. '/' .. size
+            end
+        end
+
+        local length = endPos - startPos + 1
+        if (request.method == 'HEAD') or (length <= 0) then
+            response:writeHead(statusCode, headers)
+            response:setHeader('Content-Length', length)
+            return response:finish()
+        end
+
+        -- Open before the headers are set, so a file removed after the
+        -- stat can still get a 404
+        uv.fs_open(entry.filename, 'r', 438, function(err, fd)
+            if err then
+                return _sendError(response, next, entry, err)
+            end
+
+            response:writeHead(statusCode, headers)
+            response:setHeader('Content-Length', length)
+            response:sendFile(fd, startPos, length, function()
+                uv.fs_close(fd, function() end)
+            end)
+        end)
+    end
+
+    local handler = function(request, response, next)
+        local method = request.method
+        if (method ~= 'GET') and (method ~= 'HEAD') then
+            if next then return next() end
+            return _sendStatus(response, 405, { Allow = 'GET, HEAD' })
+        end
+
+        -- Map the url to a file under root
+        local pathname = (request.url or '/'):match("^[^?#]*")
+        pathname = pathname:gsub('%%(%x%x)', function(h)
+            return string.char(tonumber(h, 16))
+        end)
+
+        if pathname:find('%z') then
+            return _sendStatus(response, 400)
+        end
+
+        local filename = path.join(root, path.normalize('/' .. pathname))
+        if (filename ~= root) and (filename:sub(1, #root + 1) ~= root .. '/') then
+            return _sendStatus(response, 403)
+        end
+
+        _stat(filename, function(entry)
+            if not entry then
+                if next then return next() end
+                return _sendStatus(response, 404)
+            end
+
+            _serve(request, response, next, entry)
+        end)
+    end
+
+    return handler, cache
+end
+
+return exports
@@ -82,20 +82,47 @@ local function bundleSearcher(name)
         return loadfile(filename)
     end
 
+    -- The bundles are mapped into memory and indexed by `miniz.open_bundle`,
+    -- so a lookup is a hash probe and stored files are loaded without a copy
     local bundle_reader = function (filename)
         if (not _G._miniz_readers) then
             _G._miniz_readers = { }
         end
 
         local reader = _G._miniz_readers[filename]
-        if (not reader) then
-            reader = miniz.new_reader(filename)
-            if (reader) then
-                _G._miniz_readers[filename] = reader
-            end    
+        if (reader == nil) then
+            reader = miniz.open_bundle(filename) or false
+            _G._miniz_readers[filename] = reader
         end
 
-        return reader
+        return reader or nil
+    end
+
+    -- Whether the `.luac` files of the bundle can be loaded by this lnode, 
+    -- see `getBytecodeTag` in `lua/zlib.lua`
+    local has_bytecode = function (filename, reader)
+        if (not _G._miniz_bytecode) then
+            _G._miniz_bytecode = { }
+        end
+
+        local ret = _G._miniz_bytecode[filename]
+        if (ret == nil) then
+            local tag = reader:read('.bytecode')
+            if (tag) then
+                local header = string.dump(function() end, true)
+                header = header:sub(1, 17 + header:byte(16) + header:byte(17))
+                header = header:gsub('.', function(c) 
+                    return string.format('%02x', c:byte()) 
+                end)
+
+                ret = (tag:match('^[^\n]*') == header)
+            end
+
+            ret = ret or false
+            _G._miniz_bytecode[filename] = ret
+        end
+
+        return ret
     end
 
     local load_bundle_module = function (filename, name)
@@ -111,24 +138,20 @@ local function bundleSearcher(name)
             return
         end
 
-        local path =  'lib/' .. name .. '.lua'
-        local index, err = reader:locate_file(path)
-        if (not index) then
+        local path = 'lib/' .. name .. '.lua'
+        if (not reader:locate(path)) then
             path = 'lib/' .. name .. '/init.lua'
-            index, err = reader:locate_file(path)
-            if (not index) then
-                return
-            end
         end
 
-        if (reader:is_directory(index)) then
-            return
+        -- Prefer the precompiled script
+        if (has_bytecode(filename, reader)) then
+            local script = reader:load(path .. 'c', '=' .. path, 'b')
+            if (script) then
+                return script
+            end
         end
 
-        local data = reader:extract(index)
-        if (data) then
-             return load(data)
-        end
+        return reader:load(path, '=' .. path)
     end
 
     local load_bundle_file = function (libname, subpath)
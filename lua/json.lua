@@ -54,4 +54,30 @@ exports.encode = exports.stringify
 exports.decode = exports.parse
 exports.null   = cjson.null
 
+-- Streaming decoder: `json.decoder(callback, options)`, see `cjson.decoder`
+exports.decoder = cjson.decoder
+
+-- Encoding without a Lua string of the whole text:
+-- `json.encodeInto(buffer, value)`, see `cjson.encode_into`
+-- `json.encodeToStream(writer, value, chunkSize)`, see `cjson.encode_to_stream`
+exports.encodeInto     = cjson.encode_into
+exports.encodeToStream = cjson.encode_to_stream
+
+-- Lazy documents: objects and arrays are decoded when their fields are
+-- accessed, see `cjson.lazy`. `materialize` converts them to Lua tables.
+exports.lazy = function(data)
+    local status, ret = pcall(cjson.lazy, data)
+    if (status) then
+        return ret
+    end
+
+    return nil, ret
+end
+
+exports.materialize = cjson.materialize
+
+-- Newline delimited JSON, see `cjson.ndjson_decoder` and `cjson.ndjson_encode`
+exports.ndjsonDecoder = cjson.ndjson_decoder
+exports.ndjsonEncode  = cjson.ndjson_encode
+
 return exports
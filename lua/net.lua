@@ -338,6 +338,24 @@ function Socket:_write(data, callback)
     end )
 end
 
+-- Write all buffered chunks (see `cork`) with one `uv.write` call
+function Socket:_writev(entries, callback)
+    if not self._handle then return end
+
+    local chunks = {}
+    for i = 1, #entries do
+        chunks[i] = entries[i].chunk
+    end
+
+    uv.write(self._handle, chunks, function(err)
+        if err then
+            self:destroy(err)
+            return callback(err)
+        end
+        callback()
+    end )
+end
+
 -------------------------------------------------------------------------------
 -- Server
 
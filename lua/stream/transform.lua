@@ -168,7 +168,7 @@ function Transform:initialize(options)
 
     self:once('prefinish', function()
         if type(self._flush) == 'function' then
-            self._flush( function(er)
+            self:_flush( function(er)
                 _done(stream, er)
             end )
 
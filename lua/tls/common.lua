@@ -21,90 +21,60 @@ local Object  = require('core').Object
 local Error   = require('core').Error
 local fs      = require('fs')
 local net     = require('net')
-local path    = require('path')
 local timer   = require('timer')
 local utils   = require('utils')
 local uv      = require('uv')
 
-local _, openssl = pcall(require, 'ssl')
+local tls     = require('lmbedtls.tls')
 
 local exports = {}
-local DEFAULT_CIPHERS = 'ECDHE-RSA-AES128-SHA256:AES128-GCM-SHA256:' .. -- TLS 1.2
-                        'RC4:HIGH:!MD5:!aNULL:!EDH'                     -- TLS 1.0
-exports.DEFAULT_CIPHERS = DEFAULT_CIPHERS
 
--------------------------------------------------------------------------------
-
-local getSecureOptions = function(protocol, flags)
-    local ssl = openssl.ssl
-    return ssl.no_sslv2 | ssl.no_sslv3 | ssl.no_compression | (flags or 0)
-end
+-- CA bundles of the common systems, used when no `ca` option is given
+exports.DEFAULT_CA_FILES = {
+    '/etc/ssl/certs/ca-certificates.crt',   -- Debian, Ubuntu, Buildroot
+    '/etc/pki/tls/certs/ca-bundle.crt',     -- Fedora, RHEL
+    '/etc/ssl/ca-bundle.pem',               -- OpenSUSE
+    '/etc/ssl/cert.pem'                     -- Alpine, macOS
+}
 
--------------------------------------------------------------------------------
-
-if (module) then
-    --local data = module:load("root_ca.dat")
-    local filename = path.join("E:\\newwork\\main\\node.lua\\bin", "root_ca.dat")
-    local data = fs.readFileSync(filename)
-
-    exports.DEFAULT_CA_STORE = openssl.x509.store:new()
-    local index = 1
-    local len = #data
-    while index < len do
-        local len = ((data:byte(index) << 8) | data:byte(index + 1))
-        index = index + 2
-        local cert = assert(openssl.x509.read(data:sub(index, index + len)))
-        index = index + len
-        assert(exports.DEFAULT_CA_STORE:add(cert))
-    end
-end
+local function noop() end
 
 -------------------------------------------------------------------------------
 -- Credential
 
 local Credential = Object:extend()
 
-function Credential:initialize(secureProtocol, defaultCiphers, flags, rejectUnauthorized, context)
+function Credential:initialize(isServer, rejectUnauthorized, context)
     self.rejectUnauthorized = rejectUnauthorized
     if context then
         self.context = context
 
     else
-        self.context = openssl.ssl.ctx_new(secureProtocol or 'TLSv1',
-          defaultCiphers or DEFAULT_CIPHERS)
-        self.context:mode(true, 'release_buffers')
-        self.context:options(getSecureOptions(secureProtocol, flags))
+        self.context = assert(tls.new_config(isServer and 'server' or 'client'))
     end
 end
 
 function Credential:addRootCerts()
-    self.context:cert_store(exports.DEFAULT_CA_STORE)
+    for _, filename in ipairs(exports.DEFAULT_CA_FILES) do
+        if fs.existsSync(filename) and self.context:ca_file(filename) then
+            return true
+        end
+    end
 end
 
---[[
-
-]]
+-- `certs` is a PEM string, which may hold several certificates, or a list
 function Credential:setCA(certs)
-    if not self.store then
-        self.store = openssl.x509.store:new()
-        self.context:cert_store(self.store)
+    if type(certs) ~= 'table' then
+        certs = { certs }
     end
 
-    if type(certs) == 'table' then
-        for _, v in pairs(certs) do
-            local cert = assert(openssl.x509.read(v))
-            assert(self.store:add(cert))
-        end
-    else
-        local cert = assert(openssl.x509.read(certs))
-        assert(self.store:add(cert))
+    for _, cert in pairs(certs) do
+        assert(self.context:ca(cert))
     end
 end
 
-function Credential:setKeyCert(key, cert)
-    key = assert(openssl.pkey.read(key, true))
-    cert = assert(openssl.x509.read(cert))
-    self.context:use(key, cert)
+function Credential:setKeyCert(key, cert, passphrase)
+    assert(self.context:own_cert(cert, key, passphrase))
 end
 
 exports.Credential = Credential
@@ -117,6 +87,33 @@ exports.Credential = Credential
 
 local TLSSocket = net.Socket:extend()
 
+local defaultCredentials
+
+-- Clients without certificates of their own share one config, so the CA
+-- bundle is only parsed once
+local function getCredentials(options)
+    if options.secureContext or options.credentials then
+        return options.secureContext or options.credentials
+
+    elseif options.ca or options.key or options.cert or options.isServer then
+        return exports.createCredentials(options)
+    end
+
+    if not defaultCredentials then
+        defaultCredentials = exports.createCredentials()
+    end
+
+    return defaultCredentials
+end
+
+-- The name checked against the certificate of the server
+local function getServername(options)
+    local host = options.servername or options.host
+    if host and not host:match('^[%d%.]+$') and not host:find(':') then
+        return host
+    end
+end
+
 function TLSSocket:initialize(socket, options)
 
     if socket then
@@ -164,65 +161,45 @@ function TLSSocket:initialize(socket, options)
 end
 
 function TLSSocket:_init()
-    self.ctx = self.options.secureContext or
-               self.options.credentials or
-               exports.createCredentials(self.options)
-    self.inp = openssl.bio.mem(8192)
-    self.out = openssl.bio.mem(8192)
-    self.ssl = self.ctx.context:ssl(self.inp, self.out, self.server)
-
-    if (not self.server) then
-        if self.options.servername then
-            self.ssl:set('hostname',self.options.servername)
-        end
-        if self.ctx.session then
-            self.ssl:session(self.ctx.session)
-        end
-    end
+    self.ctx = getCredentials(self.options)
+
+    local servername = (not self.server) and getServername(self.options) or nil
+    self.ssl = assert(tls.new(self.ctx.context, servername))
 end
 
 -- Returns an object representing the peer's certificate. 
 function TLSSocket:getPeerCertificate()
-    return self.ssl:peer()
+    return self.ssl and self.ssl:peer_certificate()
 end
 
 function TLSSocket:_verifyClient()
-    if self.ssl:session_reused() then
-        self.sessionReused = true
+    local verified, err = self.ssl:verify()
+    if verified then
+        self.authorized = true
         self:emit('secureConnection', self)
 
     else
-        local verifyError, verifyResults
-        self.ctx.session = self.ssl:session()
-        verifyError, verifyResults = self.ssl:getpeerverification()
-        if verifyError then
-            self.authorized = true
-            self:emit('secureConnection', self)
+        self.authorized = false
+        self.authorizationError = err
+        if self.rejectUnauthorized then
+            self:destroy(Error:new(err))
         else
-            self.authorized = false
-            self.authorizationError = verifyResults[1].error_string
-            if self.rejectUnauthorized then
-                local err = Error:new(self.authorizationError)
-                self:destroy(err)
-            else
-                self:emit('secureConnection', self)
-            end
+            self:emit('secureConnection', self)
         end
     end
 end
 
 function TLSSocket:_verifyServer()
     if self.requestCert then
-        local peer, verify, err
-        peer = self.ssl:peer()
-        if peer then
-            verify, err = self.ssl:getpeerverification()
+        if self.ssl:peer_certificate() then
+            local verified, err = self.ssl:verify()
             self.authorizationError = err
-            if verify then
+            if verified then
                 self.authorized = true
             elseif self.rejectUnauthorized then
-                self:destroy(err)
+                self:destroy(Error:new(err))
             end
+
         elseif self.rejectUnauthorized then
             self:destroy(Error:new('reject unauthorized'))
         end
@@ -233,62 +210,23 @@ function TLSSocket:_verifyServer()
     end
 end
 
-function TLSSocket:destroy(err)
+-- Sends a close_notify alert before the socket is closed
+function TLSSocket:destroy(err, callback)
+    if self.destroyed or self._shutdown then return end
 
-    local hasShutdown = false
-    local function reallyShutdown()
-      if hasShutdown then return end
-      hasShutdown = true
-      net.Socket.destroy(self, err)
-    end
+    if self.ssl and self._connected and self._handle and not uv.is_closing(self._handle) then
+        self._shutdown = true
+        self.ssl:close()
 
-    local function shutdown()
-      timer.active(self)
-      if self._shutdown then
-        local _, shutdown_err = self.ssl:shutdown()
-        if shutdown_err == "want_read" or shutdown_err == "want_write" or shutdown_err == "syscall" then
-          local r = self.out:pending()
-          if r > 0 then
-            timer.active(self._shutdownTimer)
-            net.Socket._write(self, self.out:read(), function(err)
-              timer.active(self._shutdownTimer)
-              if err then
-                self._shutdown = false
-                return reallyShutdown()
-              end
-              shutdown()
+        local cipherText = self.ssl:output()
+        if cipherText then
+            return net.Socket._write(self, cipherText, function()
+                net.Socket.destroy(self, err, callback)
             end)
-          end
-        else
-          self._shutdown = false
-          return reallyShutdown()
         end
-      end
     end
 
-    local function onShutdown(read_err, data)
-      timer.active(self)
-      if read_err or not data then
-        return reallyShutdown()
-      end
-      timer.active(self._shutdownTimer)
-      self.inp:write(data)
-      shutdown()
-    end
-
-    if self.destroyed or self._shutdown then return end
-    if self.ssl and self.authorized then
-      if not self._shutdownTimer then
-        self._shutdownTimer = timer.setTimeout(5000, reallyShutdown)
-      end
-      self._shutdown = true
-      uv.read_stop(self._handle)
-      uv.read_start(self._handle, onShutdown)
-      self:emit('shutdown')
-      shutdown()
-    else
-      reallyShutdown()
-    end
+    net.Socket.destroy(self, err, callback)
 end
 
 function TLSSocket:connect(...)
@@ -304,166 +242,169 @@ function TLSSocket:connect(...)
     net.Socket.connect(self, table.unpack(args))
 end
 
-function TLSSocket:sni(hosts)
-    if self.server then
-        local maps = {}
-        for k,v in pairs(hosts) do
-            local ctx = exports.createCredentials(v)
-            maps[k] = ctx.context
-        end
-        self.ctx.context:set_servername_callback(maps)
+-- Sends the records waiting in the output BIO of the connection
+function TLSSocket:_flush(callback)
+    local cipherText = self.ssl:output()
+    if cipherText then
+        net.Socket._write(self, cipherText, callback or noop)
+
+    elseif callback then
+        callback()
     end
 end
 
 function TLSSocket:_write(data, callback)
-  local ret, i, err
-    if not self.ssl or self.destroyed or self._shutdown or not self._connected then
+    if not self.ssl or self.destroyed or self._shutdown then
         return
     end
 
-    if data then
-        ret, err = self.ssl:write(data)
+    if not self._connected then
+        return self:once('secure', utils.bind(self._write, self, data, callback))
+    end
+
+    local ret, err = self.ssl:write(data)
+    if ret == nil then
+        return self:destroy(err)
+    end
+
+    self:_flush(callback)
+end
+
+-- Encrypts all buffered chunks and sends the records with one write
+function TLSSocket:_writev(entries, callback)
+    if not self.ssl or self.destroyed or self._shutdown then
+        return
+    end
+
+    if not self._connected then
+        return self:once('secure', utils.bind(self._writev, self, entries, callback))
+    end
+
+    for i = 1, #entries do
+        local ret, err = self.ssl:write(entries[i].chunk)
         if ret == nil then
             return self:destroy(err)
         end
     end
 
-    i = self.out:pending()
-    if i > 0 then
-        net.Socket._write(self, self.out:read(), callback)
-    end
+    self:_flush(callback)
 end
 
 function TLSSocket:_read(n)
-    local onHandshake, onData, handshake
+    local onData, handshake, decrypt
 
-    function onData(err, cipherText)
-        timer.active(self)
-        if err then
-            return self:destroy(err)
-        elseif cipherText then
-            if self.inp:write(cipherText) then
-                repeat
-                    local plainText, op = self.ssl:read()
-                    if not plainText then
-                        if op == 0 then
-                          return net.Socket.destroy(self)
-                        else
-                          return
-                        end
-                    else
-                        self:push(plainText)
-                    end
-                until not plainText
+    function decrypt()
+        while true do
+            local plainText, err = self.ssl:read()
+
+            if plainText then
+                self:push(plainText)
+
+            elseif err then
+                return self:destroy(err)
+
+            elseif plainText == nil then
+                -- the peer sent close_notify
+                uv.read_stop(self._handle)
+                self:push(nil)
+                self:emit('_socketEnd')
+                break
+
+            else
+                break
             end
-        else
-            self.ssl = nil
-            self:push(nil)
-            self:emit('_socketEnd')
+        end
+
+        -- reading may answer the peer, e.g. with an alert
+        if self.ssl:pending() > 0 then
+            self:_flush()
         end
     end
 
     function handshake()
-        if not self._connected then
-          local ret, err = self.ssl:handshake()
-          if ret == nil then
-              return net.Socket.destroy(self, err)
-          else
-              local i = self.out:pending()
-              if i > 0 then
-                net.Socket._write(self, self.out:read(), function(err)
-                  if err then return self:shutdown(err) end
-                  handshake()
-                end)
-              end
-            end
+        local ret, err = self.ssl:handshake()
+        self:_flush()
 
-            if ret == false then return end
+        if ret == nil then
+            return net.Socket.destroy(self, err)
+
+        elseif ret == false then
+            return
+        end
 
-            self._connected = true
-            self._handshake_complete = true
+        self._connected = true
+        self:emit('secure')
 
-            if not uv.is_active(self._handle) then return end
-            uv.read_stop(self._handle)
-            uv.read_start(self._handle, onData)
-            self:emit('secure')
+        -- the first records of the peer may come with the last of the handshake
+        if not self.destroyed then
+            decrypt()
         end
     end
 
-    function onHandshake(err, data)
+    function onData(err, cipherText)
         timer.active(self)
         if err then
-          return net.Socket.destroy(self, err)
+            return self:destroy(err)
+
+        elseif not cipherText then
+            self:push(nil)
+            self:emit('_socketEnd')
+            return
         end
-        if not data then
-          return net.Socket.destroy(self)
+
+        self.ssl:input(cipherText)
+        if self._connected then
+            decrypt()
+        else
+            handshake()
         end
-        self.inp:write(data)
-        handshake()
     end
 
     if self._connecting then
         self:once('connect', utils.bind(self._read, self, n))
 
-    elseif not self._reading and not self._handshake_complete then
-        self._reading = true
-        uv.read_start(self._handle, onHandshake)
-        handshake()
-
     elseif not self._reading then
         self._reading = true
         uv.read_start(self._handle, onData)
+
+        if not self._connected then
+            handshake()
+        end
     end
 end
 
 exports.TLSSocket = TLSSocket
 
 -------------------------------------------------------------------------------
-local VERIFY_PEER       = { "peer" }
-local VERIFY_PEER_FAIL  = { "peer", "fail_if_no_peer_cert" }
-local VERIFY_NONE       = { "none" }
 
 function exports.createCredentials(options, context)
-    local ctx, returnOne
+    local ctx
 
     options = options or {}
 
-    ctx = Credential:new(options.secureProtocol, options.ciphers,
-        options.secureOptions, options.rejectUnauthorized, context)
+    ctx = Credential:new(options.server, options.rejectUnauthorized, context)
     if context then
         return ctx
     end
 
     if options.key and options.cert then
-        ctx:setKeyCert(options.key, options.cert)
+        ctx:setKeyCert(options.key, options.cert, options.passphrase)
     end
 
     if options.ca then
         ctx:setCA(options.ca)
-    else
+    elseif not options.server or options.requestCert then
         ctx:addRootCerts()
     end
 
-    function returnOne()
-        return 1
-    end
-
-    if options.server then
-        if options.requestCert then
-            if options.rejectUnauthorized then
-              ctx.context:verify_mode(VERIFY_PEER_FAIL, returnOne)
-            else
-              ctx.context:verify_mode(VERIFY_PEER, returnOne)
-            end
-        else
-            ctx.context:verify_mode(VERIFY_NONE, returnOne)
-        end
+    -- clients finish the handshake and check the result in `_verifyClient`
+    if options.server and options.requestCert then
+        ctx.context:authmode(options.rejectUnauthorized and 'required' or 'optional')
     else
-        ctx.context:verify_mode(VERIFY_NONE, returnOne)
+        ctx.context:authmode(options.server and 'none' or 'optional')
     end
 
     return ctx
 end
 
 return exports
-
@@ -23,14 +23,12 @@ exports.license     = "Apache 2"
 exports.description = "A node-style tls module for lnode."
 exports.tags        = {"lnode", "tls"}
 
-local loaded = pcall(require, 'ssl')
+local loaded = pcall(require, 'lmbedtls.tls')
 if not loaded then return end
 
 local _common_tls = require('tls/common')
 local net = require('net')
 
-local DEFAULT_CIPHERS = _common_tls.DEFAULT_CIPHERS
-
 local extend = function(...)
     local args = {...}
     local obj = args[1]
@@ -49,6 +47,7 @@ function Server:init(options, connectionListener)
     options.server = true
 
     local sharedCreds = _common_tls.createCredentials(options)
+    self.credentials = sharedCreds
     net.Server.init(self, options, function(raw_socket)
         local socket
         socket = _common_tls.TLSSocket:new(raw_socket, {
@@ -67,18 +66,25 @@ function Server:init(options, connectionListener)
         end)
 
         self.socket = socket
-        if self.sni_hosts then
-            socket:sni(self.sni_hosts)
-        end
     end)
 end
 
+-- Clients asking for `hostname` (SNI) get the certificate of `options`
+-- ({ key, cert, passphrase, ca }) instead of the one of the server.
+-- `hostname` may start with '*.' to match any subdomain.
+function Server:addContext(hostname, options)
+    local credentials = _common_tls.createCredentials(extend({}, options, { server = true }))
+    assert(self.credentials.context:sni(hostname, credentials.context))
+end
+
+-- `hosts` maps host names to the options of `Server:addContext`
 function Server:sni(hosts)
-    self.sni_hosts = hosts
+    for hostname, options in pairs(hosts) do
+        self:addContext(hostname, options)
+    end
 end
 
 local DEFAULT_OPTIONS = {
-    ciphers = DEFAULT_CIPHERS,
     rejectUnauthorized = true,
     -- TODO checkServerIdentity
 }
@@ -228,6 +228,7 @@ exports.base64Encode    = lutils.base64_encode
 exports.bin2hex         = lutils.hex_encode
 exports.hex2bin         = lutils.hex_decode
 exports.md5             = lutils.md5
+exports.sha1            = lutils.sha1
 
 
 return exports
@@ -0,0 +1,735 @@
+--[[
+
+Copyright 2016 The Node.lua Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+--[[
+WebSocket (RFC 6455) server and client.
+
+Framing, unmasking, fragment reassembly and UTF-8 validation are done by the
+native `lwebsocket` codec, per-message deflate (RFC 7692) uses the miniz
+streaming deflator/inflator.
+
+    local websocket = require('websocket')
+
+    local server = websocket.createServer({ perMessageDeflate = true }, function(ws, request)
+        ws:on('message', function(data, isBinary)
+            ws:send(data, isBinary)
+        end)
+    end)
+    server:listen(8080)
+
+    local ws = websocket.connect('ws://127.0.0.1:8080/')
+    ws:on('open', function() ws:send('hello') end)
+--]]
+
+local meta = { }
+meta.name        = "lnode/websocket"
+meta.version     = "1.0.0"
+meta.license     = "Apache 2"
+meta.description = "WebSocket server and client for lnode"
+meta.tags        = { "lnode", "websocket", "http" }
+
+local exports = { meta = meta }
+
+local lwebsocket = require('lwebsocket')
+local miniz      = require('miniz')
+local utils      = require('utils')
+local timer      = require('timer')
+local net        = require('net')
+local url        = require('url')
+local http       = require('http')
+
+local Emitter = require('core').Emitter
+
+local GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+local OPCODE_TEXT   = lwebsocket.TEXT
+local OPCODE_BINARY = lwebsocket.BINARY
+local OPCODE_CLOSE  = lwebsocket.CLOSE
+local OPCODE_PING   = lwebsocket.PING
+local OPCODE_PONG   = lwebsocket.PONG
+
+-- The 4 octets a sync flush ends with, stripped from compressed messages
+local DEFLATE_TRAILER = "\0\0\255\255"
+
+-- Default max size of a received message, the same as the native decoder
+local DEFAULT_MAX_PAYLOAD = 64 * 1024 * 1024
+
+exports.CONNECTING = 0
+exports.OPEN       = 1
+exports.CLOSING    = 2
+exports.CLOSED     = 3
+
+-------------------------------------------------------------------------------
+-- local functions
+
+-- Returns the Sec-WebSocket-Accept value of the given key
+local function _acceptKey(key)
+    return utils.base64Encode(utils.sha1(key .. GUID))
+end
+
+exports.acceptKey = _acceptKey
+
+-- Parse a Sec-WebSocket-Extensions header into { name = { param = value } }
+local function _parseExtensions(header)
+    local extensions = {}
+    if type(header) ~= 'string' then
+        return extensions
+    end
+
+    for item in header:gmatch("[^,]+") do
+        local name
+        local params = {}
+        for token in item:gmatch("[^;]+") do
+            token = token:trim()
+            if not name then
+                name = token:lower()
+            else
+                local key, value = token:match("^([^=]+)=?(.*)$")
+                if key then
+                    value = value:trim():gsub('^"(.*)"$', '%1')
+                    params[key:trim():lower()] = (value ~= '') and value or true
+                end
+            end
+        end
+
+        -- Only the first offer of each extension is considered
+        if name and not extensions[name] then
+            extensions[name] = params
+        end
+    end
+
+    return extensions
+end
+
+exports.parseExtensions = _parseExtensions
+
+-- Server side permessage-deflate negotiation, returns the accepted
+-- parameters and the response header value, or nil to decline
+local function _acceptDeflate(offer)
+    if not offer then
+        return nil
+    end
+
+    -- miniz only supports a 32K window
+    local bits = tonumber(offer.server_max_window_bits)
+    if bits and bits < 15 then
+        return nil
+    end
+
+    local params = {
+        serverNoContextTakeover = offer.server_no_context_takeover and true,
+        clientNoContextTakeover = offer.client_no_context_takeover and true
+    }
+
+    local header = 'permessage-deflate'
+    if params.serverNoContextTakeover then
+        header = header .. '; server_no_context_takeover'
+    end
+
+    if params.clientNoContextTakeover then
+        header = header .. '; client_no_context_takeover'
+    end
+
+    return params, header
+end
+
+-------------------------------------------------------------------------------
+--[[ WebSocket ]]--
+
+local WebSocket = Emitter:extend()
+exports.WebSocket = WebSocket
+
+--[[
+Create a WebSocket for an already upgraded socket, or a WebSocket in the
+CONNECTING state when `socket` is nil (see `exports.connect`).
+
+options:
+- isServer {Boolean} true for the server end of the connection
+- maxPayload {Number} max size of a received message, default 64MB
+- deflate {Object} negotiated permessage-deflate parameters, or nil
+- deflateLevel {Number} compression level, default 6
+- deflateThreshold {Number} messages smaller than this are not compressed
+- fragmentSize {Number} split sent messages into frames of this size
+--]]
+function WebSocket:initialize(socket, options)
+    self.readyState = exports.CONNECTING
+
+    if socket then
+        self:_attach(socket, options)
+    end
+end
+
+function WebSocket:_attach(socket, options)
+    options = options or {}
+
+    self.socket       = socket
+    self.isServer     = options.isServer and true or false
+    self.readyState   = exports.OPEN
+    self.protocol     = options.protocol
+    self.fragmentSize = options.fragmentSize
+    self.deflate      = options.deflate
+
+    self._decoder = lwebsocket.new_decoder({
+        maxPayload = options.maxPayload,
+        masked     = self.isServer,
+        compressed = self.deflate ~= nil
+    })
+
+    if self.deflate then
+        -- Our end of the context takeover parameters
+        local deflate = self.deflate
+        if self.isServer then
+            self._deflateNoContext = deflate.serverNoContextTakeover
+            self._inflateNoContext = deflate.clientNoContextTakeover
+        else
+            self._deflateNoContext = deflate.clientNoContextTakeover
+            self._inflateNoContext = deflate.serverNoContextTakeover
+        end
+
+        self._deflateLevel     = options.deflateLevel
+        self._deflateThreshold = options.deflateThreshold or 64
+        self._maxPayload       = options.maxPayload or DEFAULT_MAX_PAYLOAD
+    end
+
+    socket:on('data',  function(chunk) self:_onSocketData(chunk) end)
+    socket:on('end',   function() self:_onSocketEnd() end)
+    socket:on('close', function() self:_onSocketClose() end)
+    socket:on('error', function(err) self:emit('error', err) end)
+
+    if socket.setTimeout then
+        socket:setTimeout(0)
+    end
+
+    if socket.nodelay then
+        socket:nodelay(true)
+    end
+
+    socket:resume()
+end
+
+function WebSocket:_deflate(data)
+    if not self._deflator then
+        self._deflator = miniz.new_deflator(self._deflateLevel, -15)
+    end
+
+    local output = self._deflator:deflate(data, 'sync')
+    if self._deflateNoContext then
+        self._deflator:reset()
+    end
+
+    if output:sub(-4) == DEFLATE_TRAILER then
+        output = output:sub(1, -5)
+    end
+
+    return output
+end
+
+function WebSocket:_inflate(data)
+    if not self._inflator then
+        self._inflator = miniz.new_inflator(-15)
+    end
+
+    -- Stop as soon as the message gets larger than maxPayload, so a small
+    -- compressed message can not expand into an unbounded amount of memory
+    local output, err = self._inflator:inflate(data .. DEFLATE_TRAILER, self._maxPayload)
+    if not output then
+        return nil, err, 1007
+
+    elseif #output > self._maxPayload then
+        return nil, 'message too big', 1009
+    end
+
+    if self._inflateNoContext then
+        self._inflator:reset()
+    end
+
+    return output
+end
+
+function WebSocket:_fail(code, reason)
+    self:emit('error', reason)
+    self:close(code, reason)
+    self:_destroy()
+end
+
+function WebSocket:_onSocketData(chunk)
+    local events, err, code = self._decoder:execute(chunk)
+    if not events then
+        return self:_fail(code, err)
+    end
+
+    for i = 1, #events do
+        if self.readyState == exports.CLOSED then
+            return
+        end
+
+        local event = events[i]
+        local opcode = event.opcode
+        local payload = event.payload
+
+        if opcode == OPCODE_TEXT or opcode == OPCODE_BINARY then
+            if event.compressed then
+                local code
+                payload, err, code = self:_inflate(payload)
+                if not payload then
+                    return self:_fail(code, err)
+
+                elseif opcode == OPCODE_TEXT and not lwebsocket.is_utf8(payload) then
+                    return self:_fail(1007, 'invalid UTF-8 in text message')
+                end
+            end
+
+            self:emit('message', payload, opcode == OPCODE_BINARY)
+
+        elseif opcode == OPCODE_PING then
+            if self.readyState == exports.OPEN then
+                self:_sendFrame(OPCODE_PONG, payload)
+            end
+            self:emit('ping', payload)
+
+        elseif opcode == OPCODE_PONG then
+            self:emit('pong', payload)
+
+        elseif opcode == OPCODE_CLOSE then
+            self:_onCloseFrame(payload)
+        end
+    end
+end
+
+function WebSocket:_onCloseFrame(payload)
+    local code, reason = 1005, ''
+    if #payload >= 2 then
+        code = string.unpack('>I2', payload)
+        reason = payload:sub(3)
+
+    elseif #payload == 1 then
+        return self:_fail(1002, 'invalid close frame')
+    end
+
+    self._closeCode   = code
+    self._closeReason = reason
+
+    if self.readyState == exports.OPEN then
+        -- Echo the close frame
+        self.readyState = exports.CLOSING
+        self:_sendFrame(OPCODE_CLOSE, payload:sub(1, 2))
+    end
+
+    -- The server closes the TCP connection, the client waits for it
+    if self.isServer then
+        self.socket:shutdown(function()
+            self:_destroy()
+        end)
+
+    else
+        self:_startCloseTimer()
+    end
+end
+
+function WebSocket:_onSocketEnd()
+    if self.readyState ~= exports.CLOSED then
+        self.socket:shutdown(function() end)
+    end
+end
+
+function WebSocket:_onSocketClose()
+    if self._closeTimer then
+        timer.clearTimeout(self._closeTimer)
+        self._closeTimer = nil
+    end
+
+    if self.readyState == exports.CLOSED then
+        return
+    end
+
+    self.readyState = exports.CLOSED
+
+    if self._deflator then self._deflator:close() end
+    if self._inflator then self._inflator:close() end
+
+    self:emit('close', self._closeCode or 1006, self._closeReason or '')
+end
+
+function WebSocket:_startCloseTimer()
+    if self._closeTimer then
+        return
+    end
+
+    self._closeTimer = timer.setTimeout(exports.CLOSE_TIMEOUT, function()
+        self._closeTimer = nil
+        self:_destroy()
+    end)
+end
+
+function WebSocket:_destroy()
+    local socket = self.socket
+    if socket and not socket.destroyed then
+        socket:destroy()
+    end
+
+    self:_onSocketClose()
+end
+
+function WebSocket:_sendFrame(opcode, payload, fin, compressed, callback)
+    local frame = lwebsocket.encode(opcode, payload, fin, not self.isServer, compressed)
+    return self.socket:write(frame, callback)
+end
+
+--[[
+Send a message.
+@param data {String} the message
+@param isBinary {Boolean} send a binary message, default is text
+@param callback {Function} called when the data has been written
+--]]
+function WebSocket:send(data, isBinary, callback)
+    if type(isBinary) == 'function' then
+        callback, isBinary = isBinary, nil
+    end
+
+    if self.readyState ~= exports.OPEN then
+        if callback then callback('WebSocket is not open') end
+        return false
+    end
+
+    data = tostring(data)
+    local opcode = isBinary and OPCODE_BINARY or OPCODE_TEXT
+
+    local compressed = false
+    if self.deflate and #data >= self._deflateThreshold then
+        data = self:_deflate(data)
+        compressed = true
+    end
+
+    local size = self.fragmentSize
+    if (not size) or (#data <= size) then
+        return self:_sendFrame(opcode, data, true, compressed, callback)
+    end
+
+    -- Fragmented message: all frames are written in one go, so control
+    -- frames can not be interleaved and need no special handling here
+    local frames = {}
+    local offset = 1
+    while offset <= #data do
+        local last = offset + size > #data
+        frames[#frames + 1] = lwebsocket.encode(opcode, data:sub(offset, offset + size - 1),
+            last, not self.isServer, compressed and offset == 1)
+
+        opcode = lwebsocket.CONTINUATION
+        offset = offset + size
+    end
+
+    return self.socket:write(table.concat(frames), callback)
+end
+
+function WebSocket:ping(data, callback)
+    if self.readyState ~= exports.OPEN then
+        return false
+    end
+
+    return self:_sendFrame(OPCODE_PING, data or '', true, false, callback)
+end
+
+function WebSocket:pong(data, callback)
+    if self.readyState ~= exports.OPEN then
+        return false
+    end
+
+    return self:_sendFrame(OPCODE_PONG, data or '', true, false, callback)
+end
+
+--[[
+Start the closing handshake.
+@param code {Number} status code, default 1000
+@param reason {String} the reason
+--]]
+function WebSocket:close(code, reason)
+    if self.readyState ~= exports.OPEN then
+        return
+    end
+
+    self.readyState = exports.CLOSING
+
+    local payload = ''
+    if code then
+        payload = string.pack('>I2', code) .. (reason or ''):sub(1, 123)
+    end
+
+    self:_sendFrame(OPCODE_CLOSE, payload)
+    self:_startCloseTimer()
+end
+
+-- Time to wait for the peer to complete the closing handshake (ms)
+exports.CLOSE_TIMEOUT = 5000
+
+-------------------------------------------------------------------------------
+-- Server
+
+--[[
+Complete the WebSocket handshake of an http server request whose
+`Upgrade` header is 'websocket'. Returns a WebSocket, or nil and an error
+after sending a 400 response.
+
+options:
+- perMessageDeflate {Boolean} accept the permessage-deflate extension
+- protocols {Array} supported sub-protocols, in order of preference
+- maxPayload, fragmentSize: see WebSocket:initialize
+--]]
+function exports.upgrade(request, options)
+    options = options or {}
+
+    local socket  = request.socket
+    local headers = request.headers
+    local upgrade = headers['Upgrade']
+    local key     = headers['Sec-WebSocket-Key']
+    local version = headers['Sec-WebSocket-Version']
+
+    if (request.method ~= 'GET') or (not upgrade) or (upgrade:lower() ~= 'websocket')
+        or (not key) or (version ~= '13') then
+        socket:write('HTTP/1.1 400 Bad Request\r\nSec-WebSocket-Version: 13\r\n' ..
+            'Connection: close\r\nContent-Length: 0\r\n\r\n')
+        socket:shutdown(function() end)
+        return nil, 'Invalid WebSocket handshake'
+    end
+
+    local response = {
+        'HTTP/1.1 101 Switching Protocols',
+        'Upgrade: websocket',
+        'Connection: Upgrade',
+        'Sec-WebSocket-Accept: ' .. _acceptKey(key)
+    }
+
+    -- Sub-protocol
+    local protocol
+    local offered = headers['Sec-WebSocket-Protocol']
+    if offered and options.protocols then
+        local set = {}
+        for item in offered:gmatch("[^,%s]+") do set[item] = true end
+        for _, item in ipairs(options.protocols) do
+            if set[item] then protocol = item; break end
+        end
+
+        if protocol then
+            response[#response + 1] = 'Sec-WebSocket-Protocol: ' .. protocol
+        end
+    end
+
+    -- Extensions
+    local deflate
+    if options.perMessageDeflate then
+        local extensions = _parseExtensions(headers['Sec-WebSocket-Extensions'])
+        local header
+        deflate, header = _acceptDeflate(extensions['permessage-deflate'])
+        if deflate then
+            response[#response + 1] = 'Sec-WebSocket-Extensions: ' .. header
+        end
+    end
+
+    response[#response + 1] = '\r\n'
+    socket:write(table.concat(response, '\r\n'))
+
+    return WebSocket:new(socket, {
+        isServer     = true,
+        protocol     = protocol,
+        deflate      = deflate,
+        maxPayload   = options.maxPayload,
+        fragmentSize = options.fragmentSize,
+        deflateLevel = options.deflateLevel
+    })
+end
+
+--[[
+Create an http server which accepts WebSocket connections.
+`callback(ws, request)` is called for each new connection, other requests
+are passed to `options.onRequest` or answered with 426 Upgrade Required.
+--]]
+function exports.createServer(options, callback)
+    if type(options) == 'function' then
+        callback, options = options, {}
+    end
+    options = options or {}
+
+    return http.createServer(function(request, response)
+        local upgrade = request.headers['Upgrade']
+        if upgrade and upgrade:lower() == 'websocket' then
+            local ws = exports.upgrade(request, options)
+            if ws and callback then
+                callback(ws, request)
+            end
+            return
+
+        elseif options.onRequest then
+            return options.onRequest(request, response)
+        end
+
+        response:writeHead(426, { Upgrade = 'websocket', ['Content-Length'] = 0 })
+        response:finish()
+    end)
+end
+
+-------------------------------------------------------------------------------
+-- Client
+
+--[[
+Connect to a `ws://` url. Returns a WebSocket in the CONNECTING state, which
+emits 'open' once the handshake is complete, or 'error' if it failed.
+
+options:
+- perMessageDeflate {Boolean} offer the permessage-deflate extension
+- protocols {Array} sub-protocols to offer
+- headers {Object} extra request headers
+- maxPayload, fragmentSize: see WebSocket:initialize
+--]]
+function exports.connect(address, options, callback)
+    if type(options) == 'function' then
+        callback, options = options, {}
+    end
+    options = options or {}
+
+    local parsed = url.parse(address)
+    if parsed.protocol ~= 'ws' and parsed.protocol ~= 'ws:' then
+        error('Unsupported WebSocket url: ' .. tostring(address))
+    end
+
+    local host = parsed.hostname or parsed.host or '127.0.0.1'
+    local port = tonumber(parsed.port) or 80
+    local path = parsed.path or '/'
+    if path == '' then path = '/' end
+
+    local ws = WebSocket:new()
+    ws.url = address
+
+    if callback then
+        ws:once('open', callback)
+    end
+
+    local nonce = {}
+    for i = 1, 16 do nonce[i] = string.char(math.random(0, 255)) end
+    local key = utils.base64Encode(table.concat(nonce))
+    local request = {
+        'GET ' .. path .. ' HTTP/1.1',
+        'Host: ' .. host .. ':' .. port,
+        'Upgrade: websocket',
+        'Connection: Upgrade',
+        'Sec-WebSocket-Key: ' .. key,
+        'Sec-WebSocket-Version: 13'
+    }
+
+    if options.perMessageDeflate then
+        -- miniz always deflates with a 32K window, so we can not offer
+        -- client_max_window_bits
+        request[#request + 1] = 'Sec-WebSocket-Extensions: permessage-deflate'
+    end
+
+    if options.protocols then
+        request[#request + 1] = 'Sec-WebSocket-Protocol: ' .. table.concat(options.protocols, ', ')
+    end
+
+    for name, value in pairs(options.headers or {}) do
+        request[#request + 1] = name .. ': ' .. value
+    end
+
+    request[#request + 1] = '\r\n'
+
+    local socket
+    local buffer = ''
+
+    local _onError = function(err)
+        ws.readyState = exports.CLOSED
+        ws:emit('error', err)
+    end
+
+    local _onHandshake
+    _onHandshake = function(chunk)
+        buffer = buffer .. chunk
+        local headEnd = buffer:find('\r\n\r\n', 1, true)
+        if not headEnd then
+            if #buffer > 16 * 1024 then
+                socket:destroy()
+                _onError('WebSocket handshake response too large')
+            end
+            return
+        end
+
+        socket:removeListener('data', _onHandshake)
+        socket:removeListener('error', _onError)
+
+        local head = buffer:sub(1, headEnd - 1)
+        local rest = buffer:sub(headEnd + 4)
+
+        local code = tonumber(head:match("^HTTP/1%.%d (%d+)"))
+        local headers = setmetatable({}, http.headerMeta)
+        for name, value in head:gmatch("\r\n([^:\r\n]+):[ \t]*([^\r\n]*)") do
+            headers[#headers + 1] = { name, value }
+        end
+
+        if code ~= 101 then
+            socket:destroy()
+            return _onError('Unexpected WebSocket handshake response: ' .. tostring(code))
+
+        elseif headers['Sec-WebSocket-Accept'] ~= _acceptKey(key) then
+            socket:destroy()
+            return _onError('Invalid Sec-WebSocket-Accept header')
+        end
+
+        local deflate
+        local extensions = _parseExtensions(headers['Sec-WebSocket-Extensions'])
+        local params = extensions['permessage-deflate']
+        if params then
+            if not options.perMessageDeflate then
+                socket:destroy()
+                return _onError('Unexpected permessage-deflate extension')
+
+            elseif params.client_max_window_bits
+                and tonumber(params.client_max_window_bits) ~= 15 then
+                socket:destroy()
+                return _onError('Unsupported permessage-deflate client_max_window_bits')
+            end
+
+            deflate = {
+                serverNoContextTakeover = params.server_no_context_takeover and true,
+                clientNoContextTakeover = params.client_no_context_takeover and true
+            }
+        end
+
+        ws:_attach(socket, {
+            isServer     = false,
+            protocol     = headers['Sec-WebSocket-Protocol'],
+            deflate      = deflate,
+            maxPayload   = options.maxPayload,
+            fragmentSize = options.fragmentSize,
+            deflateLevel = options.deflateLevel
+        })
+
+        ws:emit('open')
+
+        if #rest > 0 then
+            ws:_onSocketData(rest)
+        end
+    end
+
+    socket = net.connect(port, host, function()
+        socket:write(table.concat(request, '\r\n'))
+    end)
+
+    socket:on('data', _onHandshake)
+    socket:on('error', _onError)
+
+    return ws
+end
+
+return exports
@@ -34,15 +34,307 @@ local core  = require('core')
 local Error  = core.Error
 local Object = core.Object
 
+local Transform = require('stream').Transform
+
 -------------------------------------------------------------------------------
--- Gzip
+-- Zlib streams
+
+-- window bits of the miniz deflator/inflator for each format
+local WINDOW_BITS_ZLIB = 15
+local WINDOW_BITS_RAW  = -15
+local WINDOW_BITS_GZIP = 31
+
+exports.Z_NO_COMPRESSION      = 0
+exports.Z_BEST_SPEED          = 1
+exports.Z_BEST_COMPRESSION    = 9
+exports.Z_DEFAULT_COMPRESSION = 6
+
+exports.crc32 = miniz.crc32
+
+--[[
+Base class of the compression streams, a `stream.Transform` which compresses
+or decompresses each written chunk as it arrives, so only the deflate window
+and the current chunk are kept in memory.
+
+options:
+- level {Number} compression level 0 ~ 9, default 6
+- flush {String} flush mode used after each chunk: 'none' (default), 'sync'
+  or 'full'. 'sync' lets the reader decode everything written so far.
+--]]
+local Zlib = Transform:extend()
+exports.Zlib = Zlib
+
+function Zlib:initialize(options, windowBits, inflate)
+    Transform.initialize(self, options)
+
+    options = options or {}
+    self._inflate   = inflate
+    self._flushMode = options.flush or 'none'
+    self.bytesRead  = 0
+
+    local handle, err
+    if inflate then
+        handle, err = miniz.new_inflator(windowBits)
+    else
+        handle, err = miniz.new_deflator(options.level, windowBits)
+    end
+
+    if not handle then
+        error(err)
+    end
+
+    self._handle = handle
+end
+
+function Zlib:_process(chunk, flush)
+    local handle = self._handle
+    if not handle then
+        return nil, Error:new('zlib binding closed')
+    end
+
+    self.bytesRead = self.bytesRead + #chunk
+
+    if not self._inflate then
+        local output, err = handle:deflate(chunk, flush)
+        if not output then
+            return nil, Error:new(err)
+        end
+
+        return output
+    end
+
+    local output, done, unused = handle:inflate(chunk)
+    if not output then
+        return nil, Error:new(done)
+    end
+
+    -- Concatenated gzip members are decoded one after the other
+    while done and unused > 0 and self._multiMember do
+        handle:reset()
+        local more
+        more, done, unused = handle:inflate(chunk:sub(-unused))
+        if not more then
+            return nil, Error:new(done)
+        end
+
+        output = output .. more
+    end
+
+    self._ended = done
+    return output
+end
+
+function Zlib:_transform(chunk, callback)
+    local output, err = self:_process(chunk, self._flushMode)
+    if err then
+        return callback(err)
+    end
+
+    if #output > 0 then
+        self:push(output)
+    end
+
+    callback()
+end
+
+function Zlib:_flush(callback)
+    local handle = self._handle
+    if not handle then
+        return callback()
+    end
+
+    local output, err = '', nil
+    if not self._inflate then
+        output, err = self:_process('', 'finish')
+
+    elseif not self._ended then
+        err = Error:new('unexpected end of file')
+    end
+
+    self:close()
+
+    if err then
+        return callback(err)
+    end
+
+    if #output > 0 then
+        self:push(output)
+    end
 
-local Gzip = Object:extend()
+    callback()
+end
 
-function exports.createGzip(options)
-	return Gzip:new(options)
+-- Release the native compressor, further writes fail
+function Zlib:close()
+    if self._handle then
+        self._handle:close()
+        self._handle = nil
+    end
 end
 
+local Deflate = Zlib:extend()
+exports.Deflate = Deflate
+
+function Deflate:initialize(options)
+    Zlib.initialize(self, options, WINDOW_BITS_ZLIB, false)
+end
+
+local Inflate = Zlib:extend()
+exports.Inflate = Inflate
+
+function Inflate:initialize(options)
+    Zlib.initialize(self, options, WINDOW_BITS_ZLIB, true)
+end
+
+local DeflateRaw = Zlib:extend()
+exports.DeflateRaw = DeflateRaw
+
+function DeflateRaw:initialize(options)
+    Zlib.initialize(self, options, WINDOW_BITS_RAW, false)
+end
+
+local InflateRaw = Zlib:extend()
+exports.InflateRaw = InflateRaw
+
+function InflateRaw:initialize(options)
+    Zlib.initialize(self, options, WINDOW_BITS_RAW, true)
+end
+
+local Gzip = Zlib:extend()
+exports.Gzip = Gzip
+
+function Gzip:initialize(options)
+    Zlib.initialize(self, options, WINDOW_BITS_GZIP, false)
+end
+
+local Gunzip = Zlib:extend()
+exports.Gunzip = Gunzip
+
+function Gunzip:initialize(options)
+    Zlib.initialize(self, options, WINDOW_BITS_GZIP, true)
+    self._multiMember = true
+end
+
+function exports.createDeflate(options)    return Deflate:new(options)    end
+function exports.createInflate(options)    return Inflate:new(options)    end
+function exports.createDeflateRaw(options) return DeflateRaw:new(options) end
+function exports.createInflateRaw(options) return InflateRaw:new(options) end
+function exports.createGzip(options)       return Gzip:new(options)       end
+function exports.createGunzip(options)     return Gunzip:new(options)     end
+
+-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - --
+-- Synchronous helpers, the whole input and output are kept in memory
+
+local function _deflateSync(data, options, windowBits)
+    local handle, err = miniz.new_deflator(options and options.level, windowBits)
+    if not handle then
+        return nil, err
+    end
+
+    local output
+    output, err = handle:deflate(data, 'finish')
+    handle:close()
+    return output, err
+end
+
+local function _inflateSync(data, windowBits)
+    local handle, err = miniz.new_inflator(windowBits)
+    if not handle then
+        return nil, err
+    end
+
+    local output, done = handle:inflate(data)
+    handle:close()
+
+    if not output then
+        return nil, done
+
+    elseif not done then
+        return nil, 'unexpected end of file'
+    end
+
+    return output
+end
+
+function exports.deflateSync(data, options)    return _deflateSync(data, options, WINDOW_BITS_ZLIB) end
+function exports.deflateRawSync(data, options) return _deflateSync(data, options, WINDOW_BITS_RAW)  end
+function exports.gzipSync(data, options)       return _deflateSync(data, options, WINDOW_BITS_GZIP) end
+function exports.inflateSync(data)             return _inflateSync(data, WINDOW_BITS_ZLIB) end
+function exports.inflateRawSync(data)          return _inflateSync(data, WINDOW_BITS_RAW)  end
+function exports.gunzipSync(data)              return _inflateSync(data, WINDOW_BITS_GZIP) end
+
+-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - --
+-- Asynchronous helpers, (de)compressed on the libuv threadpool so the event
+-- loop is not blocked. `data` may be a string or a `buffer.Buffer`.
+
+local function _checkInput(data)
+    if type(data) == 'table' and data.buffer then
+        return data.buffer
+    end
+
+    return data
+end
+
+local function _deflateAsync(data, options, callback, windowBits)
+    if type(options) == 'function' then
+        callback, options = options, nil
+    end
+
+    local level = options and options.level or exports.Z_DEFAULT_COMPRESSION
+    local ret, err = miniz.deflate_async(_checkInput(data), level, windowBits, callback)
+    if not ret then
+        callback(err)
+    end
+end
+
+function exports.deflateAsync(data, options, callback)
+    _deflateAsync(data, options, callback, WINDOW_BITS_ZLIB)
+end
+
+function exports.deflateRawAsync(data, options, callback)
+    _deflateAsync(data, options, callback, WINDOW_BITS_RAW)
+end
+
+function exports.gzipAsync(data, options, callback)
+    _deflateAsync(data, options, callback, WINDOW_BITS_GZIP)
+end
+
+function exports.inflateRawAsync(data, callback)
+    local ret, err = miniz.inflate_async(_checkInput(data), callback)
+    if not ret then
+        callback(err)
+    end
+end
+
+
+-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - --
+-- Bytecode
+
+-- Name of the bundle entry which holds the bytecode tag
+exports.BYTECODE_TAG_NAME = '.bytecode'
+
+--[[
+Returns the tag of the bytecode produced by this interpreter. The first line
+is the hex encoded header of a dumped function: Lua version, format and the
+sizes and byte order of the integer and number types. The bundle searcher in
+`lua/init.lua` only uses `.luac` entries if it has the same first line. The
+second line is informational.
+--]]
+function exports.getBytecodeTag()
+    local header = string.dump(function() end, true)
+    header = header:sub(1, 17 + header:byte(16) + header:byte(17))
+
+    local arch = os.arch and os.arch() or ''
+    return utils.bin2hex(header) .. '\n' .. _VERSION .. ' ' .. arch .. '\n'
+end
+
+-- Compile a Lua source file, nil if it has syntax errors
+local function _dumpScript(source, filename, strip)
+    local script = load(source, '=' .. filename, 't')
+    if (script) then
+        return string.dump(script, strip)
+    end
+end
 
 -- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - --
 -- Bundle 包生成器, 将零散的 lua 文件打包成统一的 bundle 包. 更方便文件的管理
@@ -57,6 +349,18 @@ function BundleBuilder:initialize(basePath, target)
     self.basePath   = basePath
     self.target     = target
     self.files      = {}
+
+    -- Compression level of the files, with 0 they are stored and the module
+    -- loader can use them directly from the mapped bundle
+    self.level      = 9
+
+    -- Also add the compiled `.lua` files as `.luac` entries, the module
+    -- loader prefers them when the bundle was built by a compatible lnode
+    -- (see `getBytecodeTag`) and falls back to the sources otherwise.
+    self.bytecode   = false
+
+    -- Strip the debug information from the bytecode
+    self.strip      = false
 end
 
 function BundleBuilder:addFile(file)
@@ -94,6 +398,10 @@ function BundleBuilder:build()
         self:copyStaticFile("", file)
     end
 
+    if (self.bytecode) then
+        writer:add(exports.BYTECODE_TAG_NAME, exports.getBytecodeTag(), self.level)
+    end
+
     -- finish
     local offset = nil
     fs.writeSync(fd, offset, writer:finalize())
@@ -121,8 +429,15 @@ function BundleBuilder:copyFile(srcfile, destfile)
         end
     end
 
-    self.writer:add(filename, filedata, 9)
+    self.writer:add(filename, filedata, self.level)
     print("  add file", console.colorize("highlight", filename))
+
+    if (self.bytecode) and (filename:endsWith(".lua")) then
+        local bytecode = _dumpScript(filedata, filename, self.strip)
+        if (bytecode) then
+            self.writer:add(filename .. 'c', bytecode, self.level)
+        end
+    end
 end
 
 function BundleBuilder:copyStaticFile(subPath, name)
@@ -178,7 +493,22 @@ exports.loadBundleFile = loadBundleFile
 local ZipBuilder = Object:extend()
 exports.ZipBuilder = ZipBuilder
 
-function ZipBuilder:build(pathname, skipList)
+--[[
+Build `<pathname>.zip` from the files in the directory `pathname`.
+@param skipList {Array} files ({ name, md5sum }) which are left out when
+  unchanged
+@param options {Object}
+- bytecode {Boolean} also add the compiled `.lua` files as `.luac` entries
+- strip {Boolean} strip the debug information from the bytecode
+- jobs {Number} number of files compressed at the same time, default 4
+@param callback {Function} optional, `callback(err, filename)`. When given
+  the files are streamed from disk and compressed on the threadpool by
+  `miniz.new_parallel_writer`, the entries are in the same order as
+  without it.
+--]]
+function ZipBuilder:build(pathname, skipList, options, callback)
+    options = options or {}
+
     local basename = path.basename(pathname)
     local dirname  = path.dirname(pathname)
 
@@ -191,15 +521,24 @@ function ZipBuilder:build(pathname, skipList)
     end
 
     local filename = path.join(dirname, basename .. ".zip")
-    local fd = fs.openSync(filename, "w", 511)
-    if (not fd) then
-        return filename .. ' open failed!'
-    end
+    local fd, writer, err
+    if (callback) then
+        writer, err = miniz.new_parallel_writer(filename, options.jobs)
+        if (not writer) then
+            return callback(err)
+        end
 
-    local writer = miniz.new_writer()
-    if (not writer) then
-        fs.closeSync(fd)
-        return -1
+    else
+        fd = fs.openSync(filename, "w", 511)
+        if (not fd) then
+            return filename .. ' open failed!'
+        end
+
+        writer = miniz.new_writer()
+        if (not writer) then
+            fs.closeSync(fd)
+            return -1
+        end
     end
 
     local _copy_directory, _copy_file, _copy_file_data, _get_file_info
@@ -240,11 +579,25 @@ function ZipBuilder:build(pathname, skipList)
     end
 
     function _copy_file_data(srcfile, destfile)
-        local filedata = fs.readFileSync(srcfile)
         local filename = destfile:gsub('\\', '/')
+        local item = fileList[filename]
+
+        -- The parallel writer reads the file itself
+        if (callback) and (not item) then
+            writer:add_file(filename, srcfile, 9)
+            print("  adding: " .. filename)
+
+            if (options.bytecode) and (filename:endsWith(".lua")) then
+                local bytecode = _dumpScript(fs.readFileSync(srcfile), filename, options.strip)
+                if (bytecode) then
+                    writer:add(filename .. 'c', bytecode, 9)
+                end
+            end
+            return
+        end
 
+        local filedata = fs.readFileSync(srcfile)
         if (filedata) then
-            local item = fileList[filename]
             if (item) then
                 local md5sum = utils.bin2hex(utils.md5(filedata))
                 if (item.md5sum == md5sum) then
@@ -255,6 +608,13 @@ function ZipBuilder:build(pathname, skipList)
 
             writer:add(filename, filedata, 9)
             print("  adding: " .. filename)
+
+            if (options.bytecode) and (filename:endsWith(".lua")) then
+                local bytecode = _dumpScript(filedata, filename, options.strip)
+                if (bytecode) then
+                    writer:add(filename .. 'c', bytecode, 9)
+                end
+            end
         end
     end
 
@@ -274,7 +634,18 @@ function ZipBuilder:build(pathname, skipList)
 
     _copy_directory(pathname, "")
 
+    if (options.bytecode) then
+        writer:add(exports.BYTECODE_TAG_NAME, exports.getBytecodeTag(), 9)
+    end
+
     -- finish
+    if (callback) then
+        writer:finish(function(err)
+            callback(err, (not err) and filename or nil)
+        end)
+        return
+    end
+
     local offset = nil
     fs.writeSync(fd, offset, writer:finalize())
     fs.closeSync(fd)
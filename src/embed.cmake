@@ -0,0 +1,56 @@
+cmake_minimum_required(VERSION 2.8)
+
+#
+# BUILD_EMBED_LUA: compile the `lua/*.lua` library into the lnode binary. 
+# The modules are registered in `package.preload` by `lnode_openlibs`, so
+# `require` finds them without any file system access.
+#
+# On native builds the scripts are compiled to bytecode by the `lnode_embed`
+# tool. When cross compiling (BOARD_TYPE is not `local`) the tool can not 
+# run on the build host and the sources are embedded instead, they are 
+# compiled when required.
+#
+
+set(EMBED_LUA_DIR ${CMAKE_CURRENT_LIST_DIR}/../lua)
+set(EMBED_OUTPUT ${CMAKE_CURRENT_BINARY_DIR}/lnode_embed_lua.c)
+
+file(GLOB_RECURSE EMBED_LUA_FILES RELATIVE ${EMBED_LUA_DIR} ${EMBED_LUA_DIR}/*.lua)
+list(SORT EMBED_LUA_FILES)
+
+set(EMBED_LUA_DEPENDS)
+foreach (file ${EMBED_LUA_FILES})
+  list(APPEND EMBED_LUA_DEPENDS ${EMBED_LUA_DIR}/${file})
+endforeach ()
+
+include_directories(${CMAKE_CURRENT_LIST_DIR})
+
+if ((BOARD_TYPE STREQUAL local) AND (NOT CMAKE_CROSSCOMPILING))
+  if (WIN32)
+    add_executable(lnode_embed ${CMAKE_CURRENT_LIST_DIR}/lnode_embed.c)
+    target_link_libraries(lnode_embed lualib)
+
+  else ()
+    add_executable(lnode_embed ${CMAKE_CURRENT_LIST_DIR}/lnode_embed.c ${SRC_LUACORE})
+    target_link_libraries(lnode_embed ${LIBS})
+  endif ()
+
+  add_custom_command(
+    OUTPUT ${EMBED_OUTPUT}
+    COMMAND lnode_embed ${EMBED_OUTPUT} ${EMBED_LUA_DIR} ${EMBED_LUA_FILES}
+    DEPENDS lnode_embed ${EMBED_LUA_DEPENDS}
+    COMMENT "Compiling lua/*.lua into lnode"
+  )
+
+else ()
+  add_custom_command(
+    OUTPUT ${EMBED_OUTPUT}
+    COMMAND ${CMAKE_COMMAND} -DOUTPUT=${EMBED_OUTPUT} -DLUA_DIR=${EMBED_LUA_DIR}
+      -P ${CMAKE_CURRENT_LIST_DIR}/embed_source.cmake
+    DEPENDS ${CMAKE_CURRENT_LIST_DIR}/embed_source.cmake ${EMBED_LUA_DEPENDS}
+    COMMENT "Embedding lua/*.lua sources into lnode"
+  )
+endif ()
+
+set(LNODE_EMBED_SOURCES ${EMBED_OUTPUT})
+set_source_files_properties(${CMAKE_CURRENT_LIST_DIR}/lnode.c 
+  PROPERTIES COMPILE_DEFINITIONS LNODE_EMBED_LUA)
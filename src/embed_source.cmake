@@ -0,0 +1,29 @@
+#
+# cmake -DOUTPUT=<file.c> -DLUA_DIR=<dir> -P embed_source.cmake
+#
+# Writes the sources of the `LUA_DIR/**/*.lua` files as a C file with the 
+# `lnode_embed_entries` table, the same output as `lnode_embed` but without
+# compiling the scripts. Used when cross compiling, see `embed.cmake`.
+#
+
+file(GLOB_RECURSE FILES RELATIVE ${LUA_DIR} ${LUA_DIR}/*.lua)
+list(SORT FILES)
+
+set(CONTENT "/* Generated by embed_source.cmake, do not edit. */\n\n#include \"lnode.h\"\n")
+set(ENTRIES "")
+set(INDEX 0)
+
+foreach (file ${FILES})
+  file(READ ${LUA_DIR}/${file} DATA HEX)
+  string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," DATA "${DATA}")
+  set(CONTENT "${CONTENT}\nstatic const unsigned char lnode_embed_${INDEX}[] = {${DATA}};\n")
+
+  # `http/init.lua` -> `http`, `http/static.lua` -> `http/static`
+  string(REGEX REPLACE "\\.lua$" "" NAME ${file})
+  string(REGEX REPLACE "/init$" "" NAME ${NAME})
+  set(ENTRIES "${ENTRIES}  { \"${NAME}\", \"=lua/${file}\", lnode_embed_${INDEX}, sizeof(lnode_embed_${INDEX}) },\n")
+
+  math(EXPR INDEX "${INDEX} + 1")
+endforeach ()
+
+file(WRITE ${OUTPUT} "${CONTENT}\nconst lnode_embed_entry_t lnode_embed_entries[] = {\n${ENTRIES}  { NULL, NULL, NULL, 0 }\n};\n")
@@ -38,6 +38,8 @@
 #define WITH_LMESSAGE     1
 #define WITH_LUTILS       1
 #define WITH_MINIZ        1
+#define WITH_MSGPACK      1
+#define WITH_WEBSOCKET    1
 
 LUALIB_API int luaopen_cjson        (lua_State* const L);
 LUALIB_API int luaopen_env          (lua_State* const L);
@@ -45,6 +47,8 @@ LUALIB_API int luaopen_lhttp_parser (lua_State* const L);
 LUALIB_API int luaopen_lmessage     (lua_State* const L);
 LUALIB_API int luaopen_lutils       (lua_State* const L);
 LUALIB_API int luaopen_miniz        (lua_State* const L);
+LUALIB_API int luaopen_msgpack      (lua_State* const L);
+LUALIB_API int luaopen_lwebsocket   (lua_State* const L);
 
 
 LUALIB_API int luaopen_lsqlite      (lua_State* const L);
@@ -53,6 +57,22 @@ LUALIB_API int luaopen_lmedia_ts_reader(lua_State* const L);
 LUALIB_API int luaopen_lmedia_ts_writer(lua_State* const L);
 
 
+#ifdef LNODE_EMBED_LUA
+extern const lnode_embed_entry_t lnode_embed_entries[];
+
+/** package.preload loader of an embedded module */
+static int lnode_embed_loader(lua_State* L) {
+  const lnode_embed_entry_t* entry = lua_touserdata(L, lua_upvalueindex(1));
+  if (luaL_loadbufferx(L, (const char*)entry->data, entry->size, entry->chunkname, "bt")) {
+    return lua_error(L);
+  }
+
+  lua_pushstring(L, entry->name);
+  lua_call(L, 1, 1);
+  return 1;
+}
+#endif
+
 static int lua_table_set(lua_State *L, const char* key, const char* value)
 {
   lua_pushstring(L, value);
@@ -414,6 +434,16 @@ LUALIB_API int lnode_openlibs(lua_State* L) {
   lua_setfield(L, -2, "miniz");
 #endif
 
+#ifdef WITH_MSGPACK
+  lua_pushcfunction(L, luaopen_msgpack);
+  lua_setfield(L, -2, "msgpack");
+#endif
+
+#ifdef WITH_WEBSOCKET
+  lua_pushcfunction(L, luaopen_lwebsocket);
+  lua_setfield(L, -2, "lwebsocket");
+#endif
+
 #ifdef LUA_USE_LMEDIA
   lua_pushcfunction(L, luaopen_lmedia);
   lua_setfield(L, -2, "lmedia");
@@ -430,6 +460,15 @@ LUALIB_API int lnode_openlibs(lua_State* L) {
   lua_setfield(L, -2, "lsqlite");  
 #endif
 
+#ifdef LNODE_EMBED_LUA
+  // The `lua/*.lua` library compiled into the binary
+  for (const lnode_embed_entry_t* entry = lnode_embed_entries; entry->name; entry++) {
+    lua_pushlightuserdata(L, (void*)entry);
+    lua_pushcclosure(L, lnode_embed_loader, 1);
+    lua_setfield(L, -2, entry->name);
+  }
+#endif
+
   lua_pop(L, 1);
 
   return 0;
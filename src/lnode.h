@@ -24,6 +24,14 @@
 #include "uv.h"
 #include "luv.h"
 
+/** A Lua module compiled into the lnode binary, see `src/embed.cmake` */
+typedef struct {
+  const char* name;             // module name, `http/static`
+  const char* chunkname;        // `=lua/http/static.lua`
+  const unsigned char* data;    // bytecode or source
+  size_t size;
+} lnode_embed_entry_t;
+
 LUALIB_API int lnode_call_file(lua_State* L, const char* filename);
 LUALIB_API int lnode_call_script(lua_State* L, const char* script, const char* name);
 LUALIB_API int lnode_create_arg_table(lua_State *L, char **argv, int argc, int offset);
@@ -0,0 +1,156 @@
+/**
+ *  Copyright 2016 The Node.lua Authors. All Rights Reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/**
+ * Build tool: compiles Lua scripts to bytecode and writes them as a C source
+ * file with a `lnode_embed_entries` table, which is linked into lnode when
+ * `BUILD_EMBED_LUA` is enabled (see `src/embed.cmake`).
+ *
+ * Usage: lnode_embed <output.c> <basedir> <file.lua>...
+ * The file names are relative to `basedir`, `http/init.lua` becomes the
+ * module `http`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+typedef struct {
+  FILE* output;
+  size_t size;
+} embed_writer_t;
+
+static int embed_write(lua_State* L, const void* data, size_t size, void* ud) {
+  embed_writer_t* writer = ud;
+  const unsigned char* p = data;
+  (void)L;
+
+  for (size_t i = 0; i < size; i++) {
+    fprintf(writer->output, "%s%u,", (writer->size % 20 == 0) ? "\n  " : "", p[i]);
+    writer->size++;
+  }
+
+  return 0;
+}
+
+static char* embed_read_file(const char* filename, size_t* size) {
+  FILE* file = fopen(filename, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char* data = malloc(length > 0 ? length : 1);
+  if (data && fread(data, 1, length, file) != (size_t)length) {
+    free(data);
+    data = NULL;
+  }
+
+  fclose(file);
+  *size = (size_t)length;
+  return data;
+}
+
+// `http/init.lua` -> `http`, `http/static.lua` -> `http/static`
+static void embed_module_name(const char* path, char* name, size_t size) {
+  snprintf(name, size, "%s", path);
+
+  size_t len = strlen(name);
+  if (len > 4 && strcmp(name + len - 4, ".lua") == 0) {
+    name[len - 4] = '\0';
+    len -= 4;
+  }
+
+  if (len > 5 && strcmp(name + len - 5, "/init") == 0) {
+    name[len - 5] = '\0';
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <output.c> <basedir> <file.lua>...\n", argv[0]);
+    return 1;
+  }
+
+  FILE* output = fopen(argv[1], "wb");
+  if (output == NULL) {
+    fprintf(stderr, "%s: can not open\n", argv[1]);
+    return 1;
+  }
+
+  lua_State* L = luaL_newstate();
+  int count = argc - 3;
+  int ret = 0;
+
+  fprintf(output, "/* Generated by lnode_embed, do not edit. */\n\n");
+  fprintf(output, "#include \"lnode.h\"\n");
+
+  for (int i = 0; i < count; i++) {
+    const char* path = argv[i + 3];
+    char filename[4096];
+    char chunkname[4096];
+    snprintf(filename, sizeof(filename), "%s/%s", argv[2], path);
+    snprintf(chunkname, sizeof(chunkname), "=lua/%s", path);
+
+    size_t size = 0;
+    char* source = embed_read_file(filename, &size);
+    if (source == NULL) {
+      fprintf(stderr, "%s: can not read\n", filename);
+      ret = 1;
+      break;
+    }
+
+    int status = luaL_loadbufferx(L, source, size, chunkname, "t");
+    free(source);
+    if (status != LUA_OK) {
+      fprintf(stderr, "%s\n", lua_tostring(L, -1));
+      ret = 1;
+      break;
+    }
+
+    embed_writer_t writer = { output, 0 };
+    fprintf(output, "\nstatic const unsigned char lnode_embed_%d[] = {", i);
+    lua_dump(L, embed_write, &writer, 0);
+    fprintf(output, "\n};\n");
+    lua_pop(L, 1);
+  }
+
+  fprintf(output, "\nconst lnode_embed_entry_t lnode_embed_entries[] = {\n");
+  for (int i = 0; ret == 0 && i < count; i++) {
+    char name[4096];
+    embed_module_name(argv[i + 3], name, sizeof(name));
+    fprintf(output, "  { \"%s\", \"=lua/%s\", lnode_embed_%d, sizeof(lnode_embed_%d) },\n",
+      name, argv[i + 3], i, i);
+  }
+  fprintf(output, "  { NULL, NULL, NULL, 0 }\n};\n");
+
+  lua_close(L);
+  fclose(output);
+
+  if (ret != 0) {
+    remove(argv[1]);
+  }
+
+  return ret;
+}
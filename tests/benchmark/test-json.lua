@@ -0,0 +1,106 @@
+local uv     = require('uv')
+local cjson  = require('cjson')
+local assert = require('assert')
+local tap    = require('ext/tap')
+
+-- Encode and decode throughput of cjson with a few generated corpora:
+-- - logs:    records with long ASCII messages, the common case
+-- - sensors: numeric readings with short keys
+-- - api:     nested objects like a REST API response
+-- - escaped: text with quotes, newlines, slashes and non-ASCII characters
+
+local TARGET_SIZE = 4 * 1024 * 1024
+local MIN_TIME    = 500 -- ms
+
+local WORDS = {
+	'device', 'gateway', 'connected', 'timeout', 'request', 'response', 'status',
+	'firmware', 'update', 'temperature', 'humidity', 'voltage', 'network', 'socket',
+	'error', 'retry', 'session', 'config', 'sensor', 'reading', 'value', 'channel'
+}
+
+local function sentence(seed, count)
+	local items = {}
+	for i = 1, count do
+		items[i] = WORDS[(seed * 31 + i * 17) % #WORDS + 1]
+	end
+	return table.concat(items, ' ')
+end
+
+-- Repeat `make(i)` until the encoded array is about TARGET_SIZE bytes
+local function corpus(make)
+	local items, size = {}, 0
+	while size < TARGET_SIZE do
+		local item = make(#items + 1)
+		items[#items + 1] = item
+		size = size + #cjson.encode(item)
+	end
+	return items
+end
+
+local CORPORA = {
+	{ 'logs', function(i)
+		return {
+			time = 1500000000 + i, level = 'info', module = 'gateway',
+			message = sentence(i, 40) .. '. ' .. sentence(i + 1, 30) .. '.'
+		}
+	end },
+
+	{ 'sensors', function(i)
+		return {
+			id = i, t = 1500000000 + i * 60, temp = 20 + (i % 100) / 10,
+			hum = 40 + (i % 37), v = { 3.3, 3.28 + (i % 5) / 100, 12.1, 0 }
+		}
+	end },
+
+	{ 'api', function(i)
+		return {
+			id = i, name = 'user' .. i, email = 'user' .. i .. '@example.com',
+			active = (i % 3 ~= 0), roles = { 'read', 'write' },
+			profile = {
+				title = sentence(i, 4), bio = sentence(i, 16),
+				address = { city = 'Shenzhen', street = sentence(i, 3), zip = '518000' }
+			}
+		}
+	end },
+
+	{ 'escaped', function(i)
+		return {
+			path = '/var/log/lnode/' .. i .. '/app.log',
+			text = '"' .. sentence(i, 8) .. '"\n\t' .. sentence(i, 6) .. ' \\ 温度 ' .. i .. ' ℃',
+			html = '<a href="/device/' .. i .. '">' .. sentence(i, 3) .. '</a>'
+		}
+	end }
+}
+
+-- Run `fn` until at least MIN_TIME ms passed, returns MB/s
+local function measure(size, fn)
+	local count, start = 0, uv.hrtime()
+	local elapsed
+	repeat
+		fn()
+		count = count + 1
+		elapsed = (uv.hrtime() - start) / 1000000
+	until elapsed >= MIN_TIME
+
+	return size * count / (1024 * 1024) / (elapsed / 1000)
+end
+
+return tap(function (test)
+
+for _, item in ipairs(CORPORA) do
+	local name, make = item[1], item[2]
+
+	test('json ' .. name, function ()
+		local data = corpus(make)
+		local text = cjson.encode(data)
+		assert.equal(#cjson.decode(text), #data)
+
+		local encode = measure(#text, function() cjson.encode(data) end)
+		local decode = measure(#text, function() cjson.decode(text) end)
+
+		print(string.format('%-8s %6.2fMB  encode: %7.1f MB/s  decode: %7.1f MB/s',
+			name, #text / (1024 * 1024), encode, decode))
+	end)
+end
+
+end)
@@ -0,0 +1,116 @@
+local uv      = require('uv')
+local cjson   = require('cjson')
+local msgpack = require('msgpack')
+local assert  = require('assert')
+local tap     = require('ext/tap')
+
+-- Size and encode/decode speed of msgpack compared with cjson:
+-- - sensors:  numeric readings with short keys, device to gateway
+-- - status:   a device status report with nested objects
+-- - messages: many small messages, encoded and decoded one at a time
+--   as `lmessage` payloads and RPC calls are
+-- Speeds are in items (records or messages) per second.
+
+local TARGET_SIZE = 4 * 1024 * 1024
+local MIN_TIME    = 500 -- ms
+
+-- Repeat `make(i)` until the JSON text of the array is about TARGET_SIZE bytes
+local function corpus(make)
+	local items, size = {}, 0
+	while size < TARGET_SIZE do
+		local item = make(#items + 1)
+		items[#items + 1] = item
+		size = size + #cjson.encode(item)
+	end
+	return items
+end
+
+local function sensor(i)
+	return {
+		id = i, t = 1500000000 + i * 60, temp = 20 + (i % 100) / 10,
+		hum = 40 + (i % 37), rssi = -40 - (i % 50), v = { 3.3, 3.28 + (i % 5) / 100, 12.1, 0 }
+	}
+end
+
+local function status(i)
+	return {
+		did = 'dev-' .. i, online = (i % 7 ~= 0), uptime = i * 3600,
+		firmware = { version = '1.0.' .. (i % 20), build = 20170000 + i },
+		network = { ip = '192.168.1.' .. (i % 250), mac = string.format('00:1a:2b:%02x:%02x:%02x', i % 256, i % 200, i % 100) },
+		ports = { { name = 'uart0', open = true }, { name = 'uart1', open = false } }
+	}
+end
+
+-- Run `fn` until at least MIN_TIME ms passed, returns runs per second
+local function measure(fn)
+	local count, start = 0, uv.hrtime()
+	local elapsed
+	repeat
+		fn()
+		count = count + 1
+		elapsed = (uv.hrtime() - start) / 1000000
+	until elapsed >= MIN_TIME
+
+	return count / (elapsed / 1000)
+end
+
+local function report(name, format, size, count, encode, decode)
+	print(string.format('%-8s %-7s %7.2fMB  encode: %9.0f items/s  decode: %9.0f items/s',
+		name, format, size / (1024 * 1024), encode * count, decode * count))
+end
+
+return tap(function (test)
+
+for _, item in ipairs({ { 'sensors', sensor }, { 'status', status } }) do
+	local name, make = item[1], item[2]
+
+	test('msgpack ' .. name, function ()
+		local data = corpus(make)
+		local text = cjson.encode(data)
+		local binary = msgpack.encode(data)
+		assert.equal(#msgpack.decode(binary), #data)
+
+		report(name, 'json', #text, #data,
+			measure(function() cjson.encode(data) end),
+			measure(function() cjson.decode(text) end))
+
+		report(name, 'msgpack', #binary, #data,
+			measure(function() msgpack.encode(data) end),
+			measure(function() msgpack.decode(binary) end))
+	end)
+end
+
+test('msgpack messages', function ()
+	local messages = corpus(sensor)
+	local texts, binaries = {}, {}
+	local textSize, binarySize = 0, 0
+	for i, message in ipairs(messages) do
+		texts[i] = cjson.encode(message)
+		binaries[i] = msgpack.encode(message)
+		textSize = textSize + #texts[i]
+		binarySize = binarySize + #binaries[i]
+	end
+
+	report('messages', 'json', textSize, #messages,
+		measure(function() for i = 1, #messages do cjson.encode(messages[i]) end end),
+		measure(function() for i = 1, #texts do cjson.decode(texts[i]) end end))
+
+	report('messages', 'msgpack', binarySize, #messages,
+		measure(function() for i = 1, #messages do msgpack.encode(messages[i]) end end),
+		measure(function() for i = 1, #binaries do msgpack.decode(binaries[i]) end end))
+
+	-- The same messages concatenated, as received from a socket
+	local stream = table.concat(binaries)
+	local count = 0
+	local decoder = msgpack.decoder(function() count = count + 1 end)
+	local rate = measure(function()
+		for i = 1, #stream, 4096 do
+			decoder:write(stream:sub(i, i + 4095))
+		end
+		assert(decoder:finish())
+	end)
+	print(string.format('%-8s %-7s %7.2fMB  stream decode: %9.0f items/s',
+		'messages', 'msgpack', #stream / (1024 * 1024), rate * #messages))
+end)
+
+end)
@@ -0,0 +1,179 @@
+local uv     = require('uv')
+local assert = require('assert')
+local tap    = require('ext/tap')
+
+-- Statements per second of the sqlite3 binding:
+-- - prepare: prepare, bind, step and finalize for every statement
+-- - cached:  the same statements from the statement cache of the connection
+-- Rows per second of bulk inserts and reads of time-series readings, with
+-- one call per column and row compared with insert_many and fetch_many.
+-- Queued writes per second to a file, one transaction each with an async
+-- connection compared with the transactions shared by a pool.
+
+local ok, lsqlite = pcall(require, 'lsqlite')
+if not ok then
+	print('lsqlite not available, skipped')
+	return
+end
+
+local api    = lsqlite.api
+local errors = lsqlite.errors
+
+local MIN_TIME = 500 -- ms
+local BATCH    = 10000
+
+-- Run `fn` until at least MIN_TIME ms passed, returns runs per second
+local function measure(fn)
+	local count, start = 0, uv.hrtime()
+	local elapsed
+	repeat
+		fn(count)
+		count = count + 1
+		elapsed = (uv.hrtime() - start) / 1000000
+	until elapsed >= MIN_TIME
+
+	return count / (elapsed / 1000)
+end
+
+local function open()
+	local err, db = api.open(':memory:')
+	assert.equal(err, errors.OK)
+	db:exec('CREATE TABLE readings (id INTEGER PRIMARY KEY, t INTEGER, sensor TEXT, value REAL)')
+	db:exec('CREATE INDEX readings_t ON readings (t)')
+	return db
+end
+
+local SELECT = 'SELECT sensor, value FROM readings WHERE t >= ? AND t < ? ORDER BY t LIMIT 10'
+local INSERT = 'INSERT INTO readings (t, sensor, value) VALUES (?, ?, ?)'
+
+return tap(function (test)
+
+test('sqlite statement cache', function ()
+	local db = open()
+
+	local prepare = measure(function(i)
+		local err, stmt = db:prepare(INSERT)
+		stmt:bind(1, i)
+		stmt:bind(2, 'temp')
+		stmt:bind(3, 20.5)
+		stmt:step()
+		stmt:finalize()
+
+		err, stmt = db:prepare(SELECT)
+		stmt:bind(1, i - 10)
+		stmt:bind(2, i)
+		while stmt:step() == errors.ROW do end
+		stmt:finalize()
+	end)
+
+	local params = { 0, 'temp', 20.5 }
+	local range = { 0, 0 }
+	local cached = measure(function(i)
+		params[1] = i
+		local err, stmt = db:cached(INSERT, params)
+		stmt:step()
+
+		range[1], range[2] = i - 10, i
+		err, stmt = db:cached(SELECT, range)
+		while stmt:step() == errors.ROW do end
+	end)
+
+	local stats = db:cache_stats()
+	print(string.format('prepare: %9.0f statements/s', prepare * 2))
+	print(string.format('cached:  %9.0f statements/s  hit rate: %.4f', cached * 2, stats.hit_rate))
+
+	db:cache_clear()
+	db:close()
+end)
+
+test('sqlite bulk insert and fetch', function ()
+	local rows = {}
+	for i = 1, BATCH do
+		rows[i] = { i, 'temp' .. (i % 8), 20 + (i % 100) / 10 }
+	end
+
+	-- A new database for each, the inserts get slower as the table grows
+	local db = open()
+	local err, stmt = db:prepare(INSERT)
+	local single = measure(function()
+		db:exec('BEGIN')
+		for _, row in ipairs(rows) do
+			stmt:bind(1, row[1])
+			stmt:bind(2, row[2])
+			stmt:bind(3, row[3])
+			stmt:step()
+			stmt:reset()
+		end
+		db:exec('COMMIT')
+	end)
+	stmt:finalize()
+	db:close()
+
+	db = open()
+	err, stmt = db:prepare(INSERT)
+	local bulk = measure(function()
+		assert.equal(stmt:insert_many(rows), errors.OK)
+	end)
+	stmt:finalize()
+
+	print(string.format('insert:      %9.0f rows/s', single * BATCH))
+	print(string.format('insert_many: %9.0f rows/s', bulk * BATCH))
+
+	err, stmt = db:prepare('SELECT t, sensor, value FROM readings LIMIT ' .. BATCH)
+	single = measure(function()
+		stmt:reset()
+		while stmt:step() == errors.ROW do
+			stmt:arow()
+		end
+	end)
+
+	bulk = measure(function()
+		stmt:reset()
+		repeat
+			err = stmt:fetch_many(1000)
+		until err ~= errors.ROW
+	end)
+	stmt:finalize()
+
+	print(string.format('step, arow:  %9.0f rows/s', single * BATCH))
+	print(string.format('fetch_many:  %9.0f rows/s', bulk * BATCH))
+
+	db:close()
+end)
+
+test('sqlite pool writes', function (_, _, expect)
+	local WRITES = 2000
+	local filename = os.tmpname() .. '.db'
+
+	-- Queue all writes at once, `done` is called after the last one
+	local function write(db, done)
+		local start, count = uv.hrtime(), 0
+		db:exec('CREATE TABLE IF NOT EXISTS readings (t INTEGER, sensor TEXT, value REAL)', function() end)
+		for i = 1, WRITES do
+			db:run(INSERT, { i, 'temp', 20.5 }, function(err)
+				assert(not err, err)
+				count = count + 1
+				if count == WRITES then
+					done(WRITES / ((uv.hrtime() - start) / 1e9))
+				end
+			end)
+		end
+	end
+
+	local db = assert(api.open_async(filename))
+	write(db, expect(function(rate)
+		print(string.format('async: %9.0f writes/s', rate))
+		db:close(expect(function()
+			os.remove(filename)
+
+			local pool = assert(api.open_pool(filename))
+			write(pool, expect(function(rate)
+				local stats = pool:stats()
+				print(string.format('pool:  %9.0f writes/s  transactions: %d', rate, stats.transactions))
+				pool:close(expect(function() os.remove(filename) end))
+			end))
+		end))
+	end))
+end)
+
+end)
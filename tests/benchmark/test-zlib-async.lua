@@ -0,0 +1,108 @@
+local uv  	 	= require('uv')
+local miniz 	= require('miniz')
+local assert 	= require('assert')
+local tap 		= require('ext/tap')
+
+-- Event loop latency while compressing: a 1ms repeating timer records how
+-- late it fires, with the work done on the loop thread (deflate) and on the
+-- threadpool (deflate_async).
+
+local DATA_SIZE = 4 * 1024 * 1024
+local ROUNDS    = 8
+local LEVEL     = 6
+
+local function makeData(size)
+	local items = {}
+	local total = 0
+	local i = 0
+	while total < size do
+		i = i + 1
+		local line = 'line ' .. i .. ' ' .. (i * 7919 % 100000) .. '\n'
+		items[#items + 1] = line
+		total = total + #line
+	end
+	return table.concat(items)
+end
+
+local data = makeData(DATA_SIZE)
+local FLAGS = 128 -- tdefl flags of level 6 (TDEFL_DEFAULT_MAX_PROBES)
+
+-- Call `run(done)` and report the timer lag until `done()` is called
+local function measure(name, run)
+	local timer = uv.new_timer()
+	local maxLag, totalLag, ticks = 0, 0, 0
+	local last = uv.hrtime()
+
+	timer:start(1, 1, function()
+		local now = uv.hrtime()
+		local lag = (now - last) / 1000000 - 1
+		if lag > maxLag then maxLag = lag end
+		totalLag = totalLag + math.max(lag, 0)
+		ticks = ticks + 1
+		last = now
+	end)
+
+	local start = uv.hrtime()
+	run(function()
+		timer:stop()
+		timer:close()
+
+		local elapsed = (uv.hrtime() - start) / 1000000
+		print(string.format('%-16s total: %7.1fms, ticks: %5d, max lag: %7.2fms, avg lag: %5.2fms',
+			name, elapsed, ticks, maxLag, totalLag / math.max(ticks, 1)))
+	end)
+end
+
+return tap(function (test)
+
+test('deflate on the loop thread', function (expect)
+	local done = expect(function() end)
+
+	measure('deflate', function(callback)
+		local count = 0
+		local next
+		next = function()
+			count = count + 1
+			if count > ROUNDS then
+				callback()
+				return done()
+			end
+
+			local compressed = miniz.deflate(data, FLAGS)
+			assert(#compressed > 0)
+
+			-- let the timer run between the rounds
+			local idle = uv.new_timer()
+			idle:start(1, 0, function()
+				idle:close()
+				next()
+			end)
+		end
+		next()
+	end)
+end)
+
+test('deflate_async on the threadpool', function (expect)
+	local done = expect(function() end)
+
+	measure('deflate_async', function(callback)
+		local count = 0
+		local next
+		next = function()
+			count = count + 1
+			if count > ROUNDS then
+				callback()
+				return done()
+			end
+
+			miniz.deflate_async(data, LEVEL, function(err, compressed)
+				assert.equal(err, nil)
+				assert(#compressed > 0)
+				next()
+			end)
+		end
+		next()
+	end)
+end)
+
+end)
@@ -2,6 +2,7 @@ local fs 	= require('fs')
 local path 	= require('path')
 
 local bundle = require('zlib')
+local assert = require('assert')
 
 return require('ext/tap')(function (test)
 
@@ -38,4 +39,79 @@ return require('ext/tap')(function (test)
 
 	end)
 
-end)
\ No newline at end of file
+	test("load modules from an indexed bundle", function ()
+		local miniz = require('miniz')
+
+		local writer = miniz.new_writer()
+		writer:add('lib/', '')
+		writer:add('lib/stored.lua', "return 'stored'", 0)
+		writer:add('lib/deflated.lua', "return '" .. string.rep('deflated', 100) .. "'", 9)
+		writer:add('lib/dir/init.lua', "return ...", 0)
+		writer:add('lib/bad.lua', "return return", 0)
+
+		local filename = path.join(os.tmpdir, 'test-bundle-index.zip')
+		fs.writeFileSync(filename, writer:finalize())
+		writer:close()
+
+		local reader = miniz.open_bundle(filename)
+		assert(reader)
+		assert.equal(reader:get_num_files(), 5)
+		assert.equal(reader:locate('lib/stored.lua'), 2)
+		assert.equal(reader:locate('lib/missing.lua'), nil)
+		assert.equal(reader:read('lib/stored.lua'), "return 'stored'")
+
+		assert.equal(reader:load('lib/stored.lua')(), 'stored')
+		assert.equal(reader:load('lib/deflated.lua')(), string.rep('deflated', 100))
+		assert.equal(reader:load('lib/dir/init.lua', '=dir')('arg'), 'arg')
+		assert.equal(reader:load('lib/'), nil)
+		assert.equal(reader:load('lib/missing.lua'), nil)
+
+		local ret, err = reader:load('lib/bad.lua', '=bad')
+		assert.equal(ret, nil)
+		assert(err:find('^bad:'))
+
+		reader:close()
+		reader:close()
+		assert(not pcall(reader.load, reader, 'lib/stored.lua'))
+
+		assert.equal(miniz.open_bundle(path.join(os.tmpdir, 'missing.zip')), nil)
+		os.remove(filename)
+	end)
+
+	test("bytecode bundle", function ()
+		local miniz = require('miniz')
+
+		local basePath = path.join(os.tmpdir, 'lnode-test-bytecode')
+		fs.mkdirpSync(path.join(basePath, 'lib'))
+		fs.writeFileSync(path.join(basePath, 'lib', 'bcsource.lua'),
+			"return function() return debug.getinfo(1, 'S').source end")
+		fs.writeFileSync(path.join(basePath, 'lib', 'bcbad.lua'), "return return")
+
+		local target = path.join(os.tmpdir, 'lnode-test-bc', 'bctest.zip')
+		os.remove(target)
+
+		local builder = bundle.BundleBuilder:new(basePath, target)
+		builder.bytecode = true
+		builder.strip = true
+		builder.level = 0
+		builder:addFile('lib')
+		builder:build()
+
+		local reader = miniz.open_bundle(target)
+		assert.equal(reader:read('.bytecode'), bundle.getBytecodeTag())
+		assert(reader:locate('lib/bcsource.lua'))
+		assert(reader:locate('lib/bcsource.luac'))
+		assert.equal(reader:locate('lib/bcbad.luac'), nil)
+		reader:close()
+
+		-- The stripped bytecode is loaded instead of the source
+		local cpath = package.cpath
+		package.cpath = path.join(os.tmpdir, 'lnode-test-bc', '?.zip') .. ';' .. cpath
+		local source = require('bctest/bcsource')
+		package.cpath = cpath
+
+		assert.equal(source(), '=?')
+		os.remove(target)
+	end)
+
+end)
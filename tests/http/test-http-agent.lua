@@ -0,0 +1,163 @@
+--[[
+
+Copyright 2016 The Node.lua Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local http   = require('http')
+local assert = require('assert')
+
+local HOST = "127.0.0.1"
+local PORT = process.env.PORT or 10085
+
+local body = "Hello world\n"
+
+local function createServer(connections)
+    local server = http.createServer(function(request, response)
+        response:setHeader("Content-Type", "text/plain")
+        response:setHeader("Content-Length", #body)
+        response:finish(body)
+    end)
+
+    server:on('connection', function()
+        connections.count = connections.count + 1
+    end)
+
+    return server
+end
+
+local function get(agent, callback)
+    local request
+    request = http.request({
+        host = HOST, port = PORT, path = "/", agent = agent
+    }, function(response)
+        local data = {}
+        response:on('data', function(chunk) data[#data + 1] = chunk end)
+        response:on('end', function() callback(table.concat(data), request) end)
+    end)
+
+    request:on('error', function(...) print(...) end)
+    request:done()
+end
+
+require('ext/tap')(function(test)
+
+test("http-agent sequential requests reuse the socket", function(expect)
+    local connections = { count = 0 }
+    local server = createServer(connections)
+    local agent = http.Agent:new()
+
+    server:listen(PORT, HOST, function()
+        get(agent, expect(function(data, request)
+            assert.equal(data, body)
+            assert.equal(request.reusedSocket, false)
+
+            setImmediate(function()
+                get(agent, expect(function(data, request)
+                    assert.equal(data, body)
+                    assert.equal(request.reusedSocket, true)
+                    assert.equal(connections.count, 1)
+
+                    agent:destroy()
+                    server:close()
+                end))
+            end)
+        end))
+    end)
+end)
+
+test("http-agent emits 'socket' asynchronously on reused sockets", function(expect)
+    local connections = { count = 0 }
+    local server = createServer(connections)
+    local agent = http.Agent:new()
+    local onTimeout = function() end
+
+    server:listen(PORT, HOST, function()
+        local request
+        request = http.request({
+            host = HOST, port = PORT, path = "/", agent = agent
+        }, function(response)
+            response:on('data', function() end)
+            response:on('end', expect(function()
+                local socket = request.socket
+                assert.equal(socket:listenerCount('timeout'), 1)
+
+                setImmediate(function()
+                    local created = false
+                    local reused
+                    reused = http.request({
+                        host = HOST, port = PORT, path = "/", agent = agent
+                    }, function(response)
+                        response:on('data', function() end)
+                        response:on('end', expect(function()
+                            agent:destroy()
+                            server:close()
+                        end))
+                    end)
+
+                    reused:on('socket', expect(function()
+                        assert.ok(created)
+                        assert.equal(reused.reusedSocket, true)
+                    end))
+                    created = true
+                    reused:done()
+                end)
+            end))
+        end)
+
+        request:on('socket', function(socket)
+            socket:on('timeout', onTimeout)
+            request:setTimeout(1000)
+        end)
+        request:done()
+    end)
+end)
+
+test("http-agent queues requests over maxSockets", function(expect)
+    local connections = { count = 0 }
+    local server = createServer(connections)
+    local agent = http.Agent:new({ maxSockets = 1 })
+    local finished = 0
+
+    server:listen(PORT, HOST, function()
+        for i = 1, 3 do
+            get(agent, expect(function(data)
+                assert.equal(data, body)
+                finished = finished + 1
+                if finished == 3 then
+                    assert.equal(connections.count, 1)
+
+                    agent:destroy()
+                    server:close()
+                end
+            end))
+        end
+    end)
+end)
+
+test("http-agent false closes the connection", function(expect)
+    local connections = { count = 0 }
+    local server = createServer(connections)
+
+    server:listen(PORT, HOST, function()
+        get(false, expect(function(data, request)
+            assert.equal(data, body)
+            assert.equal(request.agent, nil)
+            server:close()
+        end))
+    end)
+end)
+
+end)
@@ -0,0 +1,216 @@
+--[[
+
+Copyright 2016 The Node.lua Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local http     = require('http')
+local fs       = require('fs')
+local path     = require('path')
+local zlib     = require('zlib')
+local assert   = require('assert')
+local compress = require('http/compress')
+
+local HOST = "127.0.0.1"
+local PORT = process.env.PORT or 10089
+
+local root = path.join(os.tmpdir or '/tmp', 'lnode-test-compress')
+local content = string.rep('{"name":"value","index":12345}\n', 1000)
+
+local function get(urlPath, headers, callback)
+    local request = http.request({
+        host = HOST, port = PORT, path = urlPath, headers = headers
+    }, function(response)
+        local data = {}
+        response:on('data', function(chunk) data[#data + 1] = chunk end)
+        response:on('end', function() callback(response, table.concat(data)) end)
+    end)
+
+    request:on('error', function(...) print(...) end)
+    request:done()
+end
+
+local function startServer(callback, options)
+    fs.mkdirpSync(root)
+    fs.writeFileSync(path.join(root, 'data.json'), content)
+    fs.writeFileSync(path.join(root, 'image.png'), content)
+
+    local compression, cache = http.compress(options or { threshold = 100 })
+    local static = http.static(root)
+
+    local server = http.createServer(function(request, response)
+        compression(request, response, function()
+            local url = request.url
+            if url == '/api' then
+                response:setHeader('Content-Type', 'application/json')
+                -- Written in pieces, the body is streamed
+                for i = 1, #content, 1000 do
+                    response:write(content:sub(i, i + 999))
+                end
+                response:finish()
+
+            elseif url == '/small' then
+                response:setHeader('Content-Type', 'text/plain')
+                response:finish('small')
+
+            elseif url == '/mixed' then
+                -- A file sent after the body started to be compressed
+                response:setHeader('Content-Type', 'application/json')
+                response:write(content)
+
+                local fd = fs.openSync(path.join(root, 'data.json'), 'r')
+                response:sendFile(fd, 0, #content, function()
+                    fs.closeSync(fd)
+                end)
+
+            elseif url == '/encoded' then
+                response:setHeader('Content-Type', 'text/plain')
+                response:setHeader('Content-Encoding', 'br')
+                response:finish(content)
+
+            else
+                static(request, response)
+            end
+        end)
+    end)
+
+    server:listen(PORT, HOST, function() callback(server, cache) end)
+    return server
+end
+
+require('ext/tap')(function(test)
+
+test("http-compress negotiate", function()
+    assert.equal(compress.negotiate(nil), nil)
+    assert.equal(compress.negotiate('gzip, deflate'), 'gzip')
+    assert.equal(compress.negotiate('deflate'), 'deflate')
+    assert.equal(compress.negotiate('gzip;q=0.5, deflate'), 'deflate')
+    assert.equal(compress.negotiate('gzip;q=0, deflate;q=0'), nil)
+    assert.equal(compress.negotiate('*'), 'gzip')
+    assert.equal(compress.negotiate('identity'), nil)
+
+    assert.equal(compress.isCompressible('application/json; charset=utf-8'), true)
+    assert.equal(compress.isCompressible('text/html'), true)
+    assert.equal(compress.isCompressible('image/svg+xml'), true)
+    assert.equal(compress.isCompressible('image/png'), false)
+    assert.equal(compress.isCompressible('application/zip'), false)
+    assert.equal(compress.isCompressible('application/atom+xml'), true)
+    assert.equal(compress.isCompressible('application/xml'), true)
+    assert.equal(compress.isCompressible('application/x-javascript'), true)
+    assert.equal(compress.isCompressible(
+        'application/vnd.openxmlformats-officedocument.wordprocessingml.document'), false)
+    assert.equal(compress.isCompressible(nil), false)
+end)
+
+test("http-compress dynamic responses", function(expect)
+    startServer(function(server)
+        get('/api', { ['Accept-Encoding'] = 'gzip' }, expect(function(response, body)
+            assert.equal(response.statusCode, 200)
+            assert.equal(response.headers['Content-Encoding'], 'gzip')
+            assert.equal(response.headers['Transfer-Encoding'], 'chunked')
+            assert.equal(response.headers['Vary'], 'Accept-Encoding')
+            assert(#body < #content / 10)
+            assert.equal(zlib.gunzipSync(body), content)
+
+            get('/api', { ['Accept-Encoding'] = 'deflate' }, expect(function(response, body)
+                assert.equal(response.headers['Content-Encoding'], 'deflate')
+                assert.equal(zlib.inflateSync(body), content)
+
+                get('/api', {}, expect(function(response, body)
+                    assert.equal(response.headers['Content-Encoding'], nil)
+                    assert.equal(response.headers['Vary'], 'Accept-Encoding')
+                    assert.equal(body, content)
+
+                    get('/small', { ['Accept-Encoding'] = 'gzip' }, expect(function(response, body)
+                        assert.equal(response.headers['Content-Encoding'], nil)
+                        assert.equal(body, 'small')
+
+                        get('/encoded', { ['Accept-Encoding'] = 'gzip' }, expect(function(response, body)
+                            assert.equal(response.headers['Content-Encoding'], 'br')
+                            assert.equal(body, content)
+
+                            get('/mixed', { ['Accept-Encoding'] = 'gzip' }, expect(function(response, body)
+                                assert.equal(response.headers['Content-Encoding'], 'gzip')
+                                assert.equal(zlib.gunzipSync(body), content .. content)
+
+                                -- Don't reuse the connections to the closed server
+                                http.globalAgent:destroy()
+                                server:close()
+                            end))
+                        end))
+                    end))
+                end))
+            end))
+        end))
+    end)
+end)
+
+test("http-compress static files", function(expect)
+    startServer(function(server, cache)
+        local headers = { ['Accept-Encoding'] = 'gzip' }
+        get('/data.json', headers, expect(function(response, body)
+            assert.equal(response.statusCode, 200)
+            assert.equal(response.headers['Content-Encoding'], 'gzip')
+            assert.equal(tonumber(response.headers['Content-Length']), #body)
+            assert.equal(zlib.gunzipSync(body), content)
+            assert.equal(cache.size, #body)
+
+            local etag = response.headers['ETag']
+            assert(etag:find('^W/'))
+
+            -- Served from the cache
+            get('/data.json', headers, expect(function(response, body2)
+                assert.equal(body2, body)
+
+                headers['If-None-Match'] = etag
+                get('/data.json', headers, expect(function(response)
+                    assert.equal(response.statusCode, 304)
+
+                    -- Range requests get the identity encoding
+                    get('/data.json', { ['Accept-Encoding'] = 'gzip', Range = 'bytes=0-9' }, expect(function(response, body)
+                        assert.equal(response.statusCode, 206)
+                        assert.equal(response.headers['Content-Encoding'], nil)
+                        assert.equal(body, content:sub(1, 10))
+
+                        get('/image.png', { ['Accept-Encoding'] = 'gzip' }, expect(function(response, body)
+                            assert.equal(response.headers['Content-Encoding'], nil)
+                            assert.equal(body, content)
+
+                            http.globalAgent:destroy()
+                            server:close()
+                        end))
+                    end))
+                end))
+            end))
+        end))
+    end)
+end)
+
+test("http-compress static files over cacheSize", function(expect)
+    startServer(function(server, cache)
+        get('/data.json', { ['Accept-Encoding'] = 'gzip' }, expect(function(response, body)
+            assert.equal(response.statusCode, 200)
+            assert.equal(response.headers['Content-Encoding'], nil)
+            assert.equal(tonumber(response.headers['Content-Length']), #content)
+            assert.equal(body, content)
+            assert.equal(cache.size, 0)
+
+            http.globalAgent:destroy()
+            server:close()
+        end))
+    end, { threshold = 100, cacheSize = 1000 })
+end)
+
+end)
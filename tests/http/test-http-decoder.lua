@@ -225,4 +225,60 @@ require('ext/tap')(function (test)
     }, output))
   end)
 
+  local createDecoder2 = require('http/codec').createDecoder2
+
+  local function testDecoder2(inputs, stop)
+    local outputs = {}
+    local decoder
+    decoder = createDecoder2({ type = 'request' }, function (event, err)
+      outputs[#outputs + 1] = event or { error = err }
+      return stop and stop(event, decoder)
+    end)
+
+    for _, chunk in ipairs(inputs) do
+      decoder.decode(chunk)
+    end
+    return outputs
+  end
+
+  test("lhttp_parser decoder, pipelined requests", function ()
+    local output = testDecoder2({
+      "GET /a HTTP/1.1\r\nHost: a\r\n\r\nPOST /b HTTP/1.1\r\nContent-Le",
+      "ngth: 5\r\n\r\nhel", "lo"
+    })
+    p(output)
+    assert(deepEqual({
+      { method = "GET", path = "/a", version = 1.1, keepAlive = true, upgrade = false,
+        {"Host", "a"}
+      },
+      "",
+      { method = "POST", path = "/b", version = 1.1, keepAlive = true, upgrade = false,
+        {"Content-Length", "5"}
+      },
+      "hel",
+      "lo",
+      ""
+    }, output))
+  end)
+
+  test("lhttp_parser decoder, upgrade and errors", function ()
+    local rest
+    local output = testDecoder2({
+      "GET /ws HTTP/1.1\r\nConnection: Upgrade\r\nUpgrade: websocket\r\n\r\n\129\0"
+    }, function (event, decoder)
+      if type(event) == 'table' then
+        rest = decoder.buffer
+        return true
+      end
+    end)
+    assert(#output == 1)
+    assert(output[1].upgrade == true)
+    assert(rest == "\129\0")
+
+    output = testDecoder2({ "test\n\n" })
+    p(output)
+    assert(#output == 1)
+    assert(output[1].error)
+  end)
+
 end)
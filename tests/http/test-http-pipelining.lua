@@ -0,0 +1,81 @@
+--[[
+
+Copyright 2016 The Node.lua Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local http   = require('http')
+local net    = require('net')
+local assert = require('assert')
+
+local HOST = "127.0.0.1"
+local PORT = process.env.PORT or 10086
+
+require('ext/tap')(function(test)
+
+test("http-pipelining responses are written in request order", function(expect)
+    local server = nil
+    local count = 0
+
+    server = http.createServer(function(request, response)
+        count = count + 1
+        local body = request.url
+
+        local _send = function()
+            response:setHeader("Content-Type", "text/plain")
+            response:setHeader("Content-Length", #body)
+            response:finish(body)
+        end
+
+        -- The first response is finished last
+        if request.url == '/1' then
+            setTimeout(50, _send)
+        else
+            _send()
+        end
+    end)
+
+    server:listen(PORT, HOST, function()
+        local client = net.connect(PORT, HOST)
+        local data = {}
+
+        client:on('connect', function()
+            -- Three requests in one write
+            client:write("GET /1 HTTP/1.1\r\nHost: test\r\n\r\n" ..
+                "GET /2 HTTP/1.1\r\nHost: test\r\n\r\n" ..
+                "GET /3 HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n")
+        end)
+
+        client:on('data', function(chunk)
+            data[#data + 1] = chunk
+        end)
+
+        client:on('end', expect(function()
+            local text = table.concat(data)
+            local bodies = {}
+            for body in text:gmatch("\r\n\r\n(/%d)") do
+                bodies[#bodies + 1] = body
+            end
+
+            assert.equal(count, 3)
+            assert.equal(table.concat(bodies, ','), '/1,/2,/3')
+
+            client:destroy()
+            server:close()
+        end))
+    end)
+end)
+
+end)
@@ -0,0 +1,168 @@
+--[[
+
+Copyright 2016 The Node.lua Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local http   = require('http')
+local fs     = require('fs')
+local path   = require('path')
+local assert = require('assert')
+local static = require('http/static')
+
+local HOST = "127.0.0.1"
+local PORT = process.env.PORT or 10087
+
+local root = path.join(os.tmpdir or '/tmp', 'lnode-test-static')
+local content = string.rep("0123456789", 10000)
+
+local function get(urlPath, headers, callback)
+    local request = http.request({
+        host = HOST, port = PORT, path = urlPath, headers = headers
+    }, function(response)
+        local data = {}
+        response:on('data', function(chunk) data[#data + 1] = chunk end)
+        response:on('end', function() callback(response, table.concat(data)) end)
+    end)
+
+    request:on('error', function(...) print(...) end)
+    request:done()
+end
+
+local function startServer(callback)
+    fs.mkdirpSync(root)
+    fs.writeFileSync(path.join(root, 'index.html'), '<html></html>')
+    fs.writeFileSync(path.join(root, 'data.txt'), content)
+
+    local handler, cache = http.static(root)
+    local server = http.createServer(handler)
+    server:listen(PORT, HOST, function() callback(server, cache) end)
+    return server
+end
+
+require('ext/tap')(function(test)
+
+test("http-static parse helpers", function()
+    assert.equal(static.parseHttpDate("Sun, 06 Nov 1994 08:49:37 GMT"), 784111777)
+    assert.equal(static.parseHttpDate("bad date"), nil)
+
+    assert.equal(select(1, static.parseRange("bytes=0-9", 100)), 0)
+    assert.equal(select(2, static.parseRange("bytes=0-9", 100)), 9)
+    assert.equal(select(1, static.parseRange("bytes=-10", 100)), 90)
+    assert.equal(select(2, static.parseRange("bytes=90-", 100)), 99)
+    assert.equal(static.parseRange("bytes=100-", 100), false)
+    assert.equal(static.parseRange("bytes=0-1,5-6", 100), nil)
+end)
+
+test("http-static GET, 304 and range", function(expect)
+    startServer(function(server)
+        get('/data.txt', {}, expect(function(response, body)
+            assert.equal(response.statusCode, 200)
+            assert.equal(body, content)
+            assert.equal(response.headers['Content-Type'], 'text/plain')
+            assert.equal(response.headers['Accept-Ranges'], 'bytes')
+
+            local etag = response.headers['ETag']
+            assert(etag)
+
+            get('/data.txt', { ['If-None-Match'] = etag }, expect(function(response, body)
+                assert.equal(response.statusCode, 304)
+                assert.equal(body, '')
+                assert.equal(response.headers['Content-Length'], nil)
+                assert.equal(response.headers['Connection'], 'keep-alive')
+
+                get('/data.txt', { Range = 'bytes=10-19' }, expect(function(response, body)
+                    assert.equal(response.statusCode, 206)
+                    assert.equal(body, '0123456789')
+                    assert.equal(response.headers['Content-Range'], 'bytes 10-19/' .. #content)
+
+                    get('/data.txt', { Range = 'bytes=200000-' }, expect(function(response)
+                        assert.equal(response.statusCode, 416)
+
+                        get('/', {}, expect(function(response, body)
+                            assert.equal(response.statusCode, 200)
+                            assert.equal(body, '<html></html>')
+
+                            get('/missing.txt', {}, expect(function(response)
+                                assert.equal(response.statusCode, 404)
+                                server:close()
+                            end))
+                        end))
+                    end))
+                end))
+            end))
+        end))
+    end)
+end)
+
+test("http-static cache is invalidated when the file changes", function(expect)
+    startServer(function(server)
+        get('/data.txt', {}, expect(function(response, body)
+            assert.equal(body, content)
+
+            fs.writeFileSync(path.join(root, 'data.txt'), 'changed')
+            setTimeout(200, function()
+                get('/data.txt', {}, expect(function(response, body)
+                    assert.equal(response.statusCode, 200)
+                    assert.equal(body, 'changed')
+                    server:close()
+                end))
+            end)
+        end))
+    end)
+end)
+
+test("http-static directory index is cached", function(expect)
+    startServer(function(server, cache)
+        get('/', {}, expect(function(response, body)
+            assert.equal(body, '<html></html>')
+            assert(cache:get(root .. '/'))
+
+            fs.writeFileSync(path.join(root, 'index.html'), '<html>changed</html>')
+            setTimeout(200, function()
+                assert.equal(cache:get(root .. '/'), nil)
+
+                get('/', {}, expect(function(response, body)
+                    assert.equal(body, '<html>changed</html>')
+                    server:close()
+                end))
+            end)
+        end))
+    end)
+end)
+
+test("http-static file removed after the stat", function(expect)
+    startServer(function(server, cache)
+        get('/data.txt', {}, expect(function(response, body)
+            -- A stale entry, as if the watcher had not reported the removal
+            local filename = path.join(root, 'removed.txt')
+            local entry = {}
+            for key, value in pairs(cache:get(path.join(root, 'data.txt'))) do
+                entry[key] = value
+            end
+
+            entry.filename = filename
+            cache:set(filename, entry)
+
+            get('/removed.txt', {}, expect(function(response)
+                assert.equal(response.statusCode, 404)
+                assert.equal(cache:get(filename), nil)
+                server:close()
+            end))
+        end))
+    end)
+end)
+
+end)
@@ -0,0 +1,191 @@
+--[[
+
+Copyright 2016 The Node.lua Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local websocket  = require('websocket')
+local lwebsocket = require('lwebsocket')
+local utils      = require('utils')
+local assert     = require('assert')
+
+local HOST = "127.0.0.1"
+local PORT = process.env.PORT or 10088
+
+require('ext/tap')(function(test)
+
+test("websocket accept key", function()
+    -- Example from RFC 6455
+    assert.equal(websocket.acceptKey("dGhlIHNhbXBsZSBub25jZQ=="), "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=")
+    assert.equal(utils.bin2hex(utils.sha1("abc")), "a9993e364706816aba3e25717850c26c9cd0d89d")
+end)
+
+test("websocket frame codec", function()
+    local key = "\1\2\3\4"
+    local text = string.rep("Hello WebSocket ", 20) .. "!"
+    assert.equal(lwebsocket.mask(lwebsocket.mask(text, key), key), text)
+
+    -- masked text frame with a 16 bit length
+    local frame = lwebsocket.encode(lwebsocket.TEXT, text, true, key)
+    assert.equal(frame:byte(1), 0x81)
+    assert.equal(frame:byte(2), 0x80 + 126)
+
+    -- split across several execute() calls
+    local decoder = lwebsocket.new_decoder({ masked = true })
+    local events = decoder:execute(frame:sub(1, 3))
+    assert.equal(#events, 0)
+    events = decoder:execute(frame:sub(4, 10))
+    assert.equal(#events, 0)
+    events = decoder:execute(frame:sub(11))
+    assert.equal(#events, 1)
+    assert.equal(events[1].opcode, lwebsocket.TEXT)
+    assert.equal(events[1].payload, text)
+
+    -- fragmented message with a ping in the middle
+    local data = lwebsocket.encode(lwebsocket.BINARY, "abc", false, key)
+        .. lwebsocket.encode(lwebsocket.PING, "p", true, key)
+        .. lwebsocket.encode(lwebsocket.CONTINUATION, "def", false, key)
+        .. lwebsocket.encode(lwebsocket.CONTINUATION, "g", true, key)
+    events = decoder:execute(data)
+    assert.equal(#events, 2)
+    assert.equal(events[1].opcode, lwebsocket.PING)
+    assert.equal(events[1].payload, "p")
+    assert.equal(events[2].opcode, lwebsocket.BINARY)
+    assert.equal(events[2].payload, "abcdefg")
+
+    -- 64 bit length
+    local big = string.rep("x", 70000)
+    events = lwebsocket.new_decoder():execute(lwebsocket.encode(lwebsocket.BINARY, big))
+    assert.equal(events[1].payload, big)
+
+    -- protocol errors
+    local _, err, code = lwebsocket.new_decoder({ masked = true })
+        :execute(lwebsocket.encode(lwebsocket.TEXT, "a"))
+    assert.equal(code, 1002)
+
+    _, err, code = lwebsocket.new_decoder()
+        :execute(lwebsocket.encode(lwebsocket.CONTINUATION, "a"))
+    assert.equal(code, 1002)
+
+    _, err, code = lwebsocket.new_decoder()
+        :execute(lwebsocket.encode(lwebsocket.TEXT, "\255\254"))
+    assert.equal(code, 1007)
+
+    _, err, code = lwebsocket.new_decoder({ maxPayload = 10 })
+        :execute(lwebsocket.encode(lwebsocket.BINARY, big))
+    assert.equal(code, 1009)
+end)
+
+test("websocket parse extensions", function()
+    local extensions = websocket.parseExtensions(
+        'permessage-deflate; client_max_window_bits; server_max_window_bits="10", foo')
+    assert(extensions['permessage-deflate'])
+    assert.equal(extensions['permessage-deflate'].client_max_window_bits, true)
+    assert.equal(extensions['permessage-deflate'].server_max_window_bits, '10')
+    assert(extensions['foo'])
+end)
+
+local function echoTest(options, expect)
+    local messages = {
+        "hello",
+        string.rep("compressible ", 1000),
+        string.rep("\0\1\2\3", 20000)
+    }
+
+    local server
+    server = websocket.createServer(options, function(ws)
+        ws:on('message', function(data, isBinary)
+            ws:send(data, isBinary)
+        end)
+
+        ws:on('close', expect(function(code, reason)
+            assert.equal(code, 1000)
+            server:close()
+        end))
+    end)
+
+    server:listen(PORT, HOST, function()
+        local ws = websocket.connect('ws://' .. HOST .. ':' .. PORT .. '/echo', options)
+        local received = {}
+
+        ws:on('open', expect(function()
+            if options.perMessageDeflate then
+                assert(ws.deflate)
+            end
+
+            ws:ping('ping')
+            for i, message in ipairs(messages) do
+                ws:send(message, i == 3)
+            end
+        end))
+
+        ws:on('pong', expect(function(data)
+            assert.equal(data, 'ping')
+        end))
+
+        ws:on('message', function(data, isBinary)
+            received[#received + 1] = data
+            assert.equal(isBinary, #received == 3)
+            assert.equal(data, messages[#received])
+
+            if #received == #messages then
+                ws:close(1000, 'done')
+            end
+        end)
+
+        ws:on('close', expect(function(code, reason)
+            assert.equal(#received, #messages)
+            assert.equal(code, 1000)
+        end))
+    end)
+end
+
+test("websocket echo", function(expect)
+    echoTest({ fragmentSize = 1000 }, expect)
+end)
+
+test("websocket echo with permessage-deflate", function(expect)
+    echoTest({ perMessageDeflate = true }, expect)
+end)
+
+test("websocket compressed message over maxPayload", function(expect)
+    -- Compresses to a few hundred bytes, well below maxPayload on the wire
+    local options = { perMessageDeflate = true, maxPayload = 1000 }
+
+    local server
+    server = websocket.createServer(options, function(ws)
+        ws:on('message', function()
+            assert(false, 'message over maxPayload')
+        end)
+
+        ws:on('error', expect(function(err)
+            assert(err)
+        end))
+    end)
+
+    server:listen(PORT, HOST, function()
+        local ws = websocket.connect('ws://' .. HOST .. ':' .. PORT .. '/', options)
+        ws:on('open', expect(function()
+            ws:send(string.rep("x", 1000000))
+        end))
+
+        ws:on('close', expect(function(code)
+            assert.equal(code, 1009)
+            server:close()
+        end))
+    end)
+end)
+
+end)
@@ -80,6 +80,276 @@ require('ext/tap')(function(test)
     local obj = json.parse(s)
     assert(obj.f and obj.f == "ˤ ")
   end)
+  test('long strings', function()
+    -- Special characters at every position of the 16 byte blocks
+    for _, special in ipairs({ '"', '\\', '/', '\n', '\0', '\127', '\195\169' }) do
+      for i = 0, 40 do
+        local value = string.rep('a', i) .. special .. string.rep('b', 40 - i)
+        local text = json.stringify(value)
+        assert(json.parse(text) == value)
+        assert(not text:find('[%z\1-\31\127]'))
+      end
+    end
+  end)
+  test('numbers', function()
+    -- floats round trip with the shortest text
+    for _, x in ipairs({ 0.1, 1 / 3, 1e300, 5e-324, 2 ^ 53, -1.5e-7, 123456.789,
+                         1.7976931348623157e308, 2.2250738585072014e-308 }) do
+      local text = cjson.encode(x)
+      assert(cjson.decode(text) == x, text)
+    end
+    assert(cjson.encode(0.1) == '0.1')
+    assert(cjson.encode(1 / 3) == '0.3333333333333333')
+    assert(cjson.encode(1e21) == '1e+21')
+    assert(cjson.encode(1e-7) == '1e-7')
+    assert(cjson.encode(3.0) == '3')
+
+    -- integral floats above 2^53 are not read back as integers
+    assert(cjson.encode(4.96714178081e18) == '4.96714178081e+18')
+    assert(cjson.decode(cjson.encode(4.96714178081e18)) == 4.96714178081e18)
+    for i = 1, 10000 do
+      local x = math.random() * 2 ^ math.random(53, 63) // 1
+      local text = cjson.encode(x)
+      assert(cjson.decode(text) == x, text)
+      assert(cjson.decode(cjson.encode(-x)) == -x, text)
+    end
+
+    -- integers are kept as integers
+    assert(cjson.encode(math.maxinteger) == '9223372036854775807')
+    assert(cjson.encode(math.mininteger) == '-9223372036854775808')
+    assert(cjson.encode({ 1, -20, 300 }) == '[1,-20,300]')
+    assert(math.type(cjson.decode('9223372036854775807')) == 'integer')
+    assert(cjson.decode('-9223372036854775808') == math.mininteger)
+    assert(math.type(cjson.decode('[42]')[1]) == 'integer')
+    assert(math.type(cjson.decode('42.0')) == 'float')
+    assert(math.type(cjson.decode('1e2')) == 'float')
+    assert(math.type(cjson.decode('9223372036854775808')) == 'float')
+
+    -- the fixed precision is still available
+    local encoder = cjson.new()
+    encoder.encode_number_precision(3)
+    assert(encoder.encode(1 / 3) == '0.333')
+  end)
+  test('streaming decoder', function()
+    local doc = '[{"a":1,"b":[true,false,null],"s":"x\\u00e9\\ud83d\\ude00"}, 2.5, "str", {"k":{"n":-1e3}}]'
+
+    -- Any split of the text gives the same elements
+    for size = 1, 8 do
+      local values, keys = {}, {}
+      local decoder = json.decoder(function(value, key)
+        values[#values + 1] = value
+        keys[#keys + 1] = key
+      end)
+
+      for i = 1, #doc, size do
+        assert(decoder:write(doc:sub(i, i + size - 1)))
+      end
+      assert(decoder:finish())
+
+      assert(#values == 4)
+      deepEqual({ 1, 2, 3, 4 }, keys)
+      deepEqual({ a = 1, b = { true, false, json.null }, s = 'x\195\169\240\159\152\128' }, values[1])
+      assert(values[2] == 2.5)
+      assert(values[3] == 'str')
+      deepEqual({ k = { n = -1000 } }, values[4])
+    end
+
+    -- Whole documents
+    local values = {}
+    local decoder = json.decoder(function(value) values[#values + 1] = value end, { depth = 0 })
+    assert(decoder:write('{"x":1}\n{"x"'))
+    assert(decoder:write(':2} 3'))
+    assert(decoder:finish())
+    deepEqual({ { x = 1 }, { x = 2 }, 3 }, values)
+
+    -- Events
+    local events = {}
+    decoder = json.decoder(function(event, value)
+      events[#events + 1] = (value ~= nil) and (event .. '=' .. tostring(value)) or event
+    end, { mode = 'events' })
+    assert(decoder:write('{"a":[1,'))
+    assert(decoder:write('2],"b":tr'))
+    assert(decoder:write('ue}'))
+    assert(decoder:finish())
+    assert(table.concat(events, ' ') == 'start_object key=a start_array value=1 value=2 '
+      .. 'end_array key=b value=true end_object')
+
+    -- Errors
+    decoder = json.decoder(function() end)
+    local ret, err = decoder:write('[1,2}')
+    assert(ret == nil)
+    assert(err == 'Expected comma or array end but found T_OBJ_END at character 5')
+    assert(decoder:write('[]') == nil)
+
+    decoder = json.decoder(function() end)
+    assert(decoder:write('[1,'))
+    assert(decoder:finish() == nil)
+  end)
+  test('encode into a buffer', function()
+    local lutils = require('lutils')
+    local Buffer = require('buffer').Buffer
+
+    local buffer = lutils.new_buffer(8)
+    buffer:position(1)
+    buffer:limit(1)
+    local size = cjson.encode_into(buffer, { a = { 1, 2, 3 } })
+    assert(size == 13)
+    assert(buffer:limit() == 14)
+    assert(buffer:length() >= 13)
+    assert(buffer:get_bytes(1, 13) == '{"a":[1,2,3]}')
+
+    -- appended after the limit
+    cjson.encode_into(buffer, 'x')
+    assert(buffer:get_bytes(1, buffer:limit() - 1) == '{"a":[1,2,3]}"x"')
+
+    -- the buffer is unchanged on errors
+    local limit = buffer:limit()
+    assert(not pcall(cjson.encode_into, buffer, { f = print }))
+    assert(buffer:limit() == limit)
+
+    local object = Buffer:new(0)
+    assert(cjson.encode_into(object, { true, false }) == 12)
+    assert(tostring(object) == '[true,false]')
+
+    -- a large value
+    local list = {}
+    for i = 1, 10000 do list[i] = { id = i, name = 'item ' .. i } end
+    object = Buffer:new(16)
+    cjson.encode_into(object, list)
+    assert(tostring(object) == cjson.encode(list))
+  end)
+
+  test('encode to a stream', function()
+    local list = {}
+    for i = 1, 10000 do list[i] = { id = i, name = 'item ' .. i, tags = { 'a', 'b' } } end
+    local text = cjson.encode(list)
+
+    local chunks = {}
+    local total = cjson.encode_to_stream(function(chunk)
+      chunks[#chunks + 1] = chunk
+    end, list, 4096)
+
+    assert(total == #text)
+    assert(table.concat(chunks) == text)
+    assert(#chunks > 1)
+    for i = 1, #chunks - 1 do
+      assert(#chunks[i] == 4096)
+    end
+
+    -- scalars and errors of the writer
+    chunks = {}
+    assert(cjson.encode_to_stream(function(chunk) chunks[#chunks + 1] = chunk end, 'abc') == 5)
+    assert(chunks[1] == '"abc"')
+
+    local ok, err = pcall(cjson.encode_to_stream, function() error('closed') end, list, 100)
+    assert(not ok and err:find('closed'))
+
+    -- the writer may encode too
+    chunks = {}
+    cjson.encode_to_stream(function(chunk)
+      chunks[#chunks + 1] = cjson.decode(cjson.encode(chunk))
+    end, list, 1000)
+    assert(table.concat(chunks) == text)
+  end)
+
+  test('lazy documents', function()
+    local text = '{"method":"add","id":7,"params":[1,"two",{"x":[true,false,null]},[]],'
+      .. '"e\\u0041":"v\\n","dup":1,"dup":2}'
+    local doc = cjson.lazy(text)
+
+    assert(type(doc) == 'userdata')
+    assert(doc.method == 'add')
+    assert(doc.id == 7 and math.type(doc.id) == 'integer')
+    assert(#doc.params == 4)
+    assert(doc.params[2] == 'two')
+    assert(doc.params[3].x[1] == true and doc.params[3].x[3] == cjson.null)
+    assert(#doc.params[4] == 0)
+    assert(doc.eA == 'v\n')
+    assert(doc.dup == 2)
+    assert(doc.missing == nil and doc.params[5] == nil and doc.params.x == nil)
+    assert(doc.params == doc.params)
+
+    local keys = {}
+    for key in pairs(doc) do keys[#keys + 1] = key end
+    assert(table.concat(keys, ',') == 'method,id,params,eA,dup,dup')
+
+    local count = 0
+    for i, value in ipairs(doc.params) do count = count + 1 end
+    assert(count == 4)
+
+    -- plain tables
+    local params = cjson.materialize(doc.params)
+    assert(type(params) == 'table')
+    deepEqual(params, cjson.decode(text).params)
+    assert(cjson.materialize('abc') == 'abc')
+
+    -- scalar documents are returned as is
+    assert(cjson.lazy('"abc"') == 'abc')
+    assert(cjson.lazy(' 12 ') == 12)
+
+    -- the same errors as decode
+    for _, bad in ipairs({ '{', '[1,]', '{"a" 1}', '{"a":1,}', '[1 2]', '[1]x', '', '"\\x"' }) do
+      local _, err1 = pcall(cjson.lazy, bad)
+      local _, err2 = pcall(cjson.decode, bad)
+      assert(err1 == err2, bad)
+    end
+
+    -- a large array walked in order
+    local list = {}
+    for i = 1, 1000 do list[i] = { id = i } end
+    doc = cjson.lazy(cjson.encode(list))
+    for i = 1, #doc do assert(doc[i].id == i) end
+    assert(doc[10].id == 10)
+  end)
+
+  test('ndjson', function()
+    local records = {}
+    for i = 1, 1000 do records[i] = { id = i, name = 'record ' .. i, tags = { 'a' } } end
+    local text = cjson.ndjson_encode(records)
+    assert(select(2, text:gsub('\n', '')) == 1000)
+    assert(text:sub(-1) == '\n')
+
+    -- records split across chunks of any size
+    for _, size in ipairs({ 1, 7, 100, 4096, #text }) do
+      local decoder = cjson.ndjson_decoder()
+      local result = {}
+      for i = 1, #text, size do
+        for _, record in ipairs(decoder:write(text:sub(i, i + size - 1))) do
+          result[#result + 1] = record
+        end
+      end
+      assert(#decoder:finish() == 0)
+      deepEqual(records, result)
+    end
+
+    -- blank lines, CRLF and a last line without newline
+    local decoder = cjson.ndjson_decoder()
+    local result = decoder:write('1\r\n\n  \n[2]\n"x"')
+    assert(#result == 2 and result[1] == 1 and result[2][1] == 2)
+    result = decoder:finish()
+    assert(#result == 1 and result[1] == 'x')
+
+    -- invalid lines
+    local _, err = decoder:write('{"a":1}\n{bad}\n')
+    assert(err:find('^line 2: '))
+    assert(not decoder:write('1\n'))
+
+    decoder = cjson.ndjson_decoder({ skip_invalid = true, max_line = 10 })
+    local skipped
+    result, skipped = decoder:write('1\n{bad}\n' .. string.rep('x', 20))
+    assert(#result == 1 and skipped == 2)
+    result, skipped = decoder:write(string.rep('x', 20) .. '\n3\n')
+    assert(#result == 1 and result[1] == 3 and skipped == 0)
+
+    -- into a buffer
+    local buffer = require('lutils').new_buffer(4)
+    buffer:position(1)
+    buffer:limit(1)
+    assert(cjson.ndjson_encode({ 1, 'a' }, buffer) == 6)
+    assert(buffer:get_bytes(1, 6) == '1\n"a"\n')
+    assert(cjson.ndjson_encode({}) == '')
+  end)
+
   test('null', function()
     --console.log(cjson)
     --console.log(json)
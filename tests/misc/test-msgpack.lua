@@ -0,0 +1,255 @@
+--[[
+
+Copyright 2016 The Node.lua Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local deepEqual = require('assert').isDeepEqual
+
+local msgpack = require('msgpack')
+local cjson   = require('cjson')
+local lutils  = require('lutils')
+
+local function hex(data)
+  return (data:gsub('.', function(c) return string.format('%02x', c:byte()) end))
+end
+
+require('ext/tap')(function(test)
+  test('encode scalars', function()
+    assert(hex(msgpack.encode(nil)) == 'c0')
+    assert(hex(msgpack.encode(msgpack.null)) == 'c0')
+    assert(msgpack.null == cjson.null)
+    assert(hex(msgpack.encode(true)) == 'c3')
+    assert(hex(msgpack.encode(false)) == 'c2')
+
+    assert(hex(msgpack.encode(0)) == '00')
+    assert(hex(msgpack.encode(127)) == '7f')
+    assert(hex(msgpack.encode(128)) == 'cc80')
+    assert(hex(msgpack.encode(65535)) == 'cdffff')
+    assert(hex(msgpack.encode(65536)) == 'ce00010000')
+    assert(hex(msgpack.encode(4294967296)) == 'cf0000000100000000')
+    assert(hex(msgpack.encode(-1)) == 'ff')
+    assert(hex(msgpack.encode(-32)) == 'e0')
+    assert(hex(msgpack.encode(-33)) == 'd0df')
+    assert(hex(msgpack.encode(-129)) == 'd1ff7f')
+    assert(hex(msgpack.encode(math.mininteger)) == 'd38000000000000000')
+    assert(hex(msgpack.encode(1.5)) == 'cb3ff8000000000000')
+    assert(hex(msgpack.encode(1.0)) == 'cb3ff0000000000000')
+
+    assert(hex(msgpack.encode('abc')) == 'a3616263')
+    assert(hex(msgpack.encode(string.rep('x', 32))):sub(1, 4) == 'd920')
+    assert(hex(msgpack.encode(string.rep('x', 256))):sub(1, 6) == 'da0100')
+
+    assert(not pcall(msgpack.encode, print))
+  end)
+
+  test('round trip', function()
+    local values = {
+      0, 1, -1, 127, 128, -32, -33, 255, 256, 65535, 65536, -32768, -32769,
+      2147483647, -2147483648, 4294967295, 4294967296,
+      math.maxinteger, math.mininteger, 0.5, -1.25, 1e300, 1 / 0, -1 / 0,
+      '', 'hello', string.rep('a', 31), string.rep('b', 300), string.rep('c', 70000),
+      '\0\1\255binary', true, false,
+      { 1, 2, 3 }, { a = 1, b = { c = 'd' } }, {},
+      { list = { 1.5, 'x', true, { y = -7 } }, [10] = 'ten', [1.5] = 'float key' }
+    }
+
+    for _, value in ipairs(values) do
+      local data = msgpack.encode(value)
+      local result = msgpack.decode(data)
+      if type(value) == 'table' then
+        assert(deepEqual(value, result))
+      else
+        assert(result == value)
+        assert(math.type(result) == math.type(value))
+      end
+    end
+
+    -- the header of a map grows after its pairs are written
+    for _, count in ipairs({ 15, 16, 65535, 65536 }) do
+      local map = { nested = { key = 'value' } }
+      for i = 1, count - 1 do map['k' .. i] = i end
+      local header = count < 16 and 0x80 + count or count <= 65535 and 0xde or 0xdf
+      assert(msgpack.encode(map):byte(1) == header)
+      assert(deepEqual(msgpack.decode(msgpack.encode({ map, 'after' })), { map, 'after' }))
+    end
+
+    local nan = msgpack.decode(msgpack.encode(0 / 0))
+    assert(nan ~= nan)
+
+    -- nil keeps the position of the elements after it
+    local list = msgpack.decode(msgpack.encode({ 1, msgpack.null, 3 }))
+    assert(#list == 3 and list[2] == msgpack.null)
+  end)
+
+  test('decode other encoders', function()
+    local function unhex(text)
+      return (text:gsub('%x%x', function(c) return string.char(tonumber(c, 16)) end))
+    end
+
+    -- float32, bin 8, array 16, map 16
+    assert(msgpack.decode(unhex('ca3fc00000')) == 1.5)
+    assert(msgpack.decode(unhex('c403010203')) == '\1\2\3')
+    assert(deepEqual(msgpack.decode(unhex('dc0002c3c2')), { true, false }))
+    assert(deepEqual(msgpack.decode(unhex('de0001a16101')), { a = 1 }))
+
+    -- uint64 above math.maxinteger
+    assert(msgpack.decode(unhex('cfffffffffffffffff')) == 2.0 ^ 64)
+  end)
+
+  test('invalid messages', function()
+    local invalid = {
+      '', '\xc1', '\xa5abc', '\x92\x01', '\xdc\xff\xff', '\xdd\xff\xff\xff\xff',
+      '\xd4\x01\x00', '\x01\x02'
+    }
+
+    for _, data in ipairs(invalid) do
+      local ok, err = pcall(msgpack.decode, data)
+      assert(not ok)
+      assert(err:find('Invalid message'))
+    end
+  end)
+
+  test('depth limits', function()
+    local value = {}
+    local node = value
+    for i = 1, 20 do
+      node.child = {}
+      node = node.child
+    end
+
+    local mp = msgpack.new()
+    local data = mp.encode(value)
+
+    mp.decode_max_depth(10)
+    assert(not pcall(mp.decode, data))
+    mp.decode_max_depth(100)
+    assert(deepEqual(mp.decode(data), value))
+
+    mp.encode_max_depth(10)
+    assert(not pcall(mp.encode, value))
+
+    -- a loop is an error, not a crash
+    local loop = {}
+    loop.self = loop
+    assert(not pcall(msgpack.encode, loop))
+
+    -- the config of the module is not changed
+    assert(msgpack.decode_max_depth() == 1000)
+  end)
+
+  test('sparse arrays', function()
+    local mp = msgpack.new()
+    assert(not pcall(mp.encode, { [1000] = 1 }))
+
+    mp.encode_sparse_array(true)
+    assert(deepEqual(mp.decode(mp.encode({ [1000] = 1 })), { [1000] = 1 }))
+    assert(deepEqual(mp.decode(mp.encode({ 1, nil, 3 })), { 1, msgpack.null, 3 }))
+  end)
+
+  test('buffers', function()
+    local Buffer = require('buffer').Buffer
+
+    -- a luv_buffer_t is encoded as bin
+    local bin = lutils.new_buffer(8)
+    bin:put_bytes(1, '\1\2\3\4', 1, 4)
+    bin:position(2)
+    bin:limit(4)
+    assert(hex(msgpack.encode({ data = bin })) == '81a464617461c4020203')
+
+    -- encode into and decode from a buffer
+    local buffer = lutils.new_buffer(4)
+    buffer:position(1)
+    buffer:limit(1)
+    local size = msgpack.encode_into(buffer, { 1, 2, 3 })
+    assert(size == 4)
+    assert(buffer:limit() == 5)
+    msgpack.encode_into(buffer, 'x')
+    assert(buffer:limit() == 7)
+
+    local value, position = msgpack.decode_next(buffer)
+    assert(deepEqual(value, { 1, 2, 3 }))
+    assert(position == 5)
+    value, position = msgpack.decode_next(buffer, position)
+    assert(value == 'x' and position == 7)
+    assert(msgpack.decode_next(buffer, position) == nil)
+
+    -- the buffer is unchanged on errors
+    assert(not pcall(msgpack.encode_into, buffer, { f = print }))
+    assert(buffer:limit() == 7)
+
+    local object = Buffer:new(0)
+    msgpack.encode_into(object, { a = 'b' })
+    assert(deepEqual(msgpack.decode(object), { a = 'b' }))
+  end)
+
+  test('decode concatenated messages', function()
+    local data = msgpack.encode(1) .. msgpack.encode({ 'two' }) .. msgpack.encode({ three = 3 })
+
+    local values = {}
+    local value, position = msgpack.decode_next(data)
+    while position do
+      values[#values + 1] = value
+      value, position = msgpack.decode_next(data, position)
+    end
+    assert(deepEqual(values, { 1, { 'two' }, { three = 3 } }))
+  end)
+
+  test('streaming decoder', function()
+    local messages = {}
+    for i = 1, 100 do
+      messages[i] = { id = i, name = string.rep('n', i * 10), values = { i, i * 1.5, -i } }
+    end
+
+    local data = {}
+    for i = 1, #messages do data[i] = msgpack.encode(messages[i]) end
+    data = table.concat(data)
+
+    -- every chunk size, including one byte at a time
+    for _, size in ipairs({ 1, 3, 7, 100, 4096, #data }) do
+      local values = {}
+      local decoder = msgpack.decoder(function(value)
+        values[#values + 1] = value
+      end)
+
+      for i = 1, #data, size do
+        assert(decoder:write(data:sub(i, i + size - 1)))
+      end
+      assert(decoder:finish())
+      assert(deepEqual(values, messages))
+    end
+
+    -- incomplete and invalid messages
+    local decoder = msgpack.decoder(function() end)
+    assert(decoder:write('\x92\x01'))
+    local ok, err = decoder:finish()
+    assert(ok == nil and err:find('incomplete'))
+
+    decoder = msgpack.decoder(function() end)
+    ok, err = decoder:write('\x01\xc1')
+    assert(ok == nil and err == 'invalid message')
+    assert(decoder:write('\x01') == nil)
+
+    -- too large
+    decoder = msgpack.decoder(function() end, { max_size = 16 })
+    ok, err = decoder:write('\xdb\x00\x01\x00\x00')
+    assert(ok == nil and err:find('larger than'))
+
+    -- an error of the callback stops the decoder
+    decoder = msgpack.decoder(function() error('stop') end)
+    assert(not pcall(decoder.write, decoder, '\x01'))
+    assert(decoder:write('\x01') == nil)
+  end)
+end)
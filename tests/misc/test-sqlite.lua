@@ -0,0 +1,372 @@
+--[[
+
+Copyright 2016 The Node.lua Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS-IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+--]]
+
+local deepEqual = require('assert').isDeepEqual
+
+local uv    = require('uv')
+local utils = require('utils')
+
+-- The sqlite3 module is optional (BUILD_SQLITE)
+local ok, lsqlite = pcall(require, 'lsqlite')
+if not ok then
+  print('lsqlite not available, skipped')
+  return
+end
+
+local api = lsqlite.api
+
+local function tempname(name)
+  local filename = os.tmpname() .. '-' .. name .. '.db'
+  os.remove(filename)
+  return filename
+end
+
+require('ext/tap')(function(test)
+  test('statement cache', function()
+    local errors = lsqlite.errors
+    local err, db = api.open(':memory:')
+    assert(err == errors.OK)
+    assert(db:exec('CREATE TABLE t (id INTEGER PRIMARY KEY, name TEXT)') == errors.OK)
+
+    local insert = 'INSERT INTO t (name) VALUES (:name)'
+    local first
+    for i = 1, 100 do
+      local err, stmt = db:cached(insert, { name = 'n' .. i })
+      assert(err == errors.OK)
+      first = first or stmt
+      assert(stmt == first)
+      assert(stmt:step() == errors.DONE)
+      assert(stmt:finalize() == errors.OK) -- only resets a cached statement
+    end
+
+    local err, stmt = db:cached('SELECT name FROM t WHERE id = ?', { 42 })
+    assert(stmt:step() == errors.ROW and stmt:column(0) == 'n42')
+
+    -- reset and rebound, the old bindings are cleared
+    err, stmt = db:cached('SELECT name FROM t WHERE id = ?')
+    assert(stmt:step() == errors.DONE)
+
+    local stats = db:cache_stats()
+    assert(stats.size == 2 and stats.hits == 100 and stats.misses == 2)
+    assert(stats.hit_rate > 0.98)
+
+    -- least recently used statements are evicted and finalized
+    assert(db:cache_size(2) == 2)
+    err, stmt = db:cached('SELECT 1')
+    assert(not pcall(first.step, first))
+    assert(db:cache_stats().evictions == 1)
+
+    -- the cache holds at least the statement returned last
+    assert(not pcall(db.cache_size, db, 0))
+    assert(db:cache_size(1) == 1)
+    err, stmt = db:cached('SELECT 2')
+    assert(err == errors.OK and stmt:step() == errors.ROW)
+    assert(db:cache_stats().size == 1)
+    assert(db:cache_size(2) == 2)
+
+    -- schema changes
+    err, stmt = db:cached('SELECT * FROM t WHERE id = 1')
+    stmt:step()
+    assert(stmt:data_count() == 2)
+    stmt:reset()
+    assert(db:exec('ALTER TABLE t ADD COLUMN value INTEGER') == errors.OK)
+    err, stmt = db:cached('SELECT * FROM t WHERE id = 1')
+    assert(stmt:step() == errors.ROW and stmt:data_count() == 3)
+    stmt:reset()
+
+    assert(db:exec('DROP TABLE t') == errors.OK)
+    err, stmt = db:cached('SELECT * FROM t WHERE id = 1')
+    assert(stmt:step() ~= errors.ROW)
+    assert(db:errmsg():find('no such table'))
+
+    -- prepare errors are not cached
+    err, stmt = db:cached('SELECT FROM')
+    assert(err == errors.ERROR and stmt == nil)
+
+    db:cache_clear()
+    assert(db:cache_stats().size == 0)
+    assert(db:close() == errors.OK)
+  end)
+
+  test('bulk insert and fetch', function()
+    local errors = lsqlite.errors
+    local err, db = api.open(':memory:')
+    db:exec('CREATE TABLE t (id INTEGER PRIMARY KEY, t INTEGER, name TEXT UNIQUE, value REAL)')
+
+    local rows = {}
+    for i = 1, 1000 do
+      rows[i] = { t = 1500000000000 + i, name = 'n' .. i, value = i / 2 }
+    end
+
+    local err, stmt = db:prepare('INSERT INTO t (t, name, value) VALUES (:t, :name, :value)')
+    local err, count = stmt:insert_many(rows)
+    assert(err == errors.OK and count == 1000)
+
+    -- positional rows and NULL values
+    err, count = stmt:insert_many({ { nil, 'p1' } }, { transaction = false })
+    assert(err == errors.OK and count == 1)
+    stmt:finalize()
+
+    -- a failed row rolls back the whole transaction
+    err, stmt = db:cached('INSERT INTO t (name) VALUES (?)')
+    err, count = stmt:insert_many({ { 'x1' }, { 'x2' }, { 'n5' }, { 'x3' } })
+    assert(err == errors.CONSTRAINT and count == 2)
+    err, stmt = db:cached('SELECT count(*) FROM t')
+    stmt:step()
+    assert(stmt:column(0) == 1001)
+
+    -- without a transaction the rows before the error are kept
+    err, stmt = db:cached('INSERT INTO t (name) VALUES (?)')
+    err, count = stmt:insert_many({ { 'y1' }, { 'n5' } }, { transaction = false })
+    assert(err == errors.CONSTRAINT and count == 1)
+
+    -- in the transaction of the caller
+    db:exec('BEGIN')
+    err, count = stmt:insert_many({ { 'z1' }, { 'z2' } })
+    assert(err == errors.OK and count == 2)
+    db:exec('ROLLBACK')
+
+    -- errors of the arguments are raised after a rollback
+    assert(not pcall(stmt.insert_many, stmt, { { 'w1' }, 'not a row' }))
+    assert(not pcall(stmt.insert_many, stmt, { { print } }))
+    assert(db:exec('BEGIN') == errors.OK)
+    db:exec('ROLLBACK')
+
+    err, stmt = db:prepare('SELECT t, name, value FROM t WHERE value IS NOT NULL ORDER BY id')
+    local all = {}
+    repeat
+      local rows
+      err, rows = stmt:fetch_many(64)
+      assert(#rows <= 64)
+      for _, row in ipairs(rows) do all[#all + 1] = row end
+    until err ~= errors.ROW
+    assert(err == errors.DONE)
+    assert(deepEqual(all, rows))
+    assert(math.type(all[1].t) == 'integer')
+
+    stmt:reset()
+    err, rows = stmt:fetch_many(2, 'i')
+    assert(err == errors.ROW)
+    assert(deepEqual(rows, { { 1500000000001, 'n1', 0.5 }, { 1500000000002, 'n2', 1.0 } }))
+
+    -- n is only an upper bound, nothing is allocated for it
+    stmt:reset()
+    err, rows = stmt:fetch_many(2 ^ 31 - 1)
+    assert(err == errors.DONE and deepEqual(rows, all))
+    stmt:finalize()
+
+    err, stmt = db:prepare('SELECT * FROM t WHERE id < 0')
+    err, rows = stmt:fetch_many(10)
+    assert(err == errors.DONE and #rows == 0)
+    stmt:finalize()
+
+    db:cache_clear()
+    assert(db:close() == errors.OK)
+  end)
+
+  test('async open, exec, run and query', function(print, p, expect, uv)
+    local filename = tempname('async')
+    local db = assert(api.open_async(filename))
+
+    db:exec('CREATE TABLE t (id INTEGER PRIMARY KEY, name TEXT, value REAL, data BLOB)', expect(function(err)
+      assert(err == nil)
+    end))
+
+    db:run('INSERT INTO t (name, value) VALUES (?, ?)', { 'one', 1.5 }, expect(function(err, changes, rowid)
+      assert(err == nil and changes == 1 and rowid == 1)
+    end))
+
+    db:run('INSERT INTO t (name, value, data) VALUES (:name, $value, @data)',
+      { name = 'two', value = 2, data = '\0\1', other = 'ignored' }, expect(function(err, changes, rowid)
+      assert(err == nil and changes == 1 and rowid == 2)
+    end))
+
+    db:query('SELECT * FROM t ORDER BY id', expect(function(err, rows, done)
+      assert(err == nil and done == true)
+      assert(deepEqual(rows, {
+        { id = 1, name = 'one', value = 1.5 },
+        { id = 2, name = 'two', value = 2.0, data = '\0\1' }
+      }))
+      assert(math.type(rows[1].id) == 'integer')
+    end))
+
+    -- 64-bit integers are exact
+    db:query('SELECT ? AS big', { math.maxinteger }, expect(function(err, rows)
+      assert(rows[1].big == math.maxinteger)
+    end))
+
+    db:query('SELECT * FROM missing', expect(function(err, rows)
+      assert(err:find('no such table') and rows == nil)
+    end))
+
+    db:close(expect(function(err)
+      assert(err == nil)
+      assert(not pcall(db.exec, db, 'SELECT 1', function() end))
+      os.remove(filename)
+    end))
+
+    assert(not pcall(db.run, db, 'SELECT 1', function() end))
+  end)
+
+  test('async query in batches', function(print, p, expect, uv)
+    local filename = tempname('batch')
+    local db = assert(api.open_async(filename))
+
+    local sql = {'BEGIN; CREATE TABLE t (id INTEGER);'}
+    for i = 1, 1000 do sql[#sql + 1] = 'INSERT INTO t VALUES (' .. i .. ');' end
+    sql[#sql + 1] = 'COMMIT;'
+    db:exec(table.concat(sql), function() end)
+
+    local count, calls = 0, 0
+    db:query('SELECT id FROM t WHERE id > ? ORDER BY id', { 0 }, 64, expect(function(err, rows, done)
+      assert(err == nil)
+      calls = calls + 1
+      for _, row in ipairs(rows) do
+        count = count + 1
+        assert(row.id == count)
+      end
+
+      if done then
+        assert(count == 1000 and calls == 16)
+        db:close(function() os.remove(filename) end)
+      end
+    end, 16))
+  end)
+
+  test('async with coroutines', function(print, p, expect, uv)
+    local filename = tempname('await')
+    local db = assert(api.open_async(filename))
+
+    local finish = expect(function() end)
+    coroutine.wrap(function()
+      assert(utils.await(db.exec, db, 'CREATE TABLE t (a, b)') == nil)
+
+      local err, changes = utils.await(db.run, db, 'INSERT INTO t VALUES (?, ?)', { 1, 'x' })
+      assert(err == nil and changes == 1)
+
+      local err, rows = utils.await(db.query, db, 'SELECT a, b FROM t', {})
+      assert(deepEqual(rows, { { a = 1, b = 'x' } }))
+
+      utils.await(db.close, db)
+      os.remove(filename)
+      finish()
+    end)()
+  end)
+
+  test('async does not block the loop', function(print, p, expect, uv)
+    local filename = tempname('block')
+    local db = assert(api.open_async(filename))
+
+    -- A slow query, the timer fires while it runs
+    local ticks = 0
+    local timer = uv.new_timer()
+    timer:start(1, 1, function() ticks = ticks + 1 end)
+
+    local sql = 'WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 3000000) '
+      .. 'SELECT count(*) AS n FROM c'
+    db:query(sql, expect(function(err, rows)
+      assert(rows[1].n == 3000000)
+      assert(ticks > 0)
+      timer:close()
+      db:close(function() os.remove(filename) end)
+    end))
+  end)
+
+  test('pool batches writes and reads concurrently', function(print, p, expect, uv)
+    local filename = tempname('pool')
+    local pool = assert(api.open_pool(filename, { readers = 2 }))
+
+    local ok, err = api.open_pool(':memory:')
+    assert(ok == nil and err:find('WAL'))
+
+    -- The readers only see the table once it is committed
+    pool:exec('CREATE TABLE t (id INTEGER PRIMARY KEY, name TEXT UNIQUE)', expect(function(err)
+      assert(err == nil)
+
+      -- Queued writes share transactions, a failing one is rolled back alone
+      local rowids = {}
+      for i = 1, 500 do
+        local name = (i == 250) and 'n1' or ('n' .. i)
+        pool:run('INSERT INTO t (name) VALUES (?)', { name }, function(err, changes, rowid)
+          if i == 250 then
+            assert(err:find('UNIQUE'))
+          else
+            assert(err == nil and changes == 1)
+            assert(not rowids[rowid])
+            rowids[rowid] = true
+          end
+        end)
+      end
+
+      pool:query('SELECT count(*) AS n FROM t', expect(function(err, rows)
+        -- the readers see the last commit, which may be before all writes
+        assert(err == nil and rows[1].n <= 499)
+      end))
+
+      pool:run('SELECT 1', expect(function(err)
+        local stats = pool:stats()
+        assert(stats.writes == 501 and stats.readers == 2)
+        assert(stats.transactions < 50)
+
+        pool:query('SELECT count(*) AS n FROM t', expect(function(err, rows)
+          assert(rows[1].n == 499)
+
+          -- a slow read does not block the writer
+          local written = false
+          local sql = 'WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 3000000) '
+            .. 'SELECT count(*) AS n FROM c'
+          pool:query(sql, expect(function(err, rows)
+            assert(rows[1].n == 3000000)
+            assert(written)
+
+            pool:close(expect(function(err)
+              assert(err == nil)
+              assert(not pcall(pool.query, pool, 'SELECT 1', function() end))
+              assert(not io.open(filename .. '-wal'))
+              os.remove(filename)
+            end))
+          end))
+
+          pool:run('INSERT INTO t (name) VALUES (?)', { 'during read' }, expect(function(err)
+            assert(err == nil)
+            written = true
+          end))
+        end))
+      end))
+
+      -- the readers do not write
+      pool:query('DELETE FROM t', expect(function(err)
+        assert(err:find('readonly'))
+      end))
+    end))
+  end)
+
+  test('async errors', function()
+    local ok, err = api.open_async('/missing/directory/test.db')
+    assert(ok == nil and type(err) == 'string')
+
+    local db = assert(api.open_async(':memory:'))
+    assert(not pcall(db.run, db, 'SELECT ?', { print }, function() end))
+    assert(not pcall(db.query, db, 'SELECT 1', nil, 0, function() end))
+    assert(not pcall(db.exec, db, 'SELECT 1'))
+
+    -- Dropped connections are closed by the garbage collector
+    db = nil
+    collectgarbage()
+  end)
+end)
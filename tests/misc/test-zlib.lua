@@ -3,13 +3,264 @@ local zlib     = require('zlib')
 local assert  = require('assert')
 
 local Object = require('core').Object
+local Buffer = require('buffer').Buffer
+local miniz  = require('miniz')
+local fs     = require('fs')
+local path   = require('path')
 
 local tap = require('ext/tap')
 
+-- gzip.compress(b'hello world', mtime=0) from Python
+local HELLO_GZIP = utils.hex2bin('1f8b0800000000000203cb48cdc9c95728cf2fca49010085114a0d0b000000')
+
+local function makeData(size)
+    local items = {}
+    for i = 1, size do
+        items[#items + 1] = 'line ' .. i .. ' ' .. (i * 7919 % 1000) .. '\n'
+    end
+    return table.concat(items)
+end
+
 tap(function(test)
-  	test('zlib', function(expect)
+  	test('zlib crc32', function()
+        assert.equal(zlib.crc32('hello world'), 0x0d4a1185)
+        assert.equal(zlib.crc32('world', zlib.crc32('hello ')), 0x0d4a1185)
+  	end)
+
+  	test('zlib sync', function()
+        local data = makeData(2000)
+
+        assert.equal(zlib.inflateSync(zlib.deflateSync(data)), data)
+        assert.equal(zlib.inflateRawSync(zlib.deflateRawSync(data)), data)
+        assert.equal(zlib.gunzipSync(zlib.gzipSync(data, { level = 9 })), data)
+        assert.equal(zlib.gunzipSync(HELLO_GZIP), 'hello world')
+
+        local gzipped = zlib.gzipSync(data)
+        assert.equal(gzipped:byte(1), 0x1f)
+        assert.equal(gzipped:byte(2), 0x8b)
+        assert(#gzipped < #data / 2)
+
+        -- truncated and corrupted data
+        assert.equal(zlib.gunzipSync(gzipped:sub(1, -5)), nil)
+        local bad = gzipped:sub(1, -9) .. '\0\0\0\0' .. gzipped:sub(-4)
+        local output, err = zlib.gunzipSync(bad)
+        assert.equal(output, nil)
+        assert.equal(err, 'incorrect data check')
+  	end)
+
+  	test('zlib gzip stream', function(expect)
+        local data = makeData(20000)
+        local gzip = zlib.createGzip()
+        local gunzip = zlib.createGunzip()
+
+        local compressed = {}
+        gzip:on('data', function(chunk)
+            compressed[#compressed + 1] = chunk
+            gunzip:write(chunk)
+        end)
+
+        gzip:on('end', expect(function()
+            gunzip:finish()
+
+            -- The stream output is a regular gzip file
+            assert.equal(zlib.gunzipSync(table.concat(compressed)), data)
+        end))
+
+        local output = {}
+        gunzip:on('data', function(chunk)
+            output[#output + 1] = chunk
+        end)
+
+        gunzip:on('end', expect(function()
+            assert.equal(table.concat(output), data)
+        end))
+
+        for offset = 1, #data, 4096 do
+            gzip:write(data:sub(offset, offset + 4095))
+        end
+        gzip:finish()
+  	end)
+
+  	test('zlib gunzip byte by byte and multiple members', function(expect)
+        local gunzip = zlib.createGunzip()
+        local output = {}
+        gunzip:on('data', function(chunk)
+            output[#output + 1] = chunk
+        end)
+
+        gunzip:on('end', expect(function()
+            assert.equal(table.concat(output), 'hello worldhello world')
+        end))
+
+        local input = HELLO_GZIP .. HELLO_GZIP
+        for i = 1, #input do
+            gunzip:write(input:sub(i, i))
+        end
+        gunzip:finish()
+  	end)
+
+  	test('zlib sync flush', function()
+        local deflate = zlib.createDeflateRaw({ flush = 'sync' })
+        local inflate = zlib.createInflateRaw()
+
+        local received = {}
+        inflate:on('data', function(chunk)
+            received[#received + 1] = chunk
+        end)
+
+        deflate:on('data', function(chunk)
+            inflate:write(chunk)
+        end)
+
+        -- Each written chunk can be decoded right away
+        deflate:write('first message')
+        assert.equal(table.concat(received), 'first message')
+        deflate:write(' second message')
+        assert.equal(table.concat(received), 'first message second message')
+  	end)
+
+  	test('zlib error', function(expect)
+        local gunzip = zlib.createGunzip()
+        gunzip:on('error', expect(function(err)
+            assert(err)
+        end))
+        gunzip:write('not a gzip stream')
+  	end)
+
+  	test('zlib async', function(expect)
+        local data = makeData(20000)
+
+        zlib.deflateRawAsync(data, { level = 9 }, expect(function(err, compressed)
+            assert.equal(err, nil)
+            assert(#compressed < #data / 2)
+            assert.equal(zlib.inflateRawSync(compressed), data)
+
+            -- Input from a buffer
+            zlib.inflateRawAsync(Buffer:new(compressed), expect(function(err, output)
+                assert.equal(err, nil)
+                assert.equal(output, data)
+            end))
+        end))
+
+        local buffer = Buffer:new('xxhello worldxx')
+        buffer.buffer:position(3)
+        buffer.buffer:limit(14)
+        miniz.deflate_async(buffer.buffer, expect(function(err, compressed)
+            assert.equal(err, nil)
+            assert.equal(miniz.inflate(compressed), 'hello world')
+        end))
+
+        miniz.inflate_async('not deflate data', expect(function(err, output)
+            assert(err)
+            assert.equal(output, nil)
+        end))
+
+        -- a bad input raises before any work is queued
+        local ok, err = pcall(miniz.deflate_async, {}, function() end)
+        assert(not ok and err:find('string expected'), err)
+        ok, err = pcall(miniz.inflate_async, nil, 0, function() end)
+        assert(not ok and err:find('string expected'), err)
+  	end)
+
+  	test('zip reader extract async', function(expect)
+        local writer = miniz.new_writer()
+        writer:add('a.txt', 'hello world', 9)
+        writer:add('b.txt', makeData(1000), 9)
+
+        local filename = path.join(os.tmpdir, 'test-zlib-async.zip')
+        local target = filename .. '.txt'
+        fs.writeFileSync(filename, writer:finalize())
+        writer:close()
+
+        local reader = miniz.new_reader(filename)
+        assert.equal(reader:get_num_files(), 2)
+
+        reader:extract_async(1, expect(function(err, data)
+            assert.equal(err, nil)
+            assert.equal(data, 'hello world')
+        end))
+
+        -- The reader can not be closed while extracting
+        local ret, err = reader:close()
+        assert.equal(ret, nil)
+        assert(err)
+
+        reader:extract_to_file_async(2, target, expect(function(err, ret)
+            assert.equal(err, nil)
+            assert.equal(ret, true)
+            assert.equal(fs.readFileSync(target), makeData(1000))
+
+            reader:extract_async(3, expect(function(err, data)
+                assert(err)
+                assert.equal(data, nil)
+
+                reader:close()
+                os.remove(target)
+                os.remove(filename)
+            end))
+        end))
+  	end)
+  	test('zip parallel writer', function(expect)
+        local basePath = path.join(os.tmpdir, 'test-zlib-parallel')
+        fs.mkdirpSync(path.join(basePath, 'lib'))
+
+        -- Compressed larger than the part of an entry kept in memory
+        local random = {}
+        for i = 1, 1536 * 1024 do
+            random[i] = string.char(math.random(0, 255))
+        end
+        random = table.concat(random)
+
+        local files = {
+            ['a.txt'] = 'hello world',
+            ['empty.txt'] = '',
+            ['lib/data.txt'] = makeData(20000),
+            ['lib/random.bin'] = random
+        }
+        for name, data in pairs(files) do
+            fs.writeFileSync(path.join(basePath, name), data)
+        end
+
+        local _readEntries = function(filename)
+            local reader = miniz.new_reader(filename)
+            local entries = {}
+            for i = 1, reader:get_num_files() do
+                entries[i] = reader:get_filename(i)
+                if (not reader:is_directory(i)) then
+                    assert.equal(reader:extract(i), files[entries[i]])
+                end
+            end
+            reader:close()
+            return table.concat(entries, ',')
+        end
+
+        local filename = basePath .. '.zip'
+        local builder = zlib.ZipBuilder:new()
+        builder:build(basePath)
+        local expected = _readEntries(filename)
+        os.remove(filename)
 
+        builder:build(basePath, nil, { jobs = 2 }, expect(function(err, result)
+            assert.equal(err, nil)
+            assert.equal(result, filename)
+            assert.equal(_readEntries(filename), expected)
+            os.remove(filename)
 
+            -- Errors are reported by finish and the file is removed
+            local writer = miniz.new_parallel_writer(filename)
+            writer:add('a.txt', 'hello world')
+            writer:add_file('b.txt', path.join(basePath, 'missing.txt'))
+            writer:finish(expect(function(err, ret)
+                assert(err:find('missing.txt'))
+                assert.equal(ret, nil)
+                assert.equal(fs.existsSync(filename), false)
 
+                for name in pairs(files) do
+                    os.remove(path.join(basePath, name))
+                end
+                fs.rmdirSync(path.join(basePath, 'lib'))
+                fs.rmdirSync(basePath)
+            end))
+        end))
   	end)
-end)
\ No newline at end of file
+end)
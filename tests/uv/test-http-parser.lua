@@ -215,6 +215,90 @@ return require('ext/tap')(function (test)
 
 	end)
 
+	test("parse batched headers", function()
+		local request = nil
+		local data = {}
+
+		local options = {
+			message_begin 		= function(...) request = {} end,
+			message_complete 	= function(...) request.body = table.concat(data) end,
+			header_field 		= function(name) error('header_field') end,
+			header_value 		= function(value) error('header_value') end,
+			body 				= function(body) table.insert(data, body) end,
+			headers_complete 	= function(meta) request.meta = meta end,
+		}
+
+		local parser = lhttp_parser.new('request', options, { batch_headers = true })
+
+		-- url, field and value split across chunks
+		local messages = {
+			"GET /pa", "th?q=1 HTTP/1.1\r\nHo", "st: 127.0.", "0.1\r\nX-Na",
+			"me:  lnode\r\nContent-Length: 4\r\n\r\n12", "34"
+		}
+
+		for _, message in ipairs(messages) do
+			parser:execute(message, 0, #message)
+		end
+
+		local meta = request.meta
+		assert.equal(meta.method, 'GET')
+		assert.equal(meta.url, '/path?q=1')
+		assert.equal(#meta, 3)
+		assert.equal(meta[1][1], 'Host')
+		assert.equal(meta[1][2], '127.0.0.1')
+		assert.equal(meta[2][1], 'X-Name')
+		assert.equal(meta[2][2], 'lnode')
+		assert.equal(meta[3][1], 'Content-Length')
+		assert.equal(meta[3][2], '4')
+		assert.equal(request.body, '1234')
+
+		-- the next message on the same parser starts with empty headers
+		local message = "GET / HTTP/1.1\r\nA: B\r\n\r\n"
+		parser:execute(message, 0, #message)
+		assert.equal(request.meta.url, '/')
+		assert.equal(#request.meta, 1)
+		assert.equal(request.meta[1][2], 'B')
+	end)
+
+	test("parse body offsets", function()
+		local message = "HTTP/1.1 200 OK\r\nContent-Length: 8\r\n\r\n12345678"
+		local data = {}
+
+		local options = {
+			body = function(offset, length) 
+				table.insert(data, message:sub(offset + 1, offset + length))
+			end
+		}
+
+		local parser = lhttp_parser.new('response', options, { body_offsets = true })
+		local ret = parser:execute(message, 0, #message - 4)
+		ret = ret + parser:execute(message, #message - 4, 4)
+
+		assert.equal(ret, #message)
+		assert.equal(table.concat(data), '12345678')
+		assert.equal(#data, 2)
+	end)
+
+	test("encode_head", function()
+		local head, chunked = lhttp_parser.encode_head({
+			code = 200,
+			{ "Content-Type", "text/plain" },
+			{ "Transfer-Encoding", "Chunked" },
+			{ "X-Value", "a\r\nb" },
+			{ "Content-Length", 12 }
+		}, "OK")
+
+		assert.equal(head, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n" ..
+			"Transfer-Encoding: Chunked\r\nX-Value: a b\r\nContent-Length: 12\r\n\r\n")
+		assert.equal(chunked, true)
+
+		head, chunked = lhttp_parser.encode_head({
+			method = 'GET', path = '/foo', version = 1.0, { "Host", "test" }
+		})
+		assert.equal(head, "GET /foo HTTP/1.0\r\nHost: test\r\n\r\n")
+		assert.equal(chunked, false)
+	end)
+
 	test("parse chunked response", function()
 		local decode = decoder()
 
@@ -204,6 +204,66 @@ return tap(function (test)
     end)))
   end)
 
+  test("tcp write a buffer", function (print, p, expect, uv)
+    local lutils = require('lutils')
+    local cjson = require('cjson')
+
+    local value = {}
+    for i = 1, 2000 do value[i] = { id = i, name = 'item ' .. i } end
+    local text = cjson.encode(value)
+
+    local server = uv.new_tcp()
+    assert(uv.tcp_bind(server, "127.0.0.1", 0))
+    assert(uv.listen(server, 1, expect(function ()
+      local client = uv.new_tcp()
+      assert(uv.accept(server, client))
+
+      local chunks = {}
+      assert(uv.read_start(client, function (err, data)
+        assert(not err, err)
+        if data then
+          chunks[#chunks + 1] = data
+          return
+        end
+
+        -- the readable bytes [position, limit) of the buffer
+        assert(table.concat(chunks) == text)
+        uv.close(client)
+        uv.close(server)
+      end))
+    end)))
+
+    local address = uv.tcp_getsockname(server)
+    local socket = assert(uv.new_tcp())
+    assert(uv.tcp_connect(socket, "127.0.0.1", address.port, expect(function ()
+      local buffer = lutils.new_buffer(16)
+      buffer:position(1)
+      buffer:limit(1)
+      cjson.encode_into(buffer, 'skipped')
+      buffer:position(buffer:limit())
+      cjson.encode_into(buffer, value)
+
+      assert(uv.write(socket, buffer, expect(function (err)
+        assert(not err, err)
+
+        -- released once the write ends
+        local limit = buffer:limit()
+        cjson.encode_into(buffer, 'more')
+        assert(buffer:limit() > limit)
+
+        uv.shutdown(socket, expect(function ()
+          uv.close(socket)
+        end))
+      end)))
+
+      -- the data is written in place, it can not move meanwhile
+      local ok, err = pcall(cjson.encode_into, buffer, value)
+      assert(not ok and err:find('being written'), err)
+      ok, err = pcall(buffer.close, buffer)
+      assert(not ok and err:find('being written'), err)
+    end)))
+  end)
+
   test("uv.tcp_bind invalid ip address", function (print, p, expect, uv)
     local ip = '127.0.0.100005'
     local server = uv.new_tcp()